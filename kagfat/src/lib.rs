@@ -0,0 +1,337 @@
+//! KAGFAT16 on-disk format, shared by the kernel (`src/fs.rs`) and the host
+//! image tool (`tools/kef-tool`).
+//!
+//! The views below do no I/O. Callers read whole sectors (or whole regions)
+//! and look at them through the views, which decode little-endian fields in
+//! place, so any byte buffer works whatever its alignment. `Volume` builds the
+//! filesystem operations on top of them for any `BlockDevice`.
+
+#![cfg_attr(not(test), no_std)]
+
+extern crate alloc;
+
+mod volume;
+
+pub use volume::{BlockDevice, FileHandle, FsError, FsResult, MetadataLock, PublicFileEntry, Volume};
+
+// ============================================================================
+// Layout
+// ============================================================================
+
+pub const BLOCK_SIZE: usize = 512; // bytes per sector
+
+/// Sectors per cluster (4 KB clusters).
+pub const SECTORS_PER_CLUSTER: u32 = 8;
+pub const CLUSTER_SIZE: usize = SECTORS_PER_CLUSTER as usize * BLOCK_SIZE;
+
+/// LBA of the Boot Sector / BPB.
+pub const BOOT_SECTOR_LBA: u64 = 0;
+
+/// Number of sectors occupied by the FAT table.
+/// 64 sectors × 512 bytes = 32 768 bytes = 16 384 FAT entries (u16 each).
+pub const FAT_SECTORS: u32 = 64;
+pub const FAT_ENTRIES_PER_SECTOR: usize = BLOCK_SIZE / 2; // 256
+pub const FAT_ENTRIES: usize = FAT_SECTORS as usize * FAT_ENTRIES_PER_SECTOR;
+
+/// LBA where the FAT table begins.
+pub const FAT_START_LBA: u64 = 1;
+
+/// Number of sectors reserved for the flat root directory.
+/// 16 sectors × 16 entries/sector (32 bytes each) = 256 directory entries.
+pub const ROOT_DIR_SECTORS: u32 = 16;
+pub const DIR_ENTRY_SIZE: usize = 32;
+pub const DIR_ENTRIES_PER_SECTOR: usize = BLOCK_SIZE / DIR_ENTRY_SIZE; // 16
+pub const ROOT_DIR_ENTRIES: usize = ROOT_DIR_SECTORS as usize * DIR_ENTRIES_PER_SECTOR; // 256
+
+/// LBA where the root directory begins.
+pub const ROOT_DIR_START_LBA: u64 = FAT_START_LBA + FAT_SECTORS as u64;
+
+/// LBA where the data clusters begin.
+pub const DATA_START_LBA: u64 = ROOT_DIR_START_LBA + ROOT_DIR_SECTORS as u64;
+
+/// Default volume size: 1 GB = 2 097 152 × 512-byte sectors.
+pub const TOTAL_SECTORS: u64 = 2_097_152;
+
+/// Number of data clusters on a default-sized volume.
+pub const TOTAL_CLUSTERS: u32 = ((TOTAL_SECTORS - DATA_START_LBA) / SECTORS_PER_CLUSTER as u64) as u32;
+
+/// FAT entry values.
+pub const FAT_ENTRY_FREE: u16 = 0x0000;
+pub const FAT_ENTRY_EOC: u16 = 0xFFFF; // End-of-cluster-chain
+pub const FAT_ENTRY_RESERVED: u16 = 0xFFF0; // Minimum reserved value
+/// Value of FAT entry 0 (media descriptor); entry 1 holds FAT_ENTRY_EOC.
+pub const FAT_ENTRY_MEDIA: u16 = 0xFFF8;
+
+/// Magic number stored in the Boot Sector ("KAGFAT16").
+pub const FAT_MAGIC: u64 = 0x4B41_4746_4154_3136;
+
+/// Longest file name; the name field keeps a terminating NUL.
+pub const MAX_NAME_LEN: usize = 21;
+
+/// First sector of a data cluster.
+#[inline]
+pub fn cluster_to_lba(cluster: u16) -> u64 {
+    DATA_START_LBA + (cluster as u64 - 2) * SECTORS_PER_CLUSTER as u64
+}
+
+/// FAT sector holding `cluster`'s entry, and the entry's index within it.
+#[inline]
+pub fn fat_position(cluster: u16) -> (u64, usize) {
+    let cluster = cluster as usize;
+    (
+        FAT_START_LBA + (cluster / FAT_ENTRIES_PER_SECTOR) as u64,
+        cluster % FAT_ENTRIES_PER_SECTOR,
+    )
+}
+
+/// Root directory sector holding entry `index`, and the slot within it.
+#[inline]
+pub fn dir_position(index: usize) -> (u64, usize) {
+    (
+        ROOT_DIR_START_LBA + (index / DIR_ENTRIES_PER_SECTOR) as u64,
+        index % DIR_ENTRIES_PER_SECTOR,
+    )
+}
+
+fn le_u16(bytes: &[u8], at: usize) -> u16 {
+    u16::from_le_bytes([bytes[at], bytes[at + 1]])
+}
+
+fn le_u32(bytes: &[u8], at: usize) -> u32 {
+    u32::from_le_bytes([bytes[at], bytes[at + 1], bytes[at + 2], bytes[at + 3]])
+}
+
+// ============================================================================
+// Boot sector
+// ============================================================================
+
+/// Boot Sector / BIOS Parameter Block stored at LBA 0.
+///
+/// Layout: magic(8) + bytes_per_sector(2) + sectors_per_cluster(4) +
+/// fat_start_lba(4) + fat_sectors(4) + root_dir_start_lba(4) +
+/// root_dir_sectors(4) + data_start_lba(4) + total_clusters(4) = 38 bytes,
+/// zero-padded to BLOCK_SIZE.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct BootSector {
+    /// Magic number to identify a formatted FAT volume.
+    pub magic: u64,
+    /// Bytes per sector (always 512).
+    pub bytes_per_sector: u16,
+    /// Sectors per cluster.
+    pub sectors_per_cluster: u32,
+    /// LBA of the FAT region.
+    pub fat_start_lba: u32,
+    /// Number of sectors in the FAT region.
+    pub fat_sectors: u32,
+    /// LBA of the root directory region.
+    pub root_dir_start_lba: u32,
+    /// Number of sectors in the root directory region.
+    pub root_dir_sectors: u32,
+    /// LBA where data clusters begin.
+    pub data_start_lba: u32,
+    /// Total number of data clusters.
+    pub total_clusters: u32,
+}
+
+impl BootSector {
+    /// The boot sector `format` writes.
+    pub const fn new() -> Self {
+        Self {
+            magic: FAT_MAGIC,
+            bytes_per_sector: BLOCK_SIZE as u16,
+            sectors_per_cluster: SECTORS_PER_CLUSTER,
+            fat_start_lba: FAT_START_LBA as u32,
+            fat_sectors: FAT_SECTORS,
+            root_dir_start_lba: ROOT_DIR_START_LBA as u32,
+            root_dir_sectors: ROOT_DIR_SECTORS,
+            data_start_lba: DATA_START_LBA as u32,
+            total_clusters: TOTAL_CLUSTERS,
+        }
+    }
+
+    pub fn parse(sector: &[u8; BLOCK_SIZE]) -> Self {
+        Self {
+            magic: u64::from_le_bytes(sector[0..8].try_into().unwrap()),
+            bytes_per_sector: le_u16(sector, 8),
+            sectors_per_cluster: le_u32(sector, 10),
+            fat_start_lba: le_u32(sector, 14),
+            fat_sectors: le_u32(sector, 18),
+            root_dir_start_lba: le_u32(sector, 22),
+            root_dir_sectors: le_u32(sector, 26),
+            data_start_lba: le_u32(sector, 30),
+            total_clusters: le_u32(sector, 34),
+        }
+    }
+
+    pub fn to_bytes(&self) -> [u8; BLOCK_SIZE] {
+        let mut sector = [0u8; BLOCK_SIZE];
+        sector[0..8].copy_from_slice(&self.magic.to_le_bytes());
+        sector[8..10].copy_from_slice(&self.bytes_per_sector.to_le_bytes());
+        sector[10..14].copy_from_slice(&self.sectors_per_cluster.to_le_bytes());
+        sector[14..18].copy_from_slice(&self.fat_start_lba.to_le_bytes());
+        sector[18..22].copy_from_slice(&self.fat_sectors.to_le_bytes());
+        sector[22..26].copy_from_slice(&self.root_dir_start_lba.to_le_bytes());
+        sector[26..30].copy_from_slice(&self.root_dir_sectors.to_le_bytes());
+        sector[30..34].copy_from_slice(&self.data_start_lba.to_le_bytes());
+        sector[34..38].copy_from_slice(&self.total_clusters.to_le_bytes());
+        sector
+    }
+
+    pub fn is_formatted(&self) -> bool {
+        self.magic == FAT_MAGIC
+    }
+
+    /// One past the highest cluster this volume can use: the boot sector's
+    /// cluster count, capped at what the FAT can address.
+    pub fn cluster_limit(&self) -> u16 {
+        (2 + self.total_clusters as usize).min(FAT_ENTRIES) as u16
+    }
+}
+
+// ============================================================================
+// FAT view
+// ============================================================================
+
+/// The u16 entries of one FAT sector or any run of them (the whole FAT
+/// region included), decoded in place. Index 0 is the first entry in the
+/// buffer, so a single sector's view is indexed by `fat_position().1`.
+pub struct Fat<B>(B);
+
+impl<B: AsRef<[u8]>> Fat<B> {
+    pub fn new(bytes: B) -> Self {
+        Self(bytes)
+    }
+
+    pub fn len(&self) -> usize {
+        self.0.as_ref().len() / 2
+    }
+
+    pub fn get(&self, index: usize) -> u16 {
+        le_u16(self.0.as_ref(), index * 2)
+    }
+
+    pub fn iter(&self) -> impl Iterator<Item = u16> + '_ {
+        self.0.as_ref().chunks_exact(2).map(|entry| u16::from_le_bytes([entry[0], entry[1]]))
+    }
+
+    /// Index of the first free entry at or after `from`.
+    pub fn find_free(&self, from: usize) -> Option<usize> {
+        (from..self.len()).find(|&i| self.get(i) == FAT_ENTRY_FREE)
+    }
+}
+
+impl<B: AsMut<[u8]>> Fat<B> {
+    pub fn set(&mut self, index: usize, value: u16) {
+        self.0.as_mut()[index * 2..index * 2 + 2].copy_from_slice(&value.to_le_bytes());
+    }
+}
+
+// ============================================================================
+// Directory entries
+// ============================================================================
+
+/// A 32-byte directory entry: name(22, NUL-terminated) + first_cluster(2) +
+/// size(4) + in_use(1) + reserved(3).
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct FatDirEntry {
+    /// Filename, null-terminated, up to 21 bytes.
+    pub name: [u8; 22],
+    /// First cluster in the FAT chain (0 = no data).
+    pub first_cluster: u16,
+    /// File size in bytes.
+    pub size: u32,
+    /// 1 if this slot is in use, 0 if free.
+    pub in_use: u8,
+}
+
+impl FatDirEntry {
+    pub const EMPTY: Self = Self {
+        name: [0; 22],
+        first_cluster: 0,
+        size: 0,
+        in_use: 0,
+    };
+
+    /// An in-use entry, or None if `name` is empty or too long.
+    pub fn new(name: &[u8], first_cluster: u16, size: u32) -> Option<Self> {
+        if !valid_name(name) {
+            return None;
+        }
+        let mut entry = Self {
+            first_cluster,
+            size,
+            in_use: 1,
+            ..Self::EMPTY
+        };
+        entry.name[..name.len()].copy_from_slice(name);
+        Some(entry)
+    }
+
+    pub fn parse(bytes: &[u8]) -> Self {
+        Self {
+            name: bytes[0..22].try_into().unwrap(),
+            first_cluster: le_u16(bytes, 22),
+            size: le_u32(bytes, 24),
+            in_use: bytes[28],
+        }
+    }
+
+    pub fn write_to(&self, bytes: &mut [u8]) {
+        bytes[0..22].copy_from_slice(&self.name);
+        bytes[22..24].copy_from_slice(&self.first_cluster.to_le_bytes());
+        bytes[24..28].copy_from_slice(&self.size.to_le_bytes());
+        bytes[28] = self.in_use;
+        bytes[29..32].fill(0);
+    }
+
+    pub fn is_in_use(&self) -> bool {
+        self.in_use == 1
+    }
+
+    /// The name without its NUL padding.
+    pub fn name(&self) -> &[u8] {
+        let len = self.name.iter().position(|&b| b == 0).unwrap_or(self.name.len());
+        &self.name[..len]
+    }
+}
+
+pub fn valid_name(name: &[u8]) -> bool {
+    !name.is_empty() && name.len() <= MAX_NAME_LEN
+}
+
+/// The entries of one directory sector or the whole root directory region.
+pub struct Dir<B>(B);
+
+impl<B: AsRef<[u8]>> Dir<B> {
+    pub fn new(bytes: B) -> Self {
+        Self(bytes)
+    }
+
+    pub fn len(&self) -> usize {
+        self.0.as_ref().len() / DIR_ENTRY_SIZE
+    }
+
+    pub fn get(&self, index: usize) -> FatDirEntry {
+        FatDirEntry::parse(&self.0.as_ref()[index * DIR_ENTRY_SIZE..(index + 1) * DIR_ENTRY_SIZE])
+    }
+
+    pub fn iter(&self) -> impl Iterator<Item = FatDirEntry> + '_ {
+        self.0.as_ref().chunks_exact(DIR_ENTRY_SIZE).map(FatDirEntry::parse)
+    }
+
+    /// Index of the in-use entry called `name`.
+    pub fn find(&self, name: &[u8]) -> Option<usize> {
+        self.iter().position(|entry| entry.is_in_use() && entry.name() == name)
+    }
+
+    /// Index of the first unused entry.
+    pub fn find_free(&self) -> Option<usize> {
+        self.iter().position(|entry| entry.in_use == 0)
+    }
+}
+
+impl<B: AsMut<[u8]>> Dir<B> {
+    pub fn set(&mut self, index: usize, entry: &FatDirEntry) {
+        entry.write_to(&mut self.0.as_mut()[index * DIR_ENTRY_SIZE..(index + 1) * DIR_ENTRY_SIZE]);
+    }
+}
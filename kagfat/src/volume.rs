@@ -0,0 +1,886 @@
+// ============================================================================
+// Volume
+// ============================================================================
+//
+// The filesystem operations themselves, written against `BlockDevice` so the
+// same code runs in the kernel (over the block device table) and on the host
+// (over a file or a buffer in memory). A `Volume` holds no cached state
+// beyond the device, so building one per call is free.
+//
+// Several volumes may work on one device at once if the device implements
+// `lock`/`unlock`: every read-modify-write of shared metadata (a FAT sector,
+// a directory entry, claiming a directory slot) happens under the matching
+// `MetadataLock`, and file data is only ever written to clusters the
+// writer has just claimed. A volume holds at most one metadata lock at a
+// time. Callers still serialise operations on the same file name.
+
+use alloc::string::String;
+use alloc::vec::Vec;
+
+use crate::{
+    BLOCK_SIZE, BOOT_SECTOR_LBA, BootSector, CLUSTER_SIZE, Dir, FAT_ENTRIES, FAT_ENTRY_EOC, FAT_ENTRY_FREE,
+    FAT_ENTRY_MEDIA, FAT_ENTRY_RESERVED, FAT_SECTORS, FAT_START_LBA, Fat, FatDirEntry, ROOT_DIR_ENTRIES,
+    ROOT_DIR_SECTORS, ROOT_DIR_START_LBA, TOTAL_CLUSTERS, cluster_to_lba, dir_position,
+    fat_position, valid_name,
+};
+
+// ============================================================================
+// Error types
+// ============================================================================
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum FsError {
+    NotReady,
+    InvalidArgument,
+    DeviceError,
+    NotFormatted,
+    NoSpace,
+    FileNotFound,
+    /// The volume or file is in use.
+    Busy,
+}
+
+impl FsError {
+    pub fn code(self) -> i32 {
+        match self {
+            FsError::NotReady => -1,
+            FsError::InvalidArgument => -2,
+            FsError::DeviceError => -3,
+            FsError::NotFormatted => -4,
+            FsError::NoSpace => -5,
+            FsError::FileNotFound => -6,
+            FsError::Busy => -7,
+        }
+    }
+}
+
+pub type FsResult<T> = Result<T, FsError>;
+
+// ============================================================================
+// Block device
+// ============================================================================
+
+/// Something addressable in `BLOCK_SIZE` sectors. Buffers are always a whole
+/// number of sectors long.
+pub trait BlockDevice {
+    fn read_blocks(&mut self, lba: u64, buffer: &mut [u8]) -> FsResult<()>;
+    fn write_blocks(&mut self, lba: u64, buffer: &[u8]) -> FsResult<()>;
+
+    /// Take exclusive use of part of the metadata. Devices only one volume
+    /// uses at a time can leave this and `unlock` as they are.
+    fn lock(&mut self, _part: MetadataLock) {}
+    fn unlock(&mut self, _part: MetadataLock) {}
+
+    /// A delete or overwrite took the directory entry of the chain starting
+    /// at `first_cluster`. Returning true keeps the chain allocated for a
+    /// reader that still has the file open; whoever keeps it frees it with
+    /// `Volume::free_cluster_chain` once that reader is done.
+    fn retain_chain(&mut self, _first_cluster: u16) -> bool {
+        false
+    }
+}
+
+/// The parts of the metadata `Volume` locks while it modifies them.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum MetadataLock {
+    /// The whole root directory.
+    Directory,
+    /// The FAT sector at this LBA.
+    FatSector(u64),
+}
+
+// ============================================================================
+// Public file listing type
+// ============================================================================
+
+pub struct PublicFileEntry {
+    pub name: String,
+    pub size: u64,
+    pub first_cluster: u16,
+}
+
+/// Where an open file's data lives, so it can be read piecewise without
+/// looking it up again or loading all of it.
+#[derive(Debug, Clone, Copy)]
+pub struct FileHandle {
+    pub first_cluster: u16,
+    pub size: u32,
+}
+
+const ROOT_DIR_BYTES: usize = ROOT_DIR_SECTORS as usize * BLOCK_SIZE;
+
+pub struct Volume<D> {
+    device: D,
+}
+
+impl<D: BlockDevice> Volume<D> {
+    pub fn new(device: D) -> Self {
+        Self { device }
+    }
+
+    pub fn device(&mut self) -> &mut D {
+        &mut self.device
+    }
+
+    pub fn into_device(self) -> D {
+        self.device
+    }
+
+    // ========================================================================
+    // Raw block helpers
+    // ========================================================================
+
+    pub fn read_block(&mut self, lba: u64, buffer: &mut [u8; BLOCK_SIZE]) -> FsResult<()> {
+        self.device.read_blocks(lba, buffer)
+    }
+
+    pub fn write_block(&mut self, lba: u64, buffer: &[u8; BLOCK_SIZE]) -> FsResult<()> {
+        self.device.write_blocks(lba, buffer)
+    }
+
+    // ========================================================================
+    // Boot Sector
+    // ========================================================================
+
+    pub fn read_boot_sector(&mut self) -> FsResult<BootSector> {
+        let mut buf = [0u8; BLOCK_SIZE];
+        self.read_block(BOOT_SECTOR_LBA, &mut buf)?;
+        let bs = BootSector::parse(&buf);
+        if bs.is_formatted() {
+            Ok(bs)
+        } else {
+            Err(FsError::NotFormatted)
+        }
+    }
+
+    pub fn write_boot_sector(&mut self, bs: &BootSector) -> FsResult<()> {
+        self.write_block(BOOT_SECTOR_LBA, &bs.to_bytes())
+    }
+
+    // ========================================================================
+    // FAT table
+    //
+    // The FAT is stored as a flat array of u16 values beginning at
+    // FAT_START_LBA. Each u16 entry corresponds to one data cluster:
+    //   - 0x0000 = free
+    //   - 0xFFFF = end of chain (EOC)
+    //   - other  = index of next cluster in chain
+    //
+    // Cluster indices start at 2 (clusters 0 and 1 are reserved by FAT
+    // convention). Entries are read and written a whole FAT sector at a time.
+    // ========================================================================
+
+    /// Read the FAT entry for the given cluster.
+    pub fn read_fat_entry(&mut self, cluster: u16) -> FsResult<u16> {
+        if cluster as usize >= FAT_ENTRIES {
+            return Err(FsError::InvalidArgument);
+        }
+        let (lba, index) = fat_position(cluster);
+        let mut buf = [0u8; BLOCK_SIZE];
+        self.read_block(lba, &mut buf)?;
+        Ok(Fat::new(&buf).get(index))
+    }
+
+    /// Write the FAT entry for the given cluster.
+    pub fn write_fat_entry(&mut self, cluster: u16, value: u16) -> FsResult<()> {
+        if cluster as usize >= FAT_ENTRIES {
+            return Err(FsError::InvalidArgument);
+        }
+        let (lba, index) = fat_position(cluster);
+        self.device.lock(MetadataLock::FatSector(lba));
+        let mut buf = [0u8; BLOCK_SIZE];
+        let result = self.read_block(lba, &mut buf).and_then(|_| {
+            Fat::new(&mut buf).set(index, value);
+            self.write_block(lba, &buf)
+        });
+        self.device.unlock(MetadataLock::FatSector(lba));
+        result
+    }
+
+    /// Find and allocate one free cluster in the FAT, returning its index.
+    /// Sets the new cluster's FAT entry to EOC.
+    pub fn alloc_cluster(&mut self) -> FsResult<u16> {
+        // Clusters are numbered starting at 2 by FAT convention.
+        // Maximum usable cluster = 2 + TOTAL_CLUSTERS - 1, as far as the FAT reaches.
+        let limit = (2 + TOTAL_CLUSTERS as usize).min(FAT_ENTRIES);
+        let per_sector = BLOCK_SIZE / 2;
+
+        for sector in 0..FAT_SECTORS as usize {
+            let first = sector * per_sector;
+            if first >= limit {
+                break;
+            }
+            let lba = FAT_START_LBA + sector as u64;
+            self.device.lock(MetadataLock::FatSector(lba));
+            let claimed = self.claim_free_entry(lba, 2usize.saturating_sub(first), limit - first);
+            self.device.unlock(MetadataLock::FatSector(lba));
+            if let Some(index) = claimed? {
+                return Ok((first + index) as u16);
+            }
+        }
+        Err(FsError::NoSpace)
+    }
+
+    /// Mark the first free entry at or after `from` (and before `end`) of
+    /// the FAT sector at `lba` as EOC and return its index in the sector.
+    /// The caller holds the sector's lock.
+    fn claim_free_entry(&mut self, lba: u64, from: usize, end: usize) -> FsResult<Option<usize>> {
+        let mut buf = [0u8; BLOCK_SIZE];
+        self.read_block(lba, &mut buf)?;
+        let mut fat = Fat::new(&mut buf);
+        let Some(index) = fat.find_free(from).filter(|&index| index < end) else {
+            return Ok(None);
+        };
+        fat.set(index, FAT_ENTRY_EOC);
+        self.write_block(lba, &buf)?;
+        Ok(Some(index))
+    }
+
+    /// Follow the FAT chain starting at `first_cluster` and free every cluster
+    /// (set their FAT entries back to FAT_ENTRY_FREE).
+    pub fn free_cluster_chain(&mut self, first_cluster: u16) -> FsResult<()> {
+        let mut fat = FatSectorCache::new();
+        let freed = self.free_chain_in(&mut fat, first_cluster);
+        let flushed = fat.release(&mut self.device);
+        freed.and(flushed)
+    }
+
+    fn free_chain_in(&mut self, fat: &mut FatSectorCache, first_cluster: u16) -> FsResult<()> {
+        let mut current = first_cluster;
+        loop {
+            if current < 2 || current >= FAT_ENTRY_RESERVED {
+                break;
+            }
+            let next = fat.get(&mut self.device, current)?;
+            fat.set(&mut self.device, current, FAT_ENTRY_FREE)?;
+            if next >= FAT_ENTRY_RESERVED {
+                // EOC or reserved — chain ends here
+                break;
+            }
+            current = next;
+        }
+        Ok(())
+    }
+
+    // ========================================================================
+    // Root directory
+    //
+    // The root directory is a flat array of FatDirEntry (32 bytes each).
+    // 16 entries fit in each 512-byte sector; ROOT_DIR_SECTORS sectors → 256
+    // entries. Lookups read the whole region in one request and scan it in
+    // memory.
+    // ========================================================================
+
+    /// Read the directory entry at the given index (0-based).
+    pub fn read_dir_entry(&mut self, index: usize) -> FsResult<FatDirEntry> {
+        if index >= ROOT_DIR_ENTRIES {
+            return Err(FsError::InvalidArgument);
+        }
+        let (lba, slot) = dir_position(index);
+        let mut buf = [0u8; BLOCK_SIZE];
+        self.read_block(lba, &mut buf)?;
+        Ok(Dir::new(&buf).get(slot))
+    }
+
+    /// Write a directory entry at the given index.
+    pub fn write_dir_entry(&mut self, index: usize, entry: &FatDirEntry) -> FsResult<()> {
+        self.device.lock(MetadataLock::Directory);
+        let result = self.store_dir_entry(index, entry);
+        self.device.unlock(MetadataLock::Directory);
+        result
+    }
+
+    /// `write_dir_entry` for a caller that holds the directory lock.
+    fn store_dir_entry(&mut self, index: usize, entry: &FatDirEntry) -> FsResult<()> {
+        if index >= ROOT_DIR_ENTRIES {
+            return Err(FsError::InvalidArgument);
+        }
+        let (lba, slot) = dir_position(index);
+        let mut buf = [0u8; BLOCK_SIZE];
+        self.read_block(lba, &mut buf)?;
+        Dir::new(&mut buf).set(slot, entry);
+        self.write_block(lba, &buf)
+    }
+
+    /// Read the whole root directory region.
+    fn read_root_dir(&mut self) -> FsResult<Vec<u8>> {
+        let mut buf = alloc::vec![0u8; ROOT_DIR_BYTES];
+        self.device.read_blocks(ROOT_DIR_START_LBA, &mut buf)?;
+        Ok(buf)
+    }
+
+    /// Search the root directory for a file by name.
+    /// Returns `(index, FatDirEntry)` if found.
+    pub fn find_file(&mut self, name: &str) -> FsResult<Option<(usize, FatDirEntry)>> {
+        if !valid_name(name.as_bytes()) {
+            return Err(FsError::InvalidArgument);
+        }
+        let buf = self.read_root_dir()?;
+        let dir = Dir::new(&buf);
+        Ok(dir.find(name.as_bytes()).map(|index| (index, dir.get(index))))
+    }
+
+    /// Clear the entry of `name` and return it, or None if there is none.
+    /// With `need_slot`, fail with NoSpace instead if there is neither an
+    /// entry nor a free slot. The caller holds the directory lock.
+    fn take_dir_entry(&mut self, name: &[u8], need_slot: bool) -> FsResult<Option<FatDirEntry>> {
+        let buf = self.read_root_dir()?;
+        let dir = Dir::new(&buf);
+        match dir.find(name) {
+            Some(index) => {
+                let entry = dir.get(index);
+                self.store_dir_entry(index, &FatDirEntry::EMPTY)?;
+                Ok(Some(entry))
+            }
+            None if need_slot && dir.find_free().is_none() => Err(FsError::NoSpace),
+            None => Ok(None),
+        }
+    }
+
+    /// Store `entry` in the first free directory slot. The caller holds the
+    /// directory lock.
+    fn claim_dir_slot(&mut self, entry: &FatDirEntry) -> FsResult<()> {
+        let slot = Dir::new(&self.read_root_dir()?).find_free().ok_or(FsError::NoSpace)?;
+        self.store_dir_entry(slot, entry)
+    }
+
+    // ========================================================================
+    // High-level filesystem operations
+    // ========================================================================
+
+    pub fn format(&mut self) -> FsResult<()> {
+        // 1. Write the Boot Sector
+        self.write_boot_sector(&BootSector::new())?;
+
+        // 2. Zero the FAT table, marking clusters 0 and 1 as reserved (FAT
+        //    convention), in one request.
+        let mut fat_buf = alloc::vec![0u8; FAT_SECTORS as usize * BLOCK_SIZE];
+        let mut fat = Fat::new(&mut fat_buf[..]);
+        fat.set(0, FAT_ENTRY_MEDIA); // media descriptor in cluster 0
+        fat.set(1, FAT_ENTRY_EOC); // reserved
+        self.device.write_blocks(FAT_START_LBA, &fat_buf)?;
+
+        // 3. Zero the root directory
+        let dir_buf = alloc::vec![0u8; ROOT_DIR_BYTES];
+        self.device.write_blocks(ROOT_DIR_START_LBA, &dir_buf)
+    }
+
+    pub fn create_file(&mut self, name: &str, data: &[u8]) -> FsResult<()> {
+        let name_bytes = name.as_bytes();
+        if !valid_name(name_bytes) {
+            return Err(FsError::InvalidArgument);
+        }
+
+        // Validate the volume is formatted
+        self.read_boot_sector()?;
+
+        // If the file already exists, delete it first (overwrite semantics),
+        // and fail early if the directory is full.
+        self.device.lock(MetadataLock::Directory);
+        let old_entry = self.take_dir_entry(name_bytes, true);
+        self.device.unlock(MetadataLock::Directory);
+        if let Some(old_entry) = old_entry? {
+            self.release_chain(old_entry.first_cluster)?;
+        }
+
+        // Allocate a FAT cluster chain for the file data. If that fails part
+        // way, give back what was claimed.
+        let mut first_cluster: u16 = 0; // No data → no clusters needed
+        if let Err(e) = self.write_chain(data, &mut first_cluster) {
+            if first_cluster >= 2 {
+                let _ = self.free_cluster_chain(first_cluster);
+            }
+            return Err(e);
+        }
+
+        // Claim a directory slot only now that the data is on disk; another
+        // file may have taken the one that was free above.
+        let new_entry =
+            FatDirEntry::new(name_bytes, first_cluster, data.len() as u32).ok_or(FsError::InvalidArgument)?;
+        self.device.lock(MetadataLock::Directory);
+        let claimed = self.claim_dir_slot(&new_entry);
+        self.device.unlock(MetadataLock::Directory);
+        if claimed.is_err() && first_cluster >= 2 {
+            let _ = self.free_cluster_chain(first_cluster);
+        }
+        claimed
+    }
+
+    /// Store `data` in a new cluster chain, setting `first` as soon as the
+    /// first cluster is claimed. On error `first` heads whatever part of the
+    /// chain was linked.
+    fn write_chain(&mut self, data: &[u8], first: &mut u16) -> FsResult<()> {
+        let clusters_needed = data.len().div_ceil(CLUSTER_SIZE);
+
+        // Allocate all clusters first, chaining them together
+        let mut prev_cluster: Option<u16> = None;
+        let mut cluster_buf = alloc::vec![0u8; CLUSTER_SIZE];
+
+        for i in 0..clusters_needed {
+            let c = self.alloc_cluster()?;
+            if let Some(prev) = prev_cluster {
+                // Point previous cluster to this one
+                if let Err(e) = self.write_fat_entry(prev, c) {
+                    let _ = self.write_fat_entry(c, FAT_ENTRY_FREE);
+                    return Err(e);
+                }
+            } else {
+                *first = c;
+            }
+            prev_cluster = Some(c);
+
+            // Write cluster data
+            let src_offset = i * CLUSTER_SIZE;
+            let src_end = (src_offset + CLUSTER_SIZE).min(data.len());
+            let chunk = &data[src_offset..src_end];
+
+            // Build a full-cluster buffer (zero-padded)
+            cluster_buf[..chunk.len()].copy_from_slice(chunk);
+            cluster_buf[chunk.len()..].fill(0);
+
+            self.device.write_blocks(cluster_to_lba(c), &cluster_buf)?;
+        }
+        // The last cluster already has EOC from alloc_cluster
+        Ok(())
+    }
+
+    pub fn read_file(&mut self, name: &str) -> FsResult<Vec<u8>> {
+        let (_, entry) = self.find_file(name)?.ok_or(FsError::FileNotFound)?;
+
+        let size = entry.size as usize;
+        if size == 0 {
+            return Ok(Vec::new());
+        }
+
+        let mut result = alloc::vec![0u8; size];
+        let mut written = 0usize;
+        let mut current = entry.first_cluster;
+        let mut cluster_buf = alloc::vec![0u8; CLUSTER_SIZE];
+
+        while current >= 2 && current < FAT_ENTRY_RESERVED && written < size {
+            let remaining = size - written;
+            let to_read = remaining.min(CLUSTER_SIZE);
+
+            // Read the full cluster into a temp buffer, then copy what we need
+            self.device.read_blocks(cluster_to_lba(current), &mut cluster_buf)?;
+            result[written..written + to_read].copy_from_slice(&cluster_buf[..to_read]);
+            written += to_read;
+
+            current = self.read_fat_entry(current)?;
+        }
+
+        Ok(result)
+    }
+
+    pub fn open_file(&mut self, name: &str) -> FsResult<FileHandle> {
+        let (_, entry) = self.find_file(name)?.ok_or(FsError::FileNotFound)?;
+        Ok(FileHandle {
+            first_cluster: entry.first_cluster,
+            size: entry.size,
+        })
+    }
+
+    /// Read `buffer.len()` bytes starting `skip` bytes into sector `lba`.
+    /// Whole sectors go straight into `buffer`; a partial head or tail goes
+    /// through a one-sector bounce buffer.
+    fn read_span(&mut self, mut lba: u64, mut skip: usize, buffer: &mut [u8]) -> FsResult<()> {
+        let mut done = 0usize;
+        while done < buffer.len() {
+            let left = buffer.len() - done;
+            if skip == 0 && left >= BLOCK_SIZE {
+                let count = left / BLOCK_SIZE;
+                self.device.read_blocks(lba, &mut buffer[done..done + count * BLOCK_SIZE])?;
+                lba += count as u64;
+                done += count * BLOCK_SIZE;
+            } else {
+                let mut sector = [0u8; BLOCK_SIZE];
+                self.read_block(lba, &mut sector)?;
+                let n = (BLOCK_SIZE - skip).min(left);
+                buffer[done..done + n].copy_from_slice(&sector[skip..skip + n]);
+                lba += 1;
+                skip = 0;
+                done += n;
+            }
+        }
+        Ok(())
+    }
+
+    /// Read from `offset` into `buffer`, stopping at end of file. Returns the
+    /// number of bytes read. Only the clusters covering the range are read.
+    pub fn read_file_at(&mut self, file: &FileHandle, offset: u32, buffer: &mut [u8]) -> FsResult<usize> {
+        if offset >= file.size || buffer.is_empty() {
+            return Ok(0);
+        }
+        let len = buffer.len().min((file.size - offset) as usize);
+
+        // Walk the chain to the cluster holding `offset`.
+        let mut current = file.first_cluster;
+        for _ in 0..offset as usize / CLUSTER_SIZE {
+            if current < 2 || current >= FAT_ENTRY_RESERVED {
+                return Err(FsError::DeviceError);
+            }
+            current = self.read_fat_entry(current)?;
+        }
+
+        let mut pos = offset as usize;
+        let mut done = 0usize;
+        while done < len {
+            if current < 2 || current >= FAT_ENTRY_RESERVED {
+                // Chain is shorter than the directory entry claims.
+                return Err(FsError::DeviceError);
+            }
+            let within = pos % CLUSTER_SIZE;
+            let n = (CLUSTER_SIZE - within).min(len - done);
+            let lba = cluster_to_lba(current) + (within / BLOCK_SIZE) as u64;
+            self.read_span(lba, within % BLOCK_SIZE, &mut buffer[done..done + n])?;
+            done += n;
+            pos += n;
+            if done < len {
+                current = self.read_fat_entry(current)?;
+            }
+        }
+
+        Ok(len)
+    }
+
+    pub fn delete_file(&mut self, name: &str) -> FsResult<()> {
+        if !valid_name(name.as_bytes()) {
+            return Err(FsError::InvalidArgument);
+        }
+
+        // Clear the directory entry, then free the chain it pointed to
+        self.device.lock(MetadataLock::Directory);
+        let entry = self.take_dir_entry(name.as_bytes(), false);
+        self.device.unlock(MetadataLock::Directory);
+        let entry = entry?.ok_or(FsError::FileNotFound)?;
+        self.release_chain(entry.first_cluster)
+    }
+
+    /// Free the chain of a file whose directory entry is gone, unless the
+    /// device retains it for an open reader.
+    fn release_chain(&mut self, first_cluster: u16) -> FsResult<()> {
+        if first_cluster < 2 || self.device.retain_chain(first_cluster) {
+            return Ok(());
+        }
+        self.free_cluster_chain(first_cluster)
+    }
+
+    pub fn list_files(&mut self) -> FsResult<Vec<PublicFileEntry>> {
+        // Validate the volume is formatted
+        self.read_boot_sector()?;
+
+        let buf = self.read_root_dir()?;
+        let list = Dir::new(&buf)
+            .iter()
+            .filter(|entry| entry.is_in_use())
+            .map(|entry| PublicFileEntry {
+                name: String::from_utf8_lossy(entry.name()).into_owned(),
+                size: entry.size as u64,
+                first_cluster: entry.first_cluster,
+            })
+            .collect();
+        Ok(list)
+    }
+}
+
+/// One FAT sector held in memory while a chain is walked or rewritten, so
+/// consecutive entries in the same sector cost one read and one write. The
+/// sector is locked while it is held; `release` writes it back and unlocks
+/// it.
+struct FatSectorCache {
+    lba: u64,
+    buf: [u8; BLOCK_SIZE],
+    dirty: bool,
+}
+
+impl FatSectorCache {
+    fn new() -> Self {
+        Self { lba: 0, buf: [0; BLOCK_SIZE], dirty: false }
+    }
+
+    /// Make the sector holding `cluster` current; returns its entry index.
+    fn load<D: BlockDevice>(&mut self, device: &mut D, cluster: u16) -> FsResult<usize> {
+        if cluster as usize >= FAT_ENTRIES {
+            return Err(FsError::InvalidArgument);
+        }
+        let (lba, index) = fat_position(cluster);
+        if lba != self.lba {
+            self.release(device)?;
+            device.lock(MetadataLock::FatSector(lba));
+            self.lba = lba;
+            device.read_blocks(lba, &mut self.buf)?;
+        }
+        Ok(index)
+    }
+
+    fn get<D: BlockDevice>(&mut self, device: &mut D, cluster: u16) -> FsResult<u16> {
+        let index = self.load(device, cluster)?;
+        Ok(Fat::new(&self.buf).get(index))
+    }
+
+    fn set<D: BlockDevice>(&mut self, device: &mut D, cluster: u16, value: u16) -> FsResult<()> {
+        let index = self.load(device, cluster)?;
+        Fat::new(&mut self.buf).set(index, value);
+        self.dirty = true;
+        Ok(())
+    }
+
+    /// Write the sector back if it changed and unlock it. The sector is
+    /// unlocked even if the write fails.
+    fn release<D: BlockDevice>(&mut self, device: &mut D) -> FsResult<()> {
+        if self.lba == 0 {
+            return Ok(());
+        }
+        let written = if self.dirty { device.write_blocks(self.lba, &self.buf) } else { Ok(()) };
+        device.unlock(MetadataLock::FatSector(self.lba));
+        self.lba = 0;
+        self.dirty = false;
+        written
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::{DATA_START_LBA, MAX_NAME_LEN, SECTORS_PER_CLUSTER};
+    use alloc::vec;
+
+    /// Sectors the FAT can address; nothing past them is ever touched.
+    const SECTORS: usize = DATA_START_LBA as usize + (FAT_ENTRIES - 2) * SECTORS_PER_CLUSTER as usize;
+
+    /// A volume in memory that also checks the locking rules: at most one
+    /// metadata lock held at a time, and FAT or directory sectors written
+    /// only under their lock (`format` aside, which may skip it).
+    struct MemDisk {
+        data: Vec<u8>,
+        held: Option<MetadataLock>,
+        unlocked_writes: usize,
+        /// Chains `retain_chain` keeps.
+        open: Vec<u16>,
+    }
+
+    impl MemDisk {
+        fn new() -> Self {
+            Self { data: vec![0; SECTORS * BLOCK_SIZE], held: None, unlocked_writes: 0, open: Vec::new() }
+        }
+    }
+
+    impl BlockDevice for MemDisk {
+        fn read_blocks(&mut self, lba: u64, buffer: &mut [u8]) -> FsResult<()> {
+            let start = lba as usize * BLOCK_SIZE;
+            buffer.copy_from_slice(self.data.get(start..start + buffer.len()).ok_or(FsError::DeviceError)?);
+            Ok(())
+        }
+
+        fn write_blocks(&mut self, lba: u64, buffer: &[u8]) -> FsResult<()> {
+            let start = lba as usize * BLOCK_SIZE;
+            self.data.get_mut(start..start + buffer.len()).ok_or(FsError::DeviceError)?.copy_from_slice(buffer);
+            for sector in lba..lba + (buffer.len() / BLOCK_SIZE) as u64 {
+                let needs = if (FAT_START_LBA..ROOT_DIR_START_LBA).contains(&sector) {
+                    Some(MetadataLock::FatSector(sector))
+                } else if (ROOT_DIR_START_LBA..DATA_START_LBA).contains(&sector) {
+                    Some(MetadataLock::Directory)
+                } else {
+                    None
+                };
+                if needs.is_some() && needs != self.held {
+                    self.unlocked_writes += 1;
+                }
+            }
+            Ok(())
+        }
+
+        fn lock(&mut self, part: MetadataLock) {
+            assert_eq!(self.held, None, "took {:?} while holding another lock", part);
+            self.held = Some(part);
+        }
+
+        fn unlock(&mut self, part: MetadataLock) {
+            assert_eq!(self.held, Some(part), "released a lock it did not hold");
+            self.held = None;
+        }
+
+        fn retain_chain(&mut self, first_cluster: u16) -> bool {
+            self.open.contains(&first_cluster)
+        }
+    }
+
+    fn formatted() -> Volume<MemDisk> {
+        let mut volume = Volume::new(MemDisk::new());
+        volume.format().unwrap();
+        volume.device().unlocked_writes = 0;
+        volume
+    }
+
+    fn pattern(len: usize, seed: usize) -> Vec<u8> {
+        (0..len).map(|i| (i * 7 + seed) as u8).collect()
+    }
+
+    fn free_clusters(volume: &mut Volume<MemDisk>) -> usize {
+        let mut fat = vec![0u8; FAT_SECTORS as usize * BLOCK_SIZE];
+        volume.device().read_blocks(FAT_START_LBA, &mut fat).unwrap();
+        Fat::new(&fat).iter().skip(2).filter(|&entry| entry == FAT_ENTRY_FREE).count()
+    }
+
+    #[test]
+    fn create_then_read_returns_the_data() {
+        let mut volume = formatted();
+        let sizes = [0, 1, BLOCK_SIZE, CLUSTER_SIZE, 3 * CLUSTER_SIZE + 17];
+        for (i, &size) in sizes.iter().enumerate() {
+            volume.create_file(&alloc::format!("file{}", i), &pattern(size, i)).unwrap();
+        }
+        for (i, &size) in sizes.iter().enumerate() {
+            assert_eq!(volume.read_file(&alloc::format!("file{}", i)).unwrap(), pattern(size, i));
+        }
+        let listed = volume.list_files().unwrap();
+        assert_eq!(listed.len(), sizes.len());
+        assert!(listed.iter().all(|entry| entry.size == sizes[entry.name[4..].parse::<usize>().unwrap()] as u64));
+        assert_eq!(volume.device().unlocked_writes, 0);
+    }
+
+    #[test]
+    fn create_overwrites_and_frees_the_old_chain() {
+        let mut volume = formatted();
+        let free = free_clusters(&mut volume);
+        volume.create_file("data", &pattern(5 * CLUSTER_SIZE, 1)).unwrap();
+        assert_eq!(free_clusters(&mut volume), free - 5);
+        volume.create_file("data", &pattern(CLUSTER_SIZE + 1, 2)).unwrap();
+        assert_eq!(free_clusters(&mut volume), free - 2);
+        assert_eq!(volume.read_file("data").unwrap(), pattern(CLUSTER_SIZE + 1, 2));
+        assert_eq!(volume.list_files().unwrap().len(), 1);
+        assert_eq!(volume.device().unlocked_writes, 0);
+    }
+
+    #[test]
+    fn read_at_crosses_sectors_and_clusters_and_stops_at_the_end() {
+        let mut volume = formatted();
+        let data = pattern(3 * CLUSTER_SIZE + 100, 3);
+        volume.create_file("image", &data).unwrap();
+        let file = volume.open_file("image").unwrap();
+        assert_eq!(file.size as usize, data.len());
+
+        for (offset, len) in [(0, 10), (BLOCK_SIZE - 3, 10), (CLUSTER_SIZE - 5, 2 * CLUSTER_SIZE), (700, 4096)] {
+            let mut buffer = vec![0u8; len];
+            assert_eq!(volume.read_file_at(&file, offset as u32, &mut buffer).unwrap(), len);
+            assert_eq!(buffer, &data[offset..offset + len]);
+        }
+
+        let mut buffer = vec![0u8; 500];
+        let tail = data.len() - 50;
+        assert_eq!(volume.read_file_at(&file, tail as u32, &mut buffer).unwrap(), 50);
+        assert_eq!(&buffer[..50], &data[tail..]);
+        assert_eq!(volume.read_file_at(&file, data.len() as u32, &mut buffer).unwrap(), 0);
+    }
+
+    #[test]
+    fn delete_frees_the_chain_and_the_name() {
+        let mut volume = formatted();
+        let free = free_clusters(&mut volume);
+        volume.create_file("gone", &pattern(4 * CLUSTER_SIZE, 4)).unwrap();
+        volume.delete_file("gone").unwrap();
+        assert_eq!(free_clusters(&mut volume), free);
+        assert_eq!(volume.read_file("gone"), Err(FsError::FileNotFound));
+        assert_eq!(volume.delete_file("gone"), Err(FsError::FileNotFound));
+        assert!(volume.list_files().unwrap().is_empty());
+        assert_eq!(volume.device().unlocked_writes, 0);
+    }
+
+    #[test]
+    fn open_files_keep_their_chain_through_delete_and_overwrite() {
+        let mut volume = formatted();
+        let free = free_clusters(&mut volume);
+        let data = pattern(3 * CLUSTER_SIZE, 5);
+        volume.create_file("held", &data).unwrap();
+        let old = volume.open_file("held").unwrap();
+        volume.device().open.push(old.first_cluster);
+
+        volume.create_file("held", &pattern(CLUSTER_SIZE, 6)).unwrap();
+        assert_eq!(free_clusters(&mut volume), free - 4);
+        let mut buffer = vec![0u8; data.len()];
+        assert_eq!(volume.read_file_at(&old, 0, &mut buffer).unwrap(), data.len());
+        assert_eq!(buffer, data);
+
+        let new = volume.open_file("held").unwrap();
+        volume.device().open.push(new.first_cluster);
+        volume.delete_file("held").unwrap();
+        assert_eq!(free_clusters(&mut volume), free - 4);
+        volume.free_cluster_chain(old.first_cluster).unwrap();
+        volume.free_cluster_chain(new.first_cluster).unwrap();
+        assert_eq!(free_clusters(&mut volume), free);
+        assert_eq!(volume.device().unlocked_writes, 0);
+    }
+
+    #[test]
+    fn fat_allocates_every_cluster_then_reports_no_space() {
+        let mut volume = formatted();
+        let mut allocated = 0;
+        let last = loop {
+            match volume.alloc_cluster() {
+                Ok(cluster) => {
+                    allocated += 1;
+                    assert_eq!(volume.read_fat_entry(cluster).unwrap(), FAT_ENTRY_EOC);
+                    if allocated == FAT_ENTRIES - 2 {
+                        break cluster;
+                    }
+                }
+                Err(e) => panic!("allocation {} failed: {:?}", allocated, e),
+            }
+        };
+        assert_eq!(volume.alloc_cluster(), Err(FsError::NoSpace));
+
+        volume.free_cluster_chain(last).unwrap();
+        assert_eq!(volume.alloc_cluster(), Ok(last));
+        assert_eq!(volume.device().unlocked_writes, 0);
+    }
+
+    #[test]
+    fn free_cluster_chain_follows_the_whole_chain() {
+        let mut volume = formatted();
+        let chain: Vec<u16> = (0..600).map(|_| volume.alloc_cluster().unwrap()).collect();
+        for pair in chain.windows(2) {
+            volume.write_fat_entry(pair[0], pair[1]).unwrap();
+        }
+        // 600 entries span three FAT sectors.
+        volume.free_cluster_chain(chain[0]).unwrap();
+        assert!(chain.iter().all(|&c| volume.read_fat_entry(c).unwrap() == FAT_ENTRY_FREE));
+        assert_eq!(volume.device().unlocked_writes, 0);
+    }
+
+    #[test]
+    fn create_on_a_full_volume_gives_its_clusters_back() {
+        let mut volume = formatted();
+        for _ in 3..free_clusters(&mut volume) {
+            volume.alloc_cluster().unwrap();
+        }
+        assert_eq!(volume.create_file("big", &pattern(4 * CLUSTER_SIZE, 5)), Err(FsError::NoSpace));
+        assert_eq!(free_clusters(&mut volume), 3);
+        assert_eq!(volume.read_file("big"), Err(FsError::FileNotFound));
+        volume.create_file("fits", &pattern(3 * CLUSTER_SIZE, 6)).unwrap();
+        assert_eq!(volume.read_file("fits").unwrap(), pattern(3 * CLUSTER_SIZE, 6));
+    }
+
+    #[test]
+    fn directory_holds_root_dir_entries_files() {
+        let mut volume = formatted();
+        for i in 0..ROOT_DIR_ENTRIES {
+            volume.create_file(&alloc::format!("f{}", i), &[]).unwrap();
+        }
+        assert_eq!(volume.create_file("one-more", &[1]), Err(FsError::NoSpace));
+        // Replacing an existing name needs no new slot.
+        volume.create_file("f7", &[1, 2, 3]).unwrap();
+        assert_eq!(volume.read_file("f7").unwrap(), [1, 2, 3]);
+    }
+
+    #[test]
+    fn rejects_bad_names_and_unformatted_volumes() {
+        let mut volume = formatted();
+        let long = "x".repeat(MAX_NAME_LEN + 1);
+        assert_eq!(volume.create_file("", &[1]), Err(FsError::InvalidArgument));
+        assert_eq!(volume.create_file(&long, &[1]), Err(FsError::InvalidArgument));
+        assert_eq!(volume.find_file(&long), Err(FsError::InvalidArgument));
+
+        let mut blank = Volume::new(MemDisk::new());
+        assert_eq!(blank.create_file("a", &[1]), Err(FsError::NotFormatted));
+        assert!(matches!(blank.list_files(), Err(FsError::NotFormatted)));
+    }
+}
@@ -5,6 +5,9 @@ cp target/x86_64-unknown-uefi/debug/os.efi esp/EFI/BOOT/BOOTX64.EFI
 if [ ! -f nvme.img ]; then
     qemu-img create -f raw nvme.img 1G
 fi
+if [ ! -f usb.img ]; then
+    qemu-img create -f raw usb.img 64M
+fi
 
 qemu-system-x86_64 \
     -smp 2 \
@@ -12,8 +15,10 @@ qemu-system-x86_64 \
     -drive format=raw,file=fat:rw:esp \
     -drive file=nvme.img,if=none,id=nvm,format=raw \
     -device nvme,serial=deadbeef,drive=nvm \
-    -device qemu-xhci,id=xhci,msi=off,msix=off \
+    -device qemu-xhci,id=xhci,msix=off \
     -device usb-kbd,bus=xhci.0 \
+    -drive file=usb.img,if=none,id=usbstick,format=raw \
+    -device usb-storage,bus=xhci.0,drive=usbstick \
     -device e1000,netdev=net0 \
     -netdev user,id=net0,hostfwd=udp::5555-:5555 \
     -serial stdio \
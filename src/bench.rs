@@ -0,0 +1,575 @@
+use crate::block::{self, BlockBackend};
+use crate::memory;
+use crate::network::{self, arp::ArpFrame};
+use crate::interrupts::InterruptSpinlock;
+use crate::scheduler::{self, UserContext};
+use crate::{allocator, fs, input, nvme, println};
+use alloc::vec::Vec;
+use core::sync::atomic::{AtomicBool, AtomicU64, AtomicUsize, Ordering};
+
+// ============================================================================
+// Benchmark mode
+// ============================================================================
+//
+// If the filesystem holds `bench.cfg`, the kernel runs the benchmarks below
+// instead of init, prints the results and powers off; tools/bench.sh builds
+// the image, boots QEMU and compares the results against a baseline.
+//
+// bench.cfg is plain text, one benchmark name per line, `#` starts a
+// comment. `scale <n>` multiplies every iteration count. A file naming no
+// benchmark runs all of them.
+//
+// Results go to the console (and so to COM1) between `BENCH-BEGIN` and
+// `BENCH-END`, one per line:
+//
+//     BENCH <name> <value> <unit>
+//     BENCH-SKIP <name> <reason>
+//
+// Every value is "lower is better". There is no calibrated clock, so times
+// are TSC cycles; compare them only between runs on the same host.
+
+pub const CONFIG_FILE: &str = "bench.cfg";
+
+struct Benchmark {
+    name: &'static str,
+    run: fn(usize),
+}
+
+const BENCHMARKS: [Benchmark; 9] = [
+    Benchmark { name: "ctxswitch", run: context_switch },
+    Benchmark { name: "syscall", run: syscall },
+    Benchmark { name: "nvme-qd1", run: nvme_qd1 },
+    Benchmark { name: "nvme-qd32", run: nvme_qd32 },
+    Benchmark { name: "alloc", run: alloc },
+    Benchmark { name: "locks", run: lock_contention },
+    Benchmark { name: "fs", run: fs_files },
+    Benchmark { name: "fs-contend", run: fs_contended },
+    Benchmark { name: "net-echo", run: net_echo },
+];
+
+pub struct Config {
+    /// Bit `i` selects BENCHMARKS[i].
+    selected: u32,
+    scale: usize,
+}
+
+/// Parse bench.cfg if the volume has one.
+pub fn config() -> Option<Config> {
+    if fs::find_file(CONFIG_FILE).ok().flatten().is_none() {
+        return None;
+    }
+    let text = fs::read_file(CONFIG_FILE).ok()?;
+    let text = core::str::from_utf8(&text).unwrap_or("");
+
+    let mut config = Config { selected: 0, scale: 1 };
+    for line in text.lines() {
+        let line = line.split('#').next().unwrap_or("").trim();
+        let mut words = line.split_whitespace();
+        match (words.next(), words.next()) {
+            (None, _) => {}
+            (Some("scale"), Some(n)) => match n.parse() {
+                Ok(n) if n > 0 => config.scale = n,
+                _ => println!("bench: ignoring bad scale '{}'", n),
+            },
+            (Some(name), _) => match BENCHMARKS.iter().position(|b| b.name == name) {
+                Some(i) => config.selected |= 1 << i,
+                None => println!("bench: unknown benchmark '{}'", name),
+            },
+        }
+    }
+    if config.selected == 0 {
+        config.selected = (1 << BENCHMARKS.len()) - 1;
+    }
+    Some(config)
+}
+
+/// Run the selected benchmarks on this CPU, then power off.
+pub fn run(config: &Config) -> ! {
+    println!("BENCH-BEGIN scale={}", config.scale);
+    for (i, benchmark) in BENCHMARKS.iter().enumerate() {
+        if config.selected & (1 << i) != 0 {
+            (benchmark.run)(config.scale);
+        }
+    }
+    println!("BENCH-END");
+    // Nothing unless built with lockstat.
+    crate::lockstat::dump(false);
+
+    unsafe {
+        crate::xhci::shutdown();
+        nvme::shutdown();
+        crate::uefi::system_reset(crate::uefi::EFI_RESET_TYPE::EfiResetShutdown, 0);
+    }
+}
+
+// ============================================================================
+// Helpers
+// ============================================================================
+
+fn report(name: &str, cycles: u64, ops: usize) {
+    println!("BENCH {} {} cycles/op", name, cycles / ops.max(1) as u64);
+}
+
+fn skip(name: &str, reason: &str) {
+    println!("BENCH-SKIP {} {}", name, reason);
+}
+
+/// Yield until task `id` has terminated.
+fn wait_for_task(id: usize) {
+    while scheduler::get_task_status(id) != 2 {
+        scheduler::switch_task();
+    }
+}
+
+/// xorshift64, so every run touches the same blocks.
+struct Rng(u64);
+
+impl Rng {
+    fn below(&mut self, bound: u64) -> u64 {
+        self.0 ^= self.0 << 13;
+        self.0 ^= self.0 >> 7;
+        self.0 ^= self.0 << 17;
+        self.0 % bound
+    }
+}
+
+/// A page-aligned kernel heap buffer (the heap is identity-mapped, so its
+/// address is also what DMA sees).
+struct DmaBuffer {
+    ptr: *mut u8,
+}
+
+impl DmaBuffer {
+    fn new(size: usize) -> Option<Self> {
+        let layout = core::alloc::Layout::from_size_align(size, 4096).ok()?;
+        let ptr = unsafe { allocator::alloc_aligned(layout) };
+        if ptr.is_null() { None } else { Some(Self { ptr }) }
+    }
+}
+
+impl Drop for DmaBuffer {
+    fn drop(&mut self) {
+        unsafe { allocator::free(self.ptr) };
+    }
+}
+
+// ============================================================================
+// Scheduler and syscalls
+// ============================================================================
+
+static PARTNER_STOP: AtomicBool = AtomicBool::new(false);
+static PARTNER_RUNS: AtomicU64 = AtomicU64::new(0);
+
+extern "C" fn switch_partner() {
+    while !PARTNER_STOP.load(Ordering::Acquire) {
+        PARTNER_RUNS.fetch_add(1, Ordering::Relaxed);
+        scheduler::switch_task();
+    }
+    scheduler::terminate_task(0);
+}
+
+/// Cost of one `switch_task` round trip against a kernel task that does
+/// nothing but yield back. Other ready tasks (and the APs' idle loops) share
+/// the round robin, so this is the cost of a yield on a nearly idle system.
+fn context_switch(scale: usize) {
+    let size = scheduler::KERNEL_STACK_SIZE;
+    let Some(top) = memory::alloc_kernel_stack(size) else {
+        return skip("ctxswitch", "no-kernel-stack");
+    };
+    PARTNER_STOP.store(false, Ordering::Release);
+    PARTNER_RUNS.store(0, Ordering::Relaxed);
+    let id = scheduler::add_new_task(switch_partner, top - size as u64, size);
+
+    // Let the partner start once so its first entry is not measured.
+    while PARTNER_RUNS.load(Ordering::Relaxed) == 0 {
+        scheduler::switch_task();
+    }
+
+    let rounds = 20_000 * scale;
+    let start = input::timestamp();
+    for _ in 0..rounds {
+        scheduler::switch_task();
+    }
+    let cycles = input::timestamp() - start;
+
+    PARTNER_STOP.store(true, Ordering::Release);
+    wait_for_task(id);
+    report("ctxswitch.yield", cycles, rounds);
+}
+
+/// User code for the syscall benchmark. Runs with r12 = iterations, times
+/// that many `sys_input_ring` calls (the cheapest syscall: it returns a
+/// constant) with rdtsc and exits with the cycle count as its exit code.
+const SYSCALL_LOOP: [u8; 48] = [
+    0x0F, 0x31, //                   rdtsc
+    0x48, 0xC1, 0xE2, 0x20, //       shl rdx, 32
+    0x48, 0x09, 0xD0, //             or rax, rdx
+    0x49, 0x89, 0xC5, //             mov r13, rax
+    0xB8, 0x16, 0x00, 0x00, 0x00, // 1: mov eax, 22
+    0x0F, 0x05, //                   syscall
+    0x49, 0xFF, 0xCC, //             dec r12
+    0x75, 0xF4, //                   jnz 1b
+    0x0F, 0x31, //                   rdtsc
+    0x48, 0xC1, 0xE2, 0x20, //       shl rdx, 32
+    0x48, 0x09, 0xD0, //             or rax, rdx
+    0x4C, 0x29, 0xE8, //             sub rax, r13
+    0x48, 0x89, 0xC7, //             mov rdi, rax
+    0xB8, 0x05, 0x00, 0x00, 0x00, // mov eax, 5 (terminate)
+    0x0F, 0x05, //                   syscall
+    0xEB, 0xFE, //                   jmp $
+];
+
+/// Start `code` (one page at most) as a ring-3 task in an address space of
+/// its own, with r12 = `r12`. Returns the task ID, or why it could not start.
+fn add_user_code(code: &[u8], r12: u64) -> Result<usize, &'static str> {
+    let space = memory::new_address_space().ok_or("no-address-space")?;
+    let entry = memory::reserve_user_span(memory::PAGE_SIZE).ok_or("no-user-span")?;
+    let mapped = memory::with_address_space(space, |pml4, frames| {
+        let frame = frames.allocate_frame()?;
+        unsafe {
+            core::ptr::write_bytes(frame as *mut u8, 0, memory::PAGE_SIZE as usize);
+            core::ptr::copy_nonoverlapping(code.as_ptr(), frame as *mut u8, code.len());
+            memory::map_page(pml4, entry, frame, memory::PAGE_PRESENT | memory::PAGE_USER, frames);
+        }
+        Some(())
+    })
+    .flatten();
+    let rsp = mapped.and_then(|_| memory::alloc_user_stack(space, memory::PAGE_SIZE)).ok_or("no-memory")?;
+
+    let context = UserContext { r12, ..UserContext::new(entry, rsp) };
+    scheduler::add_user_task(space, &context, scheduler::KERNEL_STACK_SIZE).ok_or("no-kernel-stack")
+}
+
+/// Round trip of a null syscall from ring 3, timed inside the user task.
+fn syscall(scale: usize) {
+    let rounds = 100_000 * scale;
+    let id = match add_user_code(&SYSCALL_LOOP, rounds as u64) {
+        Ok(id) => id,
+        Err(reason) => return skip("syscall", reason),
+    };
+    wait_for_task(id);
+    report("syscall.null", scheduler::get_task_exit_code(id) as u64, rounds);
+}
+
+// ============================================================================
+// Storage
+// ============================================================================
+
+/// 4 KiB reads at random 4 KiB-aligned offsets of the filesystem's device.
+struct RandomReads {
+    id: usize,
+    blocks: u32,
+    slots: u64,
+}
+
+impl RandomReads {
+    fn new() -> Option<Self> {
+        let id = fs::device()?;
+        let dev = block::get(id)?;
+        let blocks = (4096 / dev.block_size).max(1);
+        Some(Self { id, blocks, slots: dev.block_count / blocks as u64 })
+    }
+
+    fn lbas(&self, count: usize) -> impl Iterator<Item = u64> + '_ {
+        let mut rng = Rng(0x6b61_6775_7961_6f73);
+        (0..count).map(move |_| rng.below(self.slots) * self.blocks as u64)
+    }
+}
+
+fn nvme_qd1(scale: usize) {
+    let (Some(reads), Some(buffer)) = (RandomReads::new(), DmaBuffer::new(4096)) else {
+        return skip("nvme-qd1", "no-device");
+    };
+    let rounds = 2_000 * scale;
+    let lbas: Vec<u64> = reads.lbas(rounds).collect();
+
+    let start = input::timestamp();
+    for &lba in &lbas {
+        if block::read(reads.id, lba, reads.blocks, buffer.ptr).is_err() {
+            return skip("nvme-qd1", "read-failed");
+        }
+    }
+    report("nvme.read4k.qd1", input::timestamp() - start, rounds);
+}
+
+fn nvme_qd32(scale: usize) {
+    let Some(reads) = RandomReads::new() else {
+        return skip("nvme-qd32", "no-device");
+    };
+    let Some(BlockBackend::Nvme { controller, nsid }) = block::get(reads.id).map(|dev| dev.backend) else {
+        return skip("nvme-qd32", "not-nvme");
+    };
+    // Every read lands in the same page: the data is thrown away, and one
+    // page keeps the heap out of the measurement.
+    let Some(buffer) = DmaBuffer::new(4096) else {
+        return skip("nvme-qd32", "no-memory");
+    };
+    let rounds = 8_000 * scale;
+    let requests: Vec<(u64, *mut u8)> = reads.lbas(rounds).map(|lba| (lba, buffer.ptr)).collect();
+
+    let start = input::timestamp();
+    let status = unsafe { nvme::nvme_read_queued(controller, nsid, &requests, reads.blocks, 32) };
+    let cycles = input::timestamp() - start;
+    if status != 0 {
+        return skip("nvme-qd32", "read-failed");
+    }
+    report("nvme.read4k.qd32", cycles, rounds);
+}
+
+/// Scratch file of the filesystem benchmarks.
+const FS_FILE: &str = "bench.tmp";
+
+/// Create, read back and delete a 16 KiB file through the FAT layer.
+fn fs_files(scale: usize) {
+    let rounds = 50 * scale;
+    let data: Vec<u8> = (0..16 * 1024).map(|i| i as u8).collect();
+    let _ = fs::delete_file(FS_FILE);
+
+    let (mut create, mut read, mut delete) = (0, 0, 0);
+    for _ in 0..rounds {
+        let t0 = input::timestamp();
+        let created = fs::create_file(FS_FILE, &data);
+        let t1 = input::timestamp();
+        let back = fs::read_file(FS_FILE);
+        let t2 = input::timestamp();
+        let deleted = fs::delete_file(FS_FILE);
+        let t3 = input::timestamp();
+        if created.is_err() || deleted.is_err() || back.map_or(true, |back| back != data) {
+            return skip("fs", "fs-error");
+        }
+        create += t1 - t0;
+        read += t2 - t1;
+        delete += t3 - t2;
+    }
+    report("fs.create16k", create, rounds);
+    report("fs.read16k", read, rounds);
+    report("fs.delete16k", delete, rounds);
+}
+
+/// User code for the contended filesystem benchmark. Runs with
+/// r12 = iterations, reads `bench.tmp` that many times with `sys_fsread`
+/// (no buffer: the kernel reads the whole file and returns its size) and
+/// exits with the iterations left, 0 unless a read failed.
+const FS_READ_LOOP: [u8; 55] = [
+    0xB8, 0x0E, 0x00, 0x00, 0x00, //       1: mov eax, 14
+    0x48, 0x8D, 0x3D, 0x22, 0x00, 0x00, 0x00, // lea rdi, [rip + name]
+    0xBE, 0x09, 0x00, 0x00, 0x00, //       mov esi, 9
+    0x31, 0xD2, //                         xor edx, edx
+    0x45, 0x31, 0xD2, //                   xor r10d, r10d
+    0x0F, 0x05, //                         syscall
+    0x48, 0x85, 0xC0, //                   test rax, rax
+    0x78, 0x05, //                         js 2f
+    0x49, 0xFF, 0xCC, //                   dec r12
+    0x75, 0xDE, //                         jnz 1b
+    0x4C, 0x89, 0xE7, //                   2: mov rdi, r12
+    0xB8, 0x05, 0x00, 0x00, 0x00, //       mov eax, 5 (terminate)
+    0x0F, 0x05, //                         syscall
+    0xEB, 0xFE, //                         jmp $
+    b'b', b'e', b'n', b'c', b'h', b'.', b't', b'm', b'p', // name: FS_FILE
+];
+
+/// One ring-3 task pinned to each online CPU reads the same 16 KiB file
+/// through `sys_fsread`, so every read contends for that file's lock.
+/// Reports wall time per read until the last task is through. Built with
+/// lockstat, the FS_FILE row's `slept` column counts the readers that
+/// parked rather than spun while another CPU held the lock.
+fn fs_contended(scale: usize) {
+    let cpus = scheduler::online_cpus().count_ones() as usize;
+    let rounds = 200 * scale;
+    let data: Vec<u8> = (0..16 * 1024).map(|i| i as u8).collect();
+    if fs::create_file(FS_FILE, &data).is_err() {
+        return skip("fs-contend", "fs-error");
+    }
+    // As in `lock_contention`: an empty handler whose IPI ends the APs' `hlt`.
+    let Some(vector) = (unsafe { crate::interrupts::register_msi_handler(|| {}) }) else {
+        return skip("fs-contend", "no-vector");
+    };
+
+    let start = input::timestamp();
+    let mut tasks = Vec::new();
+    for cpu in 0..cpus {
+        match add_user_code(&FS_READ_LOOP, rounds as u64) {
+            Ok(id) => {
+                scheduler::set_affinity(id, 1 << cpu);
+                tasks.push(id);
+            }
+            Err(reason) => return skip("fs-contend", reason),
+        }
+    }
+    unsafe { crate::processor::send_ipi_others(crate::processor::lapic_base_from_msr(), vector) };
+    let mut failed = false;
+    for &id in &tasks {
+        wait_for_task(id);
+        failed |= scheduler::get_task_exit_code(id) != 0;
+    }
+    let cycles = input::timestamp() - start;
+    let _ = fs::delete_file(FS_FILE);
+    if failed {
+        return skip("fs-contend", "fs-error");
+    }
+    report("fs.contended.read16k", cycles, rounds * tasks.len());
+}
+
+// ============================================================================
+// Memory
+// ============================================================================
+
+/// Kernel heap alloc+free pairs, in batches so the size-class lists and the
+/// large-block list both see some depth.
+fn alloc(scale: usize) {
+    const BATCH: usize = 32;
+    let rounds = 2_000 * scale;
+    let mut ptrs = [core::ptr::null_mut(); BATCH];
+    for (name, size) in [("heap.alloc_free16", 16), ("heap.alloc_free256", 256), ("heap.alloc_free4096", 4096)] {
+        let start = input::timestamp();
+        for _ in 0..rounds {
+            for ptr in ptrs.iter_mut() {
+                *ptr = unsafe { allocator::alloc(size) };
+            }
+            for ptr in ptrs.iter().rev() {
+                if !ptr.is_null() {
+                    unsafe { allocator::free(*ptr) };
+                }
+            }
+        }
+        report(name, input::timestamp() - start, rounds * BATCH);
+    }
+}
+
+// ============================================================================
+// Locks
+// ============================================================================
+
+static HAMMER_SPIN: allocator::Spinlock<u64> = allocator::Spinlock::new(0);
+static HAMMER_IRQ: InterruptSpinlock<u64> = InterruptSpinlock::new(0);
+/// Which lock the hammer tasks take: 0 HAMMER_SPIN, 1 HAMMER_IRQ.
+static HAMMER_KIND: AtomicUsize = AtomicUsize::new(0);
+static HAMMER_ROUNDS: AtomicUsize = AtomicUsize::new(0);
+/// Hammer tasks wait for this before taking the lock, so all CPUs start
+/// together; each adds one to HAMMER_DONE when it is through.
+static HAMMER_GO: AtomicBool = AtomicBool::new(false);
+static HAMMER_DONE: AtomicUsize = AtomicUsize::new(0);
+
+/// Take the selected lock HAMMER_ROUNDS times with a short critical section.
+fn hammer() {
+    let rounds = HAMMER_ROUNDS.load(Ordering::Relaxed);
+    for _ in 0..rounds {
+        if HAMMER_KIND.load(Ordering::Relaxed) == 0 {
+            *HAMMER_SPIN.lock() += 1;
+        } else {
+            *HAMMER_IRQ.lock() += 1;
+        }
+    }
+}
+
+extern "C" fn hammer_task() {
+    while !HAMMER_GO.load(Ordering::Acquire) {
+        scheduler::switch_task();
+    }
+    hammer();
+    HAMMER_DONE.fetch_add(1, Ordering::Release);
+    scheduler::terminate_task(0);
+}
+
+/// Every online CPU takes the same lock in a tight loop, one hammer task
+/// pinned to each AP and this task on the BSP. Reports wall time per
+/// acquisition until the last CPU is through, so a CPU left waiting for its
+/// turn shows up in the result.
+fn lock_contention(scale: usize) {
+    let cpus = scheduler::online_cpus().count_ones() as usize;
+    let rounds = 20_000 * scale;
+    let size = scheduler::KERNEL_STACK_SIZE;
+    HAMMER_ROUNDS.store(rounds, Ordering::Relaxed);
+
+    // Park a vector the APs can be woken with; the handler has nothing to
+    // do, the interrupt itself is what ends their `hlt`.
+    let Some(vector) = (unsafe { crate::interrupts::register_msi_handler(|| {}) }) else {
+        return skip("locks", "no-vector");
+    };
+
+    for (kind, name) in [(0, "locks.spin"), (1, "locks.irq")] {
+        HAMMER_KIND.store(kind, Ordering::Relaxed);
+        HAMMER_GO.store(false, Ordering::Release);
+        HAMMER_DONE.store(0, Ordering::Release);
+
+        let mut tasks = Vec::new();
+        for cpu in 1..cpus {
+            let Some(top) = memory::alloc_kernel_stack(size) else {
+                return skip("locks", "no-kernel-stack");
+            };
+            let id = scheduler::add_new_task(hammer_task, top - size as u64, size);
+            scheduler::set_affinity(id, 1 << cpu);
+            tasks.push(id);
+        }
+        unsafe { crate::processor::send_ipi_others(crate::processor::lapic_base_from_msr(), vector) };
+
+        let start = input::timestamp();
+        HAMMER_GO.store(true, Ordering::Release);
+        hammer();
+        while HAMMER_DONE.load(Ordering::Acquire) < tasks.len() {
+            core::hint::spin_loop();
+        }
+        let cycles = input::timestamp() - start;
+        for id in tasks {
+            wait_for_task(id);
+        }
+        report(name, cycles, rounds * cpus);
+    }
+}
+
+// ============================================================================
+// Network
+// ============================================================================
+
+/// slirp's gateway, which answers ARP in QEMU's user networking.
+const GATEWAY_IP: [u8; 4] = [10, 0, 2, 2];
+
+/// Give up on a reply after this many cycles (about a second on a 2-4 GHz
+/// host).
+const ECHO_TIMEOUT: u64 = 1 << 32;
+
+/// ARP request to the gateway and back: transmit, the wire (QEMU's slirp
+/// stack) and polled receive. There is no IP stack to echo UDP through, so
+/// ARP is the round trip every setup answers.
+fn net_echo(scale: usize) {
+    let (true, Some(my_ip), Some(my_mac)) =
+        (network::is_ready(), network::get_ip_address(), unsafe { network::get_mac_address() })
+    else {
+        return skip("net-echo", "no-nic");
+    };
+    let rounds = 100 * scale;
+    let mut frame = [0u8; 1514];
+    let mut total = 0;
+    let mut answered = 0;
+
+    for _ in 0..rounds {
+        let start = input::timestamp();
+        unsafe { network::arp::send_arp_request(GATEWAY_IP, my_ip, my_mac) };
+        loop {
+            if input::timestamp() - start > ECHO_TIMEOUT {
+                break;
+            }
+            let len = unsafe { network::poll_rx(&mut frame) };
+            if len < core::mem::size_of::<ArpFrame>() {
+                continue;
+            }
+            let reply = unsafe { core::ptr::read_unaligned(frame.as_ptr() as *const ArpFrame) };
+            if u16::from_be(reply.eth.ethertype) == 0x0806
+                && u16::from_be(reply.arp.opcode) == 2
+                && reply.arp.sender_ip == GATEWAY_IP
+            {
+                total += input::timestamp() - start;
+                answered += 1;
+                break;
+            }
+        }
+    }
+
+    if answered == 0 {
+        return skip("net-echo", "no-reply");
+    }
+    report("net.arp_rtt", total, answered);
+    if answered < rounds {
+        println!("bench: net-echo: {} of {} requests timed out", rounds - answered, rounds);
+    }
+}
@@ -0,0 +1,298 @@
+#![allow(dead_code)]
+
+use crate::nvme;
+use crate::usb_storage;
+
+// ============================================================================
+// Block device table
+// ============================================================================
+//
+// Every disk-like thing the kernel can address by LBA is registered here and
+// referred to by its index. Drivers register their namespaces/LUNs during
+// PCI binding; the filesystem only ever talks to a device index.
+
+pub const MAX_BLOCK_DEVICES: usize = 16;
+
+/// Maximum number of member devices in one stripe set.
+pub const MAX_STRIPE_MEMBERS: usize = 4;
+
+/// Default stripe chunk: 8 × 512-byte blocks = one 4 KiB FS cluster, so a
+/// cluster never straddles two members.
+pub const DEFAULT_STRIPE_CHUNK_BLOCKS: u32 = 8;
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum BlockError {
+    NoDevice,
+    InvalidArgument,
+    OutOfRange,
+    DeviceError,
+}
+
+/// RAID-0 layout: chunk `c` of the volume lives on member `c % n` at member
+/// chunk `c / n`.
+#[derive(Debug, Clone, Copy)]
+pub struct StripeSet {
+    pub members: [usize; MAX_STRIPE_MEMBERS],
+    pub member_count: usize,
+    pub chunk_blocks: u32,
+}
+
+#[derive(Debug, Clone, Copy)]
+pub enum BlockBackend {
+    Nvme { controller: usize, nsid: u32 },
+    UsbStorage { device: usize, lun: u8 },
+    Stripe(StripeSet),
+}
+
+#[derive(Debug, Clone, Copy)]
+pub struct BlockDevice {
+    pub backend: BlockBackend,
+    pub block_size: u32,
+    pub block_count: u64,
+}
+
+static mut BLOCK_DEVICES: [Option<BlockDevice>; MAX_BLOCK_DEVICES] = [None; MAX_BLOCK_DEVICES];
+
+/// Add a device to the table and return its index.
+pub fn register(device: BlockDevice) -> Result<usize, BlockError> {
+    let devices = unsafe { &mut *core::ptr::addr_of_mut!(BLOCK_DEVICES) };
+    for (id, slot) in devices.iter_mut().enumerate() {
+        if slot.is_none() {
+            *slot = Some(device);
+            return Ok(id);
+        }
+    }
+    Err(BlockError::NoDevice)
+}
+
+pub fn get(id: usize) -> Option<BlockDevice> {
+    if id >= MAX_BLOCK_DEVICES {
+        return None;
+    }
+    unsafe { (*core::ptr::addr_of!(BLOCK_DEVICES))[id] }
+}
+
+/// Indices of all registered NVMe namespaces with the given block size, in
+/// registration order.
+pub fn nvme_devices(block_size: u32, out: &mut [usize]) -> usize {
+    let mut n = 0;
+    for id in 0..MAX_BLOCK_DEVICES {
+        if n >= out.len() {
+            break;
+        }
+        if let Some(dev) = get(id) {
+            if matches!(dev.backend, BlockBackend::Nvme { .. }) && dev.block_size == block_size {
+                out[n] = id;
+                n += 1;
+            }
+        }
+    }
+    n
+}
+
+// ============================================================================
+// Striping (RAID-0)
+// ============================================================================
+
+/// Build a stripe set over `members` and register it as a new device.
+///
+/// Members must be distinct NVMe namespaces with equal block sizes. The
+/// volume size is the smallest member rounded down to whole chunks, times
+/// the member count.
+pub fn create_stripe(members: &[usize], chunk_blocks: u32) -> Result<usize, BlockError> {
+    if members.len() < 2 || members.len() > MAX_STRIPE_MEMBERS || chunk_blocks == 0 {
+        return Err(BlockError::InvalidArgument);
+    }
+
+    let mut set = StripeSet {
+        members: [0; MAX_STRIPE_MEMBERS],
+        member_count: members.len(),
+        chunk_blocks,
+    };
+    let mut block_size = 0;
+    let mut min_blocks = u64::MAX;
+    for (i, &id) in members.iter().enumerate() {
+        let dev = get(id).ok_or(BlockError::NoDevice)?;
+        if !matches!(dev.backend, BlockBackend::Nvme { .. }) || members[..i].contains(&id) {
+            return Err(BlockError::InvalidArgument);
+        }
+        if block_size != 0 && dev.block_size != block_size {
+            return Err(BlockError::InvalidArgument);
+        }
+        block_size = dev.block_size;
+        min_blocks = min_blocks.min(dev.block_count);
+        set.members[i] = id;
+    }
+
+    let chunks_per_member = min_blocks / chunk_blocks as u64;
+    if chunks_per_member == 0 {
+        return Err(BlockError::OutOfRange);
+    }
+    register(BlockDevice {
+        backend: BlockBackend::Stripe(set),
+        block_size,
+        block_count: chunks_per_member * chunk_blocks as u64 * members.len() as u64,
+    })
+}
+
+/// Map a volume LBA to (member index, member LBA, blocks left in this chunk).
+fn stripe_map(set: &StripeSet, lba: u64) -> (usize, u64, u32) {
+    let chunk = lba / set.chunk_blocks as u64;
+    let within = (lba % set.chunk_blocks as u64) as u32;
+    let n = set.member_count as u64;
+    let member = (chunk % n) as usize;
+    let member_lba = (chunk / n) * set.chunk_blocks as u64 + within as u64;
+    (member, member_lba, set.chunk_blocks - within)
+}
+
+// ============================================================================
+// I/O
+// ============================================================================
+
+pub fn read(id: usize, lba: u64, count: u32, buffer: *mut u8) -> Result<(), BlockError> {
+    transfer(id, lba, count, buffer, false)
+}
+
+pub fn write(id: usize, lba: u64, count: u32, buffer: *const u8) -> Result<(), BlockError> {
+    transfer(id, lba, count, buffer as *mut u8, true)
+}
+
+fn transfer(id: usize, lba: u64, count: u32, buffer: *mut u8, write: bool) -> Result<(), BlockError> {
+    if count == 0 || buffer.is_null() {
+        return Err(BlockError::InvalidArgument);
+    }
+    let dev = get(id).ok_or(BlockError::NoDevice)?;
+    if lba.checked_add(count as u64).map_or(true, |end| end > dev.block_count) {
+        return Err(BlockError::OutOfRange);
+    }
+
+    match dev.backend {
+        BlockBackend::Nvme { controller, nsid } => {
+            nvme_transfer(controller, nsid, dev.block_size, lba, count, buffer, write)
+        }
+        BlockBackend::UsbStorage { device, lun } => {
+            usb_storage_transfer(device, lun, dev.block_size, lba, count, buffer, write)
+        }
+        BlockBackend::Stripe(set) => stripe_transfer(&set, dev.block_size, lba, count, buffer, write),
+    }
+}
+
+/// Issue a transfer to one namespace in pieces small enough for PRP1+PRP2.
+fn nvme_transfer(
+    controller: usize,
+    nsid: u32,
+    block_size: u32,
+    mut lba: u64,
+    mut count: u32,
+    mut buffer: *mut u8,
+    write: bool,
+) -> Result<(), BlockError> {
+    let max_blocks = (nvme::NVME_MAX_TRANSFER / block_size as usize).max(1) as u32;
+    while count > 0 {
+        let n = count.min(max_blocks);
+        let status = unsafe {
+            if write {
+                nvme::nvme_write(controller, nsid, lba, buffer, n)
+            } else {
+                nvme::nvme_read(controller, nsid, lba, buffer, n)
+            }
+        };
+        if status != 0 {
+            return Err(BlockError::DeviceError);
+        }
+        lba += n as u64;
+        count -= n;
+        buffer = unsafe { buffer.add(n as usize * block_size as usize) };
+    }
+    Ok(())
+}
+
+/// Issue a transfer to one USB mass storage LUN, one SCSI command per
+/// USB_STORAGE_MAX_TRANSFER bytes.
+fn usb_storage_transfer(
+    device: usize,
+    lun: u8,
+    block_size: u32,
+    mut lba: u64,
+    mut count: u32,
+    mut buffer: *mut u8,
+    write: bool,
+) -> Result<(), BlockError> {
+    let max_blocks = (usb_storage::USB_STORAGE_MAX_TRANSFER / block_size as usize).max(1) as u32;
+    while count > 0 {
+        let n = count.min(max_blocks);
+        unsafe { usb_storage::read_write(device, lun, lba, n, block_size, buffer, write) }
+            .map_err(|_| BlockError::DeviceError)?;
+        lba += n as u64;
+        count -= n;
+        buffer = unsafe { buffer.add(n as usize * block_size as usize) };
+    }
+    Ok(())
+}
+
+/// Split a volume transfer at chunk boundaries and overlap the pieces: each
+/// piece is queued on its member's controller and only waited for when that
+/// controller is needed again (or at the end), so consecutive chunks on
+/// different drives are in flight together. Every member's I/O queue is
+/// held for the whole transfer, taken in controller order so that two
+/// stripe transfers cannot deadlock.
+fn stripe_transfer(
+    set: &StripeSet,
+    block_size: u32,
+    mut lba: u64,
+    mut count: u32,
+    mut buffer: *mut u8,
+    write: bool,
+) -> Result<(), BlockError> {
+    let mut controllers = 0u32;
+    for &id in &set.members[..set.member_count] {
+        if let Some(BlockDevice { backend: BlockBackend::Nvme { controller, .. }, .. }) = get(id) {
+            controllers |= 1 << controller;
+        }
+    }
+    let _queues: [_; nvme::MAX_NVME_CONTROLLERS] = core::array::from_fn(|controller| {
+        (controllers & 1 << controller != 0).then(|| nvme::lock_io_queue(controller))
+    });
+
+    let mut inflight: [Option<u16>; nvme::MAX_NVME_CONTROLLERS] = [None; nvme::MAX_NVME_CONTROLLERS];
+    let mut result = Ok(());
+    let max_blocks = (nvme::NVME_MAX_TRANSFER / block_size as usize).max(1) as u32;
+
+    while count > 0 && result.is_ok() {
+        let (member, member_lba, chunk_left) = stripe_map(set, lba);
+        let n = count.min(chunk_left).min(max_blocks);
+
+        let Some(BlockDevice {
+            backend: BlockBackend::Nvme { controller, nsid },
+            ..
+        }) = get(set.members[member])
+        else {
+            result = Err(BlockError::NoDevice);
+            break;
+        };
+
+        if let Some(cid) = inflight[controller].take() {
+            if unsafe { nvme::nvme_wait_io(controller, cid) } != 0 {
+                result = Err(BlockError::DeviceError);
+                break;
+            }
+        }
+        match unsafe { nvme::nvme_submit_io(controller, write, nsid, member_lba, buffer, n) } {
+            Ok(cid) => inflight[controller] = Some(cid),
+            Err(_) => result = Err(BlockError::DeviceError),
+        }
+
+        lba += n as u64;
+        count -= n;
+        buffer = unsafe { buffer.add(n as usize * block_size as usize) };
+    }
+
+    for (controller, slot) in inflight.iter_mut().enumerate() {
+        if let Some(cid) = slot.take() {
+            if unsafe { nvme::nvme_wait_io(controller, cid) } != 0 && result.is_ok() {
+                result = Err(BlockError::DeviceError);
+            }
+        }
+    }
+    result
+}
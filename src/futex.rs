@@ -0,0 +1,142 @@
+// ============================================================================
+// Futexes
+// ============================================================================
+//
+// A futex is a u32 in user memory that threads of one address space wait on
+// and wake each other through. `wait` only sleeps if the word still holds
+// the value the caller last saw, and checks it under the same lock `wake`
+// takes, so a wake between the caller's check and its sleep is not lost.
+// User-space locks handle the uncontended case with atomics alone and come
+// here only to sleep.
+//
+// Waiters are kept in a fixed table of queues hashed by (address space,
+// address), so unrelated futexes rarely share a lock.
+
+use crate::interrupts::InterruptSpinlock;
+use crate::{memory, scheduler};
+use alloc::vec::Vec;
+
+const FUTEX_BUCKETS: usize = 64;
+
+/// `wait` return values.
+pub const FUTEX_WOKEN: usize = 0;
+pub const FUTEX_VALUE_CHANGED: usize = 1;
+
+#[derive(Clone, Copy)]
+struct Waiter {
+    space: u64,
+    addr: u64,
+    task: usize,
+}
+
+static QUEUES: [InterruptSpinlock<Vec<Waiter>>; FUTEX_BUCKETS] =
+    [const { InterruptSpinlock::new(Vec::new()) }; FUTEX_BUCKETS];
+
+fn queue(space: u64, addr: u64) -> &'static InterruptSpinlock<Vec<Waiter>> {
+    let key = (addr >> 2) ^ (space >> 12);
+    let hash = key.wrapping_mul(0x9E37_79B9_7F4A_7C15) >> (64 - FUTEX_BUCKETS.trailing_zeros());
+    &QUEUES[hash as usize]
+}
+
+/// Sleep until `wake` is called on `addr` if the u32 there equals
+/// `expected`. Returns FUTEX_VALUE_CHANGED without sleeping if it does not.
+/// Like every futex, it may also return early for no reason; callers
+/// re-check their condition.
+pub fn wait(addr: u64, expected: u32) -> usize {
+    let space = memory::current_pml4_phys();
+    let task = scheduler::current_task_id();
+    // Fault the word in before taking the lock the fault path may need.
+    let current = unsafe { core::ptr::read_volatile(addr as *const u32) };
+    if current != expected {
+        return FUTEX_VALUE_CHANGED;
+    }
+
+    let mut waiters = queue(space, addr).lock();
+    if unsafe { core::ptr::read_volatile(addr as *const u32) } != expected {
+        return FUTEX_VALUE_CHANGED;
+    }
+    waiters.push(Waiter { space, addr, task });
+    scheduler::block_current();
+    drop(waiters);
+    scheduler::switch_task();
+
+    // Still queued if the wake-up came from elsewhere, or if there was
+    // nothing else to run and `switch_task` returned straight away.
+    queue(space, addr).lock().retain(|waiter| waiter.task != task);
+    FUTEX_WOKEN
+}
+
+/// Wake up to `count` tasks of the active address space waiting on `addr`,
+/// oldest first. Returns how many were woken.
+pub fn wake(addr: u64, count: usize) -> usize {
+    wake_in(memory::current_pml4_phys(), addr, count)
+}
+
+fn wake_in(space: u64, addr: u64, count: usize) -> usize {
+    let mut woken = 0;
+    queue(space, addr).lock().retain(|waiter| {
+        if woken < count && waiter.space == space && waiter.addr == addr {
+            scheduler::wake(waiter.task);
+            woken += 1;
+            false
+        } else {
+            true
+        }
+    });
+    woken
+}
+
+// ============================================================================
+// Thread exit
+// ============================================================================
+//
+// A thread may name a u32 the kernel clears and wakes when the thread
+// terminates, however it terminates. Joining is then a futex wait on it.
+
+struct ExitWord {
+    task: usize,
+    space: u64,
+    addr: u64,
+}
+
+static EXIT_WORDS: InterruptSpinlock<Vec<ExitWord>> = InterruptSpinlock::named("EXIT_WORDS", Vec::new());
+
+/// Start a task with `start` and, if `addr` is not 0, have the u32 at
+/// `addr` in `space` cleared and woken when it terminates. The word is
+/// registered before the task can run, so even a thread that exits at once
+/// clears it.
+pub fn start_with_exit_word(space: u64, addr: u64, start: impl FnOnce() -> Option<usize>) -> Option<usize> {
+    let mut exit_words = EXIT_WORDS.lock();
+    let task = start()?;
+    if addr != 0 {
+        exit_words.push(ExitWord { task, space, addr });
+    }
+    Some(task)
+}
+
+/// Clear and wake the exit word of `task`, which is terminating in its own
+/// address space. The word is only written if its page is mapped writable
+/// (or copy-on-write) for user mode: a thread killed for a bad access must
+/// not take the kernel down with it.
+pub fn thread_exit(task: usize) {
+    let exit_word = {
+        let mut exit_words = EXIT_WORDS.lock();
+        let Some(i) = exit_words.iter().position(|word| word.task == task) else {
+            return;
+        };
+        exit_words.swap_remove(i)
+    };
+    if exit_word.space != memory::current_pml4_phys() || exit_word.addr % 4 != 0 {
+        return;
+    }
+    let writable = memory::with_address_space(exit_word.space, |pml4, _| {
+        unsafe { memory::lookup_page(pml4, exit_word.addr) }.is_some_and(|entry| {
+            let user = memory::PAGE_PRESENT | memory::PAGE_USER;
+            entry & user == user && entry & (memory::PAGE_WRITABLE | memory::PAGE_COW) != 0
+        })
+    });
+    if writable == Some(true) {
+        unsafe { core::ptr::write_volatile(exit_word.addr as *mut u32, 0) };
+        wake_in(exit_word.space, exit_word.addr, usize::MAX);
+    }
+}
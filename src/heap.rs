@@ -0,0 +1,467 @@
+#![allow(dead_code)]
+
+// Kernel heap allocator.
+//
+// Only `core` is used here, so tools/kbench can build this file on the host
+// and drive it over an ordinary buffer; the global allocator, the locks and
+// the user-heap wrappers live in allocator.rs.
+
+use core::mem;
+use core::ptr;
+
+// ---------------------------------------------------------------------------
+// Segregated Free List Allocator
+// ---------------------------------------------------------------------------
+//
+// Design overview
+// ---------------
+// Small allocations (size <= MAX_SMALL_SIZE) are served from a fixed set of
+// size-class buckets.  Each bucket is a singly-linked free list whose nodes
+// are embedded directly inside the free block — no separate metadata block
+// sits in front of a live allocation for the common path.
+//
+// Large allocations (size > MAX_SMALL_SIZE) fall back to a classic
+// boundary-tag linked list (first-fit) — the same structure that was used
+// everywhere before, now only paid for when really needed.
+//
+// Bucket layout
+// -------------
+//   index │ block size (bytes)
+//   ──────┼───────────────────
+//     0   │   8
+//     1   │  16
+//     2   │  32
+//     3   │  64
+//     4   │ 128
+//     5   │ 256
+//     6   │ 512
+//     7   │ 1024
+//     8   │ 2048
+//     9   │ 4096   (MAX_SMALL_SIZE)
+//
+// Each free node in a bucket stores a single pointer to the next free node
+// at offset 0 of the block body — nothing extra.  When a block is allocated
+// we write the bucket index at a one-word header immediately before the
+// returned pointer so `dealloc` can put the block back in the right list in
+// O(1).  For large blocks the header stores LARGE_BLOCK_SENTINEL and the
+// usual boundary-tag block pointer (two words before the payload).
+//
+// Memory layout for a small allocation
+// ─────────────────────────────────────
+//   [ bucket_index: usize ] [ payload … ]
+//    ^^^^ 1 word header      ^^^^ returned to caller
+//
+// Memory layout for a large allocation (mirrors original OffsetHeader scheme)
+// ──────────────────────────────────────────────────────────────────────────
+//   [ LargeBlock ] … padding … [ LARGE_BLOCK_SENTINEL: usize ]
+//                               [ block_addr:           usize ]
+//                               [ payload … ]
+//
+// Complexity
+// ----------
+//   alloc  (small)  O(1)   — pop head of bucket list, or carve from arena
+//   dealloc(small)  O(1)   — push onto bucket list
+//   alloc  (large)  O(n)   — first-fit scan (unchanged from before)
+//   dealloc(large)  O(1)   — mark free + coalesce neighbours (O(1) with ptrs)
+
+// ---------------------------------------------------------------------------
+// Constants
+// ---------------------------------------------------------------------------
+
+pub const NUM_BUCKETS: usize = 10;
+/// Maximum size served by the segregated-list fast path.
+const MAX_SMALL_SIZE: usize = 4096;
+/// Sentinel stored in the one-word header of a small block.
+const LARGE_BLOCK_SENTINEL: usize = usize::MAX;
+
+/// Size classes for the 10 buckets (must be power-of-two, ascending).
+pub const BUCKET_SIZES: [usize; NUM_BUCKETS] = [8, 16, 32, 64, 128, 256, 512, 1024, 2048, 4096];
+
+/// Header prepended to every small-block payload: one `usize` (bucket index).
+const SMALL_HEADER_SIZE: usize = mem::size_of::<usize>();
+
+/// Size of the LargeBlock boundary-tag header.
+const LARGE_BLOCK_SIZE: usize = mem::size_of::<LargeBlock>();
+
+// ---------------------------------------------------------------------------
+// Large-block boundary-tag structure (used for size > MAX_SMALL_SIZE)
+// ---------------------------------------------------------------------------
+
+#[repr(C)]
+struct LargeBlock {
+    /// Usable bytes in this block (excluding the LargeBlock header itself).
+    size: usize,
+    next: *mut LargeBlock,
+    prev: *mut LargeBlock,
+    free: bool,
+}
+
+// ---------------------------------------------------------------------------
+// Segregated free list allocator state
+// ---------------------------------------------------------------------------
+
+pub struct SegregatedAllocator {
+    /// Heads of the per-size-class free lists.  Each entry is either null or
+    /// points to the first free block in that class.
+    free_lists: [*mut u8; NUM_BUCKETS],
+
+    /// Head of the large-block linked list.
+    large_head: *mut LargeBlock,
+
+    /// Bump pointer into the raw arena — used only when a bucket's free list
+    /// is empty and we need to carve a fresh block.
+    arena_ptr: usize,
+    arena_end: usize,
+}
+
+unsafe impl Send for SegregatedAllocator {}
+
+impl SegregatedAllocator {
+    pub const fn new() -> Self {
+        Self {
+            free_lists: [ptr::null_mut(); NUM_BUCKETS],
+            large_head: ptr::null_mut(),
+            arena_ptr: 0,
+            arena_end: 0,
+        }
+    }
+
+    /// Take over `size` bytes at `start`. Returns the address where the
+    /// large-block region begins; everything below it is the bump arena.
+    pub unsafe fn init(&mut self, start: usize, size: usize) -> usize {
+        // The first part of the heap is managed as the bump arena for small
+        // blocks.  We hand the remainder to the large-block list so big
+        // allocations can still use the full heap.
+        //
+        // Split: first 3/4 → arena, last 1/4 → large-block list.
+        // (Tune this ratio for your workload.)
+        let arena_bytes = (size / 4) * 3;
+        self.arena_ptr = start;
+        self.arena_end = start + arena_bytes;
+
+        // Initialise the large-block region.
+        let lb_start = start + arena_bytes;
+        let lb_size = size - arena_bytes;
+        if lb_size > LARGE_BLOCK_SIZE {
+            let block = lb_start as *mut LargeBlock;
+            unsafe {
+                (*block).size = lb_size - LARGE_BLOCK_SIZE;
+                (*block).next = ptr::null_mut();
+                (*block).prev = ptr::null_mut();
+                (*block).free = true;
+            }
+            self.large_head = block;
+        }
+
+        lb_start
+    }
+
+    // -----------------------------------------------------------------------
+    // Small allocation helpers
+    // -----------------------------------------------------------------------
+
+    /// Return the bucket index for `size`, or `None` if size > MAX_SMALL_SIZE.
+    #[inline]
+    fn bucket_for(size: usize) -> Option<usize> {
+        for (i, &class_size) in BUCKET_SIZES.iter().enumerate() {
+            if size <= class_size {
+                return Some(i);
+            }
+        }
+        None
+    }
+
+    /// Allocate a small block from `bucket`.  Returns a pointer to the
+    /// *payload* (i.e. the word after the bucket-index header).
+    unsafe fn alloc_small(&mut self, bucket: usize) -> *mut u8 {
+        let class_size = BUCKET_SIZES[bucket];
+        let total = SMALL_HEADER_SIZE + class_size;
+
+        // 1. Pop from the free list if available.
+        let head = self.free_lists[bucket];
+        if !head.is_null() {
+            // The first word of a free block is the next-pointer.
+            let next = unsafe { ptr::read(head as *const *mut u8) };
+            self.free_lists[bucket] = next;
+
+            // Write the bucket index into the header slot.
+            unsafe { ptr::write(head as *mut usize, bucket) };
+            return unsafe { head.add(SMALL_HEADER_SIZE) };
+        }
+
+        // 2. Carve from the bump arena.
+        let aligned = align_up(self.arena_ptr, mem::align_of::<usize>());
+        if aligned + total <= self.arena_end {
+            self.arena_ptr = aligned + total;
+            let block = aligned as *mut u8;
+            unsafe { ptr::write(block as *mut usize, bucket) };
+            return unsafe { block.add(SMALL_HEADER_SIZE) };
+        }
+
+        // 3. Arena exhausted — fall back to the large-block region.
+        //    Allocate a slab of (e.g.) 32 × class_size and cut it up.
+        let slab_count: usize = 32;
+        let slab_size = total * slab_count;
+        let slab = unsafe { self.alloc_large_raw(slab_size) };
+        if slab.is_null() {
+            return ptr::null_mut();
+        }
+        // Carve blocks out of slab and push all but the first onto the list.
+        let slab_addr = slab as usize;
+        for i in 1..slab_count {
+            let blk = (slab_addr + i * total) as *mut u8;
+            // Push blk onto free list.
+            unsafe {
+                ptr::write(blk as *mut *mut u8, self.free_lists[bucket]);
+            }
+            self.free_lists[bucket] = blk;
+        }
+        // Return the zeroth block.
+        unsafe { ptr::write(slab as *mut usize, bucket) };
+        unsafe { slab.add(SMALL_HEADER_SIZE) }
+    }
+
+    /// Return a small block to its bucket's free list.
+    unsafe fn free_small(&mut self, payload: *mut u8) {
+        // The header lives one word before the payload.
+        let block = unsafe { payload.sub(SMALL_HEADER_SIZE) };
+        let bucket = unsafe { ptr::read(block as *const usize) };
+
+        // Overwrite the header slot with the next-pointer.
+        unsafe { ptr::write(block as *mut *mut u8, self.free_lists[bucket]) };
+        self.free_lists[bucket] = block;
+    }
+
+    // -----------------------------------------------------------------------
+    // Large allocation helpers (boundary-tag first-fit)
+    // -----------------------------------------------------------------------
+
+    /// Allocate `size` raw bytes from the large-block list.
+    /// Returns a pointer to the payload (just past the LargeBlock header).
+    unsafe fn alloc_large_raw(&mut self, mut size: usize) -> *mut u8 {
+        // Align size to pointer width.
+        let mask = mem::align_of::<usize>() - 1;
+        size = (size + mask) & !mask;
+
+        let mut current = self.large_head;
+        while !current.is_null() {
+            unsafe {
+                if (*current).free && (*current).size >= size {
+                    // Split if there is enough room for a new header + ≥16 bytes.
+                    if (*current).size >= size + LARGE_BLOCK_SIZE + 16 {
+                        let next_addr = (current as usize) + LARGE_BLOCK_SIZE + size;
+                        let next = next_addr as *mut LargeBlock;
+
+                        (*next).size = (*current).size - size - LARGE_BLOCK_SIZE;
+                        (*next).next = (*current).next;
+                        (*next).prev = current;
+                        (*next).free = true;
+
+                        if !(*next).next.is_null() {
+                            (*(*next).next).prev = next;
+                        }
+
+                        (*current).size = size;
+                        (*current).next = next;
+                    }
+
+                    (*current).free = false;
+                    return ((current as usize) + LARGE_BLOCK_SIZE) as *mut u8;
+                }
+                current = (*current).next;
+            }
+        }
+        ptr::null_mut()
+    }
+
+    /// Free a raw payload pointer obtained from `alloc_large_raw`.
+    unsafe fn free_large_raw(&mut self, ptr: *mut u8) {
+        if ptr.is_null() {
+            return;
+        }
+        let block = (ptr as usize - LARGE_BLOCK_SIZE) as *mut LargeBlock;
+        unsafe {
+            if (*block).free {
+                return; // guard against double-free
+            }
+            (*block).free = true;
+
+            // Coalesce with next.
+            let next = (*block).next;
+            if !next.is_null() && (*next).free {
+                (*block).size += (*next).size + LARGE_BLOCK_SIZE;
+                (*block).next = (*next).next;
+                if !(*block).next.is_null() {
+                    (*(*block).next).prev = block;
+                }
+            }
+
+            // Coalesce with prev.
+            let prev = (*block).prev;
+            if !prev.is_null() && (*prev).free {
+                (*prev).size += (*block).size + LARGE_BLOCK_SIZE;
+                (*prev).next = (*block).next;
+                if !(*block).next.is_null() {
+                    (*(*block).next).prev = prev;
+                }
+            }
+        }
+    }
+
+    // -----------------------------------------------------------------------
+    // Public allocation interface (used by KernelAllocator)
+    // -----------------------------------------------------------------------
+
+    /// Allocate `size` bytes with *at least* `align` alignment.
+    ///
+    /// For small requests a one-word header stores the bucket index.
+    /// For large requests the OffsetHeader scheme stores the large-block ptr.
+    pub unsafe fn alloc_aligned(&mut self, size: usize, align: usize) -> *mut u8 {
+        // ── Small path ──────────────────────────────────────────────────────
+        // We only use the small path when alignment ≤ SMALL_HEADER_SIZE,
+        // because BUCKET_SIZES are aligned to their own size (power-of-two ≥ 8)
+        // and the payload starts exactly SMALL_HEADER_SIZE bytes into the block.
+        if align <= SMALL_HEADER_SIZE {
+            if let Some(bucket) = Self::bucket_for(size) {
+                return unsafe { self.alloc_small(bucket) };
+            }
+        }
+
+        // ── Large path (also handles over-aligned small requests) ────────────
+        // Layout: [LargeBlock] … padding … [sentinel:usize][block_addr:usize][payload…]
+        let two_words = 2 * mem::size_of::<usize>();
+        let extra = align + two_words; // worst-case padding + two-word prefix
+        let raw = unsafe { self.alloc_large_raw(size + extra) };
+        if raw.is_null() {
+            return ptr::null_mut();
+        }
+
+        let raw_addr = raw as usize;
+        let block_addr = raw_addr - LARGE_BLOCK_SIZE;
+
+        // Find the first address ≥ raw_addr + two_words that is `align`-aligned.
+        let candidate = raw_addr + two_words;
+        let remainder = candidate % align;
+        let padding = if remainder == 0 { 0 } else { align - remainder };
+        let aligned_addr = candidate + padding;
+
+        // Write two-word prefix just before the payload.
+        let sentinel_ptr = (aligned_addr - two_words) as *mut usize;
+        unsafe {
+            ptr::write(sentinel_ptr, LARGE_BLOCK_SENTINEL);
+            ptr::write(sentinel_ptr.add(1), block_addr);
+        }
+
+        aligned_addr as *mut u8
+    }
+
+    /// Deallocate a pointer previously returned by `alloc_aligned`.
+    pub unsafe fn dealloc_aligned(&mut self, ptr: *mut u8) {
+        if ptr.is_null() {
+            return;
+        }
+        let addr = ptr as usize;
+        let two_words = 2 * mem::size_of::<usize>();
+
+        // ↓ was (addr - SMALL_HEADER_SIZE), which read block_addr instead of sentinel
+        let header_val = unsafe { ptr::read((addr - two_words) as *const usize) };
+
+        if header_val == LARGE_BLOCK_SENTINEL {
+            // Large path: the raw payload ptr is reconstructed from block_addr.
+            let block_addr = unsafe { ptr::read((addr - mem::size_of::<usize>()) as *const usize) };
+            let raw_ptr = (block_addr + LARGE_BLOCK_SIZE) as *mut u8;
+            unsafe { self.free_large_raw(raw_ptr) };
+        } else {
+            // Small path: header_val is the bucket index.
+            unsafe { self.free_small(ptr) };
+        }
+    }
+
+    /// Return the usable capacity of a live allocation (for realloc).
+    pub unsafe fn capacity_of(&self, ptr: *mut u8) -> usize {
+        let addr = ptr as usize;
+        let two_words = 2 * mem::size_of::<usize>();
+
+        // ↓ was (addr - SMALL_HEADER_SIZE), which read block_addr instead of sentinel
+        let header_val = unsafe { ptr::read((addr - two_words) as *const usize) };
+
+        if header_val == LARGE_BLOCK_SENTINEL {
+            let block_addr = unsafe { ptr::read((addr - mem::size_of::<usize>()) as *const usize) };
+            let block = block_addr as *mut LargeBlock;
+            // Remaining bytes from ptr to end of block payload.
+            let block_end = block_addr + LARGE_BLOCK_SIZE + unsafe { (*block).size };
+            block_end - addr
+        } else {
+            // Small block: capacity is the full class size.
+            BUCKET_SIZES[header_val]
+        }
+    }
+
+    // -----------------------------------------------------------------------
+    // Introspection
+    // -----------------------------------------------------------------------
+
+    /// Walk every free list and report how much memory is free and how it is
+    /// split up. O(free blocks); meant for diagnostics, not the hot path.
+    pub fn stats(&self) -> HeapStats {
+        let mut stats = HeapStats {
+            arena_free: self.arena_end.saturating_sub(self.arena_ptr),
+            small_free: [0; NUM_BUCKETS],
+            large_blocks: 0,
+            large_free_blocks: 0,
+            large_free: 0,
+            large_largest: 0,
+        };
+
+        for (bucket, &head) in self.free_lists.iter().enumerate() {
+            let mut node = head;
+            while !node.is_null() {
+                stats.small_free[bucket] += 1;
+                node = unsafe { ptr::read(node as *const *mut u8) };
+            }
+        }
+
+        let mut current = self.large_head;
+        while !current.is_null() {
+            unsafe {
+                stats.large_blocks += 1;
+                if (*current).free {
+                    stats.large_free_blocks += 1;
+                    stats.large_free += (*current).size;
+                    stats.large_largest = stats.large_largest.max((*current).size);
+                }
+                current = (*current).next;
+            }
+        }
+        stats
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Statistics
+// ---------------------------------------------------------------------------
+
+/// Snapshot of an allocator's free memory, from `SegregatedAllocator::stats`.
+#[derive(Debug, Clone, Copy)]
+pub struct HeapStats {
+    /// Bytes not yet carved from the bump arena.
+    pub arena_free: usize,
+    /// Blocks sitting on each size-class free list.
+    pub small_free: [usize; NUM_BUCKETS],
+    /// Blocks in the large-block list, free or not.
+    pub large_blocks: usize,
+    pub large_free_blocks: usize,
+    /// Usable bytes across all free large blocks.
+    pub large_free: usize,
+    /// Usable bytes in the biggest free large block.
+    pub large_largest: usize,
+}
+
+// ---------------------------------------------------------------------------
+// Utility
+// ---------------------------------------------------------------------------
+
+#[inline]
+fn align_up(addr: usize, align: usize) -> usize {
+    (addr + align - 1) & !(align - 1)
+}
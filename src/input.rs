@@ -0,0 +1,234 @@
+use core::cell::UnsafeCell;
+use core::sync::atomic::{AtomicU32, AtomicU64, Ordering, fence};
+
+// ============================================================================
+// Input event ring
+// ============================================================================
+//
+// A single-producer broadcast ring of keyboard events. The xHCI event path
+// (always under XHCI_LOCK) is the only writer; any number of readers follow
+// it with their own cursor and never write shared state, so reading needs no
+// lock at all — not in the kernel, and not from user space, where the same
+// page is mapped read-only at INPUT_RING_USER_VIRT.
+//
+// A cursor is the sequence number of the next event to read. `head` is the
+// number of events ever published; slot `seq % INPUT_RING_CAPACITY` holds
+// event `seq` while `seq + INPUT_RING_CAPACITY > head`. Readers that fall
+// further behind than that lose the oldest events and are moved forward.
+
+/// Number of event slots; a power of two so the slot index is a mask.
+pub const INPUT_RING_CAPACITY: usize = 128;
+
+/// Fixed user-space address of the read-only ring mapping, next to the user
+/// heap at 0x7000_0000_0000.
+pub const INPUT_RING_USER_VIRT: u64 = 0x0000_7100_0000_0000;
+
+/// `InputEvent::flags`: set on key-down, clear on key-up.
+pub const INPUT_FLAG_PRESSED: u8 = 1 << 0;
+
+/// `sys_input_read` flag: return 0 instead of waiting when nothing is queued.
+pub const INPUT_READ_NONBLOCK: usize = 1 << 0;
+
+/// HID usage of the first modifier key (Left Control); modifier byte bit `n`
+/// is usage `0xE0 + n`.
+pub const HID_USAGE_MODIFIER_BASE: u8 = 0xE0;
+
+/// One key transition, as seen by both the kernel and user space.
+#[repr(C)]
+#[derive(Debug, Clone, Copy, Default)]
+pub struct InputEvent {
+    /// TSC value when the report carrying this transition was processed.
+    pub timestamp: u64,
+    /// HID keyboard usage ID (0x04 = 'a', 0xE0..=0xE7 = modifiers).
+    pub usage: u8,
+    /// HID modifier byte in effect after this transition.
+    pub modifiers: u8,
+    pub flags: u8,
+    /// ASCII translation for presses of printable keys, otherwise 0.
+    pub ascii: u8,
+    _reserved: u32,
+}
+
+impl InputEvent {
+    pub const fn new(timestamp: u64, usage: u8, modifiers: u8, pressed: bool, ascii: u8) -> Self {
+        Self {
+            timestamp,
+            usage,
+            modifiers,
+            flags: if pressed { INPUT_FLAG_PRESSED } else { 0 },
+            ascii,
+            _reserved: 0,
+        }
+    }
+
+    pub fn pressed(&self) -> bool {
+        self.flags & INPUT_FLAG_PRESSED != 0
+    }
+}
+
+/// A slot is a tiny seqlock: `seq` is 0 while the producer rewrites the
+/// payload and `event_seq + 1` (truncated) once it is complete.
+#[repr(C)]
+struct Slot {
+    seq: AtomicU32,
+    _pad: u32,
+    event: UnsafeCell<InputEvent>,
+}
+
+#[repr(C, align(4096))]
+struct InputRing {
+    head: AtomicU64,
+    _pad: u64,
+    slots: [Slot; INPUT_RING_CAPACITY],
+}
+
+// Slots are only written by the single producer; readers validate with `seq`.
+unsafe impl Sync for InputRing {}
+
+const _: () = assert!(core::mem::size_of::<InputRing>() <= 4096);
+const _: () = assert!(INPUT_RING_CAPACITY.is_power_of_two());
+
+static INPUT_RING: InputRing = InputRing {
+    head: AtomicU64::new(0),
+    _pad: 0,
+    slots: [const {
+        Slot {
+            seq: AtomicU32::new(0),
+            _pad: 0,
+            event: UnsafeCell::new(InputEvent::new(0, 0, 0, false, 0)),
+        }
+    }; INPUT_RING_CAPACITY],
+};
+
+/// Cursor of the legacy one-byte `sys_read_key` consumer.
+static LEGACY_CURSOR: AtomicU64 = AtomicU64::new(0);
+
+pub fn timestamp() -> u64 {
+    unsafe { core::arch::x86_64::_rdtsc() }
+}
+
+/// Physical (= kernel virtual) address of the ring page, for the user mapping.
+pub fn ring_page() -> u64 {
+    core::ptr::addr_of!(INPUT_RING) as u64
+}
+
+/// Sequence number the next published event will get. A reader that starts
+/// here sees only events from now on.
+pub fn head() -> u64 {
+    INPUT_RING.head.load(Ordering::Acquire)
+}
+
+/// Publish one event. Only the xHCI event path may call this, and only with
+/// XHCI_LOCK held: the ring has exactly one producer.
+pub fn push(event: InputEvent) {
+    let ring = &INPUT_RING;
+    let seq = ring.head.load(Ordering::Relaxed);
+    let slot = &ring.slots[seq as usize & (INPUT_RING_CAPACITY - 1)];
+
+    slot.seq.store(0, Ordering::Relaxed);
+    fence(Ordering::Release);
+    unsafe {
+        core::ptr::write_volatile(slot.event.get(), event);
+    }
+    slot.seq.store((seq as u32).wrapping_add(1), Ordering::Release);
+    ring.head.store(seq + 1, Ordering::Release);
+}
+
+/// Copy events starting at `*cursor` into `out` and advance the cursor.
+/// Returns the number of events copied; never blocks. Events that were
+/// overwritten before the reader got to them are skipped.
+pub fn read(cursor: &mut u64, out: &mut [InputEvent]) -> usize {
+    let ring = &INPUT_RING;
+    let mut n = 0;
+
+    while n < out.len() {
+        let head = ring.head.load(Ordering::Acquire);
+        if *cursor >= head {
+            // Also catches a cursor from the future (e.g. garbage from user
+            // space); it simply waits until the ring gets there.
+            break;
+        }
+        if head - *cursor > INPUT_RING_CAPACITY as u64 {
+            *cursor = head - INPUT_RING_CAPACITY as u64;
+        }
+
+        let slot = &ring.slots[*cursor as usize & (INPUT_RING_CAPACITY - 1)];
+        let want = (*cursor as u32).wrapping_add(1);
+        if slot.seq.load(Ordering::Acquire) != want {
+            // The producer lapped us while we looked; re-read head.
+            continue;
+        }
+        let event = unsafe { core::ptr::read_volatile(slot.event.get()) };
+        fence(Ordering::Acquire);
+        if slot.seq.load(Ordering::Relaxed) != want {
+            continue;
+        }
+
+        out[n] = event;
+        n += 1;
+        *cursor += 1;
+    }
+    n
+}
+
+/// Next printable key press for the legacy `sys_read_key` interface; key-up
+/// events and non-ASCII keys are consumed and dropped, as before.
+pub fn read_ascii() -> Option<u8> {
+    loop {
+        let mut cursor = LEGACY_CURSOR.load(Ordering::Acquire);
+        let start = cursor;
+        let mut event = [InputEvent::default()];
+        if read(&mut cursor, &mut event) == 0 {
+            // Keep any overrun skip so the next call does not repeat it.
+            let _ = LEGACY_CURSOR.compare_exchange(start, cursor, Ordering::AcqRel, Ordering::Acquire);
+            return None;
+        }
+        if LEGACY_CURSOR
+            .compare_exchange(start, cursor, Ordering::AcqRel, Ordering::Acquire)
+            .is_err()
+        {
+            // Another reader of the legacy queue took this event.
+            continue;
+        }
+        if event[0].pressed() && event[0].ascii != 0 {
+            return Some(event[0].ascii);
+        }
+    }
+}
+
+// ============================================================================
+// Waiting
+// ============================================================================
+
+/// Block until an event past `cursor` exists.
+///
+/// Other ready tasks run first. When nothing else is runnable, the CPU that
+/// receives the xHCI interrupt halts until the next interrupt instead of
+/// spinning; in polled mode (or on another CPU) the event ring is drained
+/// here and the task keeps yielding.
+pub fn wait(cursor: u64) {
+    while head() <= cursor {
+        if !crate::xhci::irq_enabled() {
+            let _guard = crate::xhci::XHCI_LOCK.lock();
+            unsafe { crate::xhci::process_events() };
+            if head() > cursor {
+                break;
+            }
+        }
+
+        crate::scheduler::switch_task();
+        if head() > cursor {
+            break;
+        }
+
+        let halt_here = crate::xhci::irq_apic_id() == Some(crate::processor::current_apic_id())
+            && !crate::scheduler::has_other_ready_tasks();
+        if halt_here {
+            // sti; hlt is atomic with respect to interrupts, so an event that
+            // lands between the head check and the halt still wakes us.
+            unsafe { core::arch::asm!("sti", "hlt", "cli", options(nostack)) };
+        } else {
+            core::hint::spin_loop();
+        }
+    }
+}
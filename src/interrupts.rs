@@ -7,12 +7,14 @@ use core::mem::size_of;
 
 pub const KERNEL_CODE_SEL: u16 = 0x08;
 
-use core::sync::atomic::{AtomicBool, Ordering};
+use crate::allocator::TicketLock;
 use core::cell::UnsafeCell;
 use core::ops::{Deref, DerefMut};
 
+/// A ticket lock that keeps interrupts off on this CPU while it is held, so
+/// an interrupt handler can never spin on a lock its own CPU holds.
 pub struct InterruptSpinlock<T> {
-    lock: AtomicBool,
+    lock: TicketLock,
     data: UnsafeCell<T>,
 }
 
@@ -21,8 +23,13 @@ unsafe impl<T: Send> Send for InterruptSpinlock<T> {}
 
 impl<T> InterruptSpinlock<T> {
     pub const fn new(data: T) -> Self {
+        Self::named("", data)
+    }
+
+    /// A lock that shows up as `name` in the lockstat table. Statics only.
+    pub const fn named(name: &'static str, data: T) -> Self {
         Self {
-            lock: AtomicBool::new(false),
+            lock: TicketLock::named(name),
             data: UnsafeCell::new(data),
         }
     }
@@ -38,13 +45,7 @@ impl<T> InterruptSpinlock<T> {
         }
         let interrupts_enabled = (rflags & (1 << 9)) != 0;
 
-        while self
-            .lock
-            .compare_exchange(false, true, Ordering::Acquire, Ordering::Relaxed)
-            .is_err()
-        {
-            core::hint::spin_loop();
-        }
+        self.lock.lock();
 
         InterruptSpinlockGuard {
             lock: self,
@@ -63,11 +64,7 @@ impl<T> InterruptSpinlock<T> {
         }
         let interrupts_enabled = (rflags & (1 << 9)) != 0;
 
-        if self
-            .lock
-            .compare_exchange(false, true, Ordering::Acquire, Ordering::Relaxed)
-            .is_ok()
-        {
+        if self.lock.try_lock() {
             Some(InterruptSpinlockGuard {
                 lock: self,
                 interrupts_enabled,
@@ -83,7 +80,7 @@ impl<T> InterruptSpinlock<T> {
     }
 
     pub unsafe fn force_unlock(&self) {
-        self.lock.store(false, Ordering::Release);
+        unsafe { self.lock.force_unlock() };
     }
 }
 
@@ -107,7 +104,7 @@ impl<'a, T> DerefMut for InterruptSpinlockGuard<'a, T> {
 
 impl<'a, T> Drop for InterruptSpinlockGuard<'a, T> {
     fn drop(&mut self) {
-        self.lock.lock.store(false, Ordering::Release);
+        self.lock.lock.unlock();
         if self.interrupts_enabled {
             unsafe {
                 core::arch::asm!("sti", options(nomem, nostack, preserves_flags));
@@ -169,6 +166,16 @@ unsafe extern "C" {
     fn irq13();
     fn irq14();
     fn irq15();
+
+    // MSI vectors (48..56)
+    fn irq16();
+    fn irq17();
+    fn irq18();
+    fn irq19();
+    fn irq20();
+    fn irq21();
+    fn irq22();
+    fn irq23();
 }
 
 #[derive(Copy, Clone, Default)]
@@ -304,6 +311,16 @@ pub unsafe fn init_idt() {
         set_gate(46, irq14, KERNEL_CODE_SEL, 0x8E);
         set_gate(47, irq15, KERNEL_CODE_SEL, 0x8E);
 
+        // MSI vectors, delivered through the Local APIC
+        set_gate(48, irq16, KERNEL_CODE_SEL, 0x8E);
+        set_gate(49, irq17, KERNEL_CODE_SEL, 0x8E);
+        set_gate(50, irq18, KERNEL_CODE_SEL, 0x8E);
+        set_gate(51, irq19, KERNEL_CODE_SEL, 0x8E);
+        set_gate(52, irq20, KERNEL_CODE_SEL, 0x8E);
+        set_gate(53, irq21, KERNEL_CODE_SEL, 0x8E);
+        set_gate(54, irq22, KERNEL_CODE_SEL, 0x8E);
+        set_gate(55, irq23, KERNEL_CODE_SEL, 0x8E);
+
         IDT_PTR.limit = (size_of::<[IdtEntry; 256]>() - 1) as u16;
         IDT_PTR.base = &raw const IDT as *const _ as u64;
 
@@ -350,9 +367,57 @@ const EXCEPTION_MESSAGES: [&str; 32] = [
     "RESERVED",
 ];
 
+// ─── Device interrupt handlers ───────────────────────────────────────────────
+//
+// Drivers hook either a legacy PIC line (INTx) or one of the MSI vectors.
+// Handlers run with interrupts disabled on the interrupted CPU's stack and
+// must not block.
+
+pub const MSI_VECTOR_BASE: u8 = 48;
+pub const MSI_VECTOR_COUNT: usize = 8;
+
+static mut PIC_IRQ_HANDLERS: [Option<fn()>; 16] = [None; 16];
+static mut MSI_HANDLERS: [Option<fn()>; MSI_VECTOR_COUNT] = [None; MSI_VECTOR_COUNT];
+
+/// Route PIC line `irq` (0..16) to `handler` and unmask it.
+pub unsafe fn register_irq_handler(irq: u8, handler: fn()) -> bool {
+    if irq >= 16 {
+        return false;
+    }
+    unsafe {
+        (*core::ptr::addr_of_mut!(PIC_IRQ_HANDLERS))[irq as usize] = Some(handler);
+        crate::pic::unmask(irq);
+    }
+    true
+}
+
+/// Claim a free MSI vector for `handler`. Returns the IDT vector to program
+/// into the device's MSI data register.
+pub unsafe fn register_msi_handler(handler: fn()) -> Option<u8> {
+    let handlers = unsafe { &mut *core::ptr::addr_of_mut!(MSI_HANDLERS) };
+    for (i, slot) in handlers.iter_mut().enumerate() {
+        if slot.is_none() {
+            *slot = Some(handler);
+            return Some(MSI_VECTOR_BASE + i as u8);
+        }
+    }
+    None
+}
+
 #[unsafe(no_mangle)]
 pub unsafe extern "sysv64" fn irq_handler(frame: *mut InterruptFrame) {
     let int_no = unsafe { core::ptr::read_unaligned(core::ptr::addr_of!((*frame).int_no)) };
+
+    let msi_end = MSI_VECTOR_BASE as u64 + MSI_VECTOR_COUNT as u64;
+    if (MSI_VECTOR_BASE as u64..msi_end).contains(&int_no) {
+        let index = (int_no - MSI_VECTOR_BASE as u64) as usize;
+        if let Some(handler) = unsafe { (*core::ptr::addr_of!(MSI_HANDLERS))[index] } {
+            handler();
+        }
+        unsafe { crate::processor::lapic_eoi(crate::processor::lapic_base_from_msr()) };
+        return;
+    }
+
     if !(32..48).contains(&int_no) {
         let mut writer_guard = GLOBAL_WRITER.lock();
         if let Some(writer) = writer_guard.as_mut() {
@@ -363,11 +428,13 @@ pub unsafe extern "sysv64" fn irq_handler(frame: *mut InterruptFrame) {
 
     let irq = int_no - 32;
 
-    match irq {
-        0 => { /* Timer */ }
-        1 => {
+    let handler = unsafe { (*core::ptr::addr_of!(PIC_IRQ_HANDLERS))[irq as usize] };
+    match (irq, handler) {
+        (0, _) => { /* Timer */ }
+        (1, _) => {
             //
         }
+        (_, Some(handler)) => handler(),
         _ =>
         {
             let mut writer_guard = GLOBAL_WRITER.lock();
@@ -395,6 +462,28 @@ pub unsafe extern "sysv64" fn exception_handler(frame: *mut InterruptFrame) {
     let rdi = unsafe { core::ptr::read_unaligned(core::ptr::addr_of!((*frame).rdi)) };
     let rbp = unsafe { core::ptr::read_unaligned(core::ptr::addr_of!((*frame).rbp)) };
 
+    // A not-present fault on a demand-paged image page or below the mapped
+    // part of a growable user stack, or a write to a copy-on-write page, is
+    // not an error: fix up the page and retry the faulting instruction.
+    if int_no == 14 {
+        let cr2: u64;
+        unsafe {
+            core::arch::asm!("mov {}, cr2", out(reg) cr2, options(nomem, nostack, preserves_flags));
+        }
+        let present = err_code & 1 != 0;
+        let write = err_code & 2 != 0;
+        let resolved = if present {
+            write && crate::memory::handle_cow_fault(cr2)
+        } else {
+            crate::kef::handle_page_fault(cr2)
+                || crate::mmap::handle_page_fault(cr2)
+                || crate::memory::handle_stack_fault(cr2)
+        };
+        if resolved {
+            return;
+        }
+    }
+
     let mut writer_guard = if let Some(guard) = GLOBAL_WRITER.try_lock() {
         guard
     } else {
@@ -551,6 +640,14 @@ IRQ 12, 44
 IRQ 13, 45
 IRQ 14, 46
 IRQ 15, 47
+IRQ 16, 48
+IRQ 17, 49
+IRQ 18, 50
+IRQ 19, 51
+IRQ 20, 52
+IRQ 21, 53
+IRQ 22, 54
+IRQ 23, 55
 
 .global irq_common
 irq_common:
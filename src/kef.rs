@@ -1,4 +1,10 @@
-use crate::memory::{FrameAllocator, PageTable, map_page, PAGE_PRESENT, PAGE_WRITABLE, PAGE_USER};
+use crate::fs::{self, FileHandle, OpenFile};
+use crate::interrupts::InterruptSpinlock;
+use crate::memory::{self, FrameAllocator, PageTable, lookup_page, map_page, PAGE_NO_EXECUTE, PAGE_OWNED, PAGE_PRESENT, PAGE_WRITABLE, PAGE_USER};
+use crate::scheduler::{self, UserContext};
+use alloc::string::String;
+use alloc::vec;
+use alloc::vec::Vec;
 
 #[repr(C, packed)]
 #[derive(Debug, Copy, Clone)]
@@ -9,20 +15,80 @@ pub struct KefHeader {
     pub code_size: u32,         // Size of the code segment in bytes
 }
 
-/// Loads a KEF executable from raw file bytes, allocates and maps its code and stack pages,
-/// and returns (entry_point virtual address, user_rsp virtual address).
+// ============================================================================
+// KEF v2
+// ============================================================================
+//
+// A v2 image is linked at address 0 and may be loaded at any page-aligned
+// base: every absolute address it contains is listed in the relocation
+// table and has the load base added to it. Segments carry their own
+// permissions, and the part of a segment past its file bytes (BSS) is
+// zero-filled at load instead of being stored in the file.
+//
+// File layout: KefHeaderV2, then `segment_count` KefSegment entries, then
+// segment contents, then `reloc_count` little-endian u64 image offsets.
+
+pub const KEF_V1_MAGIC: [u8; 4] = *b"KEF\0";
+pub const KEF_V2_MAGIC: [u8; 4] = *b"KEF2";
+
+#[repr(C)]
+#[derive(Debug, Copy, Clone)]
+pub struct KefHeaderV2 {
+    pub magic: [u8; 4],         // Magic bytes: b"KEF2"
+    pub segment_count: u16,     // Number of KefSegment entries following the header
+    pub stack_pages: u16,       // Maximum stack size in pages; 0 = KEF_DEFAULT_STACK_SIZE
+    pub entry: u64,             // Entry point, relative to the image base
+    pub image_size: u64,        // Bytes of address space the segments span (page multiple)
+    pub reloc_offset: u32,      // File offset of the relocation table
+    pub reloc_count: u32,       // Number of u64 entries in it
+}
+
+#[repr(C)]
+#[derive(Debug, Copy, Clone)]
+pub struct KefSegment {
+    pub kind: u32,              // KEF_SEG_TEXT / RODATA / DATA / BSS
+    pub flags: u32,             // KEF_SEG_READ | KEF_SEG_WRITE | KEF_SEG_EXEC
+    pub vaddr: u64,             // Offset of the segment from the image base
+    pub mem_size: u64,          // Size in memory; bytes past file_size are zero
+    pub file_offset: u32,       // File offset of the segment contents
+    pub file_size: u32,         // Bytes stored in the file (0 for BSS)
+}
+
+pub const KEF_SEG_TEXT: u32 = 1;
+pub const KEF_SEG_RODATA: u32 = 2;
+pub const KEF_SEG_DATA: u32 = 3;
+pub const KEF_SEG_BSS: u32 = 4;
+
+pub const KEF_SEG_READ: u32 = 1 << 0;
+pub const KEF_SEG_WRITE: u32 = 1 << 1;
+pub const KEF_SEG_EXEC: u32 = 1 << 2;
+
+/// Largest image a v2 file may describe.
+const KEF_MAX_IMAGE_SIZE: u64 = 64 * 1024 * 1024;
+
+/// Stack limit of a v2 image whose header leaves `stack_pages` at 0.
+pub const KEF_DEFAULT_STACK_SIZE: u64 = 1024 * 1024;
+/// Largest stack a header or spawn request may ask for.
+pub const KEF_MAX_STACK_SIZE: u64 = 256 * 1024 * 1024;
+
+/// Loads a v1 KEF executable from raw file bytes, allocates and maps its code and stack pages,
+/// and returns (entry_point virtual address, user_rsp virtual address). v2 images are only
+/// demand-paged, through `load_kef_file`.
 pub fn load_kef(
     file_data: &[u8],
     allocator: &mut FrameAllocator,
     pml4: &mut PageTable,
 ) -> Result<(u64, u64), &'static str> {
+    if file_data.len() >= 4 && file_data[..4] == KEF_V2_MAGIC {
+        return Err("KEF v2 images are demand-paged; load them with load_kef_file");
+    }
     if file_data.len() < core::mem::size_of::<KefHeader>() {
         return Err("File too small to contain KEF header");
     }
 
     // SAFETY: We checked the bounds of file_data.
     let header = unsafe { &*(file_data.as_ptr() as *const KefHeader) };
-    if header.magic != [b'K', b'E', b'F', 0] {
+    if header.magic != KEF_V1_MAGIC {
         return Err("Invalid KEF magic number");
     }
 
@@ -92,3 +158,463 @@ pub fn load_kef(
 
     Ok((entry_point, user_rsp))
 }
+
+/// Page table flags for a segment's permissions. Writable code is refused.
+fn segment_page_flags(segment: &KefSegment) -> Result<u64, &'static str> {
+    let writable = segment.flags & KEF_SEG_WRITE != 0;
+    let executable = segment.flags & KEF_SEG_EXEC != 0;
+    if writable && executable {
+        return Err("KEF segment is both writable and executable");
+    }
+    let mut flags = PAGE_PRESENT | PAGE_USER;
+    if writable {
+        flags |= PAGE_WRITABLE;
+    }
+    if !executable {
+        flags |= PAGE_NO_EXECUTE;
+    }
+    Ok(flags)
+}
+
+/// Parse and check the header and segment table of a v2 file. `table` holds
+/// at least the header and the segment table; `file_len` is the size of the
+/// whole file.
+fn parse_kef_v2(table: &[u8], file_len: usize) -> Result<(KefHeaderV2, Vec<KefSegment>), &'static str> {
+    let header_size = core::mem::size_of::<KefHeaderV2>();
+    let segment_size = core::mem::size_of::<KefSegment>();
+    if table.len() < header_size {
+        return Err("File too small to contain KEF header");
+    }
+    let header = unsafe { core::ptr::read_unaligned(table.as_ptr() as *const KefHeaderV2) };
+    if header.image_size == 0 || header.image_size % 4096 != 0 || header.image_size > KEF_MAX_IMAGE_SIZE {
+        return Err("KEF image size is invalid");
+    }
+    if header.entry >= header.image_size {
+        return Err("KEF entry point is outside the image");
+    }
+
+    let table_end = header_size + header.segment_count as usize * segment_size;
+    if header.segment_count == 0 || table_end > table.len() || table_end > file_len {
+        return Err("KEF segment table extends past end of file");
+    }
+    let mut segments: Vec<KefSegment> = Vec::with_capacity(header.segment_count as usize);
+    for i in 0..header.segment_count as usize {
+        let segment = unsafe {
+            core::ptr::read_unaligned(table.as_ptr().add(header_size + i * segment_size) as *const KefSegment)
+        };
+        let mem_end = segment.vaddr.checked_add(segment.mem_size).ok_or("KEF segment overflows")?;
+        if mem_end > header.image_size || segment.file_size as u64 > segment.mem_size {
+            return Err("KEF segment lies outside the image");
+        }
+        if segment.file_offset as usize + segment.file_size as usize > file_len {
+            return Err("KEF segment extends past end of file");
+        }
+        let flags = segment_page_flags(&segment)?;
+
+        // Two segments may share a page only if they agree on its flags.
+        if segment.mem_size != 0 {
+            for other in segments.iter().filter(|other| other.mem_size != 0) {
+                let shares_page = segment.vaddr / 4096 <= (other.vaddr + other.mem_size - 1) / 4096
+                    && other.vaddr / 4096 <= (mem_end - 1) / 4096;
+                if shares_page && segment_page_flags(other)? != flags {
+                    return Err("KEF segments with different permissions share a page");
+                }
+            }
+        }
+        segments.push(segment);
+    }
+
+    let reloc_end = header.reloc_offset as usize + header.reloc_count as usize * 8;
+    if header.reloc_count != 0 && reloc_end > file_len {
+        return Err("KEF relocation table extends past end of file");
+    }
+    Ok((header, segments))
+}
+
+/// File offset of the 8 bytes a relocation patches. Every relocation must
+/// lie within the file bytes of a single segment.
+fn reloc_file_offset(segments: &[KefSegment], offset: u64) -> Option<u32> {
+    segments
+        .iter()
+        .find(|s| offset >= s.vaddr && offset + 8 <= s.vaddr + s.file_size as u64)
+        .map(|s| s.file_offset + (offset - s.vaddr) as u32)
+}
+
+/// Decode and check a relocation table, returning its offsets sorted.
+fn parse_relocations(bytes: &[u8], segments: &[KefSegment]) -> Result<Vec<u64>, &'static str> {
+    let mut relocs: Vec<u64> = bytes
+        .chunks_exact(8)
+        .map(|chunk| u64::from_le_bytes(chunk.try_into().unwrap()))
+        .collect();
+    if relocs.iter().any(|&offset| reloc_file_offset(segments, offset).is_none()) {
+        return Err("KEF relocation outside the image");
+    }
+    relocs.sort_unstable();
+    Ok(relocs)
+}
+
+/// Stack size for an image: `requested` if non-zero, else the header's
+/// `stack_pages`, else the default. Rounded up to whole pages.
+fn image_stack_size(stack_pages: u16, requested: u64) -> Result<u64, &'static str> {
+    let size = match (requested, stack_pages) {
+        (0, 0) => KEF_DEFAULT_STACK_SIZE,
+        (0, pages) => pages as u64 * 4096,
+        (size, _) => (size + 4095) & !4095,
+    };
+    if size > KEF_MAX_STACK_SIZE {
+        return Err("KEF stack size is too large");
+    }
+    Ok(size)
+}
+
+/// Claim address space for an image of `image_size` bytes followed by a
+/// guard page and a stack of `stack_size` bytes, and return its base. The
+/// next span starts after a gap, which guards the top of the stack.
+fn reserve_image_span(image_size: u64, stack_size: u64) -> Result<u64, &'static str> {
+    memory::reserve_user_span(image_size + 4096 + stack_size + 4096).ok_or("Out of user address space")
+}
+
+// ============================================================================
+// Demand paging
+// ============================================================================
+//
+// A v2 image loaded with `load_kef_file` maps nothing up front but the top
+// page of its stack, which grows on demand. The page-fault handler fills
+// each image page on first touch: only that page's bytes are read from the
+// file, the rest is zeroed, the relocations landing in it are applied, and
+// it is mapped with its segment's permissions. Pages that are never touched
+// are never read.
+//
+// Everything that depends only on the file is kept once per executable in
+// a `SharedImage`: the parsed layout, and the frames of its read-only pages
+// that no relocation touches. Those pages are identical at every base, so
+// every instance maps the same frame; only writable or relocated pages and
+// the stack are private to an instance.
+
+/// One executable file, shared by every instance loaded from it.
+struct SharedImage {
+    name: String,
+    /// Open for as long as the image is cached.
+    file: OpenFile,
+    entry: u64,
+    image_size: u64,
+    stack_pages: u16,
+    segments: Vec<KefSegment>,
+    /// Sorted image offsets of the u64s that need the base added.
+    relocs: Vec<u64>,
+    /// (page offset, frame) of the shareable pages filled so far, sorted.
+    pages: Vec<(u64, u64)>,
+}
+
+impl SharedImage {
+    fn same_file(&self, name: &str, file: &FileHandle) -> bool {
+        self.name == name && self.file.first_cluster == file.first_cluster && self.file.size == file.size
+    }
+
+    /// Index of the first relocation that touches or follows the page at
+    /// `page_offset`.
+    fn first_reloc(&self, page_offset: u64) -> usize {
+        self.relocs.partition_point(|&offset| offset + 8 <= page_offset)
+    }
+
+    fn page_has_relocs(&self, page_offset: u64) -> bool {
+        self.relocs
+            .get(self.first_reloc(page_offset))
+            .is_some_and(|&offset| offset < page_offset + 4096)
+    }
+}
+
+/// One loaded instance: which address space and base it lives at and which
+/// file backs it.
+#[derive(Clone, Copy)]
+struct LazyImage {
+    space: u64,
+    base: u64,
+    shared: usize,
+}
+
+struct DemandImages {
+    files: Vec<SharedImage>,
+    images: Vec<LazyImage>,
+}
+
+static DEMAND_IMAGES: InterruptSpinlock<DemandImages> = InterruptSpinlock::named("DEMAND_IMAGES", DemandImages {
+    files: Vec::new(),
+    images: Vec::new(),
+});
+
+fn read_exact(file: &OpenFile, offset: u32, buffer: &mut [u8]) -> Result<(), &'static str> {
+    match fs::read_file_at(file, offset, buffer) {
+        Ok(n) if n == buffer.len() => Ok(()),
+        Ok(_) => Err("KEF file is truncated"),
+        Err(_) => Err("Failed to read KEF file"),
+    }
+}
+
+/// Read and check the header, segment table and relocations of a v2 file.
+fn read_shared_image(name: &str, file: OpenFile) -> Result<SharedImage, &'static str> {
+    let header_size = core::mem::size_of::<KefHeaderV2>();
+    let mut table = vec![0u8; header_size];
+    read_exact(&file, 0, &mut table)?;
+    let segment_count = u16::from_le_bytes([table[4], table[5]]) as usize;
+    let table_len = header_size + segment_count * core::mem::size_of::<KefSegment>();
+    if table_len > file.size as usize {
+        return Err("KEF segment table extends past end of file");
+    }
+    table.resize(table_len, 0);
+    read_exact(&file, 0, &mut table)?;
+    let (header, segments) = parse_kef_v2(&table, file.size as usize)?;
+
+    let mut reloc_bytes = vec![0u8; header.reloc_count as usize * 8];
+    read_exact(&file, header.reloc_offset, &mut reloc_bytes)?;
+    let relocs = parse_relocations(&reloc_bytes, &segments)?;
+
+    Ok(SharedImage {
+        name: String::from(name),
+        file,
+        entry: header.entry,
+        image_size: header.image_size,
+        stack_pages: header.stack_pages,
+        segments,
+        relocs,
+        pages: Vec::new(),
+    })
+}
+
+/// Load a KEF executable straight from the filesystem into the address
+/// space rooted at `space` and return (entry_point, user_rsp). v2 images are
+/// demand-paged from the file; the first load of a file reads its header,
+/// segment table and relocations, later loads of the same file read nothing.
+/// Their stack may grow to `stack_size` bytes, or to what the header asks
+/// for if that is 0. v1 images are read whole and loaded eagerly.
+pub fn load_kef_file(name: &str, space: u64, stack_size: u64) -> Result<(u64, u64), &'static str> {
+    let file = fs::open_file(name).map_err(|_| "KEF file not found")?;
+    let cached = DEMAND_IMAGES
+        .lock()
+        .files
+        .iter()
+        .position(|shared| shared.same_file(name, &file));
+
+    let shared = match cached {
+        Some(shared) => shared,
+        None => {
+            let mut magic = [0u8; 4];
+            read_exact(&file, 0, &mut magic)?;
+            if magic != KEF_V2_MAGIC {
+                let file_data = fs::read_file(name).map_err(|_| "Failed to read KEF file")?;
+                return memory::with_address_space(space, |pml4, allocator| load_kef(&file_data, allocator, pml4))
+                    .ok_or("Paging is not set up")?;
+            }
+            let image = read_shared_image(name, file)?;
+            let mut demand = DEMAND_IMAGES.lock();
+            // Another CPU may have loaded the same file meanwhile.
+            match demand.files.iter().position(|shared| shared.same_file(name, &image.file)) {
+                Some(shared) => shared,
+                None => {
+                    demand.files.push(image);
+                    demand.files.len() - 1
+                }
+            }
+        }
+    };
+
+    let (entry, image_size, stack_pages) = {
+        let demand = DEMAND_IMAGES.lock();
+        let image = &demand.files[shared];
+        (image.entry, image.image_size, image.stack_pages)
+    };
+    let stack_size = image_stack_size(stack_pages, stack_size)?;
+    let base = reserve_image_span(image_size, stack_size)?;
+    let stack_top = base + image_size + 4096 + stack_size;
+    let user_rsp = memory::map_user_stack(space, stack_top, stack_size).ok_or("OOM allocating stack frame")?;
+    DEMAND_IMAGES.lock().images.push(LazyImage { space, base, shared });
+
+    Ok((base + entry, user_rsp))
+}
+
+/// Give a forked address space the demand-paged images of its parent. Pages
+/// the parent has touched are already in the copied page tables; the rest
+/// are filled from the file on first touch in the child as well.
+pub fn fork_images(parent: u64, child: u64) {
+    let mut demand = DEMAND_IMAGES.lock();
+    let inherited: Vec<LazyImage> = demand.images.iter().filter(|image| image.space == parent).copied().collect();
+    for image in inherited {
+        demand.images.push(LazyImage { space: child, ..image });
+    }
+}
+
+/// Load `name` into a fresh address space and queue it as a new user task
+/// whose stack may grow to `stack_size` bytes (0: as the file asks).
+/// Returns the task ID.
+pub fn spawn_kef_file(name: &str, stack_size: u64) -> Result<usize, &'static str> {
+    let space = memory::new_address_space().ok_or("OOM allocating address space")?;
+    let (entry, user_rsp) = load_kef_file(name, space, stack_size)?;
+    scheduler::add_user_task(space, &UserContext::new(entry, user_rsp), scheduler::KERNEL_STACK_SIZE)
+        .ok_or("OOM allocating kernel stack")
+}
+
+/// What `fill_page` needs of a `SharedImage` for one page, copied out so
+/// the file can be read without holding DEMAND_IMAGES.
+struct PageSource {
+    file: OpenFile,
+    segments: Vec<KefSegment>,
+    /// Sorted image offsets of the relocations that touch the page.
+    relocs: Vec<u64>,
+}
+
+impl PageSource {
+    fn new(image: &SharedImage, page_offset: u64) -> Self {
+        let first = image.first_reloc(page_offset);
+        Self {
+            file: image.file.clone(),
+            segments: image.segments.clone(),
+            relocs: image.relocs[first..]
+                .iter()
+                .copied()
+                .take_while(|&offset| offset < page_offset + 4096)
+                .collect(),
+        }
+    }
+}
+
+/// Build the contents of the page at `page_offset` of an instance at `base`.
+fn fill_page(source: &PageSource, base: u64, page_offset: u64, page: &mut [u8]) -> Result<(), &'static str> {
+    let page_end = page_offset + 4096;
+    page.fill(0);
+    for segment in &source.segments {
+        let lo = segment.vaddr.max(page_offset);
+        let hi = (segment.vaddr + segment.file_size as u64).min(page_end);
+        if lo < hi {
+            let file_offset = segment.file_offset + (lo - segment.vaddr) as u32;
+            read_exact(
+                &source.file,
+                file_offset,
+                &mut page[(lo - page_offset) as usize..(hi - page_offset) as usize],
+            )?;
+        }
+    }
+
+    for &offset in &source.relocs {
+        let mut bytes = [0u8; 8];
+        if offset >= page_offset && offset + 8 <= page_end {
+            let at = (offset - page_offset) as usize;
+            bytes.copy_from_slice(&page[at..at + 8]);
+        } else {
+            // Straddles a page boundary; the half outside this page may not
+            // be resident, so take the original bytes from the file.
+            let file_offset = reloc_file_offset(&source.segments, offset).ok_or("KEF relocation outside the image")?;
+            read_exact(&source.file, file_offset, &mut bytes)?;
+        }
+        let value = u64::from_le_bytes(bytes).wrapping_add(base).to_le_bytes();
+        for (i, byte) in value.iter().enumerate() {
+            let at = offset + i as u64;
+            if at >= page_offset && at < page_end {
+                page[(at - page_offset) as usize] = *byte;
+            }
+        }
+    }
+    Ok(())
+}
+
+/// Whether the page at `virt` of `space` is mapped: None if the space has
+/// no page tables.
+fn page_present(space: u64, virt: u64) -> Option<bool> {
+    memory::with_address_space(space, |pml4, _| unsafe { lookup_page(pml4, virt) })
+        .map(|entry| entry.is_some_and(|entry| entry & PAGE_PRESENT != 0))
+}
+
+fn free_frame(space: u64, frame: u64) {
+    memory::with_address_space(space, |_, allocator| allocator.free_frame(frame));
+}
+
+/// Resolve a not-present page fault at `addr` if it lies in a demand-paged
+/// image of the active address space. Returns false if the address is not
+/// part of one or the page could not be filled, in which case the fault is a
+/// real one.
+///
+/// The file is read with DEMAND_IMAGES dropped, so faults on other CPUs do
+/// not wait for this one's disk I/O; the page is installed after taking it
+/// again, unless another CPU filled it meanwhile.
+pub fn handle_page_fault(addr: u64) -> bool {
+    let space = memory::current_pml4_phys();
+    let (base, page_offset, virt, flags, shared, shareable, source) = {
+        let demand = DEMAND_IMAGES.lock();
+        let Some((base, shared)) = demand.images.iter().find_map(|image| {
+            let size = demand.files[image.shared].image_size;
+            (image.space == space && addr >= image.base && addr < image.base + size)
+                .then_some((image.base, image.shared))
+        }) else {
+            return false;
+        };
+        let image = &demand.files[shared];
+
+        let page_offset = (addr - base) & !0xFFF;
+        let Some(flags) = image
+            .segments
+            .iter()
+            .find(|s| s.mem_size != 0 && s.vaddr < page_offset + 4096 && s.vaddr + s.mem_size > page_offset)
+            .and_then(|s| segment_page_flags(s).ok())
+        else {
+            // A hole between segments.
+            return false;
+        };
+        let virt = base + page_offset;
+
+        // Another CPU may have filled the page while this one waited for the lock.
+        match page_present(space, virt) {
+            None => return false,
+            Some(true) => return true,
+            Some(false) => {}
+        }
+
+        let shareable = flags & PAGE_WRITABLE == 0 && !image.page_has_relocs(page_offset);
+        if shareable {
+            if let Ok(i) = image.pages.binary_search_by_key(&page_offset, |&(offset, _)| offset) {
+                let frame = image.pages[i].1;
+                return memory::with_address_space(space, |pml4, allocator| unsafe {
+                    map_page(pml4, virt, frame, flags, allocator)
+                })
+                .is_some();
+            }
+        }
+        (base, page_offset, virt, flags, shared, shareable, PageSource::new(image, page_offset))
+    };
+
+    let Some(Some(frame)) = memory::with_address_space(space, |_, allocator| allocator.allocate_frame()) else {
+        return false;
+    };
+    let page = unsafe { core::slice::from_raw_parts_mut(frame as *mut u8, 4096) };
+    if fill_page(&source, base, page_offset, page).is_err() {
+        free_frame(space, frame);
+        return false;
+    }
+
+    let mut demand = DEMAND_IMAGES.lock();
+    match page_present(space, virt) {
+        Some(false) => {}
+        present => {
+            free_frame(space, frame);
+            return present == Some(true);
+        }
+    }
+    let frame = if shareable {
+        let pages = &mut demand.files[shared].pages;
+        match pages.binary_search_by_key(&page_offset, |&(offset, _)| offset) {
+            // Filled for another instance meanwhile.
+            Ok(i) => {
+                free_frame(space, frame);
+                pages[i].1
+            }
+            Err(slot) => {
+                pages.insert(slot, (page_offset, frame));
+                frame
+            }
+        }
+    } else {
+        frame
+    };
+    // A private page is this instance's own, so after a fork the last
+    // space to write it takes it over rather than copying it.
+    let flags = if shareable { flags } else { flags | PAGE_OWNED };
+    memory::with_address_space(space, |pml4, allocator| unsafe { map_page(pml4, virt, frame, flags, allocator) }).is_some()
+}
@@ -0,0 +1,184 @@
+// ============================================================================
+// Lock statistics
+// ============================================================================
+//
+// Built with `--features lockstat`, every named `Spinlock`,
+// `InterruptSpinlock` and `Mutex` counts its acquisitions, how many of them
+// had to wait, the cycles spent waiting and the cycles the lock was held;
+// a `Mutex` also counts how often a waiter parked instead of spinning. A lock
+// joins the table the first time it is taken; `dump` prints the table,
+// worst wait first. Without the feature the locks carry no counters and
+// cost nothing extra.
+//
+// Only statics may be named: the table keeps a pointer to each lock's
+// counters for the life of the kernel. Locks that share a name (the locks
+// of an array) are summed into one row.
+
+#[cfg(feature = "lockstat")]
+use core::sync::atomic::{AtomicBool, AtomicPtr, AtomicU64, AtomicUsize, Ordering};
+
+#[cfg(feature = "lockstat")]
+const MAX_LOCKS: usize = 256;
+
+#[cfg(feature = "lockstat")]
+static LOCKS: [AtomicPtr<LockStats>; MAX_LOCKS] = [const { AtomicPtr::new(core::ptr::null_mut()) }; MAX_LOCKS];
+#[cfg(feature = "lockstat")]
+static LOCK_COUNT: AtomicUsize = AtomicUsize::new(0);
+
+#[cfg(feature = "lockstat")]
+pub struct LockStats {
+    name: &'static str,
+    registered: AtomicBool,
+    acquisitions: AtomicU64,
+    contended: AtomicU64,
+    wait_cycles: AtomicU64,
+    max_wait: AtomicU64,
+    hold_cycles: AtomicU64,
+    /// Times a waiter parked its task (`Mutex` only).
+    slept: AtomicU64,
+    /// When the current holder got the lock.
+    acquired_at: AtomicU64,
+}
+
+#[cfg(feature = "lockstat")]
+impl LockStats {
+    pub const fn new(name: &'static str) -> Self {
+        Self {
+            name,
+            registered: AtomicBool::new(false),
+            acquisitions: AtomicU64::new(0),
+            contended: AtomicU64::new(0),
+            wait_cycles: AtomicU64::new(0),
+            max_wait: AtomicU64::new(0),
+            hold_cycles: AtomicU64::new(0),
+            slept: AtomicU64::new(0),
+            acquired_at: AtomicU64::new(0),
+        }
+    }
+
+    /// The lock was just taken after waiting `wait` cycles (0: it was free).
+    pub fn acquired(&self, wait: u64) {
+        if self.name.is_empty() {
+            return;
+        }
+        if !self.registered.load(Ordering::Relaxed) && !self.registered.swap(true, Ordering::Relaxed) {
+            let slot = LOCK_COUNT.fetch_add(1, Ordering::Relaxed);
+            if let Some(entry) = LOCKS.get(slot) {
+                entry.store(self as *const LockStats as *mut LockStats, Ordering::Release);
+            }
+        }
+        self.acquisitions.fetch_add(1, Ordering::Relaxed);
+        if wait != 0 {
+            self.contended.fetch_add(1, Ordering::Relaxed);
+            self.wait_cycles.fetch_add(wait, Ordering::Relaxed);
+            self.max_wait.fetch_max(wait, Ordering::Relaxed);
+        }
+        self.acquired_at.store(now(), Ordering::Relaxed);
+    }
+
+    /// The holder is about to release the lock.
+    pub fn released(&self) {
+        if self.name.is_empty() {
+            return;
+        }
+        let held = now().saturating_sub(self.acquired_at.load(Ordering::Relaxed));
+        self.hold_cycles.fetch_add(held, Ordering::Relaxed);
+    }
+
+    /// A waiter is about to park its task until the lock is released.
+    pub fn slept(&self) {
+        self.slept.fetch_add(1, Ordering::Relaxed);
+    }
+
+    fn reset(&self) {
+        self.acquisitions.store(0, Ordering::Relaxed);
+        self.contended.store(0, Ordering::Relaxed);
+        self.wait_cycles.store(0, Ordering::Relaxed);
+        self.max_wait.store(0, Ordering::Relaxed);
+        self.hold_cycles.store(0, Ordering::Relaxed);
+        self.slept.store(0, Ordering::Relaxed);
+    }
+}
+
+#[cfg(feature = "lockstat")]
+pub fn now() -> u64 {
+    unsafe { core::arch::x86_64::_rdtsc() }
+}
+
+/// Print the table of every lock taken so far, the one with the most total
+/// wait first, and zero the counters if `reset`. Returns the number of
+/// locks printed, or None if the kernel was built without lockstat.
+#[cfg(feature = "lockstat")]
+pub fn dump(reset: bool) -> Option<usize> {
+    use alloc::vec::Vec;
+
+    struct Row {
+        name: &'static str,
+        acquisitions: u64,
+        contended: u64,
+        wait_cycles: u64,
+        max_wait: u64,
+        hold_cycles: u64,
+        slept: u64,
+    }
+
+    // Snapshot first: printing takes GLOBAL_WRITER, which is in the table.
+    let count = LOCK_COUNT.load(Ordering::Relaxed).min(MAX_LOCKS);
+    let mut rows: Vec<Row> = LOCKS[..count]
+        .iter()
+        .filter_map(|entry| unsafe { entry.load(Ordering::Acquire).as_ref() })
+        .map(|stats| {
+            let row = Row {
+                name: stats.name,
+                acquisitions: stats.acquisitions.load(Ordering::Relaxed),
+                contended: stats.contended.load(Ordering::Relaxed),
+                wait_cycles: stats.wait_cycles.load(Ordering::Relaxed),
+                max_wait: stats.max_wait.load(Ordering::Relaxed),
+                hold_cycles: stats.hold_cycles.load(Ordering::Relaxed),
+                slept: stats.slept.load(Ordering::Relaxed),
+            };
+            if reset {
+                stats.reset();
+            }
+            row
+        })
+        .collect();
+    rows.sort_unstable_by(|a, b| a.name.cmp(b.name));
+    rows.dedup_by(|row, kept| {
+        if row.name != kept.name {
+            return false;
+        }
+        kept.acquisitions += row.acquisitions;
+        kept.contended += row.contended;
+        kept.wait_cycles += row.wait_cycles;
+        kept.max_wait = kept.max_wait.max(row.max_wait);
+        kept.hold_cycles += row.hold_cycles;
+        kept.slept += row.slept;
+        true
+    });
+    rows.sort_unstable_by(|a, b| b.wait_cycles.cmp(&a.wait_cycles));
+
+    crate::println!(
+        "{:<22} {:>10} {:>10} {:>6} {:>14} {:>12} {:>10} {:>8}",
+        "lock", "acquired", "contended", "cont%", "wait-cycles", "max-wait", "avg-hold", "slept"
+    );
+    for row in &rows {
+        crate::println!(
+            "{:<22} {:>10} {:>10} {:>6} {:>14} {:>12} {:>10} {:>8}",
+            row.name,
+            row.acquisitions,
+            row.contended,
+            row.contended * 100 / row.acquisitions.max(1),
+            row.wait_cycles,
+            row.max_wait,
+            row.hold_cycles / row.acquisitions.max(1),
+            row.slept
+        );
+    }
+    Some(rows.len())
+}
+
+#[cfg(not(feature = "lockstat"))]
+pub fn dump(_reset: bool) -> Option<usize> {
+    None
+}
@@ -62,11 +62,19 @@ pub struct BootInfo {
 
 mod acpi;
 mod allocator;
+mod bench;
+mod block;
 mod fs;
+mod futex;
 mod gdt;
+mod heap;
+mod input;
 mod interrupts;
 mod io;
+mod lockstat;
 mod memory;
+mod mmap;
+mod mutex;
 mod network;
 mod nvme;
 mod pci;
@@ -77,11 +85,17 @@ mod syscall;
 mod writer;
 mod xhci;
 mod term;
+mod usb_storage;
 
 #[repr(align(16))]
 struct KernelStack([u8; 16384]);
 static mut KERNEL_STACK: KernelStack = KernelStack([0; 16384]);
 
+/// Stripe every 512-byte-sector NVMe namespace into one RAID-0 volume for the
+/// filesystem. Off by default: it changes the on-disk layout, so an image
+/// formatted on a single drive is unreadable once this is switched on.
+const STRIPE_NVME_VOLUME: bool = false;
+
 #[unsafe(no_mangle)]
 pub extern "sysv64" fn kernel_main(boot_info: &BootInfo) -> ! {
     // Initialize Global Writer (for interrupts and syscalls)
@@ -158,118 +172,64 @@ pub extern "sysv64" fn kernel_main(boot_info: &BootInfo) -> ! {
         println!("ACPI: no RSDP found in EFI Configuration Table");
     }
 
-    // Initialize PCI
-    pci::init();
-
-    // Initialize NVMe
-    if let Some(device) = pci::get_nvme_device() {
-        unsafe {
-            // Identity map the BAR0 MMIO region
-            let pml4 = memory::get_table_mut(pml4_phys);
-
-            let mut bar = (device.bar0 as u64) & 0xFFFFFFF0;
-            if device.bar1 != 0 {
-                bar |= (device.bar1 as u64) << 32;
-            }
-
-            println!("Mapping NVMe BAR at {:#x}", bar);
-
-            // Map 16KB (4 pages)
-            let flags = memory::PAGE_WRITABLE | memory::PAGE_PRESENT; // Kernel only, or User? Let's keep it minimal.
-            // Usually drivers run in kernel, so no PAGE_USER needed unless we access from user ring (which we shouldn't directly)
-            // But map_page logic uses OR for user? No, flags argument is used.
-            // memory.rs map_page signature: flags.
-
-            for i in 0..4 {
-                let offset = i * 4096;
-                let addr = bar + offset;
-                memory::map_page(pml4, addr, addr, flags, &mut allocator);
-            }
+    // Initialize PCI (ECAM via MCFG when available, port I/O otherwise)
+    unsafe {
+        let pml4 = memory::get_table_mut(pml4_phys);
+        pci::init(acpi_tables.as_ref(), pml4, &mut allocator);
+    }
 
-            nvme::init(device);
-            match fs::read_boot_sector() {
-                Ok(bs) => {
-                    let clusters = bs.total_clusters;
-                    println!(
-                        "FS: FAT volume mounted successfully. Total clusters: {}",
-                        clusters
-                    );
-                }
-                Err(_) => {
-                    println!("FS: FAT volume is not formatted.");
-                }
-            }
+    // Bind drivers to everything enumeration found. Registration order is
+    // probe order: storage first so the FS is available as early as possible.
+    for driver in [nvme::PCI_DRIVER, xhci::PCI_DRIVER, network::PCI_DRIVER] {
+        if let Err(msg) = pci::register_driver(driver) {
+            println!("PCI: cannot register {}: {}", driver.name, msg);
         }
-    } else {
-        println!("No NVMe device found!");
     }
-    if let Some(device) = pci::get_xhci_device() {
-        println!("find xHCI device\n");
-        unsafe {
-            let pml4 = memory::get_table_mut(pml4_phys);
-            let mut xhci_base_phys = (device.bar0 as u64) & 0xFFFFFFF0;
-            let bar_type = (device.bar0 >> 1) & 0x3;
-
-            if bar_type == 2 {
-                xhci_base_phys |= (device.bar1 as u64) << 32;
-            }
+    unsafe {
+        let pml4 = memory::get_table_mut(pml4_phys);
+        pci::bind_drivers(pml4, &mut allocator);
+    }
 
-            // Map xHCI MMIO (with cache disable)
-            let mmio_flags =
-                memory::PAGE_WRITABLE | memory::PAGE_PRESENT | memory::PAGE_CACHE_DISABLE;
-            for i in 0..16 {
-                let phys = xhci_base_phys + i * 4096;
-                memory::map_page(pml4, phys, phys, mmio_flags, &mut allocator);
+    // Pick the volume for the filesystem: the first 512-byte-sector NVMe
+    // namespace, or a RAID-0 set over all of them when striping is enabled.
+    let mut nvme_blockdevs = [0usize; block::MAX_STRIPE_MEMBERS];
+    let nvme_count = block::nvme_devices(fs::BLOCK_SIZE as u32, &mut nvme_blockdevs);
+    let mut fs_device = if nvme_count > 0 { Some(nvme_blockdevs[0]) } else { None };
+    if STRIPE_NVME_VOLUME && nvme_count > 1 {
+        match block::create_stripe(
+            &nvme_blockdevs[..nvme_count],
+            block::DEFAULT_STRIPE_CHUNK_BLOCKS,
+        ) {
+            Ok(id) => {
+                println!("block: striping {} NVMe namespaces as device {}", nvme_count, id);
+                fs_device = Some(id);
             }
+            Err(e) => println!("block: cannot build stripe set: {:?}", e),
+        }
+    }
+    if let Some(id) = fs_device {
+        if let Err(e) = fs::set_device(id) {
+            println!("FS: block device {} unusable: {:?}", id, e);
+        }
+    }
 
-            // Map xHCI DMA/static buffers (no cache disable)
-            let dma_flags = memory::PAGE_WRITABLE | memory::PAGE_PRESENT;
-
-            // Single-page statics
-            let single_page_statics: &[u64] = &[
-                core::ptr::addr_of!(xhci::COMMAND_RING_BUFFER) as u64,
-                core::ptr::addr_of!(xhci::DCBAA_BUFFER) as u64,
-                core::ptr::addr_of!(xhci::EVENT_RING_SEGMENT_TABLE) as u64,
-                core::ptr::addr_of!(xhci::EVENT_RING_BUFFER) as u64,
-                core::ptr::addr_of!(xhci::INPUT_CONTEXT_BUFFER) as u64,
-                core::ptr::addr_of!(xhci::USB_DATA_BUFFER) as u64,
-            ];
-            for &addr in single_page_statics {
-                memory::map_page(pml4, addr, addr, dma_flags, &mut allocator);
+    if fs::is_ready() {
+        match unsafe { fs::read_boot_sector() } {
+            Ok(bs) => {
+                let clusters = bs.total_clusters;
+                println!(
+                    "FS: FAT volume mounted successfully. Total clusters: {}",
+                    clusters
+                );
             }
-
-            // Multi-page statics
-            let multi_page_statics: &[(u64, usize)] = &[
-                (
-                    core::ptr::addr_of!(xhci::DEVICE_CONTEXT_BUFFERS) as u64,
-                    core::mem::size_of::<xhci::DeviceContextBuffer>(),
-                ),
-                (
-                    core::ptr::addr_of!(xhci::EP0_TR_BUFFERS) as u64,
-                    core::mem::size_of::<[xhci::TransferRingBuffer; 64]>(),
-                ),
-                (
-                    core::ptr::addr_of!(xhci::KEYBOARD_TR_BUFFERS) as u64,
-                    core::mem::size_of::<xhci::KeyboardTrBuffers>(),
-                ),
-            ];
-            for &(base, size) in multi_page_statics {
-                let pages = (size + 4095) / 4096;
-                for i in 0..pages as u64 {
-                    let addr = base + i * 4096;
-                    memory::map_page(pml4, addr, addr, dma_flags, &mut allocator);
-                }
+            Err(_) => {
+                println!("FS: FAT volume is not formatted.");
             }
-            xhci::init(device);
         }
     } else {
-        println!("failed to find xHCI device\n")
+        println!("No NVMe device found!");
     }
-    if let Some(device) = pci::get_ethernet_device() {
-        unsafe {
-            let pml4 = memory::get_table_mut(pml4_phys);
-            network::init(pml4, &mut allocator, device);
-        }
+    if network::is_ready() {
         unsafe { network::set_ip_address([10, 0, 2, 15]) };
         let ip = network::get_ip_address();
         let mac = unsafe { network::get_mac_address() };
@@ -308,27 +268,36 @@ pub extern "sysv64" fn kernel_main(boot_info: &BootInfo) -> ! {
         allocator::init(heap_start as usize, (heap_pages * 4096) as usize);
     }
 
+    // From here on page tables are built through `memory` (address spaces,
+    // kernel stacks, demand paging, copy-on-write), which owns the frame
+    // allocator.
+    memory::install_kernel_space(pml4_phys, allocator);
+
     unsafe {
         scheduler::init();
     }
     if let Some(tables) = acpi_tables {
         if let Some(madt_ptr) = tables.madt {
             let madt = unsafe { acpi::parse_madt(madt_ptr) };
-            unsafe {
-                let pml4 = memory::get_table_mut(pml4_phys);
+            memory::with_address_space(pml4_phys, |pml4, frames| unsafe {
                 let flags = memory::PAGE_WRITABLE | memory::PAGE_PRESENT | memory::PAGE_CACHE_DISABLE;
                 let lapic_phys = madt.local_apic_address;
                 println!("Mapping Local APIC MMIO at {:#x}", lapic_phys);
-                memory::map_page(pml4, lapic_phys, lapic_phys, flags, &mut allocator);
+                memory::map_page(pml4, lapic_phys, lapic_phys, flags, frames);
                 if madt.io_apic_address != 0 {
                     let io_apic_phys = madt.io_apic_address as u64;
                     println!("Mapping I/O APIC MMIO at {:#x}", io_apic_phys);
-                    memory::map_page(pml4, io_apic_phys, io_apic_phys, flags, &mut allocator);
+                    memory::map_page(pml4, io_apic_phys, io_apic_phys, flags, frames);
                 }
-            }
+            });
             let bsp_id = processor::current_apic_id();
             unsafe { processor::start_all_aps(&madt, bsp_id) };
             println!("Online APs: {}", processor::online_ap_count());
+            memory::init_tlb_shootdown();
+
+            // The LAPIC is mapped now, so MSI EOIs are safe: let interrupter 0
+            // drive the xHCI event ring instead of syscall polling.
+            unsafe { xhci::enable_interrupts() };
         } else {
             println!("ACPI: MADT table not found. Cannot start APs.");
         }
@@ -336,6 +305,10 @@ pub extern "sysv64" fn kernel_main(boot_info: &BootInfo) -> ! {
         println!("ACPI: tables not initialized. Cannot start APs.");
     }
 
+    // USB ports were set resetting during PCI binding; the rest of
+    // enumeration (and hot-plug) runs in a kernel task from here on.
+    xhci::spawn_enumeration_task();
+
     term::init();
 
     // ── User heap ─────────────────────────────────────────────────────────
@@ -355,37 +328,47 @@ pub extern "sysv64" fn kernel_main(boot_info: &BootInfo) -> ! {
     // base avoids any collision regardless of where load_kef places things.
     const USER_HEAP_VIRT_BASE: u64 = 0x0000_7000_0000_0000;
     let user_heap_pages = 128; // 512 KiB
-    let user_heap_phys_start = allocator
-        .allocate_frame()
-        .expect("Failed to allocate user heap start");
-    let mut user_current_addr = user_heap_phys_start;
-
-    for _ in 1..user_heap_pages {
-        let next_addr = allocator
+    memory::with_address_space(pml4_phys, |pml4, frames| {
+        let user_heap_phys_start = frames
             .allocate_frame()
-            .expect("Failed to allocate user heap");
-        if next_addr != user_current_addr + 4096 {
-            panic!("User heap memory allocation failed: memory not contiguous!");
+            .expect("Failed to allocate user heap start");
+        let mut user_current_addr = user_heap_phys_start;
+
+        for _ in 1..user_heap_pages {
+            let next_addr = frames
+                .allocate_frame()
+                .expect("Failed to allocate user heap");
+            if next_addr != user_current_addr + 4096 {
+                panic!("User heap memory allocation failed: memory not contiguous!");
+            }
+            user_current_addr = next_addr;
         }
-        user_current_addr = next_addr;
-    }
 
-    unsafe {
-        let pml4 = memory::get_table_mut(pml4_phys);
-        let flags = memory::PAGE_WRITABLE | memory::PAGE_USER | memory::PAGE_NO_EXECUTE;
-        for i in 0..user_heap_pages as u64 {
-            let phys = user_heap_phys_start + i * 4096;
-            let virt = USER_HEAP_VIRT_BASE + i * 4096;
-            memory::map_page(pml4, virt, phys, flags, &mut allocator);
+        unsafe {
+            let flags = memory::PAGE_WRITABLE | memory::PAGE_USER | memory::PAGE_NO_EXECUTE;
+            for i in 0..user_heap_pages as u64 {
+                let phys = user_heap_phys_start + i * 4096;
+                let virt = USER_HEAP_VIRT_BASE + i * 4096;
+                memory::map_page(pml4, virt, phys, flags, frames);
+            }
+            // The input event ring is read by user tasks directly, so expose its
+            // page read-only next to the heap.
+            memory::map_page(
+                pml4,
+                input::INPUT_RING_USER_VIRT,
+                input::ring_page(),
+                memory::PAGE_USER | memory::PAGE_NO_EXECUTE,
+                frames,
+            );
+            allocator::init_user_heap(USER_HEAP_VIRT_BASE as usize, (user_heap_pages * 4096) as usize);
+            println!(
+                "User heap mapped at {:#x}-{:#x} (phys {:#x})",
+                USER_HEAP_VIRT_BASE,
+                USER_HEAP_VIRT_BASE + (user_heap_pages * 4096) as u64,
+                user_heap_phys_start,
+            );
         }
-        allocator::init_user_heap(USER_HEAP_VIRT_BASE as usize, (user_heap_pages * 4096) as usize);
-        println!(
-            "User heap mapped at {:#x}-{:#x} (phys {:#x})",
-            USER_HEAP_VIRT_BASE,
-            USER_HEAP_VIRT_BASE + (user_heap_pages * 4096) as u64,
-            user_heap_phys_start,
-        );
-    }
+    });
 
     // Initialize FAT filesystem & load init.kef
     let mut fs_ready = false;
@@ -415,38 +398,11 @@ pub extern "sysv64" fn kernel_main(boot_info: &BootInfo) -> ! {
         }
     }
 
-    let mut loaded = false;
-    if fs_ready {
-        match fs::read_file("init.kef") {
-            Ok(file_data) => {
-                let pml4 = unsafe { memory::get_table_mut(pml4_phys) };
-                match kef::load_kef(&file_data, &mut allocator, pml4) {
-                    Ok((entry_point, user_rsp)) => {
-                        println!("Loader: Successfully loaded init.kef. Entry={:#x}, RSP={:#x}", entry_point, user_rsp);
-                        scheduler::add_new_user_task(entry_point, user_rsp, 16384);
-                        loaded = true;
-                    }
-                    Err(e) => {
-                        println!("Loader: Failed to load init.kef: {}", e);
-                    }
-                }
-            }
-            Err(e) => {
-                println!("FS: Failed to read init.kef: {:?}", e);
-            }
-        }
-    }
-
-    if !loaded {
-        panic!("Failed to load user-mode init process. System halted.");
-    }
-
-    unsafe {
+    memory::with_address_space(pml4_phys, |pml4, frames| unsafe {
         let stack_base = core::ptr::addr_of!(KERNEL_STACK) as u64;
         let stack_top = stack_base + 16384;
 
         // Map the kernel stack pages
-        let pml4 = memory::get_table_mut(pml4_phys);
         let flags = memory::PAGE_WRITABLE | memory::PAGE_PRESENT;
         for i in 0..(16384 / 4096) as u64 {
             memory::map_page(
@@ -454,13 +410,47 @@ pub extern "sysv64" fn kernel_main(boot_info: &BootInfo) -> ! {
                 stack_base + i * 4096,
                 stack_base + i * 4096,
                 flags,
-                &mut allocator,
+                frames,
             );
         }
 
         println!("Kernel stack base={:#x} top={:#x}", stack_base, stack_top);
         println!("TSS rsp0={:#x}", gdt::get_tss_stack());
+    });
+
+    // bench.cfg on the volume selects benchmark mode: run the suite, print
+    // the results and power off instead of starting init.
+    if fs_ready {
+        if let Some(config) = bench::config() {
+            bench::run(&config);
+        }
+    }
+
+    let mut init = None;
+    if fs_ready {
+        let space = memory::new_address_space().expect("OOM allocating init address space");
+        match kef::load_kef_file("init.kef", space, 0) {
+            Ok((entry_point, user_rsp)) => {
+                println!("Loader: Successfully loaded init.kef. Entry={:#x}, RSP={:#x}", entry_point, user_rsp);
+                init = Some((space, entry_point, user_rsp));
+            }
+            Err(e) => {
+                println!("Loader: Failed to load init.kef: {}", e);
+            }
+        }
+    }
 
+    let Some((space, entry_point, user_rsp)) = init else {
+        panic!("Failed to load user-mode init process. System halted.");
+    };
+    scheduler::add_user_task(
+        space,
+        &scheduler::UserContext::new(entry_point, user_rsp),
+        scheduler::KERNEL_STACK_SIZE,
+    )
+    .expect("OOM allocating init kernel stack");
+
+    unsafe {
         println!("Starting scheduler loop on BSP...");
         core::arch::asm!("sti");
         loop {
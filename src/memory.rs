@@ -1,6 +1,10 @@
 use crate::BootInfo;
+use crate::interrupts::InterruptSpinlock;
 use crate::uefi::{EFI_CONVENTIONAL_MEMORY, EFI_MEMORY_DESCRIPTOR};
+use alloc::collections::BTreeMap;
+use alloc::vec::Vec;
 use core::arch::asm;
+use core::sync::atomic::{AtomicBool, AtomicU64, AtomicU8, Ordering};
 
 pub const PAGE_SIZE: u64 = 4096;
 
@@ -8,8 +12,21 @@ pub const PAGE_PRESENT: u64 = 1 << 0;
 pub const PAGE_WRITABLE: u64 = 1 << 1;
 pub const PAGE_USER: u64 = 1 << 2;
 pub const PAGE_CACHE_DISABLE: u64 = 1 << 4;
+/// Software-defined (AVL) bit: a read-only mapping of a frame shared by
+/// `fork`, to be copied on the first write.
+pub const PAGE_COW: u64 = 1 << 9;
+/// Software-defined (AVL) bit: the frame belongs to the user mappings that
+/// map it, and goes back to the allocator when the last of them is unmapped.
+/// `fork` shares it copy-on-write, counting the extra entries in
+/// `FrameAllocator::share_frame`.
+pub const PAGE_OWNED: u64 = 1 << 10;
 pub const PAGE_NO_EXECUTE: u64 = 1 << 63;
 
+/// Physical address bits of a page table entry.
+pub const PAGE_ADDR_MASK: u64 = 0x000F_FFFF_FFFF_F000;
+
+const CR0_WP: u64 = 1 << 16;
+
 /// A simple physical frame allocator using UEFI memory map.
 pub struct FrameAllocator {
     memory_map: *const u8,
@@ -19,8 +36,17 @@ pub struct FrameAllocator {
 
     current_descriptor_index: usize,
     current_page_offset: u64,
+    /// Frames handed back by `free_frame`, linked through their first u64
+    /// (0 ends the list). Reused before the memory map is walked further.
+    free_list: u64,
+    /// PAGE_OWNED frames mapped by more than one entry since a `fork`, and
+    /// how many entries besides one.
+    shared: BTreeMap<u64, u32>,
 }
 
+// The memory map it walks is never freed or written after boot.
+unsafe impl Send for FrameAllocator {}
+
 impl FrameAllocator {
     /// # Safety
     /// BootInfo memory map must be valid.
@@ -32,10 +58,20 @@ impl FrameAllocator {
             descriptor_version: boot_info.descriptor_version,
             current_descriptor_index: 0,
             current_page_offset: 0,
+            free_list: 0,
+            shared: BTreeMap::new(),
         }
     }
 
+    /// Hand out a frame. Its contents are undefined: reused frames keep
+    /// whatever was in them.
     pub fn allocate_frame(&mut self) -> Option<u64> {
+        if self.free_list != 0 {
+            let frame = self.free_list;
+            self.free_list = unsafe { *(frame as *const u64) };
+            return Some(frame);
+        }
+
         let num_descriptors = self.memory_map_size / self.descriptor_size;
 
         while self.current_descriptor_index < num_descriptors {
@@ -61,6 +97,34 @@ impl FrameAllocator {
         }
         None
     }
+
+    /// Return a frame nothing maps any more.
+    pub fn free_frame(&mut self, frame: u64) {
+        unsafe { *(frame as *mut u64) = self.free_list };
+        self.free_list = frame;
+    }
+
+    /// Count one more page table entry mapping PAGE_OWNED `frame`.
+    pub fn share_frame(&mut self, frame: u64) {
+        *self.shared.entry(frame).or_insert(0) += 1;
+    }
+
+    /// Whether PAGE_OWNED `frame` is mapped by one entry only.
+    pub fn frame_exclusive(&self, frame: u64) -> bool {
+        !self.shared.contains_key(&frame)
+    }
+
+    /// One entry mapping PAGE_OWNED `frame` is gone: free the frame if it
+    /// was the last.
+    pub fn release_frame(&mut self, frame: u64) {
+        match self.shared.get_mut(&frame) {
+            Some(1) => {
+                self.shared.remove(&frame);
+            }
+            Some(count) => *count -= 1,
+            None => self.free_frame(frame),
+        }
+    }
 }
 
 pub struct PageTable {
@@ -80,6 +144,32 @@ pub unsafe fn get_table_mut(phys_addr: u64) -> &'static mut PageTable {
     unsafe { &mut *(phys_addr as *mut PageTable) }
 }
 
+/// Returns the page table entry for `virt_addr` if every level above it is
+/// present. The entry itself may still be non-present.
+pub unsafe fn lookup_page(pml4: &mut PageTable, virt_addr: u64) -> Option<u64> {
+    unsafe { page_entry_mut(pml4, virt_addr) }.map(|entry| *entry)
+}
+
+/// Like `lookup_page`, but returns the entry itself for in-place updates.
+/// The caller must invalidate the TLB entry after changing it.
+pub unsafe fn page_entry_mut(pml4: &mut PageTable, virt_addr: u64) -> Option<&'static mut u64> {
+    let indices = [
+        ((virt_addr >> 39) & 0x1FF) as usize,
+        ((virt_addr >> 30) & 0x1FF) as usize,
+        ((virt_addr >> 21) & 0x1FF) as usize,
+    ];
+    let mut table_phys = pml4 as *mut PageTable as u64;
+    for idx in indices {
+        let entry = unsafe { get_table_mut(table_phys) }.entries[idx];
+        if entry & PAGE_PRESENT == 0 {
+            return None;
+        }
+        table_phys = entry & PAGE_ADDR_MASK;
+    }
+    let table = unsafe { get_table_mut(table_phys) };
+    Some(&mut table.entries[((virt_addr >> 12) & 0x1FF) as usize])
+}
+
 /// Maps a virtual address to a physical address.
 pub unsafe fn map_page(
     pml4: &mut PageTable,
@@ -173,6 +263,479 @@ pub unsafe fn init_paging(boot_info: &BootInfo, allocator: &mut FrameAllocator)
 
     // 4. Load CR3
     unsafe { asm!("mov cr3, {}", in(reg) pml4_phys) };
+    unsafe { init_cpu() };
 
     pml4_phys
 }
+
+/// Per-CPU paging setup, run on the BSP by `init_paging` and on each AP at
+/// startup: make supervisor writes honour read-only pages, so kernel copies
+/// into user buffers take copy-on-write faults too.
+pub unsafe fn init_cpu() {
+    unsafe {
+        let mut cr0: u64;
+        asm!("mov {}, cr0", out(reg) cr0, options(nomem, nostack, preserves_flags));
+        cr0 |= CR0_WP;
+        asm!("mov cr0, {}", in(reg) cr0, options(nostack, preserves_flags));
+    }
+}
+
+/// The kernel page tables and the frame allocator, handed over by
+/// `kernel_main` once boot-time mapping is finished so that code running
+/// later (the page-fault path) can map pages.
+struct KernelSpace {
+    pml4_phys: u64,
+    allocator: FrameAllocator,
+}
+
+static KERNEL_SPACE: InterruptSpinlock<Option<KernelSpace>> = InterruptSpinlock::named("KERNEL_SPACE", None);
+
+pub fn install_kernel_space(pml4_phys: u64, mut allocator: FrameAllocator) {
+    // Address spaces copy the kernel's PML4 entries when they are created,
+    // so the kernel stack slot needs its table before the first one is.
+    let pml4 = unsafe { get_table_mut(pml4_phys) };
+    let slot = ((KERNEL_STACK_AREA >> 39) & 0x1FF) as usize;
+    if pml4.entries[slot] & PAGE_PRESENT == 0 {
+        let frame = allocator.allocate_frame().expect("OOM allocating kernel stack PDPT");
+        unsafe { get_table_mut(frame) }.zero();
+        pml4.entries[slot] = frame | PAGE_PRESENT | PAGE_WRITABLE;
+    }
+    *KERNEL_SPACE.lock() = Some(KernelSpace { pml4_phys, allocator });
+}
+
+/// Run `f` with the page tables rooted at `pml4_phys` and the frame
+/// allocator. Returns None before `install_kernel_space`.
+pub fn with_address_space<R>(
+    pml4_phys: u64,
+    f: impl FnOnce(&mut PageTable, &mut FrameAllocator) -> R,
+) -> Option<R> {
+    let mut guard = KERNEL_SPACE.lock();
+    let space = guard.as_mut()?;
+    let pml4 = unsafe { get_table_mut(pml4_phys) };
+    Some(f(pml4, &mut space.allocator))
+}
+
+// Address spaces
+//
+// Every address space shares the kernel's page tables for everything except
+// the KEF image area, whose PML4 slots are private: identity-mapped memory,
+// the user heap and the input ring look the same from every space. A new
+// space starts with the kernel's entries for the shared slots, so tables
+// below them are shared too and later kernel mappings inside existing slots
+// show up everywhere.
+
+/// PML4 slots private to each address space: 0x6000_0000_0000 up to the
+/// user heap at 0x7000_0000_0000.
+const PRIVATE_PML4_SLOTS: core::ops::Range<usize> = 192..224;
+
+pub fn current_pml4_phys() -> u64 {
+    let cr3: u64;
+    unsafe { asm!("mov {}, cr3", out(reg) cr3, options(nomem, nostack, preserves_flags)) };
+    cr3 & PAGE_ADDR_MASK
+}
+
+/// Load `pml4_phys` into CR3 unless it is already active.
+pub unsafe fn switch_address_space(pml4_phys: u64) {
+    if pml4_phys != current_pml4_phys() {
+        // Published first: a shootdown that misses it happened before this
+        // CPU walks the new tables.
+        LOADED_SPACE[crate::scheduler::current_cpu()].store(pml4_phys, Ordering::SeqCst);
+        unsafe { asm!("mov cr3, {}", in(reg) pml4_phys, options(nostack, preserves_flags)) };
+    }
+}
+
+fn new_space_locked(kernel_pml4_phys: u64, allocator: &mut FrameAllocator) -> Option<u64> {
+    let pml4_phys = allocator.allocate_frame()?;
+    let pml4 = unsafe { get_table_mut(pml4_phys) };
+    let kernel = unsafe { get_table_mut(kernel_pml4_phys) };
+    for slot in 0..512 {
+        pml4.entries[slot] = if PRIVATE_PML4_SLOTS.contains(&slot) { 0 } else { kernel.entries[slot] };
+    }
+    Some(pml4_phys)
+}
+
+/// Create an address space with nothing in its private slots. Returns the
+/// physical address of its PML4.
+pub fn new_address_space() -> Option<u64> {
+    let mut guard = KERNEL_SPACE.lock();
+    let space = guard.as_mut()?;
+    new_space_locked(space.pml4_phys, &mut space.allocator)
+}
+
+/// Copy one page table level of a private slot. Leaf entries are shared:
+/// writable ones become read-only + PAGE_COW in both copies, and each
+/// PAGE_OWNED frame gains a reference, so the frame is freed only when the
+/// last space that maps it unmaps it.
+unsafe fn fork_table(src_phys: u64, level: usize, allocator: &mut FrameAllocator) -> Option<u64> {
+    let dst_phys = allocator.allocate_frame()?;
+    let dst = unsafe { get_table_mut(dst_phys) };
+    let src = unsafe { get_table_mut(src_phys) };
+    for i in 0..512 {
+        let entry = src.entries[i];
+        dst.entries[i] = if entry & PAGE_PRESENT == 0 {
+            0
+        } else if level > 1 {
+            let child = unsafe { fork_table(entry & PAGE_ADDR_MASK, level - 1, allocator) }?;
+            child | (entry & !PAGE_ADDR_MASK)
+        } else {
+            if entry & PAGE_WRITABLE != 0 {
+                src.entries[i] = (entry & !PAGE_WRITABLE) | PAGE_COW;
+            }
+            if entry & PAGE_OWNED != 0 {
+                allocator.share_frame(entry & PAGE_ADDR_MASK);
+            }
+            src.entries[i]
+        };
+    }
+    Some(dst_phys)
+}
+
+/// Duplicate an address space for `fork`. Only page tables are copied;
+/// every private page is shared, writable ones copy-on-write. Every CPU
+/// with `parent` loaded is flushed before this returns, so its now
+/// read-only pages fault on the next write wherever the parent's threads
+/// run. Must be called with no spinlock held (see `flush_tlb_space`).
+pub fn fork_address_space(parent: u64) -> Option<u64> {
+    let mut guard = KERNEL_SPACE.lock();
+    let space = guard.as_mut()?;
+    let child = new_space_locked(space.pml4_phys, &mut space.allocator)?;
+    let src = unsafe { get_table_mut(parent) };
+    let dst = unsafe { get_table_mut(child) };
+    for slot in PRIVATE_PML4_SLOTS {
+        let entry = src.entries[slot];
+        if entry & PAGE_PRESENT != 0 {
+            let table = unsafe { fork_table(entry & PAGE_ADDR_MASK, 3, &mut space.allocator) }?;
+            dst.entries[slot] = table | (entry & !PAGE_ADDR_MASK);
+        }
+    }
+    drop(guard);
+    flush_tlb_space(parent);
+
+    let mut stacks = USER_STACKS.lock();
+    let inherited: Vec<UserStack> = stacks.iter().filter(|stack| stack.space == parent).copied().collect();
+    for stack in inherited {
+        stacks.push(UserStack { space: child, ..stack });
+    }
+    Some(child)
+}
+
+/// Map a zeroed frame at `virt` unless something is mapped there already.
+pub fn map_zeroed_page(pml4: &mut PageTable, virt: u64, flags: u64, allocator: &mut FrameAllocator) -> bool {
+    if unsafe { lookup_page(pml4, virt) }.is_some_and(|entry| entry & PAGE_PRESENT != 0) {
+        return true;
+    }
+    let Some(frame) = allocator.allocate_frame() else {
+        return false;
+    };
+    unsafe {
+        core::ptr::write_bytes(frame as *mut u8, 0, PAGE_SIZE as usize);
+        map_page(pml4, virt, frame, flags, allocator);
+    }
+    true
+}
+
+/// Resolve a write fault on a present page of the active address space if
+/// it is copy-on-write: give this space a private, writable copy of the
+/// frame, or make the frame writable if this entry is the last one mapping
+/// it. Returns false if the fault is a real protection violation.
+///
+/// Other threads of the space may still read the old frame through their
+/// TLB, so every CPU with the space loaded is flushed after a copy.
+pub fn handle_cow_fault(addr: u64) -> bool {
+    let space = current_pml4_phys();
+    let copied = with_address_space(space, |pml4, allocator| {
+        let Some(entry) = (unsafe { page_entry_mut(pml4, addr) }) else {
+            return None;
+        };
+        if *entry & PAGE_PRESENT == 0 {
+            return None;
+        }
+        if *entry & PAGE_WRITABLE != 0 {
+            // Another thread of this space copied it first.
+            return Some(false);
+        }
+        if *entry & PAGE_COW == 0 {
+            return None;
+        }
+        let old = *entry & PAGE_ADDR_MASK;
+        let owned = *entry & PAGE_OWNED != 0;
+        if owned && allocator.frame_exclusive(old) {
+            // Every other space has copied or unmapped it; gaining write
+            // access needs no flush.
+            *entry = (*entry & !PAGE_COW) | PAGE_WRITABLE;
+            return Some(false);
+        }
+        let frame = allocator.allocate_frame()?;
+        unsafe {
+            core::ptr::copy_nonoverlapping(old as *const u8, frame as *mut u8, PAGE_SIZE as usize);
+        }
+        *entry = frame | (*entry & !PAGE_ADDR_MASK & !PAGE_COW) | PAGE_WRITABLE | PAGE_OWNED;
+        if owned {
+            // Still mapped elsewhere, so this only drops a reference.
+            allocator.release_frame(old);
+        }
+        Some(true)
+    })
+    .flatten();
+    match copied {
+        None => false,
+        Some(false) => true,
+        Some(true) => {
+            flush_tlb_space(space);
+            true
+        }
+    }
+}
+
+// TLB shootdown
+//
+// A CPU keeps the translations of the space it has loaded until it reloads
+// CR3, even while other CPUs change that space's page tables. Whoever takes
+// access away from a page (makes it read-only, or unmaps it to free its
+// frame) must flush every CPU that may still hold the old entry before
+// relying on the change: `flush_tlb_space` flushes this CPU and sends each
+// other CPU with the space loaded an IPI, then waits until all have
+// reloaded CR3.
+//
+// The caller must hold no spinlock: a target spinning on it with
+// interrupts off would never take the IPI. Shootdowns run one at a time,
+// and a CPU waiting to start one answers the one in progress meanwhile.
+
+/// CR3 each CPU last loaded through `switch_address_space`; 0 until then.
+static LOADED_SPACE: [AtomicU64; crate::processor::MAX_AP_COUNT + 1] =
+    [const { AtomicU64::new(0) }; crate::processor::MAX_AP_COUNT + 1];
+/// IPI vector of `answer_shootdown`; 0 until `init_tlb_shootdown`.
+static SHOOTDOWN_VECTOR: AtomicU8 = AtomicU8::new(0);
+static SHOOTDOWN_BUSY: AtomicBool = AtomicBool::new(false);
+/// CPUs that still have to flush for the shootdown in progress.
+static SHOOTDOWN_PENDING: AtomicU64 = AtomicU64::new(0);
+
+/// Claim the shootdown IPI vector. Call once the Local APIC is mapped;
+/// before that, and on a single CPU, only the local TLB is flushed.
+pub fn init_tlb_shootdown() {
+    if let Some(vector) = unsafe { crate::interrupts::register_msi_handler(answer_shootdown) } {
+        SHOOTDOWN_VECTOR.store(vector, Ordering::Release);
+    }
+}
+
+fn reload_cr3() {
+    unsafe { asm!("mov {0}, cr3", "mov cr3, {0}", out(reg) _, options(nostack, preserves_flags)) };
+}
+
+/// Flush this CPU if the shootdown in progress asks it to.
+fn answer_shootdown() {
+    let me = 1u64 << unsafe { crate::processor::cpu_index_by_apic() };
+    if SHOOTDOWN_PENDING.load(Ordering::Acquire) & me != 0 {
+        reload_cr3();
+        SHOOTDOWN_PENDING.fetch_and(!me, Ordering::Release);
+    }
+}
+
+/// Flush the TLB of every CPU that has `space` loaded, or may have (an AP
+/// that never switched spaces), and wait until they all have.
+pub fn flush_tlb_space(space: u64) {
+    if current_pml4_phys() == space {
+        reload_cr3();
+    }
+    let vector = SHOOTDOWN_VECTOR.load(Ordering::Acquire);
+    if vector == 0 {
+        return;
+    }
+    let me = unsafe { crate::processor::cpu_index_by_apic() };
+    let others = crate::scheduler::online_cpus() & !(1 << me);
+    if others == 0 {
+        return;
+    }
+
+    while SHOOTDOWN_BUSY
+        .compare_exchange_weak(false, true, Ordering::Acquire, Ordering::Relaxed)
+        .is_err()
+    {
+        answer_shootdown();
+        core::hint::spin_loop();
+    }
+    // Orders the caller's page table writes before the LOADED_SPACE reads.
+    core::sync::atomic::fence(Ordering::SeqCst);
+    let targets = (0..LOADED_SPACE.len())
+        .filter(|&cpu| others & (1 << cpu) != 0)
+        .filter(|&cpu| {
+            let loaded = LOADED_SPACE[cpu].load(Ordering::SeqCst);
+            loaded == 0 || loaded == space
+        })
+        .fold(0u64, |mask, cpu| mask | 1 << cpu);
+    if targets != 0 {
+        SHOOTDOWN_PENDING.store(targets, Ordering::Release);
+        let lapic_base = unsafe { crate::processor::lapic_base_from_msr() };
+        for cpu in (0..LOADED_SPACE.len()).filter(|&cpu| targets & (1 << cpu) != 0) {
+            let apic_id = unsafe { (*core::ptr::addr_of!(crate::processor::PERCPU_DATA_SLOTS))[cpu].apic_id };
+            unsafe { crate::processor::send_ipi(lapic_base, apic_id, vector) };
+        }
+        while SHOOTDOWN_PENDING.load(Ordering::Acquire) != 0 {
+            core::hint::spin_loop();
+        }
+    }
+    SHOOTDOWN_BUSY.store(false, Ordering::Release);
+}
+
+// Stacks
+//
+// Every stack has an unmapped guard page below it, so running off the end
+// faults instead of silently overwriting whatever lies below.
+//
+// Kernel stacks are mapped in full in their own shared PML4 slot. User
+// stacks are reserved in the private area at their maximum size but only
+// their top page is mapped up front; the page-fault handler maps the rest,
+// zeroed, as the stack grows into it.
+
+/// Kernel task and AP stacks, one PML4 slot shared by every address space.
+const KERNEL_STACK_AREA: u64 = 0x0000_7F00_0000_0000;
+static NEXT_KERNEL_STACK: AtomicU64 = AtomicU64::new(KERNEL_STACK_AREA);
+
+/// Private ranges (images, stacks, mappings) are handed out from the start of
+/// the private area, below `USER_FIXED_AREA`, in `USER_SPAN_ALIGN` granules.
+/// A span is shared by every address space, so an address names the same
+/// thing in every space that has it; it is only reused once no space maps
+/// anything in it.
+pub const USER_AREA_BASE: u64 = 0x0000_6000_0000_0000;
+const USER_SPAN_ALIGN: u64 = 0x10_0000;
+
+struct UserSpans {
+    /// Start of the part of the area never handed out.
+    next: u64,
+    /// Spans given back, (base, size), sorted by base and coalesced.
+    free: Vec<(u64, u64)>,
+}
+
+static USER_SPANS: InterruptSpinlock<UserSpans> =
+    InterruptSpinlock::named("USER_SPANS", UserSpans { next: USER_AREA_BASE, free: Vec::new() });
+
+/// Pages of a user stack mapped before its first fault.
+const USER_STACK_COMMIT_PAGES: u64 = 1;
+const USER_STACK_FLAGS: u64 = PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER | PAGE_NO_EXECUTE | PAGE_OWNED;
+
+pub fn page_round_up(size: u64) -> u64 {
+    (size + PAGE_SIZE - 1) & !(PAGE_SIZE - 1)
+}
+
+/// Map a kernel stack of `size` bytes (rounded up to pages) below an
+/// unmapped guard page. Returns the stack top.
+pub fn alloc_kernel_stack(size: usize) -> Option<u64> {
+    let size = page_round_up(size as u64).max(PAGE_SIZE);
+    let bottom = NEXT_KERNEL_STACK.fetch_add(size + PAGE_SIZE, Ordering::Relaxed) + PAGE_SIZE;
+    with_address_space(current_pml4_phys(), |pml4, allocator| {
+        for page in (bottom..bottom + size).step_by(PAGE_SIZE as usize) {
+            let frame = allocator.allocate_frame()?;
+            unsafe { map_page(pml4, page, frame, PAGE_PRESENT | PAGE_WRITABLE | PAGE_NO_EXECUTE, allocator) };
+        }
+        Some(bottom + size)
+    })?
+}
+
+fn user_span_size(size: u64) -> Option<u64> {
+    Some((size.checked_add(USER_SPAN_ALIGN - 1)? & !(USER_SPAN_ALIGN - 1)).max(USER_SPAN_ALIGN))
+}
+
+/// Reserve `size` bytes of the private user area, the lowest free span that
+/// fits first. Returns the base, or None once the area is used up.
+pub fn reserve_user_span(size: u64) -> Option<u64> {
+    let span = user_span_size(size)?;
+    let mut spans = USER_SPANS.lock();
+    if let Some(i) = spans.free.iter().position(|&(_, free)| free >= span) {
+        let (base, free) = spans.free[i];
+        if free == span {
+            spans.free.remove(i);
+        } else {
+            spans.free[i] = (base + span, free - span);
+        }
+        return Some(base);
+    }
+    let base = spans.next;
+    if span > USER_FIXED_AREA.start - base {
+        return None;
+    }
+    spans.next = base + span;
+    Some(base)
+}
+
+/// Give back a span `reserve_user_span(size)` returned. The caller makes
+/// sure no address space maps anything in it any more.
+pub fn release_user_span(base: u64, size: u64) {
+    let Some(span) = user_span_size(size) else {
+        return;
+    };
+    let mut spans = USER_SPANS.lock();
+    let UserSpans { next, free } = &mut *spans;
+    let mut i = free.partition_point(|&(at, _)| at < base);
+    free.insert(i, (base, span));
+    if i + 1 < free.len() && base + span == free[i + 1].0 {
+        free[i].1 += free.remove(i + 1).1;
+    }
+    if i > 0 && free[i - 1].0 + free[i - 1].1 == base {
+        free[i - 1].1 += free.remove(i).1;
+        i -= 1;
+    }
+    // The last free span may end where the untouched part begins.
+    if i + 1 == free.len() && free[i].0 + free[i].1 == *next {
+        *next = free[i].0;
+        free.pop();
+    }
+}
+
+/// The top half of the private area, left to programs that place their own
+/// mappings. `reserve_user_span` hands out addresses below it.
+pub const USER_FIXED_AREA: core::ops::Range<u64> = 0x0000_6800_0000_0000..0x0000_7000_0000_0000;
+
+/// A user stack that grows on demand: pages in [limit, top) are mapped on
+/// first touch. The page below `limit` is never mapped.
+#[derive(Clone, Copy)]
+struct UserStack {
+    space: u64,
+    limit: u64,
+    top: u64,
+}
+
+static USER_STACKS: InterruptSpinlock<Vec<UserStack>> = InterruptSpinlock::named("USER_STACKS", Vec::new());
+
+/// Set up a growable stack of up to `size` bytes ending at `top` in `space`
+/// and map its top page. The caller keeps the page below `top - size` free.
+/// Returns the initial stack pointer.
+pub fn map_user_stack(space: u64, top: u64, size: u64) -> Option<u64> {
+    let size = page_round_up(size).max(PAGE_SIZE);
+    let commit = (USER_STACK_COMMIT_PAGES * PAGE_SIZE).min(size);
+    let mapped = with_address_space(space, |pml4, allocator| {
+        (top - commit..top)
+            .step_by(PAGE_SIZE as usize)
+            .all(|page| map_zeroed_page(pml4, page, USER_STACK_FLAGS, allocator))
+    })?;
+    if !mapped {
+        return None;
+    }
+    USER_STACKS.lock().push(UserStack { space, limit: top - size, top });
+    Some(top)
+}
+
+/// Reserve a guarded, growable user stack of up to `size` bytes in `space`.
+/// Returns the initial stack pointer.
+pub fn alloc_user_stack(space: u64, size: u64) -> Option<u64> {
+    let size = page_round_up(size).max(PAGE_SIZE);
+    // Guard page, stack; the next span starts with a gap of its own.
+    let base = reserve_user_span(size + 2 * PAGE_SIZE)?;
+    map_user_stack(space, base + PAGE_SIZE + size, size)
+}
+
+/// Resolve a not-present fault at `addr` if it lies in a growable stack of
+/// the active address space by mapping a zeroed page there.
+pub fn handle_stack_fault(addr: u64) -> bool {
+    let space = current_pml4_phys();
+    let hit = USER_STACKS
+        .lock()
+        .iter()
+        .any(|stack| stack.space == space && addr >= stack.limit && addr < stack.top);
+    if !hit {
+        return false;
+    }
+    with_address_space(space, |pml4, allocator| {
+        map_zeroed_page(pml4, addr & !(PAGE_SIZE - 1), USER_STACK_FLAGS, allocator)
+    })
+    .unwrap_or(false)
+}
@@ -0,0 +1,463 @@
+// ============================================================================
+// User memory mappings
+// ============================================================================
+//
+// `mmap` gives a task anonymous memory or a view of a file in its private
+// area. Nothing is mapped up front: a mapping is recorded here and its pages
+// are filled by the page-fault handler on first touch, anonymous ones with a
+// zeroed frame and file ones from the page cache.
+//
+// The page cache keeps one frame per file page that has been read, shared by
+// every mapping of that file. File pages are mapped read-only; a writable
+// mapping marks them PAGE_COW, so the first write gives the task a private
+// copy and the file and the cache never change. Writes are never written
+// back.
+//
+// Frames a mapping owns (zero-filled pages and private copies) carry
+// PAGE_OWNED and go back to the frame allocator on the `munmap` of the last
+// space that maps them (a fork shares them copy-on-write), but only
+// after every CPU running the space has flushed its TLB: until then a
+// thread on another CPU may still reach the frame through a stale entry.
+
+use crate::fs::{self, FileHandle, OpenFile};
+use crate::interrupts::InterruptSpinlock;
+use crate::memory::{
+    self, PAGE_ADDR_MASK, PAGE_COW, PAGE_NO_EXECUTE, PAGE_OWNED, PAGE_PRESENT, PAGE_SIZE, PAGE_USER, PAGE_WRITABLE,
+    USER_FIXED_AREA, map_page, page_entry_mut,
+};
+use alloc::string::String;
+use alloc::vec::Vec;
+
+pub const PROT_NONE: u64 = 0;
+pub const PROT_READ: u64 = 1 << 0;
+pub const PROT_WRITE: u64 = 1 << 1;
+pub const PROT_EXEC: u64 = 1 << 2;
+const PROT_MASK: u64 = PROT_READ | PROT_WRITE | PROT_EXEC;
+
+/// Place the mapping exactly at the given address, replacing whatever was
+/// mapped there.
+pub const MAP_FIXED: u64 = 1 << 4;
+
+/// Largest mapping made in one call.
+pub const MAP_MAX: u64 = 256 * 1024 * 1024;
+
+#[derive(Clone, Copy)]
+enum Backing {
+    Anon,
+    /// Page cache entry and the file offset of the mapping's first page.
+    File { cache: usize, offset: u64 },
+}
+
+/// [start, end) of `space`, page-aligned.
+#[derive(Clone, Copy)]
+struct Mapping {
+    space: u64,
+    start: u64,
+    end: u64,
+    prot: u64,
+    backing: Backing,
+}
+
+impl Mapping {
+    fn contains(&self, space: u64, addr: u64) -> bool {
+        self.space == space && addr >= self.start && addr < self.end
+    }
+}
+
+/// The pages of one file read so far.
+struct CachedFile {
+    name: String,
+    /// Open for as long as the file is cached.
+    file: OpenFile,
+    /// (file offset, frame), sorted.
+    pages: Vec<(u64, u64)>,
+}
+
+impl CachedFile {
+    fn same_file(&self, name: &str, file: &FileHandle) -> bool {
+        self.name == name && self.file.first_cluster == file.first_cluster && self.file.size == file.size
+    }
+}
+
+struct MappedMemory {
+    files: Vec<CachedFile>,
+    mappings: Vec<Mapping>,
+    /// (base, len) of the user spans `map` reserved, shared by the spaces
+    /// forked since.
+    spans: Vec<(u64, u64)>,
+}
+
+static MAPPED: InterruptSpinlock<MappedMemory> = InterruptSpinlock::named("MAPPED", MappedMemory {
+    files: Vec::new(),
+    mappings: Vec::new(),
+    spans: Vec::new(),
+});
+
+/// Page table flags for pages of a mapping with `prot`. PROT_NONE pages are
+/// left present but kernel-only.
+fn page_flags(prot: u64) -> u64 {
+    let mut flags = PAGE_PRESENT;
+    if prot != PROT_NONE {
+        flags |= PAGE_USER;
+    }
+    if prot & PROT_WRITE != 0 {
+        flags |= PAGE_WRITABLE;
+    }
+    if prot & PROT_EXEC == 0 {
+        flags |= PAGE_NO_EXECUTE;
+    }
+    flags
+}
+
+/// `[addr, addr + len)` rounded out to pages, if it lies in the private area.
+fn page_range(addr: u64, len: u64) -> Option<(u64, u64)> {
+    if addr % PAGE_SIZE != 0 || len == 0 {
+        return None;
+    }
+    let end = addr.checked_add(memory::page_round_up(len))?;
+    let private = memory::USER_AREA_BASE..USER_FIXED_AREA.end;
+    (private.contains(&addr) && end <= private.end).then_some((addr, end))
+}
+
+/// Cut the mapping of `space` that straddles `addr`, if any, in two.
+fn split_at(mappings: &mut Vec<Mapping>, space: u64, addr: u64) {
+    let Some(i) = mappings.iter().position(|m| m.contains(space, addr) && m.start != addr) else {
+        return;
+    };
+    let mut upper = mappings[i];
+    upper.start = addr;
+    if let Backing::File { offset, .. } = &mut upper.backing {
+        *offset += addr - mappings[i].start;
+    }
+    mappings[i].end = addr;
+    mappings.push(upper);
+}
+
+/// Whether mappings of `space` cover every page of [start, end).
+fn covered(mappings: &[Mapping], space: u64, start: u64, end: u64) -> bool {
+    let mut at = start;
+    while at < end {
+        match mappings.iter().find(|m| m.contains(space, at)) {
+            Some(m) => at = m.end,
+            None => return false,
+        }
+    }
+    true
+}
+
+/// Pages taken out of a space's page tables whose old translations other
+/// CPUs may still hold.
+#[derive(Default)]
+struct Unmapped {
+    /// A present entry was cleared or lost rights.
+    stale: bool,
+    /// Frames of cleared PAGE_OWNED entries, to release after the flush.
+    frames: Vec<u64>,
+}
+
+impl Unmapped {
+    /// Flush `space` everywhere, then free the frames. Call with MAPPED
+    /// released, as `memory::flush_tlb_space` requires.
+    fn release(self, space: u64) {
+        if !self.stale {
+            return;
+        }
+        memory::flush_tlb_space(space);
+        if !self.frames.is_empty() {
+            memory::with_address_space(space, |_, allocator| {
+                for frame in self.frames {
+                    allocator.release_frame(frame);
+                }
+            });
+        }
+    }
+}
+
+/// Remove the mappings of `space` in [start, end) and unmap their pages.
+/// The frames they own are returned to free once the TLBs are flushed.
+fn unmap_locked(mappings: &mut Vec<Mapping>, space: u64, start: u64, end: u64) -> Unmapped {
+    split_at(mappings, space, start);
+    split_at(mappings, space, end);
+    let mut removed = Vec::new();
+    mappings.retain(|m| {
+        let inside = m.space == space && m.start >= start && m.end <= end;
+        if inside {
+            removed.push((m.start, m.end));
+        }
+        !inside
+    });
+
+    let mut unmapped = Unmapped::default();
+    memory::with_address_space(space, |pml4, _| {
+        for (start, end) in removed {
+            for page in (start..end).step_by(PAGE_SIZE as usize) {
+                let Some(entry) = (unsafe { page_entry_mut(pml4, page) }) else {
+                    continue;
+                };
+                let old = core::mem::replace(entry, 0);
+                if old & PAGE_PRESENT == 0 {
+                    continue;
+                }
+                unmapped.stale = true;
+                if old & PAGE_OWNED != 0 {
+                    unmapped.frames.push(old & PAGE_ADDR_MASK);
+                }
+            }
+        }
+    });
+    unmapped
+}
+
+/// Index of the page cache entry for `name`, adding one if needed.
+fn cache_file(name: &str) -> Option<usize> {
+    let file = fs::open_file(name).ok()?;
+    let mut mapped = MAPPED.lock();
+    if let Some(i) = mapped.files.iter().position(|cached| cached.same_file(name, &file)) {
+        return Some(i);
+    }
+    mapped.files.push(CachedFile { name: String::from(name), file, pages: Vec::new() });
+    Some(mapped.files.len() - 1)
+}
+
+/// Map `len` bytes into `space` with `prot` (PROT_*), anonymous and zeroed
+/// or, given `file`, the named file from the page-aligned offset on.
+///
+/// With MAP_FIXED in `flags` the mapping goes exactly at `addr`, which must
+/// be page-aligned and in `USER_FIXED_AREA`, and replaces what was mapped
+/// there. Otherwise `addr` is a hint: it is used if that range of the fixed
+/// area is free, and the kernel picks an address if not. Returns the
+/// address.
+pub fn map(space: u64, addr: u64, len: u64, prot: u64, flags: u64, file: Option<(&str, u64)>) -> Option<u64> {
+    if prot & !PROT_MASK != 0 || flags & !MAP_FIXED != 0 || len == 0 || len > MAP_MAX {
+        return None;
+    }
+    let len = memory::page_round_up(len);
+    let backing = match file {
+        None => Backing::Anon,
+        Some((name, offset)) => {
+            if offset % PAGE_SIZE != 0 {
+                return None;
+            }
+            Backing::File { cache: cache_file(name)?, offset }
+        }
+    };
+
+    let in_fixed_area =
+        |start: u64| start % PAGE_SIZE == 0 && start >= USER_FIXED_AREA.start && start <= USER_FIXED_AREA.end - len;
+    let mut mapped = MAPPED.lock();
+    let mut unmapped = Unmapped::default();
+    let start = if flags & MAP_FIXED != 0 {
+        if !in_fixed_area(addr) {
+            return None;
+        }
+        unmapped = unmap_locked(&mut mapped.mappings, space, addr, addr + len);
+        addr
+    } else if in_fixed_area(addr)
+        && !mapped
+            .mappings
+            .iter()
+            .any(|m| m.space == space && m.start < addr + len && addr < m.end)
+    {
+        addr
+    } else {
+        let start = memory::reserve_user_span(len)?;
+        mapped.spans.push((start, len));
+        start
+    };
+    mapped.mappings.push(Mapping { space, start, end: start + len, prot, backing });
+    drop(mapped);
+    unmapped.release(space);
+    Some(start)
+}
+
+/// Unmap every mapped page of `space` in [addr, addr + len). Pages there
+/// that no mapping covers are left alone.
+pub fn unmap(space: u64, addr: u64, len: u64) -> bool {
+    let Some((start, end)) = page_range(addr, len) else {
+        return false;
+    };
+    let mut mapped = MAPPED.lock();
+    let unmapped = unmap_locked(&mut mapped.mappings, space, start, end);
+    let unused = unused_spans(&mut mapped, start, end);
+    drop(mapped);
+    unmapped.release(space);
+    // Only after the flush, so no CPU reaches a span's old pages once it is
+    // handed out again.
+    for (base, len) in unused {
+        memory::release_user_span(base, len);
+    }
+    true
+}
+
+/// Take out the reserved spans touching [start, end) that no mapping of any
+/// space (a forked one may still have its parent's) lies in any more.
+fn unused_spans(mapped: &mut MappedMemory, start: u64, end: u64) -> Vec<(u64, u64)> {
+    let MappedMemory { mappings, spans, .. } = mapped;
+    let mut unused = Vec::new();
+    spans.retain(|&(base, len)| {
+        if base >= end || start >= base + len || mappings.iter().any(|m| m.start < base + len && base < m.end) {
+            return true;
+        }
+        unused.push((base, len));
+        false
+    });
+    unused
+}
+
+/// Change the protection of [addr, addr + len) of `space`, which mappings
+/// must cover completely. A page that gains write access and is not the
+/// mapping's alone (a cache page, or one a fork shares) is made
+/// copy-on-write rather than writable.
+pub fn protect(space: u64, addr: u64, len: u64, prot: u64) -> bool {
+    let Some((start, end)) = page_range(addr, len) else {
+        return false;
+    };
+    if prot & !PROT_MASK != 0 {
+        return false;
+    }
+    let mut mapped = MAPPED.lock();
+    let mappings = &mut mapped.mappings;
+    if !covered(mappings, space, start, end) {
+        return false;
+    }
+    split_at(mappings, space, start);
+    split_at(mappings, space, end);
+    for m in mappings.iter_mut().filter(|m| m.space == space && m.start >= start && m.end <= end) {
+        m.prot = prot;
+    }
+
+    let flags = page_flags(prot);
+    let mut changed = Unmapped::default();
+    let done = memory::with_address_space(space, |pml4, allocator| {
+        for page in (start..end).step_by(PAGE_SIZE as usize) {
+            let Some(entry) = (unsafe { page_entry_mut(pml4, page) }) else {
+                continue;
+            };
+            if *entry & PAGE_PRESENT == 0 {
+                continue;
+            }
+            let mut new = (*entry & (PAGE_ADDR_MASK | PAGE_OWNED)) | flags;
+            let private = *entry & PAGE_OWNED != 0 && allocator.frame_exclusive(*entry & PAGE_ADDR_MASK);
+            if flags & PAGE_WRITABLE != 0 && !private {
+                new = (new & !PAGE_WRITABLE) | PAGE_COW;
+            }
+            changed.stale |= new != *entry;
+            *entry = new;
+        }
+    })
+    .is_some();
+    drop(mapped);
+    changed.release(space);
+    done
+}
+
+/// Give a forked address space the mappings of its parent. Pages the parent
+/// has touched are already shared through the copied page tables.
+pub fn fork_mappings(parent: u64, child: u64) {
+    let mut mapped = MAPPED.lock();
+    let inherited: Vec<Mapping> = mapped.mappings.iter().filter(|m| m.space == parent).copied().collect();
+    for mapping in inherited {
+        mapped.mappings.push(Mapping { space: child, ..mapping });
+    }
+}
+
+/// Map cache `frame` at `page` of `space` for a mapping with `prot`, unless
+/// another CPU mapped the page first. File pages are never writable: a
+/// writable mapping gets them copy-on-write.
+fn map_cached_page(space: u64, page: u64, frame: u64, prot: u64) -> bool {
+    let flags = page_flags(prot);
+    let flags = if flags & PAGE_WRITABLE != 0 { (flags & !PAGE_WRITABLE) | PAGE_COW } else { flags };
+    memory::with_address_space(space, |pml4, allocator| unsafe {
+        if memory::lookup_page(pml4, page).is_none_or(|entry| entry & PAGE_PRESENT == 0) {
+            map_page(pml4, page, frame, flags, allocator);
+        }
+    })
+    .is_some()
+}
+
+/// The mapping of `space` at `page` and, for a file mapping, its cache entry
+/// and the file offset of the page.
+fn lookup(mappings: &[Mapping], space: u64, page: u64) -> Option<(Mapping, Option<(usize, u64)>)> {
+    let mapping = mappings.iter().find(|m| m.contains(space, page)).copied()?;
+    let file = match mapping.backing {
+        Backing::Anon => None,
+        Backing::File { cache, offset } => Some((cache, offset + (page - mapping.start))),
+    };
+    Some((mapping, file))
+}
+
+/// Resolve a not-present page fault at `addr` if it lies in a mapping of
+/// the active address space. Returns false if it does not, the mapping is
+/// PROT_NONE, or the page could not be filled.
+///
+/// A file page that is not cached yet is read with MAPPED dropped, so other
+/// CPUs' mmap calls and faults do not wait for this one's disk I/O. The page
+/// is cached and mapped after taking MAPPED again, unless the mapping
+/// changed or another CPU filled the page meanwhile.
+pub fn handle_page_fault(addr: u64) -> bool {
+    let space = memory::current_pml4_phys();
+    let page = addr & !(PAGE_SIZE - 1);
+
+    let (mapping, cache, offset, file) = {
+        let mapped = MAPPED.lock();
+        let Some((mapping, backing)) = lookup(&mapped.mappings, space, page) else {
+            return false;
+        };
+        if mapping.prot == PROT_NONE {
+            return false;
+        }
+        let Some((cache, offset)) = backing else {
+            let flags = page_flags(mapping.prot) | PAGE_OWNED;
+            return memory::with_address_space(space, |pml4, allocator| {
+                memory::map_zeroed_page(pml4, page, flags, allocator)
+            })
+            .unwrap_or(false);
+        };
+        let cached = &mapped.files[cache];
+        if offset >= cached.file.size as u64 {
+            return false;
+        }
+        if let Ok(i) = cached.pages.binary_search_by_key(&offset, |&(at, _)| at) {
+            return map_cached_page(space, page, cached.pages[i].1, mapping.prot);
+        }
+        (mapping, cache, offset, cached.file.clone())
+    };
+
+    let Some(Some(frame)) = memory::with_address_space(space, |_, allocator| allocator.allocate_frame()) else {
+        return false;
+    };
+    let free = |frame| memory::with_address_space(space, |_, allocator| allocator.free_frame(frame));
+    let buffer = unsafe { core::slice::from_raw_parts_mut(frame as *mut u8, PAGE_SIZE as usize) };
+    buffer.fill(0);
+    let len = (file.size as u64 - offset).min(PAGE_SIZE) as usize;
+    let read = fs::read_file_at(&file, offset as u32, &mut buffer[..len]);
+    drop(file);
+    if read != Ok(len) {
+        free(frame);
+        return false;
+    }
+
+    let mut mapped = MAPPED.lock();
+    // An munmap, mprotect or MAP_FIXED may have replaced the mapping while
+    // the page was read; retry the access against whatever is there now.
+    match lookup(&mapped.mappings, space, page) {
+        Some((now, Some(file))) if now.prot == mapping.prot && file == (cache, offset) => {}
+        _ => {
+            free(frame);
+            return true;
+        }
+    }
+    let pages = &mut mapped.files[cache].pages;
+    let frame = match pages.binary_search_by_key(&offset, |&(at, _)| at) {
+        // Filled for another mapping meanwhile.
+        Ok(i) => {
+            free(frame);
+            pages[i].1
+        }
+        Err(slot) => {
+            pages.insert(slot, (offset, frame));
+            frame
+        }
+    };
+    map_cached_page(space, page, frame, mapping.prot)
+}
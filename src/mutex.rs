@@ -0,0 +1,170 @@
+// ============================================================================
+// Sleeping mutex
+// ============================================================================
+//
+// For critical sections that run long, such as filesystem operations and
+// the synchronous NVMe I/O under them. A contended `lock` spins briefly, in
+// case the holder is about to let go, then parks the task on the mutex's
+// wait queue and lets the scheduler run something else. `unlock` hands the
+// CPU back to the oldest waiter by waking it.
+//
+// A task may only sleep when nothing can deadlock on it. A caller with
+// interrupts off (holding an InterruptSpinlock, or in a fault handler)
+// spins instead. So does a CPU that already holds a mutex: a holder never
+// leaves its CPU, so a spinning waiter always has a running holder to wait
+// for, never a parked one that no CPU may be free to resume. Syscalls
+// enter with interrupts masked, so the filesystem syscalls turn them back
+// on around their work (`syscall::with_interrupts`) to be able to park.
+
+use crate::interrupts::InterruptSpinlock;
+use crate::scheduler;
+use alloc::vec::Vec;
+use core::cell::UnsafeCell;
+use core::ops::{Deref, DerefMut};
+use core::sync::atomic::{AtomicU32, Ordering};
+
+const UNLOCKED: u32 = 0;
+const LOCKED: u32 = 1;
+/// Locked, and a task may be parked waiting for it.
+const CONTENDED: u32 = 2;
+
+/// Polls of a contended mutex before parking.
+const SPINS_BEFORE_SLEEP: usize = 200;
+
+/// Mutexes held by each CPU.
+static HELD: [AtomicU32; crate::processor::MAX_AP_COUNT + 1] =
+    [const { AtomicU32::new(0) }; crate::processor::MAX_AP_COUNT + 1];
+
+pub struct Mutex<T> {
+    state: AtomicU32,
+    /// Parked task IDs, oldest first.
+    waiters: InterruptSpinlock<Vec<usize>>,
+    #[cfg(feature = "lockstat")]
+    stats: crate::lockstat::LockStats,
+    data: UnsafeCell<T>,
+}
+
+unsafe impl<T: Send> Sync for Mutex<T> {}
+unsafe impl<T: Send> Send for Mutex<T> {}
+
+pub struct MutexGuard<'a, T> {
+    mutex: &'a Mutex<T>,
+}
+
+impl<T> Mutex<T> {
+    /// A mutex that shows up as `name` in the lockstat table (statics
+    /// only), or in no table if `name` is empty.
+    #[allow(unused_variables)]
+    pub const fn named(name: &'static str, data: T) -> Self {
+        Self {
+            state: AtomicU32::new(UNLOCKED),
+            waiters: InterruptSpinlock::new(Vec::new()),
+            #[cfg(feature = "lockstat")]
+            stats: crate::lockstat::LockStats::new(name),
+            data: UnsafeCell::new(data),
+        }
+    }
+
+    pub fn try_lock(&self) -> Option<MutexGuard<'_, T>> {
+        self.state
+            .compare_exchange(UNLOCKED, LOCKED, Ordering::Acquire, Ordering::Relaxed)
+            .ok()
+            .map(|_| self.acquired(0))
+    }
+
+    pub fn lock(&self) -> MutexGuard<'_, T> {
+        if let Some(guard) = self.try_lock() {
+            return guard;
+        }
+        #[cfg(feature = "lockstat")]
+        let start = crate::lockstat::now();
+        #[cfg(not(feature = "lockstat"))]
+        let start = 0;
+
+        for _ in 0..SPINS_BEFORE_SLEEP {
+            core::hint::spin_loop();
+            if self.state.load(Ordering::Relaxed) == UNLOCKED
+                && self.state.compare_exchange(UNLOCKED, LOCKED, Ordering::Acquire, Ordering::Relaxed).is_ok()
+            {
+                return self.acquired(start);
+            }
+        }
+
+        if !may_sleep() {
+            while self.state.swap(CONTENDED, Ordering::Acquire) != UNLOCKED {
+                while self.state.load(Ordering::Relaxed) != UNLOCKED {
+                    core::hint::spin_loop();
+                }
+            }
+            return self.acquired(start);
+        }
+
+        let task = scheduler::current_task_id();
+        loop {
+            // Queued under the same lock `unlock` takes to pick a waiter,
+            // so a release between the swap and the sleep is not lost.
+            let mut waiters = self.waiters.lock();
+            if self.state.swap(CONTENDED, Ordering::Acquire) == UNLOCKED {
+                break;
+            }
+            waiters.push(task);
+            #[cfg(feature = "lockstat")]
+            self.stats.slept();
+            scheduler::block_current();
+            drop(waiters);
+            scheduler::switch_task();
+            // Still queued if there was nothing else to run and
+            // `switch_task` returned straight away.
+            self.waiters.lock().retain(|&waiter| waiter != task);
+        }
+        self.acquired(start)
+    }
+
+    /// Release a mutex whose guard was forgotten, by the task that holds it.
+    /// For callers whose lock and unlock are separate calls.
+    pub unsafe fn force_unlock(&self) {
+        #[cfg(feature = "lockstat")]
+        self.stats.released();
+        HELD[scheduler::current_cpu()].fetch_sub(1, Ordering::Relaxed);
+        if self.state.swap(UNLOCKED, Ordering::Release) == CONTENDED {
+            let mut waiters = self.waiters.lock();
+            if !waiters.is_empty() {
+                scheduler::wake(waiters.remove(0));
+            }
+        }
+    }
+
+    #[allow(unused_variables)]
+    fn acquired(&self, wait_start: u64) -> MutexGuard<'_, T> {
+        HELD[scheduler::current_cpu()].fetch_add(1, Ordering::Relaxed);
+        #[cfg(feature = "lockstat")]
+        self.stats.acquired(if wait_start == 0 { 0 } else { crate::lockstat::now() - wait_start });
+        MutexGuard { mutex: self }
+    }
+}
+
+/// Interrupts are on and this CPU holds no mutex.
+fn may_sleep() -> bool {
+    let rflags: u64;
+    unsafe { core::arch::asm!("pushfq; pop {}", out(reg) rflags, options(nomem, preserves_flags)) };
+    rflags & (1 << 9) != 0 && HELD[scheduler::current_cpu()].load(Ordering::Relaxed) == 0
+}
+
+impl<T> Deref for MutexGuard<'_, T> {
+    type Target = T;
+    fn deref(&self) -> &T {
+        unsafe { &*self.mutex.data.get() }
+    }
+}
+
+impl<T> DerefMut for MutexGuard<'_, T> {
+    fn deref_mut(&mut self) -> &mut T {
+        unsafe { &mut *self.mutex.data.get() }
+    }
+}
+
+impl<T> Drop for MutexGuard<'_, T> {
+    fn drop(&mut self) {
+        unsafe { self.mutex.force_unlock() };
+    }
+}
@@ -4,7 +4,7 @@ mod helper;
 mod ipv4;
 
 use crate::memory::{FrameAllocator, PageTable, PAGE_CACHE_DISABLE, PAGE_PRESENT, PAGE_WRITABLE};
-use crate::pci::{self, PciDevice};
+use crate::pci::{self, PciDevice, PciDriver};
 use crate::println;
 use core::ptr::{addr_of_mut};
 pub use driver::NetworkDriver;
@@ -42,6 +42,34 @@ pub unsafe fn get_mac_address() -> Option<[u8; 6]> {
     }
 }
 
+/// Registry entry binding Ethernet controllers (02:00:xx) to this stack.
+pub const PCI_DRIVER: PciDriver = PciDriver {
+    name: "network",
+    class_code: pci::PCI_CLASS_NETWORK,
+    sub_class: pci::PCI_SUBCLASS_ETHERNET,
+    prog_if: None,
+    probe: pci_probe,
+};
+
+/// Claim the first Ethernet controller that one of our NIC drivers supports.
+unsafe fn pci_probe(
+    device: &PciDevice,
+    pml4: &mut PageTable,
+    allocator: &mut FrameAllocator,
+) -> Result<(), &'static str> {
+    if is_ready() {
+        return Err("a NIC is already active");
+    }
+    if driver::Nic::probe(device).is_none() {
+        return Err("unsupported NIC");
+    }
+    unsafe {
+        pci::enable_device(device);
+        init(pml4, allocator, *device);
+    }
+    if is_ready() { Ok(()) } else { Err("NIC init failed") }
+}
+
 /// Probe PCI device, map MMIO/DMA, and bring up the NIC.
 pub unsafe fn init(
     pml4: &mut PageTable,
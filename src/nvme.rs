@@ -1,7 +1,10 @@
 #![allow(dead_code)]
 #![allow(unused_variables)]
 
-use crate::pci::PciDevice;
+use crate::block;
+use crate::memory::{self, FrameAllocator, PageTable};
+use crate::mutex::{Mutex, MutexGuard};
+use crate::pci::{self, PciDevice, PciDriver};
 use crate::println;
 use core::ptr::{addr_of_mut, read_volatile, write_volatile};
 
@@ -120,12 +123,58 @@ impl Default for NvmeQueue {
     }
 }
 
+/// Maximum number of NVMe controllers driven at once.
+pub const MAX_NVME_CONTROLLERS: usize = 4;
+/// Namespaces tracked per controller; further active namespaces are ignored.
+pub const MAX_NAMESPACES_PER_CONTROLLER: usize = 8;
+
+#[derive(Debug, Clone, Copy)]
+pub struct NvmeNamespace {
+    pub nsid: u32,
+    /// Namespace size in logical blocks (NSZE).
+    pub block_count: u64,
+    /// Logical block size in bytes, from the active LBA format.
+    pub block_size: u32,
+}
+
+impl NvmeNamespace {
+    const EMPTY: NvmeNamespace = NvmeNamespace {
+        nsid: 0,
+        block_count: 0,
+        block_size: 0,
+    };
+}
+
 pub struct NvmeContext {
     pub pci_dev: Option<PciDevice>,
     pub regs: *mut NvmeRegisters,
     pub admin_queue: NvmeQueue,
     pub io_queue: NvmeQueue,
-    pub nsid: u32,
+    pub namespaces: [NvmeNamespace; MAX_NAMESPACES_PER_CONTROLLER],
+    pub namespace_count: usize,
+}
+
+const EMPTY_QUEUE: NvmeQueue = NvmeQueue {
+    id: 0,
+    tail: 0,
+    head: 0,
+    size: 0,
+    phase: 1,
+    doorbell_tail: core::ptr::null_mut(),
+    doorbell_head: core::ptr::null_mut(),
+    sq_base: core::ptr::null_mut(),
+    cq_base: core::ptr::null_mut(),
+};
+
+impl NvmeContext {
+    const EMPTY: NvmeContext = NvmeContext {
+        pci_dev: None,
+        regs: core::ptr::null_mut(),
+        admin_queue: EMPTY_QUEUE,
+        io_queue: EMPTY_QUEUE,
+        namespaces: [NvmeNamespace::EMPTY; MAX_NAMESPACES_PER_CONTROLLER],
+        namespace_count: 0,
+    };
 }
 
 // ============================================================================
@@ -135,39 +184,50 @@ pub struct NvmeContext {
 #[repr(align(4096))]
 struct AlignedPage([u8; 4096]);
 
-static mut NVME_CTX: NvmeContext = NvmeContext {
-    pci_dev: None,
-    regs: core::ptr::null_mut(),
-    admin_queue: NvmeQueue {
-        id: 0,
-        tail: 0,
-        head: 0,
-        size: 0,
-        phase: 1,
-        doorbell_tail: core::ptr::null_mut(),
-        doorbell_head: core::ptr::null_mut(),
-        sq_base: core::ptr::null_mut(),
-        cq_base: core::ptr::null_mut(),
-    },
-    io_queue: NvmeQueue {
-        id: 0,
-        tail: 0,
-        head: 0,
-        size: 0,
-        phase: 1,
-        doorbell_tail: core::ptr::null_mut(),
-        doorbell_head: core::ptr::null_mut(),
-        sq_base: core::ptr::null_mut(),
-        cq_base: core::ptr::null_mut(),
-    },
-    nsid: 0,
-};
+/// Queue memory owned by one controller. Kept in .bss so it is covered by
+/// the kernel image's identity mapping and needs no frame allocation.
+struct NvmeQueuePages {
+    admin_sq: AlignedPage,
+    admin_cq: AlignedPage,
+    identify: AlignedPage,
+    io_sq: AlignedPage,
+    io_cq: AlignedPage,
+}
 
-static mut ADMIN_SQ_BUFFER: AlignedPage = AlignedPage([0; 4096]);
-static mut ADMIN_CQ_BUFFER: AlignedPage = AlignedPage([0; 4096]);
-static mut IDENTIFY_BUFFER: AlignedPage = AlignedPage([0; 4096]);
-static mut IO_SQ_BUFFER: AlignedPage = AlignedPage([0; 4096]);
-static mut IO_CQ_BUFFER: AlignedPage = AlignedPage([0; 4096]);
+static mut NVME_CTRLS: [NvmeContext; MAX_NVME_CONTROLLERS] =
+    [const { NvmeContext::EMPTY }; MAX_NVME_CONTROLLERS];
+static mut NVME_CTRL_COUNT: usize = 0;
+
+/// One per controller, held from submitting an I/O command until its
+/// completion has been reaped: commands on the shared I/O queue must not
+/// interleave. A sleeping mutex, so CPUs waiting for a busy controller run
+/// other tasks instead of spinning through the whole transfer.
+static IO_QUEUE_LOCKS: [Mutex<()>; MAX_NVME_CONTROLLERS] =
+    [const { Mutex::named("NVME_IO_QUEUE", ()) }; MAX_NVME_CONTROLLERS];
+
+/// Take exclusive use of `controller`'s I/O queue, which `nvme_submit_io`
+/// and `nvme_wait_io` require.
+pub fn lock_io_queue(controller: usize) -> MutexGuard<'static, ()> {
+    IO_QUEUE_LOCKS[controller].lock()
+}
+
+static mut NVME_QUEUE_PAGES: [NvmeQueuePages; MAX_NVME_CONTROLLERS] = [const {
+    NvmeQueuePages {
+        admin_sq: AlignedPage([0; 4096]),
+        admin_cq: AlignedPage([0; 4096]),
+        identify: AlignedPage([0; 4096]),
+        io_sq: AlignedPage([0; 4096]),
+        io_cq: AlignedPage([0; 4096]),
+    }
+}; MAX_NVME_CONTROLLERS];
+
+fn ctrl_ptr(index: usize) -> *mut NvmeContext {
+    unsafe { addr_of_mut!(NVME_CTRLS[index]) }
+}
+
+fn queue_pages(index: usize) -> *mut NvmeQueuePages {
+    unsafe { addr_of_mut!(NVME_QUEUE_PAGES[index]) }
+}
 
 // ============================================================================
 // Helper Functions
@@ -200,53 +260,60 @@ pub unsafe fn nvme_submit_command(q_ptr: *mut NvmeQueue, cmd: &NvmeSQEntry) {
     }
 }
 
-pub unsafe fn nvme_wait_for_completion(q_ptr: *mut NvmeQueue, cid: u16) {
+/// Spin until the next completion entry is posted, consume it and ring the
+/// head doorbell.
+unsafe fn nvme_next_completion(q_ptr: *mut NvmeQueue) -> NvmeCQEntry {
     unsafe {
         let q = &mut *q_ptr;
         loop {
-            let entry_ptr = q.cq_base.add(q.head as usize);
-            let entry = read_volatile(entry_ptr);
+            let entry = read_volatile(q.cq_base.add(q.head as usize));
 
             // Check Phase Tag
-            if (entry.status & 0x1) == q.phase {
-                // Entry is new
-                if entry.command_id == cid {
-                    // Handled
-                    q.head += 1;
-                    if q.head >= q.size {
-                        q.head = 0;
-                        q.phase = if q.phase == 1 { 0 } else { 1 };
-                    }
-
-                    // Ring Head Doorbell
-                    write_volatile(q.doorbell_head, q.head as u32);
-                    return;
-                } else {
-                    // Consume other completions
-                    q.head += 1;
-                    if q.head >= q.size {
-                        q.head = 0;
-                        q.phase = if q.phase == 1 { 0 } else { 1 };
-                    }
-                    write_volatile(q.doorbell_head, q.head as u32);
-                }
-            } else {
-                // Wait
+            if (entry.status & 0x1) != q.phase {
                 core::hint::spin_loop();
+                continue;
             }
+
+            q.head += 1;
+            if q.head >= q.size {
+                q.head = 0;
+                q.phase = if q.phase == 1 { 0 } else { 1 };
+            }
+
+            // Ring Head Doorbell
+            write_volatile(q.doorbell_head, q.head as u32);
+            return entry;
+        }
+    }
+}
+
+/// Spin until the completion for `cid` arrives and return its Status Field
+/// (SCT/SC, phase bit stripped); 0 means success. Completions for other
+/// command IDs are consumed and dropped.
+pub unsafe fn nvme_wait_for_completion(q_ptr: *mut NvmeQueue, cid: u16) -> u16 {
+    loop {
+        let entry = unsafe { nvme_next_completion(q_ptr) };
+        if entry.command_id == cid {
+            return entry.status >> 1;
         }
     }
 }
 
-unsafe fn nvme_setup_io_queues(ctx_ptr: *mut NvmeContext) {
+unsafe fn nvme_setup_io_queues(index: usize) {
     let mut cmd = NvmeSQEntry::default();
 
     unsafe {
-        let ctx = &mut *ctx_ptr;
+        let ctx = &mut *ctrl_ptr(index);
+        let pages = queue_pages(index);
+        let io_sq = addr_of_mut!((*pages).io_sq);
+        let io_cq = addr_of_mut!((*pages).io_cq);
+        core::ptr::write_bytes(io_sq.cast::<u8>(), 0, 4096);
+        core::ptr::write_bytes(io_cq.cast::<u8>(), 0, 4096);
+
         // 1. Create IO Completion Queue
         cmd.opcode = NVME_ADMIN_OP_CREATE_IOCQ;
         cmd.command_id = 2;
-        cmd.prp1 = addr_of_mut!(IO_CQ_BUFFER).cast::<u8>() as u64;
+        cmd.prp1 = io_cq.cast::<u8>() as u64;
         cmd.cdw10 = ((64 - 1) << 16) | 1; // Size 64, QID 1
         cmd.cdw11 = 1; // Phys Contiguous
 
@@ -257,49 +324,56 @@ unsafe fn nvme_setup_io_queues(ctx_ptr: *mut NvmeContext) {
         cmd = NvmeSQEntry::default();
         cmd.opcode = NVME_ADMIN_OP_CREATE_IOSQ;
         cmd.command_id = 3;
-        cmd.prp1 = addr_of_mut!(IO_SQ_BUFFER).cast::<u8>() as u64;
+        cmd.prp1 = io_sq.cast::<u8>() as u64;
         cmd.cdw10 = ((64 - 1) << 16) | 1; // Size 64, QID 1
         cmd.cdw11 = (1 << 16) | 1; // CQID 1, Phys Contiguous
 
         nvme_submit_command(addr_of_mut!(ctx.admin_queue), &cmd);
         nvme_wait_for_completion(addr_of_mut!(ctx.admin_queue), 3);
 
-        // Setup Local Queue Struct
-        // We can access fields of ctx directly or via references, since we have &mut *ctx_ptr
-        // BUT we need to be careful not to create a reference to ctx if it points to static mut and we access it via static mut elsewhere.
-        // Here we just work on ctx which is derived from ctx_ptr.
-
         ctx.io_queue.id = 1;
         ctx.io_queue.head = 0;
         ctx.io_queue.tail = 0;
         ctx.io_queue.size = 64;
         ctx.io_queue.phase = 1;
-        ctx.io_queue.sq_base = addr_of_mut!(IO_SQ_BUFFER).cast::<NvmeSQEntry>();
-        ctx.io_queue.cq_base = addr_of_mut!(IO_CQ_BUFFER).cast::<NvmeCQEntry>();
+        ctx.io_queue.sq_base = io_sq.cast::<NvmeSQEntry>();
+        ctx.io_queue.cq_base = io_cq.cast::<NvmeCQEntry>();
 
-        // Doorbell for QID 1
+        // Doorbell for QID 1 (assumes CAP.DSTRD = 0, i.e. 4-byte stride)
         let db_base = (ctx.regs as usize) + 0x1000;
         ctx.io_queue.doorbell_tail = (db_base + (2 * 1 * 4)) as *mut u32; // 0x1000 + 8
         ctx.io_queue.doorbell_head = (db_base + (2 * 1 * 4) + 4) as *mut u32; // 0x1000 + 12
     }
 }
 
-unsafe fn nvme_identify_controller(ctx_ptr: *mut NvmeContext) {
+/// Issue an Identify command into the controller's identify page.
+/// Returns the completion status (0 = success).
+unsafe fn nvme_identify(index: usize, cns: u32, nsid: u32, cid: u16) -> u16 {
     let mut cmd = NvmeSQEntry::default();
-
     unsafe {
-        let ctx = &mut *ctx_ptr;
+        let ctx = &mut *ctrl_ptr(index);
+        let buffer = addr_of_mut!((*queue_pages(index)).identify).cast::<u8>();
+        core::ptr::write_bytes(buffer, 0, 4096);
+
         cmd.opcode = NVME_ADMIN_OP_IDENTIFY;
-        cmd.command_id = 1;
-        cmd.prp1 = addr_of_mut!(IDENTIFY_BUFFER).cast::<u8>() as u64;
-        cmd.cdw10 = 1; // CNS = 1 (Identify Controller)
+        cmd.command_id = cid;
+        cmd.nsid = nsid;
+        cmd.prp1 = buffer as u64;
+        cmd.cdw10 = cns;
 
         nvme_submit_command(addr_of_mut!(ctx.admin_queue), &cmd);
-        nvme_wait_for_completion(addr_of_mut!(ctx.admin_queue), 1);
+        nvme_wait_for_completion(addr_of_mut!(ctx.admin_queue), cid)
+    }
+}
+
+/// Identify Controller (CNS 1). Prints the model string and returns NN, the
+/// highest namespace ID the controller supports.
+unsafe fn nvme_identify_controller(index: usize) -> u32 {
+    unsafe {
+        nvme_identify(index, 1, 0, 1);
 
         // Parse Model (byte 24, length 40)
-        let buffer_ptr = addr_of_mut!(IDENTIFY_BUFFER).cast::<u8>();
-        // buffer[24..64]
+        let buffer_ptr = addr_of_mut!((*queue_pages(index)).identify).cast::<u8>();
 
         let mut model_str = [0u8; 41];
         for i in 0..40 {
@@ -314,34 +388,166 @@ unsafe fn nvme_identify_controller(ctx_ptr: *mut NvmeContext) {
         }
 
         if let Ok(s) = core::str::from_utf8(&model_str[..len]) {
-            println!("NVME MODEL: {}", s);
+            println!("NVME{} MODEL: {}", index, s);
         } else {
-            println!("NVME MODEL: (Invalid UTF-8)");
+            println!("NVME{} MODEL: (Invalid UTF-8)", index);
         }
+
+        // NN: Number of Namespaces (bytes 516..520)
+        core::ptr::read_unaligned(buffer_ptr.add(516) as *const u32)
     }
 }
 
-unsafe fn nvme_identify_namespace(ctx_ptr: *mut NvmeContext) {
+/// Identify Namespace (CNS 0) for one NSID and record it if it is active.
+unsafe fn nvme_add_namespace(index: usize, nsid: u32) {
     unsafe {
-        let ctx = &mut *ctx_ptr;
-        ctx.nsid = 1;
-        println!("NVME: DEFAULT NSID 1 SELECTED");
+        if nvme_identify(index, 0, nsid, 5) != 0 {
+            return;
+        }
+        let buf = addr_of_mut!((*queue_pages(index)).identify).cast::<u8>();
+
+        // NSZE at byte 0; FLBAS at byte 26 selects one of the LBA formats
+        // starting at byte 128 (4 bytes each, LBADS in bits 16..24).
+        let nsze = core::ptr::read_unaligned(buf as *const u64);
+        if nsze == 0 {
+            return;
+        }
+        let flbas = (*buf.add(26) & 0x0F) as usize;
+        let lbaf = core::ptr::read_unaligned(buf.add(128 + flbas * 4) as *const u32);
+        let lbads = (lbaf >> 16) & 0xFF;
+        if !(9..=16).contains(&lbads) {
+            println!("NVME{}: NSID {} has unsupported LBADS {}", index, nsid, lbads);
+            return;
+        }
+
+        let ctx = &mut *ctrl_ptr(index);
+        if ctx.namespace_count >= MAX_NAMESPACES_PER_CONTROLLER {
+            return;
+        }
+        ctx.namespaces[ctx.namespace_count] = NvmeNamespace {
+            nsid,
+            block_count: nsze,
+            block_size: 1 << lbads,
+        };
+        ctx.namespace_count += 1;
+        println!(
+            "NVME{}: NSID {} {} blocks x {} bytes",
+            index,
+            nsid,
+            nsze,
+            1u32 << lbads
+        );
+    }
+}
+
+/// Enumerate active namespaces with the Active Namespace ID list (CNS 2).
+/// Controllers older than NVMe 1.1 reject CNS 2; for those every NSID up to
+/// NN is probed with Identify Namespace instead.
+unsafe fn nvme_identify_namespaces(index: usize, nn: u32) {
+    unsafe {
+        let mut nsids = [0u32; MAX_NAMESPACES_PER_CONTROLLER];
+        let mut count = 0;
+
+        if nvme_identify(index, 2, 0, 4) == 0 {
+            let list = addr_of_mut!((*queue_pages(index)).identify).cast::<u32>();
+            for i in 0..1024 {
+                let nsid = core::ptr::read_volatile(list.add(i));
+                if nsid == 0 || count >= MAX_NAMESPACES_PER_CONTROLLER {
+                    break;
+                }
+                nsids[count] = nsid;
+                count += 1;
+            }
+        } else {
+            println!("NVME{}: CNS 2 unsupported, probing NSIDs 1..={}", index, nn);
+            let last = nn.min(MAX_NAMESPACES_PER_CONTROLLER as u32);
+            for nsid in 1..=last {
+                nsids[count] = nsid;
+                count += 1;
+            }
+        }
+
+        for &nsid in &nsids[..count] {
+            nvme_add_namespace(index, nsid);
+        }
+        if (*ctrl_ptr(index)).namespace_count == 0 {
+            println!("NVME{}: no active namespaces", index);
+        }
     }
 }
 
-pub unsafe fn init(device: PciDevice) {
+/// Registry entry binding NVMe (01:08:02) functions to this driver.
+pub const PCI_DRIVER: PciDriver = PciDriver {
+    name: "nvme",
+    class_code: pci::PCI_CLASS_STORAGE,
+    sub_class: pci::PCI_SUBCLASS_NVME,
+    prog_if: Some(pci::PCI_PROG_IF_NVME),
+    probe: pci_probe,
+};
+
+/// Map the controller's register BAR, bring it up and expose each active
+/// namespace as a block device.
+unsafe fn pci_probe(
+    device: &PciDevice,
+    pml4: &mut PageTable,
+    allocator: &mut FrameAllocator,
+) -> Result<(), &'static str> {
+    let index = unsafe { NVME_CTRL_COUNT };
+    if index >= MAX_NVME_CONTROLLERS {
+        return Err("too many NVMe controllers");
+    }
+    let bar = pci::mmio_bar0(device);
+    if bar == 0 {
+        return Err("BAR0 not assigned");
+    }
+
+    // Registers + doorbells; at least 16KB (4 pages) even if sizing failed.
+    let size = device.bars[0].size.max(4 * memory::PAGE_SIZE);
+    let pages = (size + memory::PAGE_SIZE - 1) / memory::PAGE_SIZE;
+    println!("Mapping NVMe BAR at {:#x} ({} pages)", bar, pages);
+    let flags = memory::PAGE_WRITABLE | memory::PAGE_PRESENT | memory::PAGE_CACHE_DISABLE;
+    for i in 0..pages {
+        let addr = bar + i * memory::PAGE_SIZE;
+        unsafe { memory::map_page(pml4, addr, addr, flags, allocator) };
+    }
+
+    unsafe {
+        pci::enable_device(device);
+        init(index, *device);
+        NVME_CTRL_COUNT = index + 1;
+    }
+
+    let ctx = unsafe { &*ctrl_ptr(index) };
+    for ns in &ctx.namespaces[..ctx.namespace_count] {
+        let dev = block::BlockDevice {
+            backend: block::BlockBackend::Nvme {
+                controller: index,
+                nsid: ns.nsid,
+            },
+            block_size: ns.block_size,
+            block_count: ns.block_count,
+        };
+        match block::register(dev) {
+            Ok(id) => println!("NVME{}: NSID {} is block device {}", index, ns.nsid, id),
+            Err(_) => println!("NVME{}: block device table full", index),
+        }
+    }
+    Ok(())
+}
+
+pub unsafe fn init(index: usize, device: PciDevice) {
     unsafe {
         println!("NVMe: Init started");
-        let ctx_ptr = addr_of_mut!(NVME_CTX);
+        let ctx_ptr = ctrl_ptr(index);
         let ctx = &mut *ctx_ptr;
+        let pages = queue_pages(index);
+        let admin_sq = addr_of_mut!((*pages).admin_sq);
+        let admin_cq = addr_of_mut!((*pages).admin_cq);
 
         ctx.pci_dev = Some(device);
 
         // 1. Map BAR0
-        let mut bar = (device.bar0 as u64) & 0xFFFFFFF0;
-        if device.bar1 != 0 {
-            bar |= (device.bar1 as u64) << 32;
-        }
+        let bar = pci::mmio_bar0(&device);
 
         println!("NVMe: BAR0 mapped at {:#x}", bar);
         ctx.regs = bar as *mut NvmeRegisters;
@@ -365,18 +571,11 @@ pub unsafe fn init(device: PciDevice) {
         write_volatile(&mut regs.aqa, ((q_size - 1) << 16) | (q_size - 1));
 
         // Zero buffers
-        // Use write_bytes on raw pointers
-        core::ptr::write_bytes(addr_of_mut!(ADMIN_SQ_BUFFER).cast::<u8>(), 0, 4096);
-        core::ptr::write_bytes(addr_of_mut!(ADMIN_CQ_BUFFER).cast::<u8>(), 0, 4096);
+        core::ptr::write_bytes(admin_sq.cast::<u8>(), 0, 4096);
+        core::ptr::write_bytes(admin_cq.cast::<u8>(), 0, 4096);
 
-        write_volatile(
-            &mut regs.asq,
-            addr_of_mut!(ADMIN_SQ_BUFFER).cast::<u8>() as u64,
-        );
-        write_volatile(
-            &mut regs.acq,
-            addr_of_mut!(ADMIN_CQ_BUFFER).cast::<u8>() as u64,
-        );
+        write_volatile(&mut regs.asq, admin_sq.cast::<u8>() as u64);
+        write_volatile(&mut regs.acq, admin_cq.cast::<u8>() as u64);
 
         // 4. Setup Internal Queue Struct
         ctx.admin_queue.id = 0;
@@ -384,8 +583,8 @@ pub unsafe fn init(device: PciDevice) {
         ctx.admin_queue.tail = 0;
         ctx.admin_queue.size = q_size as u16;
         ctx.admin_queue.phase = 1;
-        ctx.admin_queue.sq_base = addr_of_mut!(ADMIN_SQ_BUFFER).cast::<NvmeSQEntry>();
-        ctx.admin_queue.cq_base = addr_of_mut!(ADMIN_CQ_BUFFER).cast::<NvmeCQEntry>();
+        ctx.admin_queue.sq_base = admin_sq.cast::<NvmeSQEntry>();
+        ctx.admin_queue.cq_base = admin_cq.cast::<NvmeCQEntry>();
 
         // Doorbell registers
         let db_base = (regs as *mut NvmeRegisters as usize) + 0x1000;
@@ -410,95 +609,206 @@ pub unsafe fn init(device: PciDevice) {
 
         // 6. Identify Controller
         println!("NVMe: Identifying Controller...");
-        nvme_identify_controller(ctx_ptr);
+        let nn = nvme_identify_controller(index);
 
         // 7. Setup IO Queues
         println!("NVMe: Setting up IO Queues...");
-        nvme_setup_io_queues(ctx_ptr);
+        nvme_setup_io_queues(index);
 
-        // 8. Identify Namespace
-        nvme_identify_namespace(ctx_ptr);
+        // 8. Enumerate Namespaces
+        nvme_identify_namespaces(index, nn);
         println!("NVMe: Init complete");
     }
 }
 
-pub unsafe fn nvme_read(nsid: u32, lba: u64, buffer: *mut u8, count: u32) -> i32 {
-    let mut cmd = NvmeSQEntry::default();
-
-    cmd.opcode = NVME_OP_READ;
-    cmd.command_id = 100;
-    cmd.nsid = nsid;
-    cmd.prp1 = buffer as u64;
-    cmd.cdw10 = lba as u32;
-    cmd.cdw11 = (lba >> 32) as u32;
-    cmd.cdw12 = (count - 1) & 0xFFFF;
+/// Number of controllers that completed initialisation.
+pub fn controller_count() -> usize {
+    unsafe { NVME_CTRL_COUNT }
+}
 
-    unsafe {
-        let ctx_ptr = addr_of_mut!(NVME_CTX);
-        let q_ptr = addr_of_mut!((*ctx_ptr).io_queue);
-        nvme_submit_command(q_ptr, &cmd);
-        nvme_wait_for_completion(q_ptr, 100);
+/// Fill PRP1/PRP2 for a transfer of `bytes` starting at `buffer`. The
+/// transfer may touch at most two pages; callers split anything larger.
+fn set_prps(cmd: &mut NvmeSQEntry, buffer: *mut u8, bytes: usize) {
+    let start = buffer as u64;
+    cmd.prp1 = start;
+    let first_page_end = (start & !0xFFF) + 4096;
+    if start + bytes as u64 > first_page_end {
+        cmd.prp2 = first_page_end;
     }
+}
 
-    0
+/// Largest transfer (in bytes) `nvme_read`/`nvme_write` accept in one call:
+/// it can straddle at most two pages, so PRP1+PRP2 always suffice.
+pub const NVME_MAX_TRANSFER: usize = 4096;
+
+fn namespace_block_size(controller: usize, nsid: u32) -> u32 {
+    if controller >= controller_count() {
+        return 0;
+    }
+    let ctx = unsafe { &*ctrl_ptr(controller) };
+    ctx.namespaces[..ctx.namespace_count]
+        .iter()
+        .find(|ns| ns.nsid == nsid)
+        .map_or(0, |ns| ns.block_size)
 }
 
-pub unsafe fn nvme_write(nsid: u32, lba: u64, buffer: *mut u8, count: u32) -> i32 {
-    let mut cmd = NvmeSQEntry::default();
+/// Build a read or write command for `count` blocks at `lba`.
+fn io_command(
+    controller: usize,
+    write: bool,
+    nsid: u32,
+    lba: u64,
+    buffer: *mut u8,
+    count: u32,
+    cid: u16,
+) -> Result<NvmeSQEntry, i32> {
+    let block_size = namespace_block_size(controller, nsid);
+    if block_size == 0 || count == 0 || buffer.is_null() {
+        return Err(-1);
+    }
+    let bytes = count as usize * block_size as usize;
+    if bytes > NVME_MAX_TRANSFER {
+        return Err(-1);
+    }
 
-    cmd.opcode = NVME_OP_WRITE;
-    cmd.command_id = 101;
+    let mut cmd = NvmeSQEntry::default();
+    cmd.opcode = if write { NVME_OP_WRITE } else { NVME_OP_READ };
+    cmd.command_id = cid;
     cmd.nsid = nsid;
-    cmd.prp1 = buffer as u64;
+    set_prps(&mut cmd, buffer, bytes);
     cmd.cdw10 = lba as u32;
     cmd.cdw11 = (lba >> 32) as u32;
     cmd.cdw12 = (count - 1) & 0xFFFF;
+    Ok(cmd)
+}
 
+/// Queue a read or write on the controller's I/O queue without waiting.
+/// Returns the command ID to pass to `nvme_wait_io`. At most one command per
+/// controller may be outstanding: the completion poller discards entries for
+/// other command IDs. The caller holds `lock_io_queue` until it has waited.
+pub unsafe fn nvme_submit_io(
+    controller: usize,
+    write: bool,
+    nsid: u32,
+    lba: u64,
+    buffer: *mut u8,
+    count: u32,
+) -> Result<u16, i32> {
+    let cid = if write { 101 } else { 100 };
+    let cmd = io_command(controller, write, nsid, lba, buffer, count, cid)?;
     unsafe {
-        let ctx_ptr = addr_of_mut!(NVME_CTX);
-        let q_ptr = addr_of_mut!((*ctx_ptr).io_queue);
-        nvme_submit_command(q_ptr, &cmd);
-        nvme_wait_for_completion(q_ptr, 101);
+        nvme_submit_command(addr_of_mut!((*ctrl_ptr(controller)).io_queue), &cmd);
     }
-
-    0
+    Ok(cid)
 }
 
-pub unsafe fn default_nsid() -> Option<u32> {
-    unsafe {
-        let ctx_ptr = addr_of_mut!(NVME_CTX);
-        let ctx = &*ctx_ptr;
-        if ctx.regs.is_null() || ctx.io_queue.size == 0 || ctx.nsid == 0 {
-            None
-        } else {
-            Some(ctx.nsid)
+/// Command IDs `nvme_read_queued` hands out, one per queue slot.
+const QUEUED_CID_BASE: u16 = 0x200;
+
+/// Read `count` blocks at each `(lba, buffer)` of `requests`, keeping up to
+/// `depth` commands in flight (capped one below the I/O queue size). Returns
+/// 0 once every read completed successfully, otherwise the first failing
+/// NVMe status or -1 for a request that could not be built.
+///
+/// Holds the controller's I/O queue until every read has completed.
+pub unsafe fn nvme_read_queued(
+    controller: usize,
+    nsid: u32,
+    requests: &[(u64, *mut u8)],
+    count: u32,
+    depth: usize,
+) -> i32 {
+    if controller >= controller_count() {
+        return -1;
+    }
+    let _queue_guard = lock_io_queue(controller);
+    let queue = unsafe { addr_of_mut!((*ctrl_ptr(controller)).io_queue) };
+    let depth = depth.clamp(1, unsafe { (*queue).size as usize } - 1);
+
+    let mut result = 0;
+    let mut next = 0;
+    let mut in_flight = 0;
+    while next < requests.len() || in_flight > 0 {
+        while result == 0 && in_flight < depth && next < requests.len() {
+            let (lba, buffer) = requests[next];
+            let cid = QUEUED_CID_BASE + (next % depth) as u16;
+            match io_command(controller, false, nsid, lba, buffer, count, cid) {
+                Ok(cmd) => unsafe { nvme_submit_command(queue, &cmd) },
+                Err(e) => {
+                    result = e;
+                    break;
+                }
+            }
+            next += 1;
+            in_flight += 1;
+        }
+        if in_flight == 0 {
+            break;
         }
+        let entry = unsafe { nvme_next_completion(queue) };
+        if entry.command_id >= QUEUED_CID_BASE && entry.command_id < QUEUED_CID_BASE + depth as u16 {
+            in_flight -= 1;
+            if result == 0 && entry.status >> 1 != 0 {
+                result = (entry.status >> 1) as i32;
+            }
+        }
+    }
+    result
+}
+
+/// Wait for a command queued by `nvme_submit_io`; 0 on success, otherwise
+/// the NVMe status field.
+pub unsafe fn nvme_wait_io(controller: usize, cid: u16) -> i32 {
+    unsafe { nvme_wait_for_completion(addr_of_mut!((*ctrl_ptr(controller)).io_queue), cid) as i32 }
+}
+
+pub unsafe fn nvme_read(controller: usize, nsid: u32, lba: u64, buffer: *mut u8, count: u32) -> i32 {
+    if controller >= controller_count() {
+        return -1;
+    }
+    let _queue_guard = lock_io_queue(controller);
+    match unsafe { nvme_submit_io(controller, false, nsid, lba, buffer, count) } {
+        Ok(cid) => unsafe { nvme_wait_io(controller, cid) },
+        Err(e) => e,
+    }
+}
+
+pub unsafe fn nvme_write(controller: usize, nsid: u32, lba: u64, buffer: *mut u8, count: u32) -> i32 {
+    if controller >= controller_count() {
+        return -1;
+    }
+    let _queue_guard = lock_io_queue(controller);
+    match unsafe { nvme_submit_io(controller, true, nsid, lba, buffer, count) } {
+        Ok(cid) => unsafe { nvme_wait_io(controller, cid) },
+        Err(e) => e,
     }
 }
 
 pub unsafe fn shutdown() {
-    let ctx_ptr = addr_of_mut!(NVME_CTX);
-    let ctx = &mut *ctx_ptr;
-    if !ctx.regs.is_null() {
-        println!("NVMe: Shutting down...");
-        let regs = &mut *ctx.regs;
+    for index in 0..controller_count() {
+        let ctx = unsafe { &mut *ctrl_ptr(index) };
+        if ctx.regs.is_null() {
+            continue;
+        }
+        println!("NVMe{}: Shutting down...", index);
+        let regs = unsafe { &mut *ctx.regs };
         // Set CC.SHN = 01b (Normal Shutdown)
-        let mut cc = read_volatile(&regs.cc);
+        let mut cc = unsafe { read_volatile(&regs.cc) };
         cc &= !(0x3 << 14);
         cc |= 0x1 << 14;
-        write_volatile(&mut regs.cc, cc);
+        unsafe { write_volatile(&mut regs.cc, cc) };
 
         // Wait for CSTS.SHST = 10b (Shutdown Complete)
         // SHST values: 00=Normal, 01=Occurring, 10=Complete
         let mut timeout = 0;
-        while (read_volatile(&regs.csts) >> 2) & 0x3 != 0x2 {
+        while (unsafe { read_volatile(&regs.csts) } >> 2) & 0x3 != 0x2 {
             core::hint::spin_loop();
             timeout += 1;
             if timeout > 10000000 {
-                println!("NVMe: Shutdown timeout");
+                println!("NVMe{}: Shutdown timeout", index);
                 break;
             }
         }
-        println!("NVMe: Shutdown complete");
+        println!("NVMe{}: Shutdown complete", index);
     }
 }
@@ -1,4 +1,6 @@
+use crate::acpi::{self, AcpiTables, McfgAllocation};
 use crate::io::{inl, outl};
+use crate::memory::{self, FrameAllocator, PageTable};
 use crate::println;
 
 pub const PCI_CONFIG_ADDRESS: u16 = 0xCF8;
@@ -15,6 +17,62 @@ pub const PCI_PROG_IF_XHCI: u8 = 0x30;
 pub const PCI_CLASS_NETWORK: u8 = 0x02;
 pub const PCI_SUBCLASS_ETHERNET: u8 = 0x00;
 
+pub const PCI_CLASS_BRIDGE: u8 = 0x06;
+pub const PCI_SUBCLASS_PCI_BRIDGE: u8 = 0x04;
+
+/// Size of one function's configuration space when accessed through ECAM.
+pub const PCI_EXT_CONFIG_SIZE: u16 = 4096;
+/// Size of the legacy (port 0xCF8/0xCFC reachable) configuration space.
+pub const PCI_LEGACY_CONFIG_SIZE: u16 = 256;
+
+pub const PCI_CAP_ID_MSI: u8 = 0x05;
+pub const PCI_CAP_ID_PCIE: u8 = 0x10;
+pub const PCI_CAP_ID_MSIX: u8 = 0x11;
+
+pub const MAX_PCI_DEVICES: usize = 64;
+pub const MAX_PCI_DRIVERS: usize = 16;
+pub const MAX_PCI_CAPABILITIES: usize = 16;
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum PciBarKind {
+    None,
+    Io,
+    Mem32,
+    Mem64,
+}
+
+/// One decoded Base Address Register. A 64-bit BAR occupies two slots; the
+/// upper slot is left as `PciBarKind::None`.
+#[derive(Debug, Clone, Copy)]
+pub struct PciBar {
+    pub kind: PciBarKind,
+    pub base: u64,
+    pub size: u64,
+    pub prefetchable: bool,
+}
+
+impl PciBar {
+    pub const EMPTY: PciBar = PciBar {
+        kind: PciBarKind::None,
+        base: 0,
+        size: 0,
+        prefetchable: false,
+    };
+
+    pub fn is_mmio(&self) -> bool {
+        matches!(self.kind, PciBarKind::Mem32 | PciBarKind::Mem64)
+    }
+}
+
+/// A capability found in the standard list (offset < 0x100) or, when the
+/// function is reachable through ECAM, the PCIe extended list.
+#[derive(Debug, Clone, Copy)]
+pub struct PciCapability {
+    pub id: u16,
+    pub offset: u16,
+    pub extended: bool,
+}
+
 #[derive(Debug, Clone, Copy)]
 pub struct PciDevice {
     pub bus: u8,
@@ -22,34 +80,206 @@ pub struct PciDevice {
     pub function: u8,
     pub vendor_id: u16,
     pub device_id: u16,
+    pub class_code: u8,
+    pub sub_class: u8,
+    pub prog_if: u8,
+    pub header_type: u8,
+    /// Raw BAR0/BAR1 register values, kept for drivers that decode them.
     pub bar0: u32,
     pub bar1: u32,
+    pub bars: [PciBar; 6],
+    pub capabilities: [PciCapability; MAX_PCI_CAPABILITIES],
+    pub capability_count: usize,
 }
 
-static mut NVME_DEVICE: Option<PciDevice> = None;
-static mut XHCI_DEVICE: Option<PciDevice> = None;
-static mut ETHERNET_DEVICE: Option<PciDevice> = None;
+impl PciDevice {
+    /// Config-space offset of the first capability with this id, if any.
+    pub fn find_capability(&self, id: u8) -> Option<u16> {
+        self.capabilities[..self.capability_count]
+            .iter()
+            .find(|c| !c.extended && c.id == id as u16)
+            .map(|c| c.offset)
+    }
 
-pub fn init() {
-    unsafe {
-        scan_bus();
+    /// Config-space offset of the first PCIe extended capability with this id.
+    pub fn find_extended_capability(&self, id: u16) -> Option<u16> {
+        self.capabilities[..self.capability_count]
+            .iter()
+            .find(|c| c.extended && c.id == id)
+            .map(|c| c.offset)
+    }
+}
+
+/// A function recorded during enumeration and the driver bound to it.
+#[derive(Debug, Clone, Copy)]
+pub struct PciEntry {
+    pub device: PciDevice,
+    pub driver: Option<&'static str>,
+}
+
+static mut PCI_DEVICES: [Option<PciEntry>; MAX_PCI_DEVICES] = [None; MAX_PCI_DEVICES];
+static mut PCI_DEVICE_COUNT: usize = 0;
+
+/// Probe callback: map whatever the device needs and bring it up. Returning
+/// `Err` leaves the function unbound so another driver may claim it.
+pub type PciProbeFn =
+    unsafe fn(&PciDevice, &mut PageTable, &mut FrameAllocator) -> Result<(), &'static str>;
+
+/// A driver's match table entry. `prog_if: None` matches any interface.
+#[derive(Clone, Copy)]
+pub struct PciDriver {
+    pub name: &'static str,
+    pub class_code: u8,
+    pub sub_class: u8,
+    pub prog_if: Option<u8>,
+    pub probe: PciProbeFn,
+}
+
+impl PciDriver {
+    fn matches(&self, device: &PciDevice) -> bool {
+        device.class_code == self.class_code
+            && device.sub_class == self.sub_class
+            && self.prog_if.map_or(true, |p| p == device.prog_if)
+    }
+}
+
+static mut PCI_DRIVERS: [Option<PciDriver>; MAX_PCI_DRIVERS] = [None; MAX_PCI_DRIVERS];
+
+/// Add a driver to the registry. Drivers are tried in registration order.
+pub fn register_driver(driver: PciDriver) -> Result<(), &'static str> {
+    let drivers = unsafe { &mut *core::ptr::addr_of_mut!(PCI_DRIVERS) };
+    match drivers.iter_mut().find(|d| d.is_none()) {
+        Some(slot) => {
+            *slot = Some(driver);
+            Ok(())
+        }
+        None => Err("PCI driver registry full"),
+    }
+}
+
+/// Offer every unbound function in the device table to each registered
+/// driver whose class triple matches, stopping at the first successful probe.
+///
+/// # Safety
+/// `pml4` must be the active page table. Must run on the BSP before the
+/// frame allocator is handed off.
+pub unsafe fn bind_drivers(pml4: &mut PageTable, allocator: &mut FrameAllocator) {
+    let drivers = unsafe { *core::ptr::addr_of!(PCI_DRIVERS) };
+    let count = unsafe { PCI_DEVICE_COUNT };
+    for i in 0..count {
+        let Some(entry) = (unsafe { (*core::ptr::addr_of!(PCI_DEVICES))[i] }) else {
+            continue;
+        };
+        if entry.driver.is_some() {
+            continue;
+        }
+        let dev = entry.device;
+        for driver in drivers.iter().flatten() {
+            if !driver.matches(&dev) {
+                continue;
+            }
+            match unsafe { (driver.probe)(&dev, pml4, allocator) } {
+                Ok(()) => {
+                    println!(
+                        "PCI: {}:{}:{} bound to {}",
+                        dev.bus, dev.device, dev.function, driver.name
+                    );
+                    unsafe {
+                        if let Some(e) = &mut (*core::ptr::addr_of_mut!(PCI_DEVICES))[i] {
+                            e.driver = Some(driver.name);
+                        }
+                    }
+                    break;
+                }
+                Err(msg) => {
+                    println!(
+                        "PCI: {} probe of {}:{}:{} failed: {}",
+                        driver.name, dev.bus, dev.device, dev.function, msg
+                    );
+                }
+            }
+        }
     }
 }
 
-pub fn get_nvme_device() -> Option<PciDevice> {
-    unsafe { NVME_DEVICE }
+/// Number of functions found during enumeration.
+pub fn device_count() -> usize {
+    unsafe { PCI_DEVICE_COUNT }
+}
+
+/// The `index`-th function found during enumeration.
+pub fn device_entry(index: usize) -> Option<PciEntry> {
+    if index >= MAX_PCI_DEVICES {
+        return None;
+    }
+    unsafe { (*core::ptr::addr_of!(PCI_DEVICES))[index] }
 }
 
-pub fn get_xhci_device() -> Option<PciDevice> {
-    unsafe { XHCI_DEVICE }
+/// First enumerated function matching a class triple (`prog_if: None` = any).
+pub fn find_device(class_code: u8, sub_class: u8, prog_if: Option<u8>) -> Option<PciDevice> {
+    (0..device_count())
+        .filter_map(device_entry)
+        .map(|e| e.device)
+        .find(|d| {
+            d.class_code == class_code
+                && d.sub_class == sub_class
+                && prog_if.map_or(true, |p| p == d.prog_if)
+        })
 }
 
-pub fn get_ethernet_device() -> Option<PciDevice> {
-    unsafe { ETHERNET_DEVICE }
+/// Enable memory space decoding and bus mastering for a function.
+pub unsafe fn enable_device(device: &PciDevice) {
+    let (bus, dev, func) = (device.bus, device.device, device.function);
+    let mut cmd = unsafe { read_config_16(bus, dev, func, 0x04) };
+    cmd |= 0x0006; // Bit 1: Memory Space, Bit 2: Bus Master
+    unsafe {
+        write_config_16(bus, dev, func, 0x04, cmd);
+    }
+}
+
+/// Legacy INTx line the firmware routed this function to (config 0x3C),
+/// or `None` if the function has no interrupt pin or the line is unassigned.
+pub unsafe fn interrupt_line(device: &PciDevice) -> Option<u8> {
+    let (bus, dev, func) = (device.bus, device.device, device.function);
+    let pin = unsafe { read_config_8(bus, dev, func, 0x3D) };
+    let line = unsafe { read_config_8(bus, dev, func, 0x3C) };
+    if pin == 0 || line == 0xFF { None } else { Some(line) }
+}
+
+/// Program the MSI capability to deliver `vector` (fixed, edge) to the Local
+/// APIC `apic_id`, enable a single message and mask legacy INTx.
+pub unsafe fn enable_msi(device: &PciDevice, vector: u8, apic_id: u8) -> Result<(), &'static str> {
+    let cap = device.find_capability(PCI_CAP_ID_MSI).ok_or("no MSI capability")?;
+    let (bus, dev, func) = (device.bus, device.device, device.function);
+
+    let mut control = unsafe { read_config_16(bus, dev, func, cap + 2) };
+    let is_64 = control & (1 << 7) != 0;
+    let address = 0xFEE0_0000u32 | ((apic_id as u32) << 12);
+
+    unsafe {
+        write_config_32(bus, dev, func, cap + 4, address);
+        if is_64 {
+            write_config_32(bus, dev, func, cap + 8, 0);
+            write_config_16(bus, dev, func, cap + 12, vector as u16);
+        } else {
+            write_config_16(bus, dev, func, cap + 8, vector as u16);
+        }
+    }
+
+    control &= !(0x7 << 4); // MME = 0: one message
+    control |= 1; // MSI Enable
+    unsafe { write_config_16(bus, dev, func, cap + 2, control) };
+
+    let cmd = unsafe { read_config_16(bus, dev, func, 0x04) };
+    unsafe { write_config_16(bus, dev, func, 0x04, cmd | (1 << 10)) }; // Interrupt Disable
+    Ok(())
 }
 
 /// Decode the physical MMIO base address for a device's BAR0.
 pub fn mmio_bar0(device: &PciDevice) -> u64 {
+    if device.bars[0].is_mmio() {
+        return device.bars[0].base;
+    }
     let mut base = (device.bar0 as u64) & 0xFFFF_FFF0;
     let bar_type = (device.bar0 >> 1) & 0x3;
     if bar_type == 2 {
@@ -58,24 +288,187 @@ pub fn mmio_bar0(device: &PciDevice) -> u64 {
     base
 }
 
-unsafe fn scan_bus() {
-    for bus in 0..256 {
-        for dev in 0..32 {
-            unsafe {
-                check_device(bus as u8, dev as u8);
+// ============================================================================
+// ECAM (PCIe Enhanced Configuration Access Mechanism)
+// ============================================================================
+//
+// When the firmware publishes an MCFG table every function's 4 KiB config
+// space is memory-mapped, so a config read is a single uncached load instead
+// of an outl/inl pair serialised through 0xCF8/0xCFC. The window for a bus is
+// mapped lazily the first time enumeration visits it; buses that were never
+// mapped (or systems without MCFG) fall back to port I/O.
+
+const MAX_ECAM_REGIONS: usize = 8;
+
+#[derive(Debug, Clone, Copy)]
+struct EcamRegion {
+    base: u64,
+    segment: u16,
+    start_bus: u8,
+    end_bus: u8,
+}
+
+impl EcamRegion {
+    fn allocation(&self) -> McfgAllocation {
+        McfgAllocation {
+            base_address: self.base,
+            pci_segment_group: self.segment,
+            start_bus_number: self.start_bus,
+            end_bus_number: self.end_bus,
+            reserved: 0,
+        }
+    }
+}
+
+static mut ECAM_REGIONS: [Option<EcamRegion>; MAX_ECAM_REGIONS] = [None; MAX_ECAM_REGIONS];
+/// One bit per bus number on segment 0: set once that bus's 1 MiB ECAM window
+/// has been identity-mapped and may be accessed through MMIO.
+static mut ECAM_BUS_MAPPED: [u64; 4] = [0; 4];
+
+/// Discover ECAM regions and enumerate the PCI hierarchy.
+///
+/// `acpi_tables` may be `None` (no RSDP) or lack an MCFG, in which case the
+/// legacy port I/O mechanism is used for everything.
+///
+/// # Safety
+/// `pml4` must be the active page table; ECAM windows are mapped into it.
+pub unsafe fn init(
+    acpi_tables: Option<&AcpiTables>,
+    pml4: &mut PageTable,
+    allocator: &mut FrameAllocator,
+) {
+    if let Some(mcfg) = acpi_tables.and_then(|t| t.mcfg) {
+        let mut count = 0;
+        unsafe {
+            acpi::iter_mcfg_allocations(mcfg, |alloc| {
+                let alloc = core::ptr::read_unaligned(alloc);
+                if count < MAX_ECAM_REGIONS {
+                    ECAM_REGIONS[count] = Some(EcamRegion {
+                        base: alloc.base_address,
+                        segment: alloc.pci_segment_group,
+                        start_bus: alloc.start_bus_number,
+                        end_bus: alloc.end_bus_number,
+                    });
+                    count += 1;
+                }
+            });
+        }
+        println!("PCI: {} ECAM region(s) from MCFG", count);
+    } else {
+        println!("PCI: no MCFG, using legacy port I/O config access");
+    }
+
+    unsafe {
+        enumerate(pml4, allocator);
+    }
+}
+
+/// Returns the ECAM region covering `bus` on segment 0, if any.
+fn ecam_region_for_bus(bus: u8) -> Option<EcamRegion> {
+    let regions = unsafe { &*core::ptr::addr_of!(ECAM_REGIONS) };
+    regions.iter().flatten().copied().find(|r| {
+        r.segment == 0 && bus >= r.start_bus && bus <= r.end_bus
+    })
+}
+
+fn ecam_bus_mapped(bus: u8) -> bool {
+    let mapped = unsafe { &*core::ptr::addr_of!(ECAM_BUS_MAPPED) };
+    mapped[(bus / 64) as usize] & (1 << (bus % 64)) != 0
+}
+
+/// Identity-map the 1 MiB ECAM window of `bus` (uncached) if MCFG covers it.
+unsafe fn map_ecam_bus(bus: u8, pml4: &mut PageTable, allocator: &mut FrameAllocator) {
+    if ecam_bus_mapped(bus) {
+        return;
+    }
+    let Some(region) = ecam_region_for_bus(bus) else {
+        return;
+    };
+    let Some(base) = acpi::ecam_address(&region.allocation(), bus, 0, 0) else {
+        return;
+    };
+
+    let flags = memory::PAGE_WRITABLE | memory::PAGE_PRESENT | memory::PAGE_CACHE_DISABLE;
+    for i in 0..256u64 {
+        let addr = base + i * memory::PAGE_SIZE;
+        unsafe { memory::map_page(pml4, addr, addr, flags, allocator) };
+    }
+    unsafe {
+        let mapped = &mut *core::ptr::addr_of_mut!(ECAM_BUS_MAPPED);
+        mapped[(bus / 64) as usize] |= 1 << (bus % 64);
+    }
+}
+
+/// MMIO address of `offset` in the config space of bus:dev.func, or `None`
+/// when that bus must be reached through port I/O.
+fn ecam_config_address(bus: u8, dev: u8, func: u8, offset: u16) -> Option<u64> {
+    if !ecam_bus_mapped(bus) {
+        return None;
+    }
+    let region = ecam_region_for_bus(bus)?;
+    let base = acpi::ecam_address(&region.allocation(), bus, dev, func)?;
+    Some(base + (offset & (PCI_EXT_CONFIG_SIZE - 1)) as u64)
+}
+
+// ============================================================================
+// Enumeration
+// ============================================================================
+
+/// Walk the hierarchy from the root bus(es) instead of probing all 256 buses.
+///
+/// With MCFG the root bus of each segment-0 region is its `start_bus`. If the
+/// host bridge at root:0.0 is multi-function, each function `f` is a separate
+/// host controller responsible for bus `root + f`.
+unsafe fn enumerate(pml4: &mut PageTable, allocator: &mut FrameAllocator) {
+    let regions = unsafe { *core::ptr::addr_of!(ECAM_REGIONS) };
+    let mut root_buses = [0u8; MAX_ECAM_REGIONS];
+    let mut root_count = 0;
+    for region in regions.iter().flatten() {
+        if region.segment == 0 {
+            root_buses[root_count] = region.start_bus;
+            root_count += 1;
+        }
+    }
+    if root_count == 0 {
+        root_count = 1;
+    }
+
+    for &root in &root_buses[..root_count] {
+        unsafe { map_ecam_bus(root, pml4, allocator) };
+        let header_type = unsafe { read_config_8(root, 0, 0, 0x0E) };
+        if (header_type & 0x80) == 0 {
+            unsafe { scan_bus(root, pml4, allocator) };
+            continue;
+        }
+        for func in 0..8u8 {
+            if unsafe { read_config_16(root, 0, func, 0x00) } == 0xFFFF {
+                continue;
             }
+            let Some(bus) = root.checked_add(func) else {
+                break;
+            };
+            unsafe { scan_bus(bus, pml4, allocator) };
+        }
+    }
+}
+
+unsafe fn scan_bus(bus: u8, pml4: &mut PageTable, allocator: &mut FrameAllocator) {
+    unsafe { map_ecam_bus(bus, pml4, allocator) };
+    for dev in 0..32 {
+        unsafe {
+            check_device(bus, dev, pml4, allocator);
         }
     }
 }
 
-unsafe fn check_device(bus: u8, dev: u8) {
+unsafe fn check_device(bus: u8, dev: u8, pml4: &mut PageTable, allocator: &mut FrameAllocator) {
     let vendor_id = unsafe { read_config_16(bus, dev, 0, 0x00) };
     if vendor_id == 0xFFFF {
         return;
     }
 
     unsafe {
-        check_function(bus, dev, 0);
+        check_function(bus, dev, 0, pml4, allocator);
     }
 
     let header_type = unsafe { read_config_8(bus, dev, 0, 0x0E) };
@@ -83,14 +476,20 @@ unsafe fn check_device(bus: u8, dev: u8) {
         for func in 1..8 {
             if unsafe { read_config_16(bus, dev, func, 0x00) } != 0xFFFF {
                 unsafe {
-                    check_function(bus, dev, func);
+                    check_function(bus, dev, func, pml4, allocator);
                 }
             }
         }
     }
 }
 
-unsafe fn check_function(bus: u8, dev: u8, func: u8) {
+unsafe fn check_function(
+    bus: u8,
+    dev: u8,
+    func: u8,
+    pml4: &mut PageTable,
+    allocator: &mut FrameAllocator,
+) {
     let vendor_id = unsafe { read_config_16(bus, dev, func, 0x00) };
     if vendor_id == 0xFFFF {
         return;
@@ -99,140 +498,265 @@ unsafe fn check_function(bus: u8, dev: u8, func: u8) {
     let class_code = unsafe { read_config_8(bus, dev, func, 0x0B) };
     let sub_class = unsafe { read_config_8(bus, dev, func, 0x0A) };
     let prog_if = unsafe { read_config_8(bus, dev, func, 0x09) };
+    let header_type = unsafe { read_config_8(bus, dev, func, 0x0E) } & 0x7F;
 
     println!(
         "PCI: Checking {}:{}:{} Vendor={:#04x} Device={:#04x} Class={:02x}:{:02x}:{:02x}",
         bus, dev, func, vendor_id, device_id, class_code, sub_class, prog_if
     );
 
-    if class_code == PCI_CLASS_STORAGE
-        && sub_class == PCI_SUBCLASS_NVME
-        && prog_if == PCI_PROG_IF_NVME
-    {
-        let bar0 = unsafe { read_config_32(bus, dev, func, 0x10) };
-        let bar1 = unsafe { read_config_32(bus, dev, func, 0x14) };
-
-        let device = PciDevice {
-            bus,
-            device: dev,
-            function: func,
-            vendor_id,
-            device_id,
-            bar0,
-            bar1,
-        };
+    let mut device = PciDevice {
+        bus,
+        device: dev,
+        function: func,
+        vendor_id,
+        device_id,
+        class_code,
+        sub_class,
+        prog_if,
+        header_type,
+        bar0: 0,
+        bar1: 0,
+        bars: [PciBar::EMPTY; 6],
+        capabilities: [PciCapability { id: 0, offset: 0, extended: false }; MAX_PCI_CAPABILITIES],
+        capability_count: 0,
+    };
+    unsafe {
+        read_bars(&mut device);
+        read_capabilities(&mut device);
+    }
 
-        unsafe {
-            NVME_DEVICE = Some(device);
+    unsafe {
+        let count = PCI_DEVICE_COUNT;
+        if count < MAX_PCI_DEVICES {
+            (*core::ptr::addr_of_mut!(PCI_DEVICES))[count] = Some(PciEntry { device, driver: None });
+            PCI_DEVICE_COUNT = count + 1;
+        } else {
+            println!("PCI: device table full, ignoring {}:{}:{}", bus, dev, func);
         }
-        println!("PCI: Found NVMe Controller at {}:{}:{}", bus, dev, func);
-        println!(
-            "Vendor ID: {:#04x}, Device ID: {:#04x}",
-            vendor_id, device_id
-        );
+    }
 
-        // Enable Bus Master and Memory Space in Command Register (Offset 0x04)
-        let mut cmd = unsafe { read_config_16(bus, dev, func, 0x04) };
-        cmd |= 0x0006; // Bit 1: Memory Space, Bit 2: Bus Master
-        unsafe {
-            write_config_32(bus, dev, func, 0x04, cmd as u32);
-        }
-    } else if class_code == PCI_CLASS_SERIAL_BUS
-        && sub_class == PCI_SUBCLASS_USB
-        && prog_if == PCI_PROG_IF_XHCI
-    {
-        let bar0 = unsafe { read_config_32(bus, dev, func, 0x10) };
-        let bar1 = unsafe { read_config_32(bus, dev, func, 0x14) };
-
-        let device = PciDevice {
-            bus,
-            device: dev,
-            function: func,
-            vendor_id,
-            device_id,
-            bar0,
-            bar1,
-        };
+    if class_code == PCI_CLASS_BRIDGE && sub_class == PCI_SUBCLASS_PCI_BRIDGE {
+        // Type 1 header: follow the bridge to the bus the firmware assigned
+        // behind it. Only descend to higher bus numbers so a misconfigured
+        // bridge cannot send us round in a loop.
+        let secondary = unsafe { read_config_8(bus, dev, func, 0x19) };
+        if header_type == 0x01 && secondary > bus {
+            println!("PCI: Bridge {}:{}:{} -> bus {}", bus, dev, func, secondary);
+            unsafe { scan_bus(secondary, pml4, allocator) };
+        }
+    }
+}
 
-        unsafe {
-            XHCI_DEVICE = Some(device);
+/// Decode and size every BAR of a function.
+///
+/// Sizing writes all-ones and reads back the mask, so memory and I/O decoding
+/// are switched off for the duration to keep the device from claiming a
+/// bogus window mid-probe.
+unsafe fn read_bars(device: &mut PciDevice) {
+    let (bus, dev, func) = (device.bus, device.device, device.function);
+    let bar_count = match device.header_type {
+        0x00 => 6,
+        0x01 => 2,
+        _ => 0,
+    };
+
+    device.bar0 = unsafe { read_config_32(bus, dev, func, 0x10) };
+    device.bar1 = unsafe { read_config_32(bus, dev, func, 0x14) };
+    if bar_count == 0 {
+        return;
+    }
+
+    let cmd = unsafe { read_config_16(bus, dev, func, 0x04) };
+    unsafe { write_config_16(bus, dev, func, 0x04, cmd & !0x0003) };
+
+    let mut i = 0;
+    while i < bar_count {
+        let offset = 0x10 + (i as u16) * 4;
+        let orig = unsafe { read_config_32(bus, dev, func, offset) };
+
+        if orig & 0x1 != 0 {
+            unsafe { write_config_32(bus, dev, func, offset, 0xFFFF_FFFF) };
+            let mask = unsafe { read_config_32(bus, dev, func, offset) } & 0xFFFF_FFFC;
+            unsafe { write_config_32(bus, dev, func, offset, orig) };
+            if mask != 0 {
+                device.bars[i] = PciBar {
+                    kind: PciBarKind::Io,
+                    base: (orig & 0xFFFF_FFFC) as u64,
+                    size: ((!mask).wrapping_add(1) & 0xFFFF) as u64,
+                    prefetchable: false,
+                };
+            }
+            i += 1;
+            continue;
         }
-        println!("PCI: Found xHCI Controller at {}:{}:{}", bus, dev, func);
-        println!(
-            "Vendor ID: {:#04x}, Device ID: {:#04x}",
-            vendor_id, device_id
-        );
 
-        // Enable Bus Master and Memory Space in Command Register (Offset 0x04)
-        let mut cmd = unsafe { read_config_16(bus, dev, func, 0x04) };
-        cmd |= 0x0006; // Bit 1: Memory Space, Bit 2: Bus Master
-        unsafe {
-            write_config_32(bus, dev, func, 0x04, cmd as u32);
-        }
-    } else if class_code == PCI_CLASS_NETWORK && sub_class == PCI_SUBCLASS_ETHERNET {
-        let bar0 = unsafe { read_config_32(bus, dev, func, 0x10) };
-        let bar1 = unsafe { read_config_32(bus, dev, func, 0x14) };
-
-        let device = PciDevice {
-            bus,
-            device: dev,
-            function: func,
-            vendor_id,
-            device_id,
-            bar0,
-            bar1,
+        let is_64 = (orig >> 1) & 0x3 == 2 && i + 1 < bar_count;
+        let prefetchable = orig & 0x8 != 0;
+
+        unsafe { write_config_32(bus, dev, func, offset, 0xFFFF_FFFF) };
+        let lo_mask = unsafe { read_config_32(bus, dev, func, offset) } & 0xFFFF_FFF0;
+        unsafe { write_config_32(bus, dev, func, offset, orig) };
+
+        let (base, mask) = if is_64 {
+            let orig_hi = unsafe { read_config_32(bus, dev, func, offset + 4) };
+            unsafe { write_config_32(bus, dev, func, offset + 4, 0xFFFF_FFFF) };
+            let hi_mask = unsafe { read_config_32(bus, dev, func, offset + 4) };
+            unsafe { write_config_32(bus, dev, func, offset + 4, orig_hi) };
+            (
+                ((orig_hi as u64) << 32) | (orig & 0xFFFF_FFF0) as u64,
+                ((hi_mask as u64) << 32) | lo_mask as u64,
+            )
+        } else {
+            ((orig & 0xFFFF_FFF0) as u64, 0xFFFF_FFFF_0000_0000 | lo_mask as u64)
         };
 
-        unsafe {
-            ETHERNET_DEVICE = Some(device);
-        }
-        println!(
-            "PCI: Found Ethernet controller at {}:{}:{}",
-            bus, dev, func
-        );
-        println!(
-            "Vendor ID: {:#04x}, Device ID: {:#04x}",
-            vendor_id, device_id
-        );
-
-        let mut cmd = unsafe { read_config_16(bus, dev, func, 0x04) };
-        cmd |= 0x0006;
-        unsafe {
-            write_config_32(bus, dev, func, 0x04, cmd as u32);
+        if lo_mask != 0 || (is_64 && mask >> 32 != 0) {
+            device.bars[i] = PciBar {
+                kind: if is_64 { PciBarKind::Mem64 } else { PciBarKind::Mem32 },
+                base,
+                size: (!mask).wrapping_add(1),
+                prefetchable,
+            };
         }
+        i += if is_64 { 2 } else { 1 };
     }
+
+    unsafe { write_config_16(bus, dev, func, 0x04, cmd) };
 }
 
-pub unsafe fn read_config_32(bus: u8, dev: u8, func: u8, offset: u8) -> u32 {
-    let address = ((bus as u32) << 16)
+/// Walk the standard capability list and, for ECAM-reachable functions, the
+/// PCIe extended list at 0x100. Both walks are bounded so a looping list in
+/// broken hardware cannot hang enumeration.
+unsafe fn read_capabilities(device: &mut PciDevice) {
+    let (bus, dev, func) = (device.bus, device.device, device.function);
+
+    let status = unsafe { read_config_16(bus, dev, func, 0x06) };
+    if status & (1 << 4) != 0 {
+        let mut ptr = (unsafe { read_config_8(bus, dev, func, 0x34) } & 0xFC) as u16;
+        let mut guard = 0;
+        while ptr >= 0x40 && guard < 48 && device.capability_count < MAX_PCI_CAPABILITIES {
+            let id = unsafe { read_config_8(bus, dev, func, ptr) };
+            device.capabilities[device.capability_count] = PciCapability {
+                id: id as u16,
+                offset: ptr,
+                extended: false,
+            };
+            device.capability_count += 1;
+            ptr = (unsafe { read_config_8(bus, dev, func, ptr + 1) } & 0xFC) as u16;
+            guard += 1;
+        }
+    }
+
+    if ecam_config_address(bus, dev, func, 0x100).is_none() {
+        return;
+    }
+    let mut ptr: u16 = 0x100;
+    let mut guard = 0;
+    while ptr >= 0x100 && guard < 64 && device.capability_count < MAX_PCI_CAPABILITIES {
+        let header = unsafe { read_config_32(bus, dev, func, ptr) };
+        if header == 0 || header == 0xFFFF_FFFF {
+            break;
+        }
+        device.capabilities[device.capability_count] = PciCapability {
+            id: (header & 0xFFFF) as u16,
+            offset: ptr,
+            extended: true,
+        };
+        device.capability_count += 1;
+        ptr = ((header >> 20) & 0xFFC) as u16;
+        guard += 1;
+    }
+}
+
+// ============================================================================
+// Config space access
+// ============================================================================
+//
+// Offsets are u16 so the PCIe extended space (0x100..0xFFF) is reachable
+// through ECAM. On the legacy path only the first 256 bytes exist: reads
+// beyond that return all-ones and writes are dropped.
+
+fn legacy_config_address(bus: u8, dev: u8, func: u8, offset: u16) -> u32 {
+    ((bus as u32) << 16)
         | ((dev as u32) << 11)
         | ((func as u32) << 8)
         | (offset as u32 & 0xFC)
-        | 0x80000000;
+        | 0x80000000
+}
+
+pub unsafe fn read_config_32(bus: u8, dev: u8, func: u8, offset: u16) -> u32 {
+    if let Some(addr) = ecam_config_address(bus, dev, func, offset & !3) {
+        return unsafe { core::ptr::read_volatile(addr as *const u32) };
+    }
+    if offset >= PCI_LEGACY_CONFIG_SIZE {
+        return 0xFFFF_FFFF;
+    }
     unsafe {
-        outl(PCI_CONFIG_ADDRESS, address);
+        outl(PCI_CONFIG_ADDRESS, legacy_config_address(bus, dev, func, offset));
         inl(PCI_CONFIG_DATA)
     }
 }
 
-pub unsafe fn read_config_16(bus: u8, dev: u8, func: u8, offset: u8) -> u16 {
+pub unsafe fn read_config_16(bus: u8, dev: u8, func: u8, offset: u16) -> u16 {
+    if let Some(addr) = ecam_config_address(bus, dev, func, offset & !1) {
+        return unsafe { core::ptr::read_volatile(addr as *const u16) };
+    }
     let val = unsafe { read_config_32(bus, dev, func, offset) };
     (val >> ((offset & 2) * 8)) as u16
 }
 
-pub unsafe fn read_config_8(bus: u8, dev: u8, func: u8, offset: u8) -> u8 {
+pub unsafe fn read_config_8(bus: u8, dev: u8, func: u8, offset: u16) -> u8 {
+    if let Some(addr) = ecam_config_address(bus, dev, func, offset) {
+        return unsafe { core::ptr::read_volatile(addr as *const u8) };
+    }
     let val = unsafe { read_config_32(bus, dev, func, offset) };
     (val >> ((offset & 3) * 8)) as u8
 }
 
-pub unsafe fn write_config_32(bus: u8, dev: u8, func: u8, offset: u8, val: u32) {
-    let address = ((bus as u32) << 16)
-        | ((dev as u32) << 11)
-        | ((func as u32) << 8)
-        | (offset as u32 & 0xFC)
-        | 0x80000000;
+pub unsafe fn write_config_32(bus: u8, dev: u8, func: u8, offset: u16, val: u32) {
+    if let Some(addr) = ecam_config_address(bus, dev, func, offset & !3) {
+        unsafe { core::ptr::write_volatile(addr as *mut u32, val) };
+        return;
+    }
+    if offset >= PCI_LEGACY_CONFIG_SIZE {
+        return;
+    }
     unsafe {
-        outl(PCI_CONFIG_ADDRESS, address);
+        outl(PCI_CONFIG_ADDRESS, legacy_config_address(bus, dev, func, offset));
         outl(PCI_CONFIG_DATA, val);
     }
 }
+
+/// The rest of the dword at `offset` to write back around a narrow write
+/// through port I/O. The Status register (0x06) is all RW1C bits, so writing
+/// back what was read would acknowledge every error it reports; zeros leave
+/// it alone.
+unsafe fn legacy_write_back(bus: u8, dev: u8, func: u8, offset: u16) -> u32 {
+    let old = unsafe { read_config_32(bus, dev, func, offset) };
+    if offset & !3 == 0x04 { old & 0xFFFF } else { old }
+}
+
+/// 16-bit write. Through port I/O this is a read-modify-write of the
+/// surrounding dword, with the Status half written as zeros.
+pub unsafe fn write_config_16(bus: u8, dev: u8, func: u8, offset: u16, val: u16) {
+    if let Some(addr) = ecam_config_address(bus, dev, func, offset & !1) {
+        unsafe { core::ptr::write_volatile(addr as *mut u16, val) };
+        return;
+    }
+    let shift = (offset & 2) * 8;
+    let old = unsafe { legacy_write_back(bus, dev, func, offset) };
+    let new = (old & !(0xFFFF << shift)) | ((val as u32) << shift);
+    unsafe { write_config_32(bus, dev, func, offset, new) };
+}
+
+pub unsafe fn write_config_8(bus: u8, dev: u8, func: u8, offset: u16, val: u8) {
+    if let Some(addr) = ecam_config_address(bus, dev, func, offset) {
+        unsafe { core::ptr::write_volatile(addr as *mut u8, val) };
+        return;
+    }
+    let shift = (offset & 3) * 8;
+    let old = unsafe { legacy_write_back(bus, dev, func, offset) };
+    let new = (old & !(0xFF << shift)) | ((val as u32) << shift);
+    unsafe { write_config_32(bus, dev, func, offset, new) };
+}
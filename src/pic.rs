@@ -57,6 +57,22 @@ pub unsafe fn init() {
     }
 }
 
+/// Unmask a single IRQ line. Lines on the slave PIC also unmask the cascade
+/// (IRQ 2) on the master.
+pub unsafe fn unmask(irq: u8) {
+    unsafe {
+        if irq < 8 {
+            let mask = inb(PIC1_DATA) & !(1 << irq);
+            outb(PIC1_DATA, mask);
+        } else {
+            let mask = inb(PIC2_DATA) & !(1 << (irq - 8));
+            outb(PIC2_DATA, mask);
+            let master = inb(PIC1_DATA) & !(1 << 2);
+            outb(PIC1_DATA, master);
+        }
+    }
+}
+
 pub unsafe fn notify_eoi(irq: u8) {
     unsafe {
         if irq >= 8 {
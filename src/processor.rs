@@ -32,15 +32,10 @@ use crate::io::{io_wait, outb};
 /// Maximum number of APs we support (BSP + 63 APs = 64 logical CPUs total).
 pub const MAX_AP_COUNT: usize = 63;
 
-/// Stack size for each AP kernel stack (16 KiB, 16-byte aligned).
+/// Stack size for each AP kernel stack (16 KiB). Each is mapped by
+/// `memory::alloc_kernel_stack` below an unmapped guard page.
 pub const AP_STACK_SIZE: usize = 16 * 1024;
 
-#[repr(align(16))]
-struct ApStack([u8; AP_STACK_SIZE]);
-
-/// Static backing storage for all AP kernel stacks.
-static mut AP_STACKS: [ApStack; MAX_AP_COUNT] = [const { ApStack([0; AP_STACK_SIZE]) }; MAX_AP_COUNT];
-
 // ─── Online CPU counter (atomic, updated by each AP on entry) ────────────────
 
 /// Number of APs that have fully come online (not counting the BSP).
@@ -160,6 +155,36 @@ unsafe fn icr_send(lapic_base: u64, dest_apic_id: u8, icr_low: u32) {
     }
 }
 
+/// Send a fixed interrupt with `vector` to the CPU with Local APIC ID
+/// `apic_id`.
+///
+/// # Safety
+/// `lapic_base` must be valid and `vector` must have a handler that EOIs.
+pub unsafe fn send_ipi(lapic_base: u64, apic_id: u8, vector: u8) {
+    unsafe {
+        icr_send(
+            lapic_base,
+            apic_id,
+            ICR_DELIVERY_FIXED | ICR_LEVEL_ASSERT | ICR_TRIGGER_EDGE | ICR_DEST_NONE | vector as u32,
+        );
+    }
+}
+
+/// Send a fixed interrupt with `vector` to every CPU but this one, e.g. to
+/// get idle APs out of `hlt`.
+///
+/// # Safety
+/// `lapic_base` must be valid and `vector` must have a handler that EOIs.
+pub unsafe fn send_ipi_others(lapic_base: u64, vector: u8) {
+    unsafe {
+        icr_send(
+            lapic_base,
+            0,
+            ICR_DELIVERY_FIXED | ICR_LEVEL_ASSERT | ICR_TRIGGER_EDGE | ICR_DEST_ALL_EXCL | vector as u32,
+        );
+    }
+}
+
 // ─── Trampoline ──────────────────────────────────────────────────────────────
 
 /// Physical address of the trampoline page (must be < 1 MiB and page-aligned).
@@ -485,6 +510,7 @@ pub unsafe extern "sysv64" fn ap_entry() {
             // 1. Load GDT & IDT for this CPU
             crate::gdt::init_cpu(my_cpu_index as usize);
             crate::interrupts::init_idt();
+            crate::memory::init_cpu();
 
             // 2. Enable this AP's Local APIC.
             let lapic_base = lapic_base_from_msr();
@@ -578,9 +604,9 @@ pub unsafe fn start_all_aps(madt: &MadtInfo, bsp_apic_id: u8) {
         }
 
         // Assign a unique stack for this AP.
-        let stack_top = unsafe {
-            let stack = &raw const AP_STACKS[ap_index] as *const ApStack;
-            (stack as u64) + AP_STACK_SIZE as u64
+        let Some(stack_top) = crate::memory::alloc_kernel_stack(AP_STACK_SIZE) else {
+            crate::println!("[SMP] OOM allocating stack, skipping APIC ID={}", apic_id);
+            continue;
         };
 
         crate::println!(
@@ -642,6 +668,18 @@ pub fn current_apic_id() -> u8 {
     ((apic_id_bits >> 24) & 0xFF) as u8
 }
 
+/// cpu_index of the calling CPU, looked up by its Local APIC ID. Unlike
+/// the GS-based per-CPU pointer this also works in an interrupt taken from
+/// user mode, where GS still holds the user's base.
+///
+/// # Safety
+/// The LAPIC must be mapped.
+pub unsafe fn cpu_index_by_apic() -> usize {
+    let apic_id = (unsafe { lapic_read(lapic_base_from_msr(), LAPIC_ID) } >> 24) as u8;
+    let slots = unsafe { &*core::ptr::addr_of!(PERCPU_DATA_SLOTS) };
+    slots.iter().position(|slot| slot.apic_id == apic_id).unwrap_or(0)
+}
+
 // ─── LAPIC timer (basic, for per-CPU periodic tick) ──────────────────────────
 
 /// Configure the Local APIC one-shot timer on the current CPU.
@@ -741,6 +779,8 @@ pub unsafe fn wrmsr(msr: u32, value: u64) {
 pub const MSR_IA32_EFER:        u32 = 0xC000_0080;
 /// IA32_APIC_BASE MSR number.
 pub const MSR_IA32_APIC_BASE:   u32 = 0x0000_001B;
+/// IA32_FS_BASE MSR number (user thread-local storage).
+pub const MSR_IA32_FS_BASE:     u32 = 0xC000_0100;
 /// IA32_GS_BASE MSR number (used for per-CPU data).
 pub const MSR_IA32_GS_BASE:     u32 = 0xC000_0101;
 /// IA32_KERNEL_GS_BASE MSR number.
@@ -2,7 +2,7 @@
 use alloc::boxed::Box;
 use alloc::vec::Vec;
 use core::arch::asm;
-use core::sync::atomic::{AtomicUsize, Ordering};
+use core::sync::atomic::{AtomicBool, AtomicUsize, Ordering};
 
 // Re-using the allocator from the crate
 
@@ -10,6 +10,8 @@ use core::sync::atomic::{AtomicUsize, Ordering};
 pub enum TaskStatus {
     Ready,
     Running,
+    /// Waiting for `wake`; never picked by `switch_task`.
+    Blocked,
     Terminated,
 }
 
@@ -21,17 +23,237 @@ pub struct Task {
     pub kernel_stack_bottom: u64,
     pub kernel_stack_top: u64,
     pub gs_base: u64, // User GS base value
+    pub fs_base: u64, // User FS base value (thread-local storage)
     pub user_rsp: u64, // User stack pointer value
     pub exit_code: usize,
+    pub cr3: u64, // Address space (PML4 physical address); 0 = runs in whichever is loaded
+    pub affinity: u64, // Bit n set: may run on the CPU with cpu_index n
+    pub last_cpu: usize, // cpu_index it last ran on; NO_CPU before its first run
+    pub policy: SchedPolicy,
+    pub vruntime: u64, // Fair class: TSC cycles run, scaled by NICE_0_WEIGHT / weight
+    pub run_start: u64, // TSC when it last got the CPU or was last charged
+    pub ready_seq: u64, // Real-time classes: queue position among equal priorities
+    /// Set while a CPU is executing on this task's kernel stack, from the
+    /// moment it is picked until `context_switch` has saved its stack
+    /// pointer. A task woken before that is Ready but must not be resumed
+    /// anywhere else yet.
+    on_cpu: AtomicBool,
+}
+
+impl Task {
+    fn may_run_on(&self, cpu: usize) -> bool {
+        self.affinity & (1 << cpu) != 0
+    }
+
+    /// Selection order on `cpu`, lowest first: real-time tasks by priority
+    /// and then queue position, then fair tasks by virtual runtime, less a
+    /// credit if their cache is still warm here.
+    fn rank(&self, cpu: usize) -> (u8, u64, u64) {
+        match self.policy {
+            SchedPolicy::Fifo { priority } | SchedPolicy::RoundRobin { priority } => {
+                (0, (RT_PRIORITY_MAX - priority) as u64, self.ready_seq)
+            }
+            SchedPolicy::Fair { .. } => {
+                let credit = if self.last_cpu == cpu { CACHE_HOT_CREDIT } else { 0 };
+                (1, self.vruntime.saturating_sub(credit), 0)
+            }
+        }
+    }
+}
+
+// ───────────────────────────────────────────────────────────────────────────
+// Scheduling classes
+// ───────────────────────────────────────────────────────────────────────────
+//
+// Tasks switch only when they call `switch_task` (yield, block or exit), so
+// the classes decide who runs next at those points:
+//
+// * Real-time tasks always go before fair ones, higher priority first.
+//   A FIFO task keeps the CPU across yields until it blocks, exits or a
+//   higher priority becomes ready; a round-robin task goes behind its
+//   equals every time it yields. A real-time task that spins waiting for a
+//   lower class starves it on that CPU.
+// * Fair tasks share what is left in proportion to their weight: each one
+//   accumulates virtual runtime (TSC cycles scaled by NICE_0_WEIGHT /
+//   weight) and the lowest goes next. A yielding fair task always lets
+//   another ready task run. Sleepers come back no further behind than
+//   SLEEPER_CREDIT, so they run soon without banking their sleep.
+//
+// Selection scans the task list, as it already must for affinity; with the
+// handful of tasks this kernel runs that beats keeping a sorted tree in step
+// with every status change.
+
+/// How a task is scheduled.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum SchedPolicy {
+    /// Weighted fair share; `nice` in NICE_MIN..=NICE_MAX, lower is heavier.
+    Fair { nice: i8 },
+    /// Real-time, fixed priority in 1..=RT_PRIORITY_MAX, higher first.
+    Fifo { priority: u8 },
+    /// Like Fifo, but yields to tasks of equal priority.
+    RoundRobin { priority: u8 },
+}
+
+impl SchedPolicy {
+    pub fn is_valid(self) -> bool {
+        match self {
+            SchedPolicy::Fair { nice } => (NICE_MIN..=NICE_MAX).contains(&nice),
+            SchedPolicy::Fifo { priority } | SchedPolicy::RoundRobin { priority } => {
+                (1..=RT_PRIORITY_MAX).contains(&priority)
+            }
+        }
+    }
+}
+
+pub const NICE_MIN: i8 = -20;
+pub const NICE_MAX: i8 = 19;
+pub const RT_PRIORITY_MAX: u8 = 99;
+
+const NICE_0_WEIGHT: u64 = 1024;
+
+/// Weight of each nice level from NICE_MIN up; each step is about 1.25x,
+/// so one level apart is roughly a 10% difference in CPU share.
+const NICE_WEIGHTS: [u64; 40] = [
+    88761, 71755, 56483, 46273, 36291, 29154, 23254, 18705, 14949, 11916,
+    9548, 7620, 6100, 4904, 3906, 3121, 2501, 1991, 1586, 1277,
+    1024, 820, 655, 526, 423, 335, 272, 215, 172, 137,
+    110, 87, 70, 56, 45, 36, 29, 23, 18, 15,
+];
+
+/// Virtual runtime a woken fair task may be behind the slowest runner.
+const SLEEPER_CREDIT: u64 = 3_000_000;
+
+/// Virtual runtime credit for a fair task on the CPU it last ran on.
+const CACHE_HOT_CREDIT: u64 = 500_000;
+
+fn rdtsc() -> u64 {
+    unsafe { core::arch::x86_64::_rdtsc() }
+}
+
+/// User-mode register state a new user task starts from. Registers not
+/// listed here start at zero.
+#[derive(Debug, Clone, Copy, Default)]
+pub struct UserContext {
+    pub rip: u64,
+    pub rsp: u64,
+    pub rflags: u64,
+    pub rbx: u64,
+    pub rbp: u64,
+    pub r12: u64,
+    pub r13: u64,
+    pub r14: u64,
+    pub r15: u64,
+    pub gs_base: u64,
+    pub fs_base: u64,
+}
+
+impl UserContext {
+    /// Fresh state for a task starting at `entry` on the stack `user_rsp`.
+    pub fn new(entry: u64, user_rsp: u64) -> Self {
+        Self {
+            rip: entry,
+            rsp: user_rsp,
+            rflags: 0x202,
+            ..Self::default()
+        }
+    }
 }
 
 pub struct Scheduler {
-    tasks: Vec<Task>,
+    /// Boxed so `switch_task` can hand `context_switch` pointers into a
+    /// task that stay valid after SCHEDULER_LOCK is dropped.
+    tasks: Vec<Box<Task>>,
+    /// Lower bound of the fair tasks' virtual runtimes; only grows.
+    min_vruntime: u64,
+    /// Next real-time queue position.
+    next_seq: u64,
 }
 
+impl Scheduler {
+    /// Index of the task running on this CPU, if any.
+    fn current_index(&self) -> Option<usize> {
+        let percpu = unsafe { crate::processor::get_percpu_data() };
+        if percpu.is_null() {
+            return None;
+        }
+        let index = unsafe { (*percpu).current_task_index };
+        (index != usize::MAX).then_some(index)
+    }
+
+    fn take_seq(&mut self) -> u64 {
+        self.next_seq += 1;
+        self.next_seq
+    }
+
+    /// Charge the task at `index` for the CPU time since its `run_start`.
+    /// A round-robin task that is still runnable goes behind its equals.
+    fn charge(&mut self, index: usize) {
+        let now = rdtsc();
+        let seq = self.take_seq();
+        let task = &mut self.tasks[index];
+        let ran = now.saturating_sub(task.run_start);
+        task.run_start = now;
+        match task.policy {
+            SchedPolicy::Fair { nice } => {
+                let weight = NICE_WEIGHTS[(nice - NICE_MIN) as usize];
+                task.vruntime += ran * NICE_0_WEIGHT / weight;
+            }
+            SchedPolicy::RoundRobin { .. } if task.status == TaskStatus::Running => task.ready_seq = seq,
+            _ => {}
+        }
+    }
+
+    /// What a task entering the ready set starts from: the back of its
+    /// real-time queue, and no less virtual runtime than the fair tasks
+    /// already there minus SLEEPER_CREDIT.
+    fn enqueue(&mut self, index: usize) {
+        let seq = self.take_seq();
+        let floor = self.min_vruntime.saturating_sub(SLEEPER_CREDIT);
+        let task = &mut self.tasks[index];
+        task.ready_seq = seq;
+        task.vruntime = task.vruntime.max(floor);
+    }
+
+    /// The task that should run next on `cpu`: the best-ranked Ready task
+    /// that may run here and is on no other CPU, or `current` itself if it is still runnable here
+    /// and a real-time task no other ranks ahead of. A runnable fair
+    /// `current` always gives way to another ready task.
+    fn pick_next(&self, current: usize, cpu: usize) -> Option<usize> {
+        let best = (0..self.tasks.len())
+            .filter(|&index| {
+                let task = &self.tasks[index];
+                task.status == TaskStatus::Ready
+                    && task.may_run_on(cpu)
+                    && (index == current || !task.on_cpu.load(Ordering::Acquire))
+            })
+            .min_by_key(|&index| self.tasks[index].rank(cpu));
+        let Some(current_task) = self.tasks.get(current) else {
+            return best;
+        };
+        let keeps = current_task.status == TaskStatus::Running
+            && current_task.may_run_on(cpu)
+            && !matches!(current_task.policy, SchedPolicy::Fair { .. })
+            && best.is_none_or(|best| current_task.rank(cpu) < self.tasks[best].rank(cpu));
+        if keeps { Some(current) } else { best }
+    }
+}
+
+/// Kernel stack of each user task, mapped below a guard page.
+pub const KERNEL_STACK_SIZE: usize = 16 * 1024;
+
+/// Affinity mask allowing every CPU.
+pub const ALL_CPUS: u64 = u64::MAX;
+const NO_CPU: usize = usize::MAX;
+
 static mut SCHEDULER: Option<Scheduler> = None;
 static NEXT_TASK_ID: AtomicUsize = AtomicUsize::new(1); // 0 is reserved for main kernel task
-static SCHEDULER_LOCK: crate::interrupts::InterruptSpinlock<()> = crate::interrupts::InterruptSpinlock::new(());
+static SCHEDULER_LOCK: crate::interrupts::InterruptSpinlock<()> =
+    crate::interrupts::InterruptSpinlock::named("SCHEDULER_LOCK", ());
+
+/// Saved stack pointer of each AP's scheduler loop, which the AP returns to
+/// when the task it runs may not stay and nothing else may run there. The
+/// BSP has none: its loop is task 0.
+static mut IDLE_STACKS: [u64; crate::processor::MAX_AP_COUNT + 1] = [0; crate::processor::MAX_AP_COUNT + 1];
 
 /// Initialize the global scheduler.
 /// This must be called only once.
@@ -40,6 +262,8 @@ pub unsafe fn init() {
     unsafe {
         SCHEDULER = Some(Scheduler {
             tasks: Vec::new(),
+            min_vruntime: 0,
+            next_seq: 0,
         });
     }
 
@@ -52,25 +276,48 @@ pub unsafe fn init() {
         kernel_stack_bottom: 0,
         kernel_stack_top: 0,
         gs_base: 0,
+        fs_base: 0,
         user_rsp: 0,
         exit_code: 0,
+        cr3: 0,
+        // The BSP's own loop stays on the BSP.
+        affinity: 1 << 0,
+        last_cpu: 0,
+        policy: SchedPolicy::Fair { nice: 0 },
+        vruntime: 0,
+        run_start: rdtsc(),
+        ready_seq: 0,
+        on_cpu: AtomicBool::new(true),
     };
 
     if let Some(scheduler) = unsafe { SCHEDULER.as_mut() } {
-        scheduler.tasks.push(main_task);
+        scheduler.tasks.push(Box::new(main_task));
     }
 }
 
-pub fn add_new_user_task(entry_point: u64, user_rsp: u64, stack_size: usize) -> usize {
+/// Start a user thread at `entry_point` in the caller's address space.
+pub fn add_new_user_task(entry_point: u64, user_rsp: u64, stack_size: usize) -> Option<usize> {
+    add_user_task(
+        crate::memory::current_pml4_phys(),
+        &UserContext::new(entry_point, user_rsp),
+        stack_size,
+    )
+}
+
+/// Start a user task in the address space rooted at `cr3` with the given
+/// register state and a guarded kernel stack of `stack_size` bytes. It
+/// inherits the calling task's affinity and scheduling policy. Returns the task ID, or None if
+/// the kernel stack could not be mapped.
+pub fn add_user_task(cr3: u64, context: &UserContext, stack_size: usize) -> Option<usize> {
+    // 1. Allocate Kernel Stack
+    let kernel_stack_top = crate::memory::alloc_kernel_stack(stack_size)?;
+    let kernel_stack_bottom = kernel_stack_top - stack_size as u64;
+
     let _guard = SCHEDULER_LOCK.lock();
     unsafe {
         if let Some(scheduler) = SCHEDULER.as_mut() {
             let id = NEXT_TASK_ID.fetch_add(1, Ordering::SeqCst);
 
-            // 1. Allocate Kernel Stack
-            let kernel_stack_bottom = crate::allocator::alloc(stack_size) as u64;
-            let kernel_stack_top = kernel_stack_bottom + stack_size as u64;
-
             // 2. Setup Stack Frame for IRETQ (to enter usermode)
             // We'll simulate a stack that context_switch can jump into.
             // When we switch TO this task, context_switch will 'ret' to our entry logic.
@@ -87,56 +334,86 @@ pub fn add_new_user_task(entry_point: u64, user_rsp: u64, stack_size: usize) ->
             sp = sp.sub(1);
             *sp = crate::gdt::USER_DATA_SEL as u64; // SS
             sp = sp.sub(1);
-            *sp = user_rsp; // RSP
+            *sp = context.rsp; // RSP
             sp = sp.sub(1);
-            *sp = 0x202; // RFLAGS
+            *sp = context.rflags; // RFLAGS
             sp = sp.sub(1);
             *sp = crate::gdt::USER_CODE_SEL as u64; // CS
             sp = sp.sub(1);
-            *sp = entry_point; // RIP
+            *sp = context.rip; // RIP
 
-            // Now push caller-saved registers that context_switch expects
+            // Now push the callee-saved registers that context_switch
+            // restores; they reach user mode untouched by the trampoline.
             sp = sp.sub(1);
             *sp = user_task_trampoline as *const () as u64; // RIP for context_switch 'ret'
             sp = sp.sub(1);
-            *sp = 0; // RBP
+            *sp = context.r15; // R15
             sp = sp.sub(1);
-            *sp = 0; // RBX
+            *sp = context.r14; // R14
             sp = sp.sub(1);
-            *sp = 0; // R12
+            *sp = context.r13; // R13
             sp = sp.sub(1);
-            *sp = 0; // R13
+            *sp = context.r12; // R12
             sp = sp.sub(1);
-            *sp = 0; // R14
+            *sp = context.rbx; // RBX
             sp = sp.sub(1);
-            *sp = 0; // R15
+            *sp = context.rbp; // RBP
 
+            let (affinity, policy) = scheduler
+                .current_index()
+                .map_or((ALL_CPUS, SchedPolicy::Fair { nice: 0 }), |i| {
+                    (scheduler.tasks[i].affinity, scheduler.tasks[i].policy)
+                });
             let task = Task {
                 id,
                 stack_top: sp as u64,
-                stack_bottom: user_rsp - stack_size as u64,
+                stack_bottom: context.rsp - stack_size as u64,
                 status: TaskStatus::Ready,
                 kernel_stack_bottom,
                 kernel_stack_top,
-                gs_base: 0,
-                user_rsp,
+                gs_base: context.gs_base,
+                fs_base: context.fs_base,
+                user_rsp: context.rsp,
                 exit_code: 0,
+                cr3,
+                affinity,
+                last_cpu: NO_CPU,
+                policy,
+                vruntime: 0,
+                run_start: 0,
+                ready_seq: 0,
+                on_cpu: AtomicBool::new(false),
             };
 
-            scheduler.tasks.push(task);
-            id
+            scheduler.tasks.push(Box::new(task));
+            scheduler.enqueue(scheduler.tasks.len() - 1);
+            Some(id)
         } else {
-            0
+            Some(0)
         }
     }
 }
 
 #[unsafe(naked)]
 unsafe extern "C" fn user_task_trampoline() {
-    core::arch::naked_asm!("swapgs", "iretq");
+    // Clear the scratch registers so no kernel values leak to user mode; a
+    // forked child also sees rax = 0 here as its return value.
+    core::arch::naked_asm!(
+        "xor eax, eax",
+        "xor ecx, ecx",
+        "xor edx, edx",
+        "xor esi, esi",
+        "xor edi, edi",
+        "xor r8d, r8d",
+        "xor r9d, r9d",
+        "xor r10d, r10d",
+        "xor r11d, r11d",
+        "swapgs",
+        "iretq",
+    );
 }
 
-pub fn add_new_task(entry_point: extern "C" fn(), stack_bottom: u64, stack_size: usize) {
+pub fn add_new_task(entry_point: extern "C" fn(), stack_bottom: u64, stack_size: usize) -> usize {
     let _guard = SCHEDULER_LOCK.lock();
     unsafe {
         if let Some(scheduler) = SCHEDULER.as_mut() {
@@ -188,11 +465,24 @@ pub fn add_new_task(entry_point: extern "C" fn(), stack_bottom: u64, stack_size:
                 kernel_stack_bottom: stack_bottom,
                 kernel_stack_top: stack_top,
                 gs_base: 0,
+                fs_base: 0,
                 user_rsp: 0,
                 exit_code: 0,
+                cr3: 0,
+                affinity: ALL_CPUS,
+                last_cpu: NO_CPU,
+                policy: SchedPolicy::Fair { nice: 0 },
+                vruntime: 0,
+                run_start: 0,
+                ready_seq: 0,
+                on_cpu: AtomicBool::new(false),
             };
 
-            scheduler.tasks.push(task);
+            scheduler.tasks.push(Box::new(task));
+            scheduler.enqueue(scheduler.tasks.len() - 1);
+            id
+        } else {
+            0
         }
     }
 }
@@ -207,37 +497,46 @@ pub fn switch_task() {
                 return;
             }
             let current_index = (*percpu).current_task_index;
-
-            // Round-robin: find next Ready task
-            let start_index = if current_index == usize::MAX { 0 } else { current_index };
-            let mut next_index = (start_index + 1) % scheduler.tasks.len();
-            let mut found = false;
-
-            // Loop once to find a ready task
-            for _ in 0..scheduler.tasks.len() {
-                if scheduler.tasks[next_index].status == TaskStatus::Ready {
-                    found = true;
-                    break;
-                }
-                next_index = (next_index + 1) % scheduler.tasks.len();
+            let cpu = (*percpu).cpu_index as usize;
+            if current_index != usize::MAX {
+                scheduler.charge(current_index);
             }
 
-            if !found {
-                // If no other task is Ready, check if current is still runnable.
-                if current_index != usize::MAX && scheduler.tasks[current_index].status == TaskStatus::Terminated {
-                    // We are terminated and no one else to run? deadlock/halt
-                    core::mem::drop(guard);
-                    crate::println!("All tasks could be terminated, or deadlock. Halting.");
-                    loop {
-                        core::arch::asm!("hlt");
+            let next_index = match scheduler.pick_next(current_index, cpu) {
+                Some(next_index) => next_index,
+                None if current_index == usize::MAX => return,
+                None => {
+                    let current = &mut scheduler.tasks[current_index];
+                    let must_leave = current.status == TaskStatus::Terminated || !current.may_run_on(cpu);
+                    if must_leave && IDLE_STACKS[cpu] != 0 {
+                        // Back to this AP's scheduler loop; another CPU
+                        // may pick the task up from there.
+                        if current.status == TaskStatus::Running {
+                            current.status = TaskStatus::Ready;
+                        }
+                        usize::MAX
+                    } else if current.status == TaskStatus::Terminated {
+                        // We are terminated and no one else to run? deadlock/halt
+                        core::mem::drop(guard);
+                        crate::println!("All tasks could be terminated, or deadlock. Halting.");
+                        loop {
+                            core::arch::asm!("hlt");
+                        }
+                    } else {
+                        // Just continue current task. A task that was about
+                        // to block keeps the CPU, so it must not look
+                        // runnable to other CPUs.
+                        if current.status == TaskStatus::Blocked {
+                            current.status = TaskStatus::Running;
+                        }
+                        return;
                     }
                 }
-                // Just continue current task
-                return;
-            }
+            };
 
             if next_index == current_index {
-                // No switch needed
+                // No switch needed (we were woken before we got to yield)
+                scheduler.tasks[current_index].status = TaskStatus::Running;
                 return;
             }
 
@@ -249,52 +548,67 @@ pub fn switch_task() {
                 }
             }
 
-            scheduler.tasks[next_index].status = TaskStatus::Running;
             (*percpu).current_task_index = next_index;
 
-            let mut dummy_sp = 0u64;
-            let old_stack_ref = if current_index != usize::MAX {
-                &mut scheduler.tasks[current_index].stack_top as *mut u64
+            let (old_stack_ref, old_on_cpu) = if current_index != usize::MAX {
+                let current = &mut scheduler.tasks[current_index];
+                (&mut current.stack_top as *mut u64, &current.on_cpu as *const AtomicBool)
             } else {
-                &mut dummy_sp as *mut u64
+                (&raw mut IDLE_STACKS[cpu], core::ptr::null())
             };
-            let new_stack = scheduler.tasks[next_index].stack_top;
 
-            // Update CPU's active kernel stack in PercpuData (so syscalls on this CPU use it)
-            let new_kernel_stack_top = scheduler.tasks[next_index].kernel_stack_top;
-            if new_kernel_stack_top != 0 {
-                (*percpu).kernel_stack = new_kernel_stack_top;
-
-                // Update TSS stack for the current CPU
-                let cpu_index = (*percpu).cpu_index as usize;
-                crate::gdt::set_tss_stack_cpu(cpu_index, new_kernel_stack_top);
-            }
-
-            // Save/Restore user stack pointer (so syscalls return to the correct stack)
+            // Save the outgoing task's user stack pointer, GS base (the
+            // inactive one while in kernel mode) and FS base, which the
+            // kernel itself never uses.
             if current_index != usize::MAX {
-                scheduler.tasks[current_index].user_rsp = (*percpu).user_stack;
+                let current = &mut scheduler.tasks[current_index];
+                current.user_rsp = (*percpu).user_stack;
+                current.gs_base = crate::processor::rdmsr(crate::processor::MSR_IA32_KERNEL_GS_BASE);
+                current.fs_base = crate::processor::rdmsr(crate::processor::MSR_IA32_FS_BASE);
             }
-            (*percpu).user_stack = scheduler.tasks[next_index].user_rsp;
 
-            // Save/Restore user GS base (inactive GS base when in kernel mode)
-            if current_index != usize::MAX {
-                let old_user_gs = crate::processor::rdmsr(crate::processor::MSR_IA32_KERNEL_GS_BASE);
-                scheduler.tasks[current_index].gs_base = old_user_gs;
-            }
+            let new_stack = if next_index == usize::MAX {
+                IDLE_STACKS[cpu]
+            } else {
+                if let SchedPolicy::Fair { .. } = scheduler.tasks[next_index].policy {
+                    scheduler.min_vruntime = scheduler.min_vruntime.max(scheduler.tasks[next_index].vruntime);
+                }
+                let next = &mut scheduler.tasks[next_index];
+                next.status = TaskStatus::Running;
+                next.on_cpu.store(true, Ordering::Relaxed);
+                next.last_cpu = cpu;
+                next.run_start = rdtsc();
+
+                // Update CPU's active kernel stack in PercpuData (so syscalls on this CPU use it)
+                if next.kernel_stack_top != 0 {
+                    (*percpu).kernel_stack = next.kernel_stack_top;
+
+                    // Update TSS stack for the current CPU
+                    crate::gdt::set_tss_stack_cpu(cpu, next.kernel_stack_top);
+                }
 
-            let new_user_gs = scheduler.tasks[next_index].gs_base;
-            crate::processor::wrmsr(crate::processor::MSR_IA32_KERNEL_GS_BASE, new_user_gs);
+                (*percpu).user_stack = next.user_rsp;
+                crate::processor::wrmsr(crate::processor::MSR_IA32_KERNEL_GS_BASE, next.gs_base);
+                crate::processor::wrmsr(crate::processor::MSR_IA32_FS_BASE, next.fs_base);
+
+                // Kernel tasks run in whatever address space is loaded.
+                if next.cr3 != 0 {
+                    crate::memory::switch_address_space(next.cr3);
+                }
+                next.stack_top
+            };
 
             // Drop SCHEDULER_LOCK immediately before context switch to prevent deadlock
             core::mem::drop(guard);
 
             // Perform the low-level switch
-            context_switch(old_stack_ref, new_stack);
+            context_switch(old_stack_ref, new_stack, old_on_cpu);
         }
     }
 }
 
 pub fn terminate_task(exit_code: usize) {
+    crate::futex::thread_exit(current_task_id());
     let guard = SCHEDULER_LOCK.lock();
     unsafe {
         if let Some(scheduler) = SCHEDULER.as_mut() {
@@ -316,9 +630,51 @@ pub fn terminate_task(exit_code: usize) {
     }
 }
 
+/// Mark the calling task as blocked. It keeps running until it next calls
+/// `switch_task`, and is not scheduled again until someone calls `wake` for
+/// it. A wake-up that arrives in between simply makes that yield a no-op,
+/// and no other CPU resumes the task until it has switched out.
+pub fn block_current() {
+    let _guard = SCHEDULER_LOCK.lock();
+    unsafe {
+        if let Some(scheduler) = SCHEDULER.as_mut() {
+            let percpu = crate::processor::get_percpu_data();
+            if !percpu.is_null() {
+                let current_index = (*percpu).current_task_index;
+                if current_index != usize::MAX {
+                    scheduler.tasks[current_index].status = TaskStatus::Blocked;
+                }
+            }
+        }
+    }
+}
+
+/// Make a blocked task runnable again. Safe to call from interrupt handlers;
+/// does nothing if the task is not blocked.
+pub fn wake(task_id: usize) {
+    let _guard = SCHEDULER_LOCK.lock();
+    unsafe {
+        if let Some(scheduler) = SCHEDULER.as_mut() {
+            if let Some(index) = scheduler.tasks.iter().position(|task| task.id == task_id) {
+                if scheduler.tasks[index].status == TaskStatus::Blocked {
+                    scheduler.tasks[index].status = TaskStatus::Ready;
+                    scheduler.enqueue(index);
+                }
+            }
+        }
+    }
+}
+
+/// Save the callee-saved registers and stack pointer of the running task to
+/// `old_stack_ptr`, then clear `old_on_cpu` (if not null) so other CPUs may
+/// resume it, and continue on `new_stack_ptr`.
 #[unsafe(naked)]
 #[unsafe(no_mangle)]
-unsafe extern "sysv64" fn context_switch(old_stack_ptr: *mut u64, new_stack_ptr: u64) {
+unsafe extern "sysv64" fn context_switch(
+    old_stack_ptr: *mut u64,
+    new_stack_ptr: u64,
+    old_on_cpu: *const AtomicBool,
+) {
     core::arch::naked_asm!(
         "push r15",
         "push r14",
@@ -328,6 +684,12 @@ unsafe extern "sysv64" fn context_switch(old_stack_ptr: *mut u64, new_stack_ptr:
         "push rbp",
         // Save current RSP to the old_stack_ptr location
         "mov [rdi], rsp",
+        // Stores are not reordered, so whoever sees the flag clear also
+        // sees the saved RSP.
+        "test rdx, rdx",
+        "jz 2f",
+        "mov byte ptr [rdx], 0",
+        "2:",
         // Load new RSP
         "mov rsp, rsi",
         "pop rbp",
@@ -340,6 +702,22 @@ unsafe extern "sysv64" fn context_switch(old_stack_ptr: *mut u64, new_stack_ptr:
     );
 }
 
+/// Whether any task other than the caller and the BSP's idle loop (task 0)
+/// is waiting to run. Blocking waits use this to decide whether halting the
+/// CPU would starve someone.
+pub fn has_other_ready_tasks() -> bool {
+    let _guard = SCHEDULER_LOCK.lock();
+    unsafe {
+        if let Some(scheduler) = SCHEDULER.as_ref() {
+            return scheduler
+                .tasks
+                .iter()
+                .any(|task| task.id != 0 && task.status == TaskStatus::Ready);
+        }
+        false
+    }
+}
+
 // Helper to get current task id
 pub fn current_task_id() -> usize {
     let _guard = SCHEDULER_LOCK.lock();
@@ -364,7 +742,7 @@ pub fn get_task_status(task_id: usize) -> usize {
             for task in &scheduler.tasks {
                 if task.id == task_id {
                     return match task.status {
-                        TaskStatus::Ready => 0,
+                        TaskStatus::Ready | TaskStatus::Blocked => 0,
                         TaskStatus::Running => 1,
                         TaskStatus::Terminated => 2,
                     };
@@ -389,6 +767,84 @@ pub fn get_task_exit_code(task_id: usize) -> usize {
     }
 }
 
+/// Mask of the CPUs that are running the scheduler: the BSP and every AP
+/// that came online.
+pub fn online_cpus() -> u64 {
+    let count = crate::processor::online_ap_count() as u64 + 1;
+    if count >= 64 { ALL_CPUS } else { (1 << count) - 1 }
+}
+
+/// Restrict `task_id` to the CPUs in `mask`. Fails if no online CPU is left
+/// in it or the task does not exist. A task moved off the CPU it is running
+/// on leaves at its next `switch_task`.
+pub fn set_affinity(task_id: usize, mask: u64) -> bool {
+    if mask & online_cpus() == 0 {
+        return false;
+    }
+    let _guard = SCHEDULER_LOCK.lock();
+    unsafe {
+        if let Some(scheduler) = SCHEDULER.as_mut() {
+            if let Some(task) = scheduler.tasks.iter_mut().find(|task| task.id == task_id) {
+                task.affinity = mask;
+                return true;
+            }
+        }
+        false
+    }
+}
+
+/// Affinity mask of `task_id`, if it exists.
+pub fn get_affinity(task_id: usize) -> Option<u64> {
+    let _guard = SCHEDULER_LOCK.lock();
+    unsafe {
+        SCHEDULER
+            .as_ref()?
+            .tasks
+            .iter()
+            .find(|task| task.id == task_id)
+            .map(|task| task.affinity)
+    }
+}
+
+/// Give `task_id` a new scheduling policy. It takes effect at the next
+/// `switch_task` on the task's CPU. Fails for an invalid policy or a task
+/// that does not exist.
+pub fn set_policy(task_id: usize, policy: SchedPolicy) -> bool {
+    if !policy.is_valid() {
+        return false;
+    }
+    let _guard = SCHEDULER_LOCK.lock();
+    unsafe {
+        if let Some(scheduler) = SCHEDULER.as_mut() {
+            if let Some(index) = scheduler.tasks.iter().position(|task| task.id == task_id) {
+                scheduler.tasks[index].policy = policy;
+                scheduler.enqueue(index);
+                return true;
+            }
+        }
+        false
+    }
+}
+
+/// Scheduling policy of `task_id`, if it exists.
+pub fn get_policy(task_id: usize) -> Option<SchedPolicy> {
+    let _guard = SCHEDULER_LOCK.lock();
+    unsafe {
+        SCHEDULER
+            .as_ref()?
+            .tasks
+            .iter()
+            .find(|task| task.id == task_id)
+            .map(|task| task.policy)
+    }
+}
+
+/// cpu_index of the calling CPU.
+pub fn current_cpu() -> usize {
+    let percpu = unsafe { crate::processor::get_percpu_data() };
+    if percpu.is_null() { 0 } else { unsafe { (*percpu).cpu_index as usize } }
+}
+
 pub fn run_ap_scheduler() -> ! {
     unsafe {
         core::arch::asm!("sti");
@@ -1,5 +1,6 @@
 use crate::gdt;
 use crate::print;
+use crate::xhci::XHCI_LOCK;
 use core::arch::asm;
 
 // MSR Constants
@@ -11,6 +12,7 @@ const MSR_KERNEL_GS_BASE: u32 = 0xC0000102;
 
 // EFER bits
 const EFER_SCE: u64 = 1; // System Call Extensions
+const EFER_NXE: u64 = 1 << 11; // No-Execute Enable
 
 #[repr(C)]
 pub struct KernelGsBase {
@@ -25,8 +27,6 @@ pub(crate) static mut KERNEL_GS_BASE: KernelGsBase = KernelGsBase {
     scratch: 0,
 };
 
-static XHCI_LOCK: crate::interrupts::InterruptSpinlock<()> = crate::interrupts::InterruptSpinlock::new(());
-
 pub unsafe fn get_global_gs_base() -> u64 {
     core::ptr::addr_of_mut!(KERNEL_GS_BASE) as u64
 }
@@ -41,9 +41,10 @@ static mut SYSCALL_STACK: AlignedStack = AlignedStack([0; 16384]);
 
 pub unsafe fn init_cpu() {
     unsafe {
-        // 1. Enable SCE in EFER
+        // 1. Enable SCE in EFER, and NXE so PAGE_NO_EXECUTE is honoured
+        //    (rather than a reserved bit) on every CPU
         let efer = crate::processor::rdmsr(MSR_EFER);
-        crate::processor::wrmsr(MSR_EFER, efer | EFER_SCE);
+        crate::processor::wrmsr(MSR_EFER, efer | EFER_SCE | EFER_NXE);
 
         // 2. Setup STAR
         // Kernel Code is 0x08.
@@ -140,7 +141,7 @@ extern "sysv64" fn syscall_dispatcher_impl(
     arg3: usize,
     arg4: usize,
     arg5: usize,
-    _arg6: usize,
+    arg6: usize,
 ) -> usize {
     match id {
         0 => {
@@ -172,10 +173,13 @@ extern "sysv64" fn syscall_dispatcher_impl(
             0
         }
         6 => {
-            // sys_xhci_poll()
-            let _guard = XHCI_LOCK.lock();
-            unsafe {
-                crate::xhci::process_events();
+            // sys_xhci_poll(): a no-op once interrupter 0 drives the event
+            // ring, kept so polled-mode systems still make progress.
+            if !crate::xhci::irq_enabled() {
+                let _guard = XHCI_LOCK.lock();
+                unsafe {
+                    crate::xhci::process_events();
+                }
             }
             0
         }
@@ -199,23 +203,23 @@ extern "sysv64" fn syscall_dispatcher_impl(
         }
         11 => {
             // sys_fsformat() -> i32
-            sys_fsformat() as usize
+            with_interrupts(|| sys_fsformat() as usize)
         }
         12 => {
             // sys_fsls(buf, max_entries) -> isize
-            sys_fsls(arg1, arg2) as usize
+            with_interrupts(|| sys_fsls(arg1, arg2) as usize)
         }
         13 => {
             // sys_fswrite(filename_ptr, filename_len, content_ptr, content_len) -> i32
-            sys_fswrite(arg1, arg2, arg3, arg4) as usize
+            with_interrupts(|| sys_fswrite(arg1, arg2, arg3, arg4) as usize)
         }
         14 => {
             // sys_fsread(filename_ptr, filename_len, buffer_ptr, buffer_len) -> isize
-            sys_fsread(arg1, arg2, arg3, arg4) as usize
+            with_interrupts(|| sys_fsread(arg1, arg2, arg3, arg4) as usize)
         }
         15 => {
             // sys_fsrm(filename_ptr, filename_len) -> i32
-            sys_fsrm(arg1, arg2) as usize
+            with_interrupts(|| sys_fsrm(arg1, arg2) as usize)
         }
         16 => {
             // sys_get_task_status(task_id) -> usize
@@ -237,6 +241,87 @@ extern "sysv64" fn syscall_dispatcher_impl(
             sys_write_region(arg1, arg2, arg3, arg4, arg5);
             0
         }
+        21 => {
+            // sys_input_read(events_ptr, max_events, cursor_ptr, flags) -> isize
+            sys_input_read(arg1, arg2, arg3, arg4) as usize
+        }
+        22 => {
+            // sys_input_ring() -> user address of the read-only event ring
+            crate::input::INPUT_RING_USER_VIRT as usize
+        }
+        23 => {
+            // sys_spawn(filename_ptr, filename_len, stack_size) -> task id
+            with_interrupts(|| sys_spawn(arg1, arg2, arg3))
+        }
+        24 => {
+            // sys_fork() -> child task id in the parent, 0 in the child
+            sys_fork()
+        }
+        25 => {
+            // sys_add_thread(entry, stack_size) -> task id
+            sys_add_thread(arg1, arg2)
+        }
+        26 => {
+            // sys_map_anon(size) -> user address, 0 on failure
+            sys_map_anon(arg1)
+        }
+        27 => {
+            // sys_mmap(addr, len, prot | flags, filename_ptr, filename_len, offset)
+            //   -> user address, 0 on failure
+            with_interrupts(|| sys_mmap(arg1, arg2, arg3, arg4, arg5, arg6))
+        }
+        28 => {
+            // sys_munmap(addr, len) -> 0, usize::MAX on failure
+            sys_munmap(arg1, arg2)
+        }
+        29 => {
+            // sys_mprotect(addr, len, prot) -> 0, usize::MAX on failure
+            sys_mprotect(arg1, arg2, arg3)
+        }
+        30 => {
+            // sys_clone_thread(entry, stack_size, tls, arg, exit_word) -> task id
+            sys_clone_thread(arg1, arg2, arg3, arg4, arg5)
+        }
+        31 => {
+            // sys_set_tls_base(which, base) -> 0, usize::MAX on failure
+            sys_set_tls_base(arg1, arg2)
+        }
+        32 => {
+            // sys_futex_wait(addr, expected) -> 0 woken, 1 value changed
+            sys_futex_wait(arg1, arg2)
+        }
+        33 => {
+            // sys_futex_wake(addr, count) -> tasks woken
+            sys_futex_wake(arg1, arg2)
+        }
+        34 => {
+            // sys_set_affinity(task_id, mask) -> 0, usize::MAX on failure
+            sys_set_affinity(arg1, arg2)
+        }
+        35 => {
+            // sys_get_affinity(task_id) -> mask, 0 if there is no such task
+            sys_get_affinity(arg1)
+        }
+        36 => {
+            // sys_current_cpu() -> index of the CPU the caller runs on
+            crate::scheduler::current_cpu()
+        }
+        37 => {
+            // sys_online_cpus() -> mask of the CPUs running the scheduler
+            crate::scheduler::online_cpus() as usize
+        }
+        38 => {
+            // sys_set_scheduler(task_id, policy, param) -> 0, usize::MAX on failure
+            sys_set_scheduler(arg1, arg2, arg3)
+        }
+        39 => {
+            // sys_get_scheduler(task_id) -> policy << 32 | param as u32, usize::MAX on failure
+            sys_get_scheduler(arg1)
+        }
+        40 => {
+            // sys_lockstat(reset) -> locks printed, usize::MAX without lockstat
+            crate::lockstat::dump(arg1 != 0).unwrap_or(usize::MAX)
+        }
         _ => {
             // Unknown syscall
             let _ = crate::println!("Unknown syscall: {}", id);
@@ -249,7 +334,38 @@ use core::alloc::Layout;
 use core::slice;
 use core::str;
 
+/// Run `f` with interrupts on. Syscalls enter with them masked (SFMASK),
+/// and a task with interrupts off never parks on a contended `Mutex`; the
+/// filesystem and block paths hold no spinlock between their mutexes, so
+/// they run with interrupts on and a waiter sleeps instead of spinning
+/// through someone else's disk I/O. Taking interrupts there also lets this
+/// CPU answer TLB shootdowns meanwhile.
+fn with_interrupts<R>(f: impl FnOnce() -> R) -> R {
+    unsafe { asm!("sti", options(nomem, nostack)) };
+    let result = f();
+    unsafe { asm!("cli", options(nomem, nostack)) };
+    result
+}
+
+/// Touch every page of a user buffer before the kernel reads it under a
+/// lock. Demand-paged image pages are filled by the page-fault handler,
+/// which reads files through the block layer's I/O queue locks, so they must
+/// not first fault in with one of those (or any lock the fill path may need)
+/// already held.
+fn prefault_user(ptr: usize, len: usize) {
+    if len == 0 {
+        return;
+    }
+    let mut page = ptr & !0xFFF;
+    while page < ptr + len {
+        let addr = page.max(ptr);
+        unsafe { core::ptr::read_volatile(addr as *const u8) };
+        page += 4096;
+    }
+}
+
 fn sys_print(ptr: usize, len: usize) {
+    prefault_user(ptr, len);
     let slice = unsafe { slice::from_raw_parts(ptr as *const u8, len) };
     match str::from_utf8(slice) {
         Ok(s) => {
@@ -294,9 +410,250 @@ fn sys_free(ptr: usize) {
 }
 
 fn sys_add_task(entry: usize, user_rsp: usize) -> usize {
-    // We assume stack size 16KB for new user tasks
-    let stack_size = 16384;
-    crate::scheduler::add_new_user_task(entry as u64, user_rsp as u64, stack_size)
+    let stack_size = crate::scheduler::KERNEL_STACK_SIZE;
+    crate::scheduler::add_new_user_task(entry as u64, user_rsp as u64, stack_size).unwrap_or(usize::MAX)
+}
+
+/// Start a thread at `entry` in the caller's address space on a fresh,
+/// guarded user stack that may grow to `stack_size` bytes. Returns the task
+/// ID, or usize::MAX on failure.
+fn sys_add_thread(entry: usize, stack_size: usize) -> usize {
+    if stack_size == 0 || stack_size as u64 > crate::kef::KEF_MAX_STACK_SIZE {
+        return usize::MAX;
+    }
+    let space = crate::memory::current_pml4_phys();
+    let Some(user_rsp) = crate::memory::alloc_user_stack(space, stack_size as u64) else {
+        return usize::MAX;
+    };
+    let kernel_stack_size = crate::scheduler::KERNEL_STACK_SIZE;
+    crate::scheduler::add_new_user_task(entry as u64, user_rsp, kernel_stack_size).unwrap_or(usize::MAX)
+}
+
+/// Start a thread in the caller's address space on a fresh, guarded user
+/// stack of up to `stack_size` bytes. It begins at `entry` with `arg` in r12
+/// and its FS base at `tls`. If `exit_word` is not 0, the u32 there is set
+/// to 0 and futex-woken when the thread terminates. Returns the task ID, or
+/// usize::MAX on failure.
+fn sys_clone_thread(entry: usize, stack_size: usize, tls: usize, arg: usize, exit_word: usize) -> usize {
+    if stack_size == 0 || stack_size as u64 > crate::kef::KEF_MAX_STACK_SIZE {
+        return usize::MAX;
+    }
+    let space = crate::memory::current_pml4_phys();
+    let Some(user_rsp) = crate::memory::alloc_user_stack(space, stack_size as u64) else {
+        return usize::MAX;
+    };
+    let context = crate::scheduler::UserContext {
+        r12: arg as u64,
+        fs_base: tls as u64,
+        ..crate::scheduler::UserContext::new(entry as u64, user_rsp)
+    };
+    let kernel_stack_size = crate::scheduler::KERNEL_STACK_SIZE;
+    crate::futex::start_with_exit_word(space, exit_word as u64, || {
+        crate::scheduler::add_user_task(space, &context, kernel_stack_size)
+    })
+    .unwrap_or(usize::MAX)
+}
+
+/// Set the calling thread's FS (`which` = 0) or GS (`which` = 1) base.
+/// Returns 0, or usize::MAX for another `which` or a non-canonical base.
+fn sys_set_tls_base(which: usize, base: usize) -> usize {
+    // Bits 63..47 all equal.
+    let canonical = ((base as i64) << 16 >> 16) as usize == base;
+    if !canonical {
+        return usize::MAX;
+    }
+    let msr = match which {
+        0 => crate::processor::MSR_IA32_FS_BASE,
+        // The user GS base is the inactive one while in the kernel.
+        1 => crate::processor::MSR_IA32_KERNEL_GS_BASE,
+        _ => return usize::MAX,
+    };
+    unsafe { crate::processor::wrmsr(msr, base as u64) };
+    0
+}
+
+/// Sleep until `sys_futex_wake` on `addr` if the u32 there still equals
+/// `expected`. Returns 0 once woken (or spuriously), 1 if the value had
+/// already changed, usize::MAX if `addr` is not 4-byte aligned.
+fn sys_futex_wait(addr: usize, expected: usize) -> usize {
+    if addr % 4 != 0 {
+        return usize::MAX;
+    }
+    crate::futex::wait(addr as u64, expected as u32)
+}
+
+/// Wake up to `count` threads waiting on `addr`. Returns how many woke.
+fn sys_futex_wake(addr: usize, count: usize) -> usize {
+    crate::futex::wake(addr as u64, count)
+}
+
+/// Let task `task_id` (0: the caller) run only on the CPUs whose bits are
+/// set in `mask`. A caller that excludes its own CPU moves before this
+/// returns. Returns 0, or usize::MAX if the task does not exist or no
+/// online CPU is in `mask`.
+fn sys_set_affinity(task_id: usize, mask: usize) -> usize {
+    let current = crate::scheduler::current_task_id();
+    let task_id = if task_id == 0 { current } else { task_id };
+    if !crate::scheduler::set_affinity(task_id, mask as u64) {
+        return usize::MAX;
+    }
+    if task_id == current && mask as u64 & (1 << crate::scheduler::current_cpu()) == 0 {
+        crate::scheduler::switch_task();
+    }
+    0
+}
+
+fn sys_get_affinity(task_id: usize) -> usize {
+    let task_id = if task_id == 0 { crate::scheduler::current_task_id() } else { task_id };
+    crate::scheduler::get_affinity(task_id).unwrap_or(0) as usize
+}
+
+/// Policy numbers of `sys_set_scheduler`/`sys_get_scheduler`.
+const SCHED_FAIR: usize = 0;
+const SCHED_FIFO: usize = 1;
+const SCHED_RR: usize = 2;
+
+/// Set the scheduling policy of task `task_id` (0: the caller). `param` is
+/// the nice value (-20..=19, as a signed integer) for SCHED_FAIR and the
+/// priority (1..=99) for SCHED_FIFO and SCHED_RR. Returns 0, or usize::MAX
+/// for a bad policy or parameter or an unknown task.
+fn sys_set_scheduler(task_id: usize, policy: usize, param: usize) -> usize {
+    use crate::scheduler::SchedPolicy;
+    let task_id = if task_id == 0 { crate::scheduler::current_task_id() } else { task_id };
+    let param = param as isize;
+    let policy = match policy {
+        SCHED_FAIR if (i8::MIN as isize..=i8::MAX as isize).contains(&param) => SchedPolicy::Fair { nice: param as i8 },
+        SCHED_FIFO if (0..=u8::MAX as isize).contains(&param) => SchedPolicy::Fifo { priority: param as u8 },
+        SCHED_RR if (0..=u8::MAX as isize).contains(&param) => SchedPolicy::RoundRobin { priority: param as u8 },
+        _ => return usize::MAX,
+    };
+    if crate::scheduler::set_policy(task_id, policy) { 0 } else { usize::MAX }
+}
+
+/// The policy of task `task_id` (0: the caller) in the upper 32 bits and
+/// its parameter, as an i32, in the lower 32. usize::MAX if there is no
+/// such task.
+fn sys_get_scheduler(task_id: usize) -> usize {
+    use crate::scheduler::SchedPolicy;
+    let task_id = if task_id == 0 { crate::scheduler::current_task_id() } else { task_id };
+    let (policy, param) = match crate::scheduler::get_policy(task_id) {
+        Some(SchedPolicy::Fair { nice }) => (SCHED_FAIR, nice as i32),
+        Some(SchedPolicy::Fifo { priority }) => (SCHED_FIFO, priority as i32),
+        Some(SchedPolicy::RoundRobin { priority }) => (SCHED_RR, priority as i32),
+        None => return usize::MAX,
+    };
+    policy << 32 | param as u32 as usize
+}
+
+/// Map `size` bytes of zeroed, writable memory into the caller's address
+/// space at an address of the kernel's choosing. Returns the address, or 0
+/// on failure. User allocators take their arenas from here.
+fn sys_map_anon(size: usize) -> usize {
+    use crate::mmap::{PROT_READ, PROT_WRITE};
+    let space = crate::memory::current_pml4_phys();
+    crate::mmap::map(space, 0, size as u64, PROT_READ | PROT_WRITE, 0, None).unwrap_or(0) as usize
+}
+
+/// Map `len` bytes into the caller's address space. `prot_flags` holds the
+/// PROT_* bits and MAP_FIXED. With an empty file name the memory is
+/// anonymous and zeroed; otherwise it shows the file from `offset` on.
+/// Returns the address, or 0 on failure.
+fn sys_mmap(
+    addr: usize,
+    len: usize,
+    prot_flags: usize,
+    filename_ptr: usize,
+    filename_len: usize,
+    offset: usize,
+) -> usize {
+    use crate::mmap::MAP_FIXED;
+    let prot_flags = prot_flags as u64;
+    let (prot, flags) = (prot_flags & !MAP_FIXED, prot_flags & MAP_FIXED);
+    let space = crate::memory::current_pml4_phys();
+    if filename_len == 0 {
+        return crate::mmap::map(space, addr as u64, len as u64, prot, flags, None).unwrap_or(0) as usize;
+    }
+    prefault_user(filename_ptr, filename_len);
+    let name_slice = unsafe { core::slice::from_raw_parts(filename_ptr as *const u8, filename_len) };
+    let Ok(filename) = core::str::from_utf8(name_slice) else {
+        return 0;
+    };
+    let file = Some((filename, offset as u64));
+    crate::mmap::map(space, addr as u64, len as u64, prot, flags, file).unwrap_or(0) as usize
+}
+
+fn sys_munmap(addr: usize, len: usize) -> usize {
+    let space = crate::memory::current_pml4_phys();
+    if crate::mmap::unmap(space, addr as u64, len as u64) { 0 } else { usize::MAX }
+}
+
+fn sys_mprotect(addr: usize, len: usize, prot: usize) -> usize {
+    let space = crate::memory::current_pml4_phys();
+    if crate::mmap::protect(space, addr as u64, len as u64, prot as u64) { 0 } else { usize::MAX }
+}
+
+/// Load a KEF file into a new address space and start it with a stack of up
+/// to `stack_size` bytes (0: as the file asks). Returns the task ID, or
+/// usize::MAX on failure.
+fn sys_spawn(filename_ptr: usize, filename_len: usize, stack_size: usize) -> usize {
+    prefault_user(filename_ptr, filename_len);
+    let name_slice = unsafe { core::slice::from_raw_parts(filename_ptr as *const u8, filename_len) };
+    let Ok(filename) = core::str::from_utf8(name_slice) else {
+        return usize::MAX;
+    };
+    match crate::kef::spawn_kef_file(filename, stack_size as u64) {
+        Ok(id) => id,
+        Err(e) => {
+            crate::println!("spawn {}: {}", filename, e);
+            usize::MAX
+        }
+    }
+}
+
+/// User registers `syscall_handler` pushes at the top of the kernel stack,
+/// lowest address first.
+#[repr(C)]
+struct SyscallSavedRegs {
+    r15: u64,
+    r14: u64,
+    r13: u64,
+    r12: u64,
+    rbx: u64,
+    rbp: u64,
+    rip: u64,    // rcx
+    rflags: u64, // r11
+}
+
+/// Duplicate the calling task's address space copy-on-write and start a
+/// task in the copy that resumes from this syscall with rax = 0. Returns the
+/// child's task ID, or usize::MAX on failure.
+fn sys_fork() -> usize {
+    let parent = crate::memory::current_pml4_phys();
+    let Some(child) = crate::memory::fork_address_space(parent) else {
+        return usize::MAX;
+    };
+    crate::kef::fork_images(parent, child);
+    crate::mmap::fork_mappings(parent, child);
+
+    let context = unsafe {
+        let percpu = crate::processor::get_percpu_data();
+        let regs = &*(((*percpu).kernel_stack as usize - core::mem::size_of::<SyscallSavedRegs>())
+            as *const SyscallSavedRegs);
+        crate::scheduler::UserContext {
+            rip: regs.rip,
+            rsp: (*percpu).user_stack,
+            rflags: regs.rflags,
+            rbx: regs.rbx,
+            rbp: regs.rbp,
+            r12: regs.r12,
+            r13: regs.r13,
+            r14: regs.r14,
+            r15: regs.r15,
+            gs_base: crate::processor::rdmsr(crate::processor::MSR_IA32_KERNEL_GS_BASE),
+            fs_base: crate::processor::rdmsr(crate::processor::MSR_IA32_FS_BASE),
+        }
+    };
+    crate::scheduler::add_user_task(child, &context, crate::scheduler::KERNEL_STACK_SIZE).unwrap_or(usize::MAX)
 }
 
 fn sys_switch_task() {
@@ -316,12 +673,27 @@ fn sys_shutdown() {
 }
 
 fn sys_read_key() -> usize {
-    let _guard = XHCI_LOCK.lock();
-    if let Some(key) = crate::xhci::get_key() {
-        key as usize
-    } else {
-        0
+    crate::input::read_ascii().map_or(0, |key| key as usize)
+}
+
+/// Copy up to `max_events` input events after `*cursor_ptr` into the user
+/// buffer and advance the cursor. Unless `INPUT_READ_NONBLOCK` is set, waits
+/// for at least one event. Returns the number copied, or -1 on bad pointers.
+fn sys_input_read(events_ptr: usize, max_events: usize, cursor_ptr: usize, flags: usize) -> isize {
+    use crate::input::{self, InputEvent};
+
+    if events_ptr == 0 || cursor_ptr == 0 || max_events == 0 {
+        return -1;
     }
+    let events = unsafe { slice::from_raw_parts_mut(events_ptr as *mut InputEvent, max_events) };
+    let cursor = unsafe { &mut *(cursor_ptr as *mut u64) };
+
+    let mut n = input::read(cursor, events);
+    while n == 0 && flags & input::INPUT_READ_NONBLOCK == 0 {
+        input::wait(*cursor);
+        n = input::read(cursor, events);
+    }
+    n as isize
 }
 
 fn sys_clear() {
@@ -424,10 +796,12 @@ fn sys_fswrite(
     content_ptr: usize,
     content_len: usize,
 ) -> i32 {
+    prefault_user(filename_ptr, filename_len);
     let name_slice = unsafe { core::slice::from_raw_parts(filename_ptr as *const u8, filename_len) };
     let Ok(filename) = core::str::from_utf8(name_slice) else {
         return crate::fs::FsError::InvalidArgument.code();
     };
+    prefault_user(content_ptr, content_len);
     let content = unsafe { core::slice::from_raw_parts(content_ptr as *const u8, content_len) };
     match crate::fs::create_file(filename, content) {
         Ok(()) => 0,
@@ -441,6 +815,7 @@ fn sys_fsread(
     buffer_ptr: usize,
     buffer_len: usize,
 ) -> isize {
+    prefault_user(filename_ptr, filename_len);
     let name_slice = unsafe { core::slice::from_raw_parts(filename_ptr as *const u8, filename_len) };
     let Ok(filename) = core::str::from_utf8(name_slice) else {
         return crate::fs::FsError::InvalidArgument.code() as isize;
@@ -461,6 +836,7 @@ fn sys_fsread(
 }
 
 fn sys_fsrm(filename_ptr: usize, filename_len: usize) -> i32 {
+    prefault_user(filename_ptr, filename_len);
     let name_slice = unsafe { core::slice::from_raw_parts(filename_ptr as *const u8, filename_len) };
     let Ok(filename) = core::str::from_utf8(name_slice) else {
         return crate::fs::FsError::InvalidArgument.code();
@@ -525,6 +901,8 @@ fn sys_write_region(
         return;
     }
 
+    prefault_user(ptr, byte_len);
+
     // Safety: bounds checked above; userspace owns this memory
     let raw = unsafe {
         core::slice::from_raw_parts(ptr as *const u32, len * 3)
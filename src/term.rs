@@ -6,7 +6,7 @@ const CELL_W: usize = 8;
 const CELL_H: usize = 16; // matches your new_line() stride
 
 pub static GLOBAL_CELL_RENDERER: InterruptSpinlock<Option<CellRenderer>> =
-    InterruptSpinlock::new(None);
+    InterruptSpinlock::named("GLOBAL_CELL_RENDERER", None);
 
 pub fn init() {
     let info = crate::writer::get_framebuffer_info()
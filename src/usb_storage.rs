@@ -0,0 +1,408 @@
+#![allow(dead_code)]
+
+use crate::block::{self, BlockBackend, BlockDevice};
+use crate::println;
+use crate::xhci::{self, UsbInterface};
+use alloc::boxed::Box;
+
+// ============================================================================
+// USB Mass Storage, Bulk-Only Transport
+// ============================================================================
+//
+// Every command is three bulk transfers: a 31-byte Command Block Wrapper
+// (CBW) on the OUT pipe, an optional data stage, and a 13-byte Command
+// Status Wrapper (CSW) on the IN pipe. The command blocks are SCSI (SBC).
+// Each LUN that reports a capacity is registered as a block device.
+//
+// Like the NVMe driver, this does no locking of its own: the block layer's
+// callers (the filesystem) serialise access to a device.
+
+pub const MAX_USB_STORAGE_DEVICES: usize = 4;
+
+/// Largest data stage issued per command; bigger requests are split by the
+/// block layer.
+pub const USB_STORAGE_MAX_TRANSFER: usize = 64 * 1024;
+
+const USB_CLASS_MASS_STORAGE: u8 = 0x08;
+const USB_MSC_SUBCLASS_SCSI: u8 = 0x06;
+const USB_MSC_PROTOCOL_BOT: u8 = 0x50;
+
+const CBW_SIGNATURE: u32 = 0x4342_5355; // "USBC"
+const CSW_SIGNATURE: u32 = 0x5342_5355; // "USBS"
+const CBW_FLAG_DATA_IN: u8 = 0x80;
+
+const CSW_STATUS_PASSED: u8 = 0;
+const CSW_STATUS_FAILED: u8 = 1;
+const CSW_STATUS_PHASE_ERROR: u8 = 2;
+
+// SCSI opcodes
+const SCSI_TEST_UNIT_READY: u8 = 0x00;
+const SCSI_REQUEST_SENSE: u8 = 0x03;
+const SCSI_INQUIRY: u8 = 0x12;
+const SCSI_READ_CAPACITY_10: u8 = 0x25;
+const SCSI_READ_10: u8 = 0x28;
+const SCSI_WRITE_10: u8 = 0x2A;
+const SCSI_READ_16: u8 = 0x88;
+const SCSI_WRITE_16: u8 = 0x8A;
+const SCSI_SERVICE_ACTION_IN_16: u8 = 0x9E;
+const SCSI_SAI_READ_CAPACITY_16: u8 = 0x10;
+
+/// TEST UNIT READY attempts while a freshly attached unit reports
+/// UNIT ATTENTION / becoming ready.
+const UNIT_READY_RETRIES: usize = 5;
+
+#[repr(C, packed)]
+#[derive(Clone, Copy)]
+struct CommandBlockWrapper {
+    signature: u32,
+    tag: u32,
+    data_transfer_length: u32,
+    flags: u8,
+    lun: u8,
+    cb_length: u8,
+    cb: [u8; 16],
+}
+
+#[repr(C, packed)]
+#[derive(Clone, Copy)]
+struct CommandStatusWrapper {
+    signature: u32,
+    tag: u32,
+    data_residue: u32,
+    status: u8,
+}
+
+/// Buffers the controller reads and writes; boxed so they live on the
+/// identity-mapped kernel heap.
+#[repr(C, align(64))]
+struct BotBuffers {
+    cbw: CommandBlockWrapper,
+    csw: CommandStatusWrapper,
+    /// Small data stages (INQUIRY, READ CAPACITY, REQUEST SENSE).
+    scratch: [u8; 64],
+}
+
+struct UsbStorageDevice {
+    slot_id: u8,
+    interface: u8,
+    bulk_in: u8,
+    bulk_out: u8,
+    max_lun: u8,
+    tag: u32,
+    buffers: Box<BotBuffers>,
+}
+
+static mut USB_STORAGE_DEVICES: [Option<UsbStorageDevice>; MAX_USB_STORAGE_DEVICES] =
+    [const { None }; MAX_USB_STORAGE_DEVICES];
+
+fn device_mut(index: usize) -> Option<&'static mut UsbStorageDevice> {
+    if index >= MAX_USB_STORAGE_DEVICES {
+        return None;
+    }
+    unsafe { (*core::ptr::addr_of_mut!(USB_STORAGE_DEVICES))[index].as_mut() }
+}
+
+/// SCSI-over-BOT interfaces are ours; UAS and other command sets are not.
+pub fn matches(interface: &UsbInterface) -> bool {
+    interface.class == USB_CLASS_MASS_STORAGE
+        && interface.sub_class == USB_MSC_SUBCLASS_SCSI
+        && interface.protocol == USB_MSC_PROTOCOL_BOT
+}
+
+/// Configure the bulk pipes of a BOT interface and register every LUN that
+/// answers READ CAPACITY as a block device. Called from xHCI enumeration
+/// after SET_CONFIGURATION.
+pub unsafe fn probe(slot_id: u8, interface: &UsbInterface) -> Result<(), &'static str> {
+    let bulk_in = interface
+        .find_endpoint(xhci::USB_ENDPOINT_BULK, true)
+        .ok_or("no bulk IN endpoint")?;
+    let bulk_out = interface
+        .find_endpoint(xhci::USB_ENDPOINT_BULK, false)
+        .ok_or("no bulk OUT endpoint")?;
+
+    let devices = unsafe { &mut *core::ptr::addr_of_mut!(USB_STORAGE_DEVICES) };
+    let index = devices
+        .iter()
+        .position(|d| d.is_none())
+        .ok_or("too many mass storage devices")?;
+
+    if !unsafe { xhci::configure_endpoints(slot_id, &[bulk_in, bulk_out]) } {
+        return Err("failed to configure bulk endpoints");
+    }
+
+    devices[index] = Some(UsbStorageDevice {
+        slot_id,
+        interface: interface.number,
+        bulk_in: bulk_in.dci(),
+        bulk_out: bulk_out.dci(),
+        max_lun: 0,
+        tag: 0,
+        buffers: Box::new(BotBuffers {
+            cbw: CommandBlockWrapper {
+                signature: 0,
+                tag: 0,
+                data_transfer_length: 0,
+                flags: 0,
+                lun: 0,
+                cb_length: 0,
+                cb: [0; 16],
+            },
+            csw: CommandStatusWrapper {
+                signature: 0,
+                tag: 0,
+                data_residue: 0,
+                status: 0,
+            },
+            scratch: [0; 64],
+        }),
+    });
+    let dev = device_mut(index).ok_or("device vanished")?;
+    dev.max_lun = unsafe { get_max_lun(slot_id, interface.number) };
+    println!(
+        "usb-storage: slot {} interface {}: bulk IN {:#x}, OUT {:#x}, {} LUN(s)",
+        slot_id,
+        interface.number,
+        bulk_in.address,
+        bulk_out.address,
+        dev.max_lun as u32 + 1
+    );
+
+    for lun in 0..=dev.max_lun {
+        match unsafe { probe_lun(dev, lun) } {
+            Ok((block_count, block_size)) => {
+                let registered = block::register(BlockDevice {
+                    backend: BlockBackend::UsbStorage { device: index, lun },
+                    block_size,
+                    block_count,
+                });
+                match registered {
+                    Ok(id) => println!(
+                        "usb-storage: LUN {}: {} blocks of {} bytes -> block device {}",
+                        lun, block_count, block_size, id
+                    ),
+                    Err(_) => println!("usb-storage: LUN {}: block device table full", lun),
+                }
+            }
+            Err(msg) => println!("usb-storage: LUN {}: {}", lun, msg),
+        }
+    }
+    Ok(())
+}
+
+/// GET MAX LUN; devices with a single LUN may STALL it, which means LUN 0.
+unsafe fn get_max_lun(slot_id: u8, interface: u8) -> u8 {
+    let setup: [u8; 8] = [
+        0xA1, // bmRequestType: Device-to-Host, Class, Interface
+        0xFE, // bRequest: GET MAX LUN
+        0x00, 0x00, // wValue
+        interface, 0x00, // wIndex: Interface
+        0x01, 0x00, // wLength: 1
+    ];
+    let buffer = core::ptr::addr_of_mut!(xhci::USB_DATA_BUFFER) as *mut u8;
+    let code = unsafe {
+        *buffer = 0;
+        xhci::control_transfer(slot_id, setup, buffer, 1, true)
+    };
+    if code == xhci::COMPLETION_SUCCESS {
+        unsafe { (*buffer).min(15) }
+    } else {
+        0
+    }
+}
+
+/// Wait for the unit to become ready and read its capacity.
+unsafe fn probe_lun(dev: &mut UsbStorageDevice, lun: u8) -> Result<(u64, u32), &'static str> {
+    let mut inquiry = [0u8; 16];
+    inquiry[0] = SCSI_INQUIRY;
+    inquiry[4] = 36;
+    unsafe { command_scratch(dev, lun, &inquiry[..6], 36)? };
+    let peripheral_type = dev.buffers.scratch[0] & 0x1F;
+    if peripheral_type != 0x00 && peripheral_type != 0x0E {
+        // Only direct-access (and simplified direct-access) block devices.
+        return Err("not a direct-access device");
+    }
+
+    let mut ready = false;
+    for _ in 0..UNIT_READY_RETRIES {
+        let tur = [SCSI_TEST_UNIT_READY, 0, 0, 0, 0, 0];
+        if unsafe { command(dev, lun, &tur, core::ptr::null_mut(), 0, false) }.is_ok() {
+            ready = true;
+            break;
+        }
+    }
+    if !ready {
+        return Err("unit not ready");
+    }
+
+    let mut cap10 = [0u8; 10];
+    cap10[0] = SCSI_READ_CAPACITY_10;
+    unsafe { command_scratch(dev, lun, &cap10, 8)? };
+    let s = &dev.buffers.scratch;
+    let last_lba = u32::from_be_bytes([s[0], s[1], s[2], s[3]]);
+    let mut block_size = u32::from_be_bytes([s[4], s[5], s[6], s[7]]);
+    let mut block_count = last_lba as u64 + 1;
+
+    if last_lba == u32::MAX {
+        // Too big for READ CAPACITY(10).
+        let mut cap16 = [0u8; 16];
+        cap16[0] = SCSI_SERVICE_ACTION_IN_16;
+        cap16[1] = SCSI_SAI_READ_CAPACITY_16;
+        cap16[13] = 32; // allocation length
+        unsafe { command_scratch(dev, lun, &cap16, 32)? };
+        let s = &dev.buffers.scratch;
+        let last = u64::from_be_bytes([s[0], s[1], s[2], s[3], s[4], s[5], s[6], s[7]]);
+        block_size = u32::from_be_bytes([s[8], s[9], s[10], s[11]]);
+        block_count = last + 1;
+    }
+
+    if block_size == 0 || block_size as usize > USB_STORAGE_MAX_TRANSFER {
+        return Err("unsupported block size");
+    }
+    Ok((block_count, block_size))
+}
+
+/// Run a data-in command whose response fits in the scratch buffer.
+unsafe fn command_scratch(
+    dev: &mut UsbStorageDevice,
+    lun: u8,
+    cb: &[u8],
+    len: u32,
+) -> Result<(), &'static str> {
+    let scratch = dev.buffers.scratch.as_mut_ptr();
+    unsafe {
+        core::ptr::write_bytes(scratch, 0, dev.buffers.scratch.len());
+        command(dev, lun, cb, scratch, len, true)
+    }
+}
+
+/// Execute one SCSI command through the three BOT phases.
+///
+/// A stalled data stage is cleared and the CSW still collected, as the BOT
+/// spec requires; a bad CSW or a phase error triggers reset recovery. A
+/// failed command has its sense data fetched, which also clears conditions
+/// such as UNIT ATTENTION.
+unsafe fn command(
+    dev: &mut UsbStorageDevice,
+    lun: u8,
+    cb: &[u8],
+    data: *mut u8,
+    len: u32,
+    data_in: bool,
+) -> Result<(), &'static str> {
+    dev.tag = dev.tag.wrapping_add(1);
+    let tag = dev.tag;
+
+    let mut cbw = CommandBlockWrapper {
+        signature: CBW_SIGNATURE,
+        tag,
+        data_transfer_length: len,
+        flags: if data_in { CBW_FLAG_DATA_IN } else { 0 },
+        lun,
+        cb_length: cb.len() as u8,
+        cb: [0; 16],
+    };
+    cbw.cb[..cb.len()].copy_from_slice(cb);
+    dev.buffers.cbw = cbw;
+
+    // 1. Command
+    let cbw_ptr = core::ptr::addr_of_mut!(dev.buffers.cbw) as *mut u8;
+    if unsafe { xhci::transfer(dev.slot_id, dev.bulk_out, cbw_ptr, 31) }.is_err() {
+        unsafe { reset_recovery(dev) };
+        return Err("CBW transfer failed");
+    }
+
+    // 2. Data
+    if len > 0 {
+        let pipe = if data_in { dev.bulk_in } else { dev.bulk_out };
+        match unsafe { xhci::transfer(dev.slot_id, pipe, data, len as usize) } {
+            Ok(()) => {}
+            Err(xhci::COMPLETION_STALL) => {
+                unsafe { xhci::reset_endpoint(dev.slot_id, pipe) };
+            }
+            Err(_) => {
+                unsafe { reset_recovery(dev) };
+                return Err("data transfer failed");
+            }
+        }
+    }
+
+    // 3. Status (one retry after clearing a stalled IN pipe)
+    let csw_ptr = core::ptr::addr_of_mut!(dev.buffers.csw) as *mut u8;
+    let mut result = unsafe { xhci::transfer(dev.slot_id, dev.bulk_in, csw_ptr, 13) };
+    if result == Err(xhci::COMPLETION_STALL) {
+        unsafe { xhci::reset_endpoint(dev.slot_id, dev.bulk_in) };
+        result = unsafe { xhci::transfer(dev.slot_id, dev.bulk_in, csw_ptr, 13) };
+    }
+    let csw = dev.buffers.csw;
+    let (signature, csw_tag, residue, status) = (csw.signature, csw.tag, csw.data_residue, csw.status);
+    if result.is_err() || signature != CSW_SIGNATURE || csw_tag != tag || status == CSW_STATUS_PHASE_ERROR {
+        unsafe { reset_recovery(dev) };
+        return Err("invalid command status");
+    }
+
+    if status == CSW_STATUS_FAILED {
+        if cb[0] != SCSI_REQUEST_SENSE {
+            let sense = [SCSI_REQUEST_SENSE, 0, 0, 0, 18, 0];
+            let _ = unsafe { command_scratch(dev, lun, &sense, 18) };
+        }
+        return Err("command failed");
+    }
+    if residue != 0 && cb[0] != SCSI_INQUIRY {
+        return Err("short data transfer");
+    }
+    Ok(())
+}
+
+/// Bulk-Only Mass Storage Reset followed by clearing both bulk pipes.
+unsafe fn reset_recovery(dev: &mut UsbStorageDevice) {
+    println!("usb-storage: slot {}: reset recovery", dev.slot_id);
+    let setup: [u8; 8] = [
+        0x21, // bmRequestType: Host-to-Device, Class, Interface
+        0xFF, // bRequest: Bulk-Only Mass Storage Reset
+        0x00, 0x00, // wValue
+        dev.interface, 0x00, // wIndex: Interface
+        0x00, 0x00, // wLength
+    ];
+    unsafe {
+        xhci::control_transfer(dev.slot_id, setup, core::ptr::null_mut(), 0, false);
+        xhci::reset_endpoint(dev.slot_id, dev.bulk_in);
+        xhci::reset_endpoint(dev.slot_id, dev.bulk_out);
+    }
+}
+
+// ============================================================================
+// Block I/O
+// ============================================================================
+
+/// READ/WRITE `count` blocks at `lba`. Uses the 10-byte CDBs when the LBA
+/// and count fit, the 16-byte ones otherwise. The transfer must not exceed
+/// USB_STORAGE_MAX_TRANSFER.
+pub unsafe fn read_write(
+    device: usize,
+    lun: u8,
+    lba: u64,
+    count: u32,
+    block_size: u32,
+    buffer: *mut u8,
+    write: bool,
+) -> Result<(), &'static str> {
+    let dev = device_mut(device).ok_or("no such device")?;
+    let len = count as u64 * block_size as u64;
+    if count == 0 || len > USB_STORAGE_MAX_TRANSFER as u64 {
+        return Err("invalid transfer size");
+    }
+
+    let mut cb = [0u8; 16];
+    let cb_len = if lba + count as u64 <= u32::MAX as u64 + 1 && count <= u16::MAX as u32 {
+        cb[0] = if write { SCSI_WRITE_10 } else { SCSI_READ_10 };
+        cb[2..6].copy_from_slice(&(lba as u32).to_be_bytes());
+        cb[7..9].copy_from_slice(&(count as u16).to_be_bytes());
+        10
+    } else {
+        cb[0] = if write { SCSI_WRITE_16 } else { SCSI_READ_16 };
+        cb[2..10].copy_from_slice(&lba.to_be_bytes());
+        cb[10..14].copy_from_slice(&count.to_be_bytes());
+        16
+    };
+    unsafe { command(dev, lun, &cb[..cb_len], buffer, len as u32, !write) }
+}
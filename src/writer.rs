@@ -3,7 +3,7 @@ use core::fmt;
 use core::fmt::Write;
 use font8x8::{BASIC_FONTS, UnicodeFonts};
 
-pub static GLOBAL_WRITER: crate::interrupts::InterruptSpinlock<Option<Writer>> = crate::interrupts::InterruptSpinlock::new(None);
+pub static GLOBAL_WRITER: crate::interrupts::InterruptSpinlock<Option<Writer>> = crate::interrupts::InterruptSpinlock::named("GLOBAL_WRITER", None);
 
 pub unsafe fn init_global_writer(info: BootInfo) {
     let mut writer = GLOBAL_WRITER.lock();
@@ -1,10 +1,14 @@
 #![allow(dead_code)]
 #![allow(unused_variables)]
 
-use crate::pci::PciDevice;
+use crate::input::{self, InputEvent};
+use crate::memory::{self, FrameAllocator, PageTable};
+use crate::pci::{self, PciDevice, PciDriver};
 use crate::print;
 use crate::println;
+use core::alloc::Layout;
 use core::ptr::{read_volatile, write_volatile};
+use core::sync::atomic::{AtomicBool, AtomicU8, AtomicUsize, Ordering};
 
 // xHCI Capability Registers (Offset 0x00 from BAR)
 #[repr(C)]
@@ -74,6 +78,39 @@ pub const TRB_DATA_STAGE: u8 = 3;
 pub const TRB_STATUS_STAGE: u8 = 4;
 pub const TRB_TRANSFER_EVENT: u8 = 32;
 pub const TRB_LINK: u8 = 6;
+pub const TRB_RESET_ENDPOINT_COMMAND: u8 = 14;
+pub const TRB_STOP_ENDPOINT_COMMAND: u8 = 15;
+pub const TRB_SET_TR_DEQUEUE_COMMAND: u8 = 16;
+
+// TRB control flags
+pub const TRB_FLAG_CHAIN: u32 = 1 << 4;
+pub const TRB_FLAG_IOC: u32 = 1 << 5;
+
+// Completion codes
+pub const COMPLETION_SUCCESS: u8 = 1;
+pub const COMPLETION_STALL: u8 = 6;
+pub const COMPLETION_SHORT_PACKET: u8 = 13;
+/// Not a controller code: the TD never completed and was aborted.
+pub const COMPLETION_TIMEOUT: u8 = 0xFF;
+
+// Endpoint Context EP Type values
+pub const EP_TYPE_BULK_OUT: u32 = 2;
+pub const EP_TYPE_INTERRUPT_OUT: u32 = 3;
+pub const EP_TYPE_CONTROL: u32 = 4;
+pub const EP_TYPE_BULK_IN: u32 = 6;
+pub const EP_TYPE_INTERRUPT_IN: u32 = 7;
+
+// Endpoint descriptor bmAttributes transfer types
+pub const USB_ENDPOINT_CONTROL: u8 = 0;
+pub const USB_ENDPOINT_ISOCHRONOUS: u8 = 1;
+pub const USB_ENDPOINT_BULK: u8 = 2;
+pub const USB_ENDPOINT_INTERRUPT: u8 = 3;
+
+// Port speed IDs (PORTSC bits 10-13)
+pub const USB_SPEED_FULL: u8 = 1;
+pub const USB_SPEED_LOW: u8 = 2;
+pub const USB_SPEED_HIGH: u8 = 3;
+pub const USB_SPEED_SUPER: u8 = 4;
 
 #[repr(C, align(16))]
 #[derive(Debug, Clone, Copy, Default)]
@@ -142,6 +179,11 @@ pub struct TransferRing {
     pub cycle_bit: bool,
 }
 
+/// Bytes per dynamically allocated transfer ring: 255 usable TRBs plus the
+/// Link TRB. A single aligned page can never cross the 64 KiB boundary that
+/// xHCI forbids for ring segments.
+const TRANSFER_RING_BYTES: usize = 4096;
+
 impl TransferRing {
     pub fn new(buffer: *mut Trb, size_bytes: usize) -> Self {
         let size = size_bytes / core::mem::size_of::<Trb>();
@@ -162,58 +204,135 @@ impl TransferRing {
         }
     }
 
-    pub unsafe fn enqueue(&mut self, mut trb: Trb, db: *mut u32, endpoint_id: u8) {
-        let control = trb.control & !1;
-        trb.control = control | (if self.cycle_bit { 1 } else { 0 });
+    /// Allocate a ring from the kernel heap, which is identity-mapped and
+    /// therefore usable for DMA as-is.
+    pub fn allocate() -> Option<Self> {
+        let layout = Layout::from_size_align(TRANSFER_RING_BYTES, 4096).ok()?;
+        let buffer = unsafe { crate::allocator::alloc_aligned(layout) } as *mut Trb;
+        if buffer.is_null() {
+            return None;
+        }
+        Some(Self::new(buffer, TRANSFER_RING_BYTES))
+    }
 
-        let trb_ptr = unsafe { self.base.add(self.enqueue_index) };
-        unsafe { write_volatile(trb_ptr, trb) };
+    /// Dequeue pointer (with DCS) describing the next TRB we will write, for
+    /// the endpoint context and for Set TR Dequeue Pointer.
+    pub fn dequeue_pointer(&self) -> u64 {
+        unsafe { self.base.add(self.enqueue_index) as u64 | self.cycle_bit as u64 }
+    }
+
+    /// Write `trbs` as one TD: every TRB but the last gets the chain flag,
+    /// and the first TRB's cycle bit is flipped last so the controller never
+    /// sees a half-written TD. Returns the address of the last TRB, which is
+    /// what its Transfer Event will point at. Does not ring the doorbell.
+    pub unsafe fn enqueue_td(&mut self, trbs: &[Trb]) -> u64 {
+        let first_index = self.enqueue_index;
+        let first_cycle = self.cycle_bit;
+        let mut last_trb = 0;
+
+        for (i, trb) in trbs.iter().enumerate() {
+            let chained = i + 1 < trbs.len();
+            let mut trb = *trb;
+            trb.control &= !(1 | TRB_FLAG_CHAIN);
+            if chained {
+                trb.control |= TRB_FLAG_CHAIN;
+            }
+            let cycle = if i == 0 { !self.cycle_bit } else { self.cycle_bit };
+            trb.control |= cycle as u32;
+
+            let trb_ptr = unsafe { self.base.add(self.enqueue_index) };
+            unsafe { write_volatile(trb_ptr, trb) };
+            last_trb = trb_ptr as u64;
+            unsafe { self.advance(chained) };
+        }
+
+        core::sync::atomic::fence(Ordering::Release);
+        let first_ptr = unsafe { self.base.add(first_index) };
+        let mut first = unsafe { read_volatile(first_ptr) };
+        first.control = (first.control & !1) | first_cycle as u32;
+        unsafe { write_volatile(first_ptr, first) };
+        last_trb
+    }
 
+    /// Step past one TRB, following the Link TRB at the end of the segment.
+    /// The Link TRB carries the chain flag when a TD continues across it.
+    unsafe fn advance(&mut self, chained: bool) {
         self.enqueue_index += 1;
         if self.enqueue_index >= self.size {
-            // Update Link TRB cycle bit
             let link_trb_ptr = unsafe { self.base.add(self.size) };
             let mut link_trb = unsafe { read_volatile(link_trb_ptr) };
-            link_trb.control = (link_trb.control & !1) | (if self.cycle_bit { 1 } else { 0 });
+            link_trb.control &= !(1 | TRB_FLAG_CHAIN);
+            link_trb.control |= self.cycle_bit as u32;
+            if chained {
+                link_trb.control |= TRB_FLAG_CHAIN;
+            }
             unsafe { write_volatile(link_trb_ptr, link_trb) };
 
             self.enqueue_index = 0;
             self.cycle_bit = !self.cycle_bit;
         }
+    }
 
-        // Ring Doorbell
-        unsafe { write_volatile(db, endpoint_id as u32) };
+    pub unsafe fn enqueue(&mut self, trb: Trb, db: *mut u32, endpoint_id: u8) {
+        unsafe {
+            self.enqueue_td(&[trb]);
+            // Ring Doorbell
+            write_volatile(db, endpoint_id as u32);
+        }
     }
 }
 
-// Global state for command results (simplified for single-task)
-static mut LAST_COMPLETION_CODE: u8 = 0;
-static mut LAST_SLOT_ID: u8 = 0;
+/// Driver-side state for one endpoint of one device slot.
+pub struct Endpoint {
+    pub ring: TransferRing,
+    pub max_packet_size: u16,
+    /// Address of the last TRB of the TD in flight; 0 when idle.
+    pending_trb: u64,
+    /// Completion code of the last finished TD; 0 while one is in flight.
+    completion_code: u8,
+    /// Residual byte count reported with that completion.
+    residual: u32,
+}
+
+pub const MAX_SLOTS: usize = 64;
+/// Endpoints are indexed by Device Context Index (1 = EP0, 2n/2n+1 = EP n
+/// OUT/IN); the table stores DCI 1..=31.
+const MAX_ENDPOINTS: usize = 31;
+
+/// A command posted to the command ring, keyed by the address of its TRB
+/// (which is what the Command Completion Event points back at).
+#[derive(Clone, Copy)]
+struct PendingCommand {
+    /// TRB address; 0 marks a free entry.
+    trb: u64,
+    /// Completion code once the event has arrived; 0 until then.
+    code: u8,
+    slot_id: u8,
+}
 
-static mut EP0_TRANSFER_RINGS: [Option<TransferRing>; 64] = [const { None }; 64];
-static mut KEYBOARD_TRANSFER_RINGS: [Option<TransferRing>; 64] = [const { None }; 64];
+/// One command in flight per enumerating port, plus a few for drivers.
+const MAX_PENDING_COMMANDS: usize = MAX_ROOT_PORTS + 8;
 
-#[repr(align(4096))]
-pub struct TransferRingBuffer([Trb; 256]);
-pub static mut EP0_TR_BUFFERS: [TransferRingBuffer; 64] = [const {
-    TransferRingBuffer(
-        [Trb {
-            param: 0,
-            status: 0,
-            control: 0,
-        }; 256],
-    )
-}; 64];
+static mut PENDING_COMMANDS: [PendingCommand; MAX_PENDING_COMMANDS] =
+    [PendingCommand { trb: 0, code: 0, slot_id: 0 }; MAX_PENDING_COMMANDS];
 
-#[repr(align(4096))]
-pub struct KeyboardTrBuffers([[Trb; 256]; 64]);
-pub static mut KEYBOARD_TR_BUFFERS: KeyboardTrBuffers = KeyboardTrBuffers(
-    [[Trb {
-        param: 0,
-        status: 0,
-        control: 0,
-    }; 256]; 64],
-);
+static mut ENDPOINTS: [[Option<Endpoint>; MAX_ENDPOINTS]; MAX_SLOTS] =
+    [const { [const { None }; MAX_ENDPOINTS] }; MAX_SLOTS];
+static mut SLOT_SPEEDS: [u8; MAX_SLOTS] = [0; MAX_SLOTS];
+
+/// The endpoint at `dci` of `slot_id`, if it has been configured.
+unsafe fn endpoint(slot_id: u8, dci: u8) -> Option<&'static mut Endpoint> {
+    if slot_id == 0 || slot_id as usize > MAX_SLOTS || dci == 0 || dci as usize > MAX_ENDPOINTS {
+        return None;
+    }
+    unsafe { (*core::ptr::addr_of_mut!(ENDPOINTS))[slot_id as usize - 1][dci as usize - 1].as_mut() }
+}
+
+unsafe fn set_endpoint(slot_id: u8, dci: u8, ep: Endpoint) {
+    unsafe {
+        (*core::ptr::addr_of_mut!(ENDPOINTS))[slot_id as usize - 1][dci as usize - 1] = Some(ep);
+    }
+}
 
 pub struct CommandRing {
     pub base: *mut Trb,
@@ -242,7 +361,9 @@ impl CommandRing {
         }
     }
 
-    pub unsafe fn enqueue(&mut self, mut trb: Trb, db: *mut u32) {
+    /// Write one command TRB and ring the host controller doorbell. Returns
+    /// the TRB's address.
+    pub unsafe fn enqueue(&mut self, mut trb: Trb, db: *mut u32) -> u64 {
         let control = trb.control & !1;
         trb.control = control | (if self.cycle_bit { 1 } else { 0 });
 
@@ -263,6 +384,7 @@ impl CommandRing {
 
         // Ring Doorbell 0 (Host Controller)
         unsafe { write_volatile(db, 0) };
+        trb_ptr as u64
     }
 }
 
@@ -277,10 +399,35 @@ pub struct XhciContext {
     pub event_ring_dequeue_index: usize,
     pub event_ring_cycle_bit: bool,
     pub max_ports: u8,
+    pub pci_dev: PciDevice,
 }
 
 static mut XHCI_CTX: Option<XhciContext> = None;
 
+/// Serialises event-ring draining between the interrupt handler and the
+/// syscall layer; it also makes the xHCI path the input ring's single
+/// producer. Taking it disables interrupts on
+/// the local CPU, so the IRQ path can never spin on a lock its own CPU holds.
+pub static XHCI_LOCK: crate::interrupts::InterruptSpinlock<()> =
+    crate::interrupts::InterruptSpinlock::named("XHCI_LOCK", ());
+
+/// Set once interrupter 0 delivers interrupts; until then (or if no MSI/INTx
+/// route exists) events only advance when `process_events` is polled.
+static XHCI_IRQ_ENABLED: AtomicBool = AtomicBool::new(false);
+
+/// Local APIC ID of the CPU interrupter 0 is delivered to.
+static XHCI_IRQ_APIC_ID: AtomicU8 = AtomicU8::new(0);
+
+/// Interrupt moderation interval for interrupter 0, in 250 ns units
+/// (1000 = 250 µs): bounds the IRQ rate under key-repeat storms while
+/// keeping latency far below a HID polling interval.
+const XHCI_IMOD_INTERVAL: u32 = 1000;
+
+const IMAN_IP: u32 = 1 << 0;
+const IMAN_IE: u32 = 1 << 1;
+const USBCMD_INTE: u32 = 1 << 2;
+const USBSTS_EINT: u32 = 1 << 3;
+
 #[repr(align(4096))]
 pub struct AlignedPage([u8; 4096]);
 
@@ -317,33 +464,6 @@ static mut KEYBOARD_REPORT_BUFFERS: [[u8; 8]; 64] = [[0; 8]; 64];
 static mut KEYBOARD_EP_INDICES: [u8; 64] = [0; 64];
 static mut PREVIOUS_KEYBOARD_REPORTS: [[u8; 8]; 64] = [[0; 8]; 64];
 
-const KBD_BUF_SIZE: usize = 256;
-static mut KEYBOARD_BUFFER: [u8; KBD_BUF_SIZE] = [0; KBD_BUF_SIZE];
-static mut KBD_BUF_HEAD: usize = 0;
-static mut KBD_BUF_TAIL: usize = 0;
-
-fn push_key(key: u8) {
-    unsafe {
-        let next_head = (KBD_BUF_HEAD + 1) % KBD_BUF_SIZE;
-        if next_head != KBD_BUF_TAIL {
-            KEYBOARD_BUFFER[KBD_BUF_HEAD] = key;
-            KBD_BUF_HEAD = next_head;
-        }
-    }
-}
-
-pub fn get_key() -> Option<u8> {
-    unsafe {
-        if KBD_BUF_HEAD == KBD_BUF_TAIL {
-            None
-        } else {
-            let key = KEYBOARD_BUFFER[KBD_BUF_TAIL];
-            KBD_BUF_TAIL = (KBD_BUF_TAIL + 1) % KBD_BUF_SIZE;
-            Some(key)
-        }
-    }
-}
-
 const HID_ASCII_TABLE: [u8; 128] = {
     let mut table = [0u8; 128];
     table[0x04] = b'a';
@@ -475,6 +595,48 @@ const HID_ASCII_SHIFT_TABLE: [u8; 128] = {
 const HID_MOD_LEFT_SHIFT: u8 = 1 << 1;
 const HID_MOD_RIGHT_SHIFT: u8 = 1 << 5;
 
+/// Turn the difference between two boot-protocol reports into input events:
+/// modifier bits that flipped, keys that disappeared (released) and keys
+/// that appeared (pressed), all stamped with the same time.
+///
+/// Returns false for a rollover error report (too many keys down), which
+/// carries no key state and must not replace the previous report.
+fn report_key_events(report: &[u8; 8], prev_report: &[u8; 8]) -> bool {
+    // Boot Protocol: bytes 2-7 are keycodes; 1-3 are error codes.
+    if report[2] <= 3 && report[2] != 0 {
+        return false;
+    }
+
+    let now = input::timestamp();
+    let modifier = report[0];
+    let changed = modifier ^ prev_report[0];
+    for bit in 0..8 {
+        if changed & (1 << bit) != 0 {
+            let pressed = modifier & (1 << bit) != 0;
+            input::push(InputEvent::new(
+                now,
+                input::HID_USAGE_MODIFIER_BASE + bit,
+                modifier,
+                pressed,
+                0,
+            ));
+        }
+    }
+
+    for &key in &prev_report[2..8] {
+        if key != 0 && !report[2..8].contains(&key) {
+            input::push(InputEvent::new(now, key, modifier, false, 0));
+        }
+    }
+    for &key in &report[2..8] {
+        if key != 0 && !prev_report[2..8].contains(&key) {
+            let ascii = hid_key_to_ascii(key, modifier);
+            input::push(InputEvent::new(now, key, modifier, true, ascii));
+        }
+    }
+    true
+}
+
 fn hid_key_to_ascii(key: u8, modifier: u8) -> u8 {
     let table = if modifier & (HID_MOD_LEFT_SHIFT | HID_MOD_RIGHT_SHIFT) != 0 {
         &HID_ASCII_SHIFT_TABLE
@@ -493,6 +655,68 @@ fn hid_key_to_ascii(key: u8, modifier: u8) -> u8 {
 pub static mut INPUT_CONTEXT_BUFFER: AlignedPage = AlignedPage([0; 4096]);
 pub static mut USB_DATA_BUFFER: AlignedPage = AlignedPage([0; 4096]);
 
+/// Registry entry binding xHCI (0C:03:30) functions to this driver.
+pub const PCI_DRIVER: PciDriver = PciDriver {
+    name: "xhci",
+    class_code: pci::PCI_CLASS_SERIAL_BUS,
+    sub_class: pci::PCI_SUBCLASS_USB,
+    prog_if: Some(pci::PCI_PROG_IF_XHCI),
+    probe: pci_probe,
+};
+
+/// Map the controller MMIO window and the static DMA buffers, then bring the
+/// controller up. Only one controller is driven; later ones are left unbound.
+unsafe fn pci_probe(
+    device: &PciDevice,
+    pml4: &mut PageTable,
+    allocator: &mut FrameAllocator,
+) -> Result<(), &'static str> {
+    if unsafe { (*core::ptr::addr_of!(XHCI_CTX)).is_some() } {
+        return Err("controller already bound");
+    }
+    let xhci_base_phys = pci::mmio_bar0(device);
+    if xhci_base_phys == 0 {
+        return Err("BAR0 not assigned");
+    }
+
+    // Map xHCI MMIO (with cache disable); at least 64KB (16 pages).
+    let size = device.bars[0].size.max(16 * memory::PAGE_SIZE);
+    let pages = (size + memory::PAGE_SIZE - 1) / memory::PAGE_SIZE;
+    let mmio_flags = memory::PAGE_WRITABLE | memory::PAGE_PRESENT | memory::PAGE_CACHE_DISABLE;
+    for i in 0..pages {
+        let phys = xhci_base_phys + i * memory::PAGE_SIZE;
+        unsafe { memory::map_page(pml4, phys, phys, mmio_flags, allocator) };
+    }
+
+    // Map xHCI DMA/static buffers (no cache disable)
+    let dma_flags = memory::PAGE_WRITABLE | memory::PAGE_PRESENT;
+    let statics: &[(u64, usize)] = &[
+        (core::ptr::addr_of!(COMMAND_RING_BUFFER) as u64, 4096),
+        (core::ptr::addr_of!(DCBAA_BUFFER) as u64, 4096),
+        (core::ptr::addr_of!(EVENT_RING_SEGMENT_TABLE) as u64, 4096),
+        (core::ptr::addr_of!(EVENT_RING_BUFFER) as u64, 4096),
+        (core::ptr::addr_of!(INPUT_CONTEXT_BUFFER) as u64, 4096),
+        (core::ptr::addr_of!(USB_DATA_BUFFER) as u64, 4096),
+        (
+            core::ptr::addr_of!(DEVICE_CONTEXT_BUFFERS) as u64,
+            core::mem::size_of::<DeviceContextBuffer>(),
+        ),
+    ];
+    for &(base, size) in statics {
+        let pages = (size + 4095) / 4096;
+        for i in 0..pages as u64 {
+            let addr = base + i * 4096;
+            unsafe { memory::map_page(pml4, addr, addr, dma_flags, allocator) };
+        }
+    }
+
+    unsafe {
+        pci::enable_device(device);
+        init(*device);
+    }
+    Ok(())
+}
+
 pub unsafe fn init(device: PciDevice) {
     println!("xHCI: Initializing...");
 
@@ -626,63 +850,443 @@ pub unsafe fn init(device: PciDevice) {
             event_ring_dequeue_index: 0,
             event_ring_cycle_bit: true,
             max_ports,
+            pci_dev: device,
         });
     }
 
-    unsafe { poll_ports() };
     unsafe { send_noop_command() };
+
+    // Start every connected port resetting, all at once. Nothing gets past
+    // Enable Slot here, since the event ring is not drained until the
+    // enumeration task runs; the later steps need the kernel heap, which is
+    // not up yet.
+    let _guard = XHCI_LOCK.lock();
+    unsafe { advance_ports() };
+}
+
+/// Root hub ports the enumeration state machine tracks.
+const MAX_ROOT_PORTS: usize = 32;
+
+// PORTSC bits
+const PORTSC_CCS: u32 = 1 << 0; // Current Connect Status
+const PORTSC_PED: u32 = 1 << 1; // Port Enabled/Disabled
+const PORTSC_PR: u32 = 1 << 4; // Port Reset
+const PORTSC_CSC: u32 = 1 << 17; // Connect Status Change
+const PORTSC_PEC: u32 = 1 << 18; // Port Enabled/Disabled Change
+const PORTSC_PRC: u32 = 1 << 21; // Port Reset Change
+/// Bits written back unchanged when touching PORTSC; leaves out PED (writing
+/// 1 disables the port) and the RW1C change bits.
+const PORTSC_PRESERVE: u32 = 0x0E01_C0E1;
+
+const USB_DESCRIPTOR_DEVICE: u8 = 1;
+const USB_DESCRIPTOR_CONFIGURATION: u8 = 2;
+
+/// Where a root port is in enumeration. Each state waits for exactly one
+/// thing (a port reset, a command completion or an EP0 transfer) and
+/// `advance_ports` moves the port on once it has happened, so resets and
+/// descriptor fetches on different ports overlap.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+enum PortState {
+    Disconnected,
+    Resetting,
+    EnablingSlot { command: u64 },
+    Addressing { slot_id: u8, command: u64 },
+    DeviceDescriptor { slot_id: u8 },
+    ConfigHeader { slot_id: u8 },
+    ConfigDescriptor { slot_id: u8 },
+    /// Descriptors are in; class drivers have yet to claim the interfaces.
+    ReadyToBind { slot_id: u8 },
+    Configured { slot_id: u8 },
+    /// Gave up; tried again once the device is unplugged and replugged.
+    Failed,
+}
+
+/// DMA buffers private to one enumerating port, so ports in flight together
+/// never share an Input Context or a descriptor buffer.
+#[repr(C)]
+struct PortBuffers {
+    input_context: AlignedPage,
+    descriptors: AlignedPage,
 }
 
-pub unsafe fn poll_ports() {
-    let ctx = unsafe {
-        (*core::ptr::addr_of!(XHCI_CTX))
-            .as_ref()
-            .expect("xHCI not initialized")
+struct RootPort {
+    state: PortState,
+    speed: u8,
+    /// Allocated when the port gets a slot, freed once it is bound.
+    buffers: *mut PortBuffers,
+}
+
+static mut ROOT_PORTS: [RootPort; MAX_ROOT_PORTS] = [const {
+    RootPort {
+        state: PortState::Disconnected,
+        speed: 0,
+        buffers: core::ptr::null_mut(),
+    }
+}; MAX_ROOT_PORTS];
+
+/// Scheduler task ID of the enumeration task; 0 until it runs.
+static ENUMERATION_TASK: AtomicUsize = AtomicUsize::new(0);
+
+const ENUMERATION_STACK_SIZE: usize = 16 * 1024;
+
+fn portsc(ctx: &XhciContext, index: usize) -> *mut u32 {
+    (ctx.op as usize + 0x400 + index * 0x10) as *mut u32
+}
+
+/// Set `bits` in a PORTSC register (PR, or change bits to acknowledge them)
+/// without disturbing anything else.
+unsafe fn write_portsc(ptr: *mut u32, bits: u32) {
+    unsafe { write_volatile(ptr, (read_volatile(ptr) & PORTSC_PRESERVE) | bits) };
+}
+
+/// Move every root port as far as it can go without waiting. The caller
+/// holds XHCI_LOCK; this only ever submits work and never blocks.
+unsafe fn advance_ports() {
+    let ctx = match unsafe { &mut *core::ptr::addr_of_mut!(XHCI_CTX) } {
+        Some(c) => c,
+        None => return,
     };
-    let op = ctx.op;
-    let max_ports = ctx.max_ports;
-
-    println!("xHCI: Polling {} ports...", max_ports);
-
-    for i in 0..max_ports {
-        let portsc_ptr = (op as usize + 0x400 + (i as usize * 0x10)) as *mut u32;
-        let portsc = unsafe { read_volatile(portsc_ptr) };
-        if (portsc & 1) != 0 {
-            // Check if port is enabled (bit 1). If not, reset it.
-            if (portsc & (1 << 1)) == 0 {
-                println!("xHCI: Resetting port {}...", i + 1);
-                unsafe {
-                    let mut p = read_volatile(portsc_ptr);
-                    p &= 0x0E01_C0E1; // Preserve read-write bits, clear change bits
-                    p |= 1 << 4; // PR = 1
-                    write_volatile(portsc_ptr, p);
+    let ports = (ctx.max_ports as usize).min(MAX_ROOT_PORTS);
+    for index in 0..ports {
+        let port = unsafe { &mut (*core::ptr::addr_of_mut!(ROOT_PORTS))[index] };
+        // Keep going while steps complete immediately.
+        loop {
+            let before = port.state;
+            port.state = unsafe { advance_port(ctx, index, port) };
+            if port.state == before {
+                break;
+            }
+        }
+    }
+}
+
+/// One step of the state machine for the port at `index`: returns the
+/// port's next state, which is its current one if it is still waiting.
+unsafe fn advance_port(ctx: &XhciContext, index: usize, port: &mut RootPort) -> PortState {
+    let port_id = index as u8 + 1;
+    let portsc_ptr = portsc(ctx, index);
+    let status = unsafe { read_volatile(portsc_ptr) };
+
+    // A connect status change means whatever we were talking to is gone,
+    // even if something is plugged in again by now.
+    if status & PORTSC_CSC != 0 {
+        unsafe { write_portsc(portsc_ptr, PORTSC_CSC) };
+    }
+    if (status & PORTSC_CSC != 0 || status & PORTSC_CCS == 0) && port.state != PortState::Disconnected {
+        println!("xHCI: Port {} disconnected", port_id);
+        unsafe { release_port(port) };
+        return PortState::Disconnected;
+    }
+
+    match port.state {
+        PortState::Disconnected if status & PORTSC_CCS == 0 => PortState::Disconnected,
+        PortState::Disconnected => {
+            if status & PORTSC_PED != 0 {
+                // USB 3 ports train by themselves and come up enabled.
+                unsafe { enable_port_slot(port_id, port, status) }
+            } else {
+                println!("xHCI: Resetting port {}...", port_id);
+                unsafe { write_portsc(portsc_ptr, PORTSC_PR) };
+                PortState::Resetting
+            }
+        }
+        PortState::Resetting => {
+            if status & PORTSC_PRC == 0 {
+                return PortState::Resetting;
+            }
+            unsafe { write_portsc(portsc_ptr, PORTSC_PRC | PORTSC_PEC) };
+            if status & PORTSC_PED == 0 {
+                println!("xHCI: Port {} not enabled after reset", port_id);
+                return PortState::Failed;
+            }
+            unsafe { enable_port_slot(port_id, port, status) }
+        }
+        PortState::EnablingSlot { command } => match unsafe { command_result(command) } {
+            None => port.state,
+            Some((COMPLETION_SUCCESS, slot_id)) => {
+                println!("xHCI: Port {}: assigned Slot ID {}", port_id, slot_id);
+                if port.buffers.is_null() {
+                    let layout = Layout::new::<PortBuffers>();
+                    port.buffers = unsafe { crate::allocator::alloc_aligned(layout) } as *mut PortBuffers;
+                    if port.buffers.is_null() {
+                        println!("xHCI: Out of memory for port {}", port_id);
+                        return PortState::Failed;
+                    }
                 }
-                // Wait for PRC (bit 21)
-                while (unsafe { read_volatile(portsc_ptr) } & (1 << 21)) == 0 {
-                    core::hint::spin_loop();
+                let input_ctx_ptr =
+                    unsafe { core::ptr::addr_of_mut!((*port.buffers).input_context) } as *mut InputContext;
+                match unsafe { start_address_device(slot_id, port_id, port.speed as u32, input_ctx_ptr) } {
+                    Some(command) => PortState::Addressing { slot_id, command },
+                    None => PortState::Failed,
                 }
-                // Clear PRC (write 1 to bit 21)
-                unsafe {
-                    let mut p = read_volatile(portsc_ptr);
-                    p &= 0x0E01_C0E1;
-                    p |= 1 << 21;
-                    write_volatile(portsc_ptr, p);
+            }
+            Some((code, _)) => {
+                println!("xHCI: Port {}: Enable Slot failed with code {}", port_id, code);
+                PortState::Failed
+            }
+        },
+        PortState::Addressing { slot_id, command } => match unsafe { command_result(command) } {
+            None => port.state,
+            Some((COMPLETION_SUCCESS, _)) => {
+                println!("xHCI: Slot {} addressed", slot_id);
+                if unsafe { request_descriptor(slot_id, port, USB_DESCRIPTOR_DEVICE, 18) } {
+                    PortState::DeviceDescriptor { slot_id }
+                } else {
+                    PortState::Failed
+                }
+            }
+            Some((code, _)) => {
+                println!("xHCI: Address Device failed with code {}", code);
+                PortState::Failed
+            }
+        },
+        PortState::DeviceDescriptor { slot_id } => match unsafe { control_result(slot_id) } {
+            None => port.state,
+            Some(COMPLETION_SUCCESS) => {
+                let buffer = unsafe { &(*port.buffers).descriptors.0 };
+                let vendor_id = u16::from_le_bytes([buffer[8], buffer[9]]);
+                let product_id = u16::from_le_bytes([buffer[10], buffer[11]]);
+                println!(
+                    "xHCI: Device Descriptor: VendorID={:#06x}, ProductID={:#06x}",
+                    vendor_id, product_id
+                );
+                // Header first, to learn the total length.
+                if unsafe { request_descriptor(slot_id, port, USB_DESCRIPTOR_CONFIGURATION, 9) } {
+                    PortState::ConfigHeader { slot_id }
+                } else {
+                    PortState::Failed
                 }
             }
+            Some(code) => {
+                println!("xHCI: GET_DESCRIPTOR (Device) failed with code {}", code);
+                PortState::Failed
+            }
+        },
+        PortState::ConfigHeader { slot_id } => match unsafe { control_result(slot_id) } {
+            None => port.state,
+            Some(COMPLETION_SUCCESS) => {
+                let buffer = unsafe { &(*port.buffers).descriptors.0 };
+                let total_len = u16::from_le_bytes([buffer[2], buffer[3]]).clamp(9, 4096);
+                println!("xHCI: Config descriptor total length: {}", total_len);
+                if unsafe { request_descriptor(slot_id, port, USB_DESCRIPTOR_CONFIGURATION, total_len) } {
+                    PortState::ConfigDescriptor { slot_id }
+                } else {
+                    PortState::Failed
+                }
+            }
+            Some(code) => {
+                println!("xHCI: GET_DESCRIPTOR (Config Header) failed with code {}", code);
+                PortState::Failed
+            }
+        },
+        PortState::ConfigDescriptor { slot_id } => match unsafe { control_result(slot_id) } {
+            None => port.state,
+            Some(COMPLETION_SUCCESS) => PortState::ReadyToBind { slot_id },
+            Some(code) => {
+                println!("xHCI: GET_DESCRIPTOR (Config Full) failed with code {}", code);
+                PortState::Failed
+            }
+        },
+        state @ (PortState::ReadyToBind { .. } | PortState::Configured { .. } | PortState::Failed) => state,
+    }
+}
 
-            let portsc_final = unsafe { read_volatile(portsc_ptr) };
-            let speed = (portsc_final >> 10) & 0xF;
-            println!(
-                "xHCI: Device detected on port {} (speed {}, enabled={})",
-                i + 1,
-                speed,
-                (portsc_final >> 1) & 1
-            );
-            let slot_id = unsafe { enable_slot() };
-            if slot_id > 0 {
-                unsafe { address_device(slot_id, i + 1, speed) };
+/// Record the speed of a newly enabled port and ask for a slot.
+unsafe fn enable_port_slot(port_id: u8, port: &mut RootPort, status: u32) -> PortState {
+    port.speed = ((status >> 10) & 0xF) as u8;
+    println!("xHCI: Device detected on port {} (speed {})", port_id, port.speed);
+    let mut trb = Trb::default();
+    trb.control = (TRB_ENABLE_SLOT_COMMAND as u32) << 10;
+    match unsafe { post_command(trb) } {
+        Some(command) => PortState::EnablingSlot { command },
+        None => PortState::Failed,
+    }
+}
+
+/// Queue GET_DESCRIPTOR for the first `length` bytes of a standard
+/// descriptor into the port's descriptor buffer.
+unsafe fn request_descriptor(slot_id: u8, port: &mut RootPort, descriptor_type: u8, length: u16) -> bool {
+    let setup: [u8; 8] = [
+        0x80, // bmRequestType: Device-to-Host, Standard, Device
+        0x06, // bRequest: GET_DESCRIPTOR
+        0x00, descriptor_type, // wValue: Descriptor Type / Index 0
+        0x00, 0x00, // wIndex: 0
+        length as u8, (length >> 8) as u8, // wLength
+    ];
+    let buffer = unsafe { core::ptr::addr_of_mut!((*port.buffers).descriptors) } as *mut u8;
+    unsafe {
+        core::ptr::write_bytes(buffer, 0, length as usize);
+        submit_control(slot_id, setup, buffer, length, true)
+    }
+}
+
+/// Drop whatever a port had in flight. The slot itself is not disabled, so
+/// it stays allocated until the controller is reset.
+unsafe fn release_port(port: &mut RootPort) {
+    if let PortState::EnablingSlot { command } | PortState::Addressing { command, .. } = port.state {
+        unsafe { forget_command(command) };
+    }
+    if !port.buffers.is_null() {
+        unsafe { crate::allocator::free(port.buffers as *mut u8) };
+        port.buffers = core::ptr::null_mut();
+    }
+}
+
+/// Claim a port whose descriptors are ready, marking it configured. Returns
+/// its slot and descriptor buffer, which the caller now owns.
+unsafe fn take_ready_port() -> Option<(u8, *mut PortBuffers)> {
+    let ports = unsafe { &mut *core::ptr::addr_of_mut!(ROOT_PORTS) };
+    for port in ports.iter_mut() {
+        if let PortState::ReadyToBind { slot_id } = port.state {
+            port.state = PortState::Configured { slot_id };
+            let buffers = core::mem::replace(&mut port.buffers, core::ptr::null_mut());
+            return Some((slot_id, buffers));
+        }
+    }
+    None
+}
+
+/// Start the background enumeration task. Called once the kernel heap and
+/// the scheduler are up; `init` has already set the ports going.
+pub fn spawn_enumeration_task() {
+    if unsafe { (*core::ptr::addr_of!(XHCI_CTX)).is_none() } {
+        return;
+    }
+    let layout = match Layout::from_size_align(ENUMERATION_STACK_SIZE, 16) {
+        Ok(layout) => layout,
+        Err(_) => return,
+    };
+    let stack = unsafe { crate::allocator::alloc_aligned(layout) };
+    if stack.is_null() {
+        println!("xHCI: Out of memory for the enumeration task");
+        return;
+    }
+    crate::scheduler::add_new_task(enumeration_task, stack as u64, ENUMERATION_STACK_SIZE);
+}
+
+/// Drives port enumeration for the lifetime of the system, hot-plug
+/// included. With interrupts it sleeps until `process_events` sees a port,
+/// command or EP0 event; in polled mode it drains the event ring itself and
+/// yields between passes. Binding runs here rather than in `advance_ports`
+/// because class drivers block on their transfers.
+extern "C" fn enumeration_task() {
+    ENUMERATION_TASK.store(crate::scheduler::current_task_id(), Ordering::Release);
+    loop {
+        let ready = {
+            let _guard = XHCI_LOCK.lock();
+            if !irq_enabled() {
+                unsafe { process_events() };
+            }
+            unsafe { advance_ports() };
+            let ready = unsafe { take_ready_port() };
+            if ready.is_none() && irq_enabled() {
+                // Blocking under XHCI_LOCK means the next event, which needs
+                // the lock to be drained, cannot slip past the wake-up.
+                crate::scheduler::block_current();
+            }
+            ready
+        };
+
+        match ready {
+            Some((slot_id, buffers)) => unsafe {
+                let descriptors = &(*buffers).descriptors.0;
+                let total_len = (u16::from_le_bytes([descriptors[2], descriptors[3]]) as usize).clamp(9, 4096);
+                configure_device(slot_id, &descriptors[..total_len]);
+                crate::allocator::free(buffers as *mut u8);
+            },
+            None => crate::scheduler::switch_task(),
+        }
+    }
+}
+
+/// Switch interrupter 0 from polled to interrupt-driven operation.
+///
+/// Prefers MSI targeted at the calling CPU's Local APIC and falls back to
+/// the legacy INTx line through the PIC. Must be called after the Local APIC
+/// MMIO page is mapped, since the MSI path sends its EOI there.
+pub unsafe fn enable_interrupts() -> bool {
+    let ctx = match unsafe { &mut *core::ptr::addr_of_mut!(XHCI_CTX) } {
+        Some(c) => c,
+        None => return false,
+    };
+    let device = ctx.pci_dev;
+    let apic_id = crate::processor::current_apic_id();
+
+    let routed = match unsafe { crate::interrupts::register_msi_handler(handle_interrupt) } {
+        Some(vector) => {
+            unsafe { crate::processor::lapic_enable(crate::processor::lapic_base_from_msr()) };
+            match unsafe { pci::enable_msi(&device, vector, apic_id) } {
+                Ok(()) => {
+                    println!("xHCI: MSI vector {} -> APIC {}", vector, apic_id);
+                    true
+                }
+                Err(msg) => {
+                    println!("xHCI: MSI unavailable ({})", msg);
+                    false
+                }
             }
         }
+        None => false,
+    };
+    let routed = routed
+        || match unsafe { pci::interrupt_line(&device) } {
+            Some(line) if unsafe { crate::interrupts::register_irq_handler(line, handle_interrupt) } => {
+                println!("xHCI: using legacy INTx on IRQ {}", line);
+                true
+            }
+            _ => false,
+        };
+    if !routed {
+        println!("xHCI: no interrupt route, staying in polled mode");
+        return false;
+    }
+
+    let _guard = XHCI_LOCK.lock();
+    let ir0 = unsafe { &mut (*ctx.rt).ir[0] };
+    unsafe {
+        write_volatile(&mut ir0.imod, XHCI_IMOD_INTERVAL);
+        write_volatile(&mut ir0.iman, IMAN_IE | IMAN_IP);
+        let usbcmd = read_volatile(&(*ctx.op).usbcmd);
+        write_volatile(&mut (*ctx.op).usbcmd, usbcmd | USBCMD_INTE);
+    }
+    // The PIC delivers INTx to the BSP, which is also who calls this.
+    XHCI_IRQ_APIC_ID.store(apic_id, Ordering::Relaxed);
+    XHCI_IRQ_ENABLED.store(true, Ordering::Release);
+
+    // Anything that arrived while we were still polling will not raise a
+    // fresh interrupt, so drain it now.
+    unsafe { process_events() };
+    true
+}
+
+pub fn irq_enabled() -> bool {
+    XHCI_IRQ_ENABLED.load(Ordering::Acquire)
+}
+
+/// APIC ID of the CPU that takes xHCI interrupts, once they are enabled.
+pub fn irq_apic_id() -> Option<u8> {
+    if irq_enabled() {
+        Some(XHCI_IRQ_APIC_ID.load(Ordering::Relaxed))
+    } else {
+        None
+    }
+}
+
+/// Interrupter 0 handler: acknowledge, drain the event ring and re-arm any
+/// keyboard transfers that completed.
+fn handle_interrupt() {
+    let _guard = XHCI_LOCK.lock();
+    let ctx = match unsafe { &mut *core::ptr::addr_of_mut!(XHCI_CTX) } {
+        Some(c) => c,
+        None => return,
+    };
+    unsafe {
+        // Both are RW1C. Clear EINT first so a new event after the drain
+        // raises IP (and therefore a new interrupt) again.
+        write_volatile(&mut (*ctx.op).usbsts, USBSTS_EINT);
+        let ir0 = &mut (*ctx.rt).ir[0];
+        write_volatile(&mut ir0.iman, IMAN_IE | IMAN_IP);
+        process_events();
     }
 }
 
@@ -695,6 +1299,8 @@ pub unsafe fn process_events() {
     let ir0 = unsafe { &mut (*ctx.rt).ir[0] };
     let erdp = unsafe { read_volatile(&ir0.erdp) } & !0xF;
     let mut erdp_val = erdp;
+    // Set when an event may let a port make enumeration progress.
+    let mut wake_enumeration = false;
 
     loop {
         let trb_ptr = erdp_val as *mut Trb;
@@ -709,6 +1315,7 @@ pub unsafe fn process_events() {
         if event_type == TRB_PORT_STATUS_CHANGE_EVENT {
             let port_id = (trb.param >> 24) as u8;
             println!("xHCI: Event: Port Status Change on port {}", port_id);
+            wake_enumeration = true;
         } else if event_type == TRB_COMMAND_COMPLETION_EVENT {
             let code = trb.completion_code();
             let slot_id = trb.slot_id();
@@ -717,76 +1324,53 @@ pub unsafe fn process_events() {
             //    "xHCI: Event: Command Completion. Code={}, SlotID={}, Param={:#x}",
             //    code, slot_id, param
             //);
-            unsafe {
-                write_volatile(core::ptr::addr_of_mut!(LAST_COMPLETION_CODE), code);
-                write_volatile(core::ptr::addr_of_mut!(LAST_SLOT_ID), slot_id);
+            let commands = unsafe { &mut *core::ptr::addr_of_mut!(PENDING_COMMANDS) };
+            if let Some(command) = commands.iter_mut().find(|c| c.trb == param && c.code == 0) {
+                command.code = code;
+                command.slot_id = slot_id;
             }
+            wake_enumeration = true;
         } else if event_type == TRB_TRANSFER_EVENT {
             let code = trb.completion_code();
             let slot_id = trb.slot_id();
-            let trb_ptr = trb.param;
+            let dci = ((trb.control >> 16) & 0x1F) as u8;
 
-            // Check if this is a keyboard report (Interrupt In)
-            let is_keyboard_report = unsafe {
-                let rings_ptr = core::ptr::addr_of_mut!(KEYBOARD_TRANSFER_RINGS);
-                if let Some(ref tr) = (*rings_ptr)[slot_id as usize - 1] {
-                    trb_ptr >= tr.base as u64 && trb_ptr < (tr.base as u64 + (tr.size * 16) as u64)
-                } else {
-                    false
-                }
-            };
+            let is_keyboard_report = slot_id != 0
+                && (slot_id as usize) <= MAX_SLOTS
+                && dci == unsafe { (*core::ptr::addr_of!(KEYBOARD_EP_INDICES))[slot_id as usize - 1] };
 
             if is_keyboard_report {
                 let report = unsafe {
                     &(*core::ptr::addr_of!(KEYBOARD_REPORT_BUFFERS))[slot_id as usize - 1]
                 };
-                if code == 1 {
+                if code == COMPLETION_SUCCESS {
                     unsafe {
                         let prev_report =
                             &mut (*core::ptr::addr_of_mut!(PREVIOUS_KEYBOARD_REPORTS))
                                 [slot_id as usize - 1];
-                        let modifier = report[0];
-                        // Process new key presses (Boot Protocol: bytes 2-7 are keycodes)
-                        for i in 2..8 {
-                            let key = report[i];
-                            if key != 0 {
-                                // Check if this key was already pressed in previous report
-                                let mut found = false;
-                                for j in 2..8 {
-                                    if prev_report[j] == key {
-                                        found = true;
-                                        break;
-                                    }
-                                }
-                                if !found {
-                                    // New key press!
-                                    let ascii = hid_key_to_ascii(key, modifier);
-                                    if ascii != 0 {
-                                        // print!("{}", ascii as char);
-                                        push_key(ascii);
-                                    }
-                                }
-                            }
+                        if report_key_events(report, prev_report) {
+                            *prev_report = *report;
                         }
-                        *prev_report = *report;
                     }
 
                     // Re-queue request for next report
-                    let ep_index = unsafe {
-                        (*core::ptr::addr_of!(KEYBOARD_EP_INDICES))[slot_id as usize - 1]
-                    };
-                    if ep_index != 0 {
-                        unsafe { queue_keyboard_report_request(slot_id, ep_index) };
-                    }
-                } else if code == 6 {
+                    unsafe { queue_keyboard_report_request(slot_id, dci) };
+                } else if code == COMPLETION_STALL {
                     println!("xHCI: Keyboard Stall. Attempting to clear...");
                     // In a real driver we would send CLEAR_FEATURE(HALT).
                     // For now, let's just try re-queuing after a while.
                 }
-            }
-
-            unsafe {
-                write_volatile(core::ptr::addr_of_mut!(LAST_COMPLETION_CODE), code);
+            } else if let Some(ep) = unsafe { endpoint(slot_id, dci) } {
+                // Only the last TRB of a TD asks for an event, so an event
+                // for any other TRB means the TD stopped early on an error.
+                let finished = trb.param == ep.pending_trb
+                    || (code != COMPLETION_SUCCESS && code != COMPLETION_SHORT_PACKET);
+                if ep.pending_trb != 0 && finished {
+                    ep.pending_trb = 0;
+                    ep.residual = trb.status & 0x00FF_FFFF;
+                    ep.completion_code = code;
+                }
+                wake_enumeration |= dci == 1;
             }
         } else {
             // println!("xHCI: Event: Other ({})", event_type);
@@ -803,6 +1387,13 @@ pub unsafe fn process_events() {
     }
 
     unsafe { write_volatile(&mut ir0.erdp, erdp_val | (1 << 3)) }; // Clear EHB
+
+    if wake_enumeration {
+        let task = ENUMERATION_TASK.load(Ordering::Acquire);
+        if task != 0 {
+            crate::scheduler::wake(task);
+        }
+    }
 }
 
 pub unsafe fn send_noop_command() {
@@ -816,56 +1407,105 @@ pub unsafe fn send_noop_command() {
     unsafe { ctx.cmd_ring.enqueue(trb, ctx.db) };
 }
 
-pub unsafe fn enable_slot() -> u8 {
-    let ctx = match unsafe { &mut *core::ptr::addr_of_mut!(XHCI_CTX) } {
-        Some(c) => c,
-        None => panic!("xHCI not initialized"),
-    };
-    println!("xHCI: Sending Enable Slot command...");
-    let mut trb = Trb::default();
-    trb.control = (TRB_ENABLE_SLOT_COMMAND as u32) << 10;
+/// Write a command TRB to the command ring and start tracking it; the caller
+/// holds XHCI_LOCK. Returns the TRB address that `command_result` takes, or
+/// None if too many commands are already outstanding.
+unsafe fn post_command(trb: Trb) -> Option<u64> {
+    let ctx = unsafe { (*core::ptr::addr_of_mut!(XHCI_CTX)).as_mut()? };
+    let commands = unsafe { &mut *core::ptr::addr_of_mut!(PENDING_COMMANDS) };
+    let entry = commands.iter_mut().find(|c| c.trb == 0)?;
+    entry.trb = unsafe { ctx.cmd_ring.enqueue(trb, ctx.db) };
+    entry.code = 0;
+    entry.slot_id = 0;
+    Some(entry.trb)
+}
 
-    unsafe {
-        write_volatile(core::ptr::addr_of_mut!(LAST_COMPLETION_CODE), 0);
-        write_volatile(core::ptr::addr_of_mut!(LAST_SLOT_ID), 0);
-        ctx.cmd_ring.enqueue(trb, ctx.db);
+/// Completion code and slot ID of a posted command, once its completion
+/// event has been drained. Retires the tracking entry.
+unsafe fn command_result(command: u64) -> Option<(u8, u8)> {
+    let commands = unsafe { &mut *core::ptr::addr_of_mut!(PENDING_COMMANDS) };
+    let entry = commands.iter_mut().find(|c| c.trb == command && c.code != 0)?;
+    entry.trb = 0;
+    Some((entry.code, entry.slot_id))
+}
+
+/// Stop tracking a command whose result nobody wants any more.
+unsafe fn forget_command(command: u64) {
+    let commands = unsafe { &mut *core::ptr::addr_of_mut!(PENDING_COMMANDS) };
+    for entry in commands.iter_mut().filter(|c| c.trb == command) {
+        entry.trb = 0;
     }
+}
+
+/// Post one command TRB and wait for its Command Completion Event.
+/// Returns the completion code.
+unsafe fn execute_command(trb: Trb) -> u8 {
+    let command = {
+        let _guard = XHCI_LOCK.lock();
+        match unsafe { post_command(trb) } {
+            Some(command) => command,
+            None => return 0,
+        }
+    };
 
-    // Wait for completion (simple poll)
-    while unsafe { read_volatile(core::ptr::addr_of!(LAST_COMPLETION_CODE)) } == 0 {
-        unsafe { process_events() };
+    loop {
+        {
+            let _guard = XHCI_LOCK.lock();
+            unsafe { process_events() };
+            if let Some((code, _)) = unsafe { command_result(command) } {
+                return code;
+            }
+        }
         core::hint::spin_loop();
     }
+}
 
-    let slot_id = unsafe { read_volatile(core::ptr::addr_of!(LAST_SLOT_ID)) };
-    println!("xHCI: Assigned Slot ID: {}", slot_id);
-    slot_id
+fn device_context(slot_id: u8) -> *mut DeviceContext {
+    let buffers_ptr = core::ptr::addr_of_mut!(DEVICE_CONTEXT_BUFFERS);
+    unsafe { core::ptr::addr_of_mut!((*buffers_ptr).0[slot_id as usize - 1]) }
 }
 
-pub unsafe fn address_device(slot_id: u8, port_id: u8, speed: u32) {
-    let ctx = match unsafe { &mut *core::ptr::addr_of_mut!(XHCI_CTX) } {
-        Some(c) => c,
-        None => panic!("xHCI not initialized"),
-    };
+impl Endpoint {
+    fn new(ring: TransferRing, max_packet_size: u16) -> Self {
+        Self {
+            ring,
+            max_packet_size,
+            pending_trb: 0,
+            completion_code: 0,
+            residual: 0,
+        }
+    }
+}
+
+/// Set up the Device Context and EP0 ring of a freshly enabled slot and post
+/// Address Device for it, without waiting. The caller holds XHCI_LOCK.
+/// Returns the command's TRB address.
+unsafe fn start_address_device(
+    slot_id: u8,
+    port_id: u8,
+    speed: u32,
+    input_ctx_ptr: *mut InputContext,
+) -> Option<u64> {
+    let ctx = unsafe { (*core::ptr::addr_of_mut!(XHCI_CTX)).as_mut()? };
 
     println!(
         "xHCI: Addressing device in slot {} (port {})...",
         slot_id, port_id
     );
+    if slot_id as usize > MAX_SLOTS {
+        println!("xHCI: Slot {} is beyond the driver's limit", slot_id);
+        return None;
+    }
 
     // 1. Initialize Device Context
-    let device_ctx_ptr = {
-        let buffers_ptr = core::ptr::addr_of_mut!(DEVICE_CONTEXT_BUFFERS);
-        let device_ptr = unsafe { core::ptr::addr_of_mut!((*buffers_ptr).0[slot_id as usize - 1]) };
-        unsafe {
-            core::ptr::write_bytes(
-                device_ptr as *mut u8,
-                0,
-                core::mem::size_of::<DeviceContext>(),
-            );
-        }
-        device_ptr
-    };
+    let device_ctx_ptr = device_context(slot_id);
+    unsafe {
+        core::ptr::write_bytes(
+            device_ctx_ptr as *mut u8,
+            0,
+            core::mem::size_of::<DeviceContext>(),
+        );
+    }
 
     // Set Slot Context
     unsafe {
@@ -874,29 +1514,26 @@ pub unsafe fn address_device(slot_id: u8, port_id: u8, speed: u32) {
     }
 
     // 2. Initialize EP0 Transfer Ring
-    let tr_buffer = {
-        let ep0_buffers_ptr = core::ptr::addr_of_mut!(EP0_TR_BUFFERS);
-        let buffer_ptr = unsafe {
-            core::ptr::addr_of_mut!((*ep0_buffers_ptr)[slot_id as usize - 1].0) as *mut Trb
-        };
-        buffer_ptr
+    let tr = match TransferRing::allocate() {
+        Some(tr) => tr,
+        None => {
+            println!("xHCI: Out of memory for EP0 transfer ring");
+            return None;
+        }
     };
-    let tr = TransferRing::new(tr_buffer, 4096);
-    let rings_ptr = core::ptr::addr_of_mut!(EP0_TRANSFER_RINGS);
-    unsafe {
-        (*rings_ptr)[slot_id as usize - 1] = Some(tr);
-    }
 
     // Set EP0 Context
-    let mps = match speed {
-        3 => 64,  // High Speed
-        4 => 512, // Super Speed
-        2 => 8,   // Low Speed
-        _ => 64,  // Full Speed default
+    let mps = match speed as u8 {
+        USB_SPEED_HIGH => 64,
+        USB_SPEED_SUPER => 512,
+        USB_SPEED_LOW => 8,
+        _ => 64, // Full Speed default
     };
     unsafe {
-        (*device_ctx_ptr).endpoints[0].field2 = (4 << 3) | (mps << 16) | (3 << 1); // EP Type = Control, MPS, CErr = 3
-        (*device_ctx_ptr).endpoints[0].tr_dequeue_pointer = (tr_buffer as u64) | 1; // DCS = 1
+        (*device_ctx_ptr).endpoints[0].field2 = (EP_TYPE_CONTROL << 3) | (mps << 16) | (3 << 1); // EP Type = Control, MPS, CErr = 3
+        (*device_ctx_ptr).endpoints[0].tr_dequeue_pointer = tr.dequeue_pointer(); // DCS = 1
+        set_endpoint(slot_id, 1, Endpoint::new(tr, mps as u16));
+        (*core::ptr::addr_of_mut!(SLOT_SPEEDS))[slot_id as usize - 1] = speed as u8;
     }
 
     // 3. Set DCBAA entry
@@ -909,59 +1546,48 @@ pub unsafe fn address_device(slot_id: u8, port_id: u8, speed: u32) {
     }
 
     // 4. Prepare Input Context
-    let input_ctx_ptr = {
-        let ptr = core::ptr::addr_of_mut!(INPUT_CONTEXT_BUFFER) as *mut InputContext;
-        unsafe {
-            core::ptr::write_bytes(ptr as *mut u8, 0, 4096);
-            (*ptr).add_flags = 0x3; // Add Slot Context (bit 0) and EP0 Context (bit 1)
-            core::ptr::copy_nonoverlapping(
-                device_ctx_ptr as *const u8,
-                core::ptr::addr_of_mut!((*ptr).device) as *mut u8,
-                core::mem::size_of::<DeviceContext>(),
-            );
-        }
-        ptr
-    };
+    unsafe {
+        core::ptr::write_bytes(input_ctx_ptr as *mut u8, 0, 4096);
+        (*input_ctx_ptr).add_flags = 0x3; // Add Slot Context (bit 0) and EP0 Context (bit 1)
+        core::ptr::copy_nonoverlapping(
+            device_ctx_ptr as *const u8,
+            core::ptr::addr_of_mut!((*input_ctx_ptr).device) as *mut u8,
+            core::mem::size_of::<DeviceContext>(),
+        );
+    }
 
     // 5. Send Address Device Command
     let mut trb = Trb::default();
     trb.param = input_ctx_ptr as u64;
     trb.control = (TRB_ADDRESS_DEVICE_COMMAND as u32) << 10 | (slot_id as u32) << 24; // BSR = 0
-
-    unsafe {
-        write_volatile(core::ptr::addr_of_mut!(LAST_COMPLETION_CODE), 0);
-        ctx.cmd_ring.enqueue(trb, ctx.db);
-    }
-
-    // Wait for completion
-    while unsafe { read_volatile(core::ptr::addr_of!(LAST_COMPLETION_CODE)) } == 0 {
-        unsafe { process_events() };
-        core::hint::spin_loop();
-    }
-
-    println!("xHCI: Address Device completed with code {}", unsafe {
-        read_volatile(core::ptr::addr_of!(LAST_COMPLETION_CODE))
-    });
-
-    if unsafe { read_volatile(core::ptr::addr_of!(LAST_COMPLETION_CODE)) } == 1 {
-        unsafe { get_descriptor(slot_id) };
-    }
+    unsafe { post_command(trb) }
 }
 
-pub unsafe fn control_transfer(
+/// Polls before a control transfer is declared lost.
+const CONTROL_TIMEOUT_SPINS: usize = 2_000_000;
+/// Polls before a bulk/interrupt transfer is declared lost; mass storage
+/// devices may take a while to spin up or flush.
+const TRANSFER_TIMEOUT_SPINS: usize = 20_000_000;
+
+/// Queue a control transfer on EP0 without waiting for it; the caller holds
+/// XHCI_LOCK. `control_result` reports its completion. Returns false if the
+/// slot has no EP0.
+unsafe fn submit_control(
     slot_id: u8,
     setup: [u8; 8],
     data: *mut u8,
     data_len: u16,
     is_in: bool,
-) {
+) -> bool {
     let ctx = match unsafe { &mut *core::ptr::addr_of_mut!(XHCI_CTX) } {
         Some(c) => c,
-        None => panic!("xHCI not initialized"),
+        None => return false,
     };
     let db = unsafe { ctx.db.add(slot_id as usize) };
-    let rings_ptr = core::ptr::addr_of_mut!(EP0_TRANSFER_RINGS);
-    let tr = unsafe { (*rings_ptr)[slot_id as usize - 1].as_mut().unwrap() };
+    let ep = match unsafe { endpoint(slot_id, 1) } {
+        Some(ep) => ep,
+        None => return false,
+    };
 
     // 1. Setup Stage
     let mut setup_trb = Trb::default();
@@ -972,8 +1598,7 @@ pub unsafe fn control_transfer(
         control |= (if is_in { 3 } else { 2 }) << 16; // TRT: 3=In, 2=Out
     }
     setup_trb.control = control;
-    unsafe { tr.enqueue(setup_trb, db, 1) }; // EP0 Endpoint ID = 1
-    // println!("xHCI: Setup stage enqueued");
+    unsafe { ep.ring.enqueue_td(&[setup_trb]) };
 
     // 2. Data Stage (optional)
     if data_len > 0 {
@@ -981,278 +1606,506 @@ pub unsafe fn control_transfer(
         data_trb.param = data as u64;
         data_trb.status = data_len as u32;
         data_trb.control = (TRB_DATA_STAGE as u32) << 10 | (if is_in { 1 } else { 0 }) << 16;
-        unsafe { tr.enqueue(data_trb, db, 1) };
-        // println!("xHCI: Data stage enqueued");
+        unsafe { ep.ring.enqueue_td(&[data_trb]) };
     }
 
     // 3. Status Stage
     let mut status_trb = Trb::default();
     status_trb.control = (TRB_STATUS_STAGE as u32) << 10
         | (if is_in && data_len > 0 { 0 } else { 1 }) << 16
-        | (1 << 5); // IOC = 1
-    unsafe {
-        write_volatile(core::ptr::addr_of_mut!(LAST_COMPLETION_CODE), 0);
-        tr.enqueue(status_trb, db, 1);
+        | TRB_FLAG_IOC;
+    ep.completion_code = 0;
+    ep.pending_trb = unsafe { ep.ring.enqueue_td(&[status_trb]) };
+    unsafe { write_volatile(db, 1) }; // EP0 Endpoint ID = 1
+    true
+}
+
+/// Completion code of the last control transfer on a slot's EP0, or None
+/// while it is still in flight.
+unsafe fn control_result(slot_id: u8) -> Option<u8> {
+    match unsafe { endpoint(slot_id, 1) } {
+        Some(ep) if ep.pending_trb != 0 => None,
+        Some(ep) => Some(ep.completion_code),
+        None => Some(0),
     }
-    // println!("xHCI: Status stage enqueued");
+}
 
-    // Wait for completion
-    let mut timeout = 0;
-    while unsafe { read_volatile(core::ptr::addr_of!(LAST_COMPLETION_CODE)) } == 0 {
-        unsafe { process_events() };
-        core::hint::spin_loop();
-        timeout += 1;
-        if timeout > 2000000 {
-            println!("xHCI: Control transfer timeout!");
-            break;
+/// Run a control transfer on EP0 and wait for it. Returns the completion
+/// code of the Status stage, or of whichever stage failed.
+pub unsafe fn control_transfer(
+    slot_id: u8,
+    setup: [u8; 8],
+    data: *mut u8,
+    data_len: u16,
+    is_in: bool,
+) -> u8 {
+    {
+        let _guard = XHCI_LOCK.lock();
+        if !unsafe { submit_control(slot_id, setup, data, data_len, is_in) } {
+            return 0;
         }
     }
+
+    unsafe { wait_td(slot_id, 1, CONTROL_TIMEOUT_SPINS) }
 }
 
-pub unsafe fn get_descriptor(slot_id: u8) {
-    println!("xHCI: Getting Device Descriptor for slot {}...", slot_id);
+/// Largest TD `transfer` builds; data TRBs are split at 64 KiB boundaries.
+const MAX_TD_TRBS: usize = 32;
+/// Largest buffer `transfer` accepts, whatever its alignment.
+pub const MAX_TRANSFER_BYTES: usize = (MAX_TD_TRBS - 1) * 0x10000;
 
-    // GET_DESCRIPTOR: 80 06 00 01 00 00 12 00
-    let setup: [u8; 8] = [
-        0x80, // bmRequestType: Device-to-Host, Standard, Device
-        0x06, // bRequest: GET_DESCRIPTOR
-        0x00, 0x01, // wValue: Descriptor Type (01) / Index (00)
-        0x00, 0x00, // wIndex: 0
-        18, 0x00, // wLength: 18
-    ];
+/// Run one bulk or interrupt transfer on a configured endpoint and wait for
+/// it; the direction is the endpoint's. The buffer is handed to the
+/// controller as-is, so it must be identity-mapped (the kernel heap, statics
+/// and stacks all are). A short packet counts as success.
+pub unsafe fn transfer(slot_id: u8, dci: u8, buffer: *mut u8, len: usize) -> Result<(), u8> {
+    let ctx = match unsafe { &mut *core::ptr::addr_of_mut!(XHCI_CTX) } {
+        Some(c) => c,
+        None => return Err(0),
+    };
+    if len > MAX_TRANSFER_BYTES {
+        return Err(0);
+    }
 
-    let buffer = core::ptr::addr_of_mut!(USB_DATA_BUFFER) as *mut u8;
-    unsafe {
-        core::ptr::write_bytes(buffer, 0, 18);
-        control_transfer(slot_id, setup, buffer, 18, true);
+    {
+        let _guard = XHCI_LOCK.lock();
+        let ep = match unsafe { endpoint(slot_id, dci) } {
+            Some(ep) => ep,
+            None => return Err(0),
+        };
+
+        let mut trbs = [Trb::default(); MAX_TD_TRBS];
+        let mut count = 0;
+        let mps = ep.max_packet_size.max(1) as usize;
+        let mut offset = 0;
+        loop {
+            let addr = buffer as u64 + offset as u64;
+            let chunk = (len - offset).min(0x10000 - (addr as usize & 0xFFFF));
+            offset += chunk;
+            // TD Size: packets still to come after this TRB, saturating at 31.
+            let td_size = (len - offset).div_ceil(mps).min(31) as u32;
+            trbs[count].param = addr;
+            trbs[count].status = chunk as u32 | (td_size << 17);
+            trbs[count].control = (TRB_NORMAL as u32) << 10;
+            count += 1;
+            if offset >= len {
+                break;
+            }
+        }
+        trbs[count - 1].control |= TRB_FLAG_IOC;
+
+        ep.completion_code = 0;
+        ep.pending_trb = unsafe { ep.ring.enqueue_td(&trbs[..count]) };
+        unsafe { write_volatile(ctx.db.add(slot_id as usize), dci as u32) };
     }
 
-    let code = unsafe { read_volatile(core::ptr::addr_of!(LAST_COMPLETION_CODE)) };
-    if code == 1 {
-        let vendor_id = unsafe { u16::from_le_bytes([*buffer.add(8), *buffer.add(9)]) };
-        let product_id = unsafe { u16::from_le_bytes([*buffer.add(10), *buffer.add(11)]) };
-        println!(
-            "xHCI: Device Descriptor: VendorID={:#06x}, ProductID={:#06x}",
-            vendor_id, product_id
-        );
+    match unsafe { wait_td(slot_id, dci, TRANSFER_TIMEOUT_SPINS) } {
+        COMPLETION_SUCCESS | COMPLETION_SHORT_PACKET => Ok(()),
+        code => Err(code),
+    }
+}
 
-        // Fetch Configuration Descriptor
-        unsafe { get_config_descriptor(slot_id) };
-    } else {
-        println!("xHCI: GET_DESCRIPTOR (Device) failed with code {}", code);
+/// Poll until the TD in flight on an endpoint completes, draining the event
+/// ring here so this works with or without interrupts. A TD that never
+/// completes is abandoned by resetting the endpoint.
+unsafe fn wait_td(slot_id: u8, dci: u8, spins: usize) -> u8 {
+    for _ in 0..spins {
+        {
+            let _guard = XHCI_LOCK.lock();
+            unsafe { process_events() };
+            match unsafe { endpoint(slot_id, dci) } {
+                Some(ep) if ep.pending_trb == 0 => return ep.completion_code,
+                Some(_) => {}
+                None => return 0,
+            }
+        }
+        core::hint::spin_loop();
     }
+
+    println!("xHCI: Transfer timeout (slot {}, endpoint {})", slot_id, dci);
+    unsafe { reset_endpoint(slot_id, dci) };
+    COMPLETION_TIMEOUT
 }
 
-pub unsafe fn get_config_descriptor(slot_id: u8) {
-    println!(
-        "xHCI: Getting Configuration Descriptor for slot {}...",
-        slot_id
-    );
+// Endpoint Context EP State values
+const EP_STATE_RUNNING: u32 = 1;
+const EP_STATE_HALTED: u32 = 2;
+
+/// Bring an endpoint back to an idle, usable state after a stall or a lost
+/// TD: Reset Endpoint if it halted (Stop Endpoint if it is still running),
+/// then Set TR Dequeue Pointer to our enqueue position so anything left on
+/// the ring is skipped. A halted bulk/interrupt pipe is also halted on the
+/// device side, so that is cleared with CLEAR_FEATURE(ENDPOINT_HALT).
+pub unsafe fn reset_endpoint(slot_id: u8, dci: u8) -> bool {
+    let ep_state = match unsafe { endpoint(slot_id, dci) } {
+        Some(_) => unsafe {
+            read_volatile(&(*device_context(slot_id)).endpoints[dci as usize - 1].field1) & 0x7
+        },
+        None => return false,
+    };
+    let target = (dci as u32) << 16 | (slot_id as u32) << 24;
 
-    // 1. Get first 9 bytes to know total length
-    let setup: [u8; 8] = [
-        0x80, // bmRequestType
-        0x06, // GET_DESCRIPTOR
-        0x00, 0x02, // wValue: Config Descriptor (02)
-        0x00, 0x00, // wIndex
-        0x09, 0x00, // wLength: 9
-    ];
+    let command = match ep_state {
+        EP_STATE_HALTED => Some(TRB_RESET_ENDPOINT_COMMAND),
+        EP_STATE_RUNNING => Some(TRB_STOP_ENDPOINT_COMMAND),
+        _ => None,
+    };
+    if let Some(command) = command {
+        let mut trb = Trb::default();
+        trb.control = (command as u32) << 10 | target;
+        let code = unsafe { execute_command(trb) };
+        if code != COMPLETION_SUCCESS {
+            println!("xHCI: Endpoint {} reset/stop failed with code {}", dci, code);
+            return false;
+        }
+    }
 
-    let buffer = unsafe { core::ptr::addr_of_mut!(USB_DATA_BUFFER) as *mut u8 };
-    unsafe {
-        core::ptr::write_bytes(buffer, 0, 9);
-        control_transfer(slot_id, setup, buffer, 9, true);
+    let mut trb = Trb::default();
+    {
+        let _guard = XHCI_LOCK.lock();
+        if let Some(ep) = unsafe { endpoint(slot_id, dci) } {
+            trb.param = ep.ring.dequeue_pointer();
+            ep.pending_trb = 0;
+        }
+    }
+    trb.control = (TRB_SET_TR_DEQUEUE_COMMAND as u32) << 10 | target;
+    let code = unsafe { execute_command(trb) };
+    if code != COMPLETION_SUCCESS {
+        println!("xHCI: Set TR Dequeue Pointer failed with code {}", code);
+        return false;
     }
 
-    if unsafe { read_volatile(core::ptr::addr_of!(LAST_COMPLETION_CODE)) } != 1 {
-        println!("xHCI: GET_DESCRIPTOR (Config Header) failed");
-        return;
+    if ep_state == EP_STATE_HALTED && dci > 1 {
+        let address = (dci / 2) | if dci & 1 != 0 { 0x80 } else { 0 };
+        let setup: [u8; 8] = [
+            0x02, // bmRequestType: Host-to-Device, Standard, Endpoint
+            0x01, // bRequest: CLEAR_FEATURE
+            0x00, 0x00, // wValue: ENDPOINT_HALT
+            address, 0x00, // wIndex: Endpoint Address
+            0x00, 0x00, // wLength
+        ];
+        let code = unsafe { control_transfer(slot_id, setup, core::ptr::null_mut(), 0, false) };
+        if code != COMPLETION_SUCCESS {
+            println!("xHCI: CLEAR_FEATURE(ENDPOINT_HALT) failed with code {}", code);
+            return false;
+        }
+    }
+    true
+}
+
+/// One endpoint, as described by its USB endpoint descriptor.
+#[derive(Debug, Clone, Copy, Default)]
+pub struct EndpointDescriptor {
+    pub address: u8,
+    pub attributes: u8,
+    pub max_packet_size: u16,
+    pub interval: u8,
+}
+
+impl EndpointDescriptor {
+    pub fn is_in(&self) -> bool {
+        (self.address & 0x80) != 0
     }
 
-    let total_len = unsafe { u16::from_le_bytes([*buffer.add(2), *buffer.add(3)]) };
-    println!("xHCI: Config descriptor total length: {}", total_len);
+    pub fn transfer_type(&self) -> u8 {
+        self.attributes & 0x03
+    }
 
-    // 2. Get full configuration descriptor
-    let mut setup_full = setup;
-    setup_full[6] = (total_len & 0xFF) as u8;
-    setup_full[7] = ((total_len >> 8) & 0xFF) as u8;
+    /// Device Context Index: EP n OUT is 2n, EP n IN is 2n + 1.
+    pub fn dci(&self) -> u8 {
+        (self.address & 0x0F) * 2 + self.is_in() as u8
+    }
+}
 
-    unsafe {
-        core::ptr::write_bytes(buffer, 0, total_len as usize);
-        control_transfer(slot_id, setup_full, buffer, total_len, true);
+pub const MAX_INTERFACE_ENDPOINTS: usize = 4;
+const MAX_INTERFACES: usize = 4;
+
+/// An interface (alternate setting 0) of the active configuration.
+#[derive(Debug, Clone, Copy, Default)]
+pub struct UsbInterface {
+    pub number: u8,
+    pub class: u8,
+    pub sub_class: u8,
+    pub protocol: u8,
+    endpoints: [EndpointDescriptor; MAX_INTERFACE_ENDPOINTS],
+    endpoint_count: usize,
+}
+
+impl UsbInterface {
+    pub fn endpoints(&self) -> &[EndpointDescriptor] {
+        &self.endpoints[..self.endpoint_count]
     }
 
-    if unsafe { read_volatile(core::ptr::addr_of!(LAST_COMPLETION_CODE)) } != 1 {
-        println!("xHCI: GET_DESCRIPTOR (Config Full) failed");
-        return;
+    /// First endpoint with the given transfer type and direction.
+    pub fn find_endpoint(&self, transfer_type: u8, is_in: bool) -> Option<EndpointDescriptor> {
+        self.endpoints()
+            .iter()
+            .find(|ep| ep.transfer_type() == transfer_type && ep.is_in() == is_in)
+            .copied()
     }
+}
+
+const USB_CLASS_HID: u8 = 3;
+const USB_HID_PROTOCOL_KEYBOARD: u8 = 1;
 
-    // 3. Parse descriptors to find Interrupt In endpoint
+fn is_boot_keyboard(interface: &UsbInterface) -> bool {
+    interface.class == USB_CLASS_HID && interface.protocol == USB_HID_PROTOCOL_KEYBOARD
+}
+
+fn has_driver(interface: &UsbInterface) -> bool {
+    is_boot_keyboard(interface) || crate::usb_storage::matches(interface)
+}
+
+/// Hand an interface of a configured device to its class driver.
+unsafe fn bind_interface(slot_id: u8, interface: &UsbInterface) {
+    if is_boot_keyboard(interface) {
+        unsafe { setup_keyboard_endpoint(slot_id, interface) };
+    } else if crate::usb_storage::matches(interface) {
+        if let Err(msg) = unsafe { crate::usb_storage::probe(slot_id, interface) } {
+            println!("usb-storage: slot {}: {}", slot_id, msg);
+        }
+    }
+}
+
+/// Parse a device's full configuration descriptor, select that configuration
+/// and hand each interface to its class driver. Runs in task context, since
+/// class drivers issue blocking transfers.
+unsafe fn configure_device(slot_id: u8, descriptors: &[u8]) {
+    if descriptors.len() < 9 {
+        return;
+    }
+    let buffer = descriptors.as_ptr();
+    let total_len = descriptors.len();
+    let config_value = descriptors[5];
+
+    // 1. Parse descriptors into interfaces and their endpoints. Alternate
+    //    settings other than 0 are skipped along with their endpoints.
+    let mut interfaces = [UsbInterface::default(); MAX_INTERFACES];
+    let mut interface_count = 0;
+    let mut current: Option<usize> = None;
     let mut offset = 0;
-    while offset < total_len as usize {
+    while offset + 2 <= total_len {
         let len = unsafe { *buffer.add(offset) } as usize;
         let type_ = unsafe { *buffer.add(offset + 1) };
+        if len == 0 || offset + len > total_len {
+            break;
+        }
 
         if type_ == 0x04 {
             // Interface Descriptor
+            let number = unsafe { *buffer.add(offset + 2) };
+            let alternate = unsafe { *buffer.add(offset + 3) };
             let class = unsafe { *buffer.add(offset + 5) };
             let sub_class = unsafe { *buffer.add(offset + 6) };
             let protocol = unsafe { *buffer.add(offset + 7) };
             println!(
-                "xHCI: Interface: Class={}, SubClass={}, Protocol={}",
-                class, sub_class, protocol
+                "xHCI: Interface {}: Class={}, SubClass={}, Protocol={}",
+                number, class, sub_class, protocol
             );
+            current = None;
+            if alternate == 0 && interface_count < MAX_INTERFACES {
+                interfaces[interface_count] = UsbInterface {
+                    number,
+                    class,
+                    sub_class,
+                    protocol,
+                    ..UsbInterface::default()
+                };
+                current = Some(interface_count);
+                interface_count += 1;
+            }
         } else if type_ == 0x05 {
             // Endpoint Descriptor
-            let addr = unsafe { *buffer.add(offset + 2) };
-            let attr = unsafe { *buffer.add(offset + 3) };
-            let mps =
-                unsafe { u16::from_le_bytes([*buffer.add(offset + 4), *buffer.add(offset + 5)]) };
-            let interval = unsafe { *buffer.add(offset + 6) };
-
-            let is_in = (addr & 0x80) != 0;
-            let ep_type = attr & 0x03; // 0=Control, 1=Isoch, 2=Bulk, 3=Interrupt
-
+            let ep = EndpointDescriptor {
+                address: unsafe { *buffer.add(offset + 2) },
+                attributes: unsafe { *buffer.add(offset + 3) },
+                max_packet_size: unsafe {
+                    u16::from_le_bytes([*buffer.add(offset + 4), *buffer.add(offset + 5)])
+                },
+                interval: unsafe { *buffer.add(offset + 6) },
+            };
             println!(
                 "xHCI: Endpoint: Addr={:#x}, Attr={}, MPS={}, Interval={}",
-                addr, attr, mps, interval
+                ep.address, ep.attributes, ep.max_packet_size, ep.interval
             );
-
-            if is_in && ep_type == 3 {
-                println!("xHCI: Found Interrupt In endpoint: {:#x}", addr);
-                let ep_index = (addr & 0x0F) * 2 + 1;
-                unsafe {
-                    (*core::ptr::addr_of_mut!(KEYBOARD_EP_INDICES))[slot_id as usize - 1] =
-                        ep_index;
-                    setup_keyboard_endpoint(slot_id, ep_index, mps, interval);
+            if let Some(i) = current {
+                let interface = &mut interfaces[i];
+                if interface.endpoint_count < MAX_INTERFACE_ENDPOINTS {
+                    interface.endpoints[interface.endpoint_count] = ep;
+                    interface.endpoint_count += 1;
                 }
-                return;
             }
         }
         offset += len;
-        if len == 0 {
-            break;
-        }
     }
-}
-
-pub unsafe fn setup_keyboard_endpoint(slot_id: u8, ep_index: u8, mps: u16, interval: u8) {
-    println!(
-        "xHCI: Setting up keyboard endpoint (Slot={}, Index={}, MPS={}, Interval={})...",
-        slot_id, ep_index, mps, interval
-    );
-
-    // 1. Set Configuration
-    let setup_config: [u8; 8] = [
-        0x00, // bmRequestType: Host-to-Device, Standard, Device
-        0x09, // bRequest: SET_CONFIGURATION
-        0x01, 0x00, // wValue: Config Value 1
-        0x00, 0x00, // wIndex
-        0x00, 0x00, // wLength
-    ];
-    unsafe { control_transfer(slot_id, setup_config, core::ptr::null_mut(), 0, false) };
 
-    if unsafe { read_volatile(core::ptr::addr_of!(LAST_COMPLETION_CODE)) } != 1 {
+    // 2. Select the configuration, then let each class driver claim its
+    //    interface. Devices nobody drives are left unconfigured.
+    let interfaces = &interfaces[..interface_count];
+    if !interfaces.iter().any(has_driver) {
+        println!("xHCI: No driver for any interface of slot {}", slot_id);
+        return;
+    }
+    if !unsafe { set_configuration(slot_id, config_value) } {
         println!("xHCI: SET_CONFIGURATION failed");
         return;
     }
-    println!("xHCI: Configuration set to 1");
+    println!("xHCI: Configuration set to {}", config_value);
 
-    // 1.1 Set Idle (0 = infinity)
-    let setup_idle: [u8; 8] = [
-        0x21, // bmRequestType: Host-to-Device, Class, Interface
-        0x0A, // SET_IDLE
-        0x00, 0x00, // wValue: Duration=0, ReportID=0
-        0x00, 0x00, // wIndex: Interface 0
-        0x00, 0x00, // wLength
-    ];
-    unsafe { control_transfer(slot_id, setup_idle, core::ptr::null_mut(), 0, false) };
-    println!("xHCI: SET_IDLE completed");
+    for interface in interfaces {
+        unsafe { bind_interface(slot_id, interface) };
+    }
+}
 
-    // 1.2 Set Protocol (0 = Boot Protocol)
-    let setup_protocol: [u8; 8] = [
-        0x21, // bmRequestType
-        0x0B, // SET_PROTOCOL
-        0x00, 0x00, // wValue: 0 (Boot Protocol)
+pub unsafe fn set_configuration(slot_id: u8, value: u8) -> bool {
+    let setup: [u8; 8] = [
+        0x00, // bmRequestType: Host-to-Device, Standard, Device
+        0x09, // bRequest: SET_CONFIGURATION
+        value, 0x00, // wValue: Config Value
         0x00, 0x00, // wIndex
         0x00, 0x00, // wLength
     ];
-    unsafe { control_transfer(slot_id, setup_protocol, core::ptr::null_mut(), 0, false) };
-    println!("xHCI: SET_PROTOCOL completed");
+    unsafe { control_transfer(slot_id, setup, core::ptr::null_mut(), 0, false) == COMPLETION_SUCCESS }
+}
 
-    // 2. Initialize Interrupt In Transfer Ring
-    let tr_buffer = unsafe {
-        let buffers_ptr = core::ptr::addr_of_mut!(KEYBOARD_TR_BUFFERS);
-        &mut (*buffers_ptr).0[slot_id as usize - 1] as *mut [Trb; 256] as *mut Trb
-    };
-    let tr = TransferRing::new(tr_buffer, 4096);
-    unsafe {
-        let rings_ptr = core::ptr::addr_of_mut!(KEYBOARD_TRANSFER_RINGS);
-        (*rings_ptr)[slot_id as usize - 1] = Some(tr);
+/// Endpoint Context Interval: the service interval as 2^Interval × 125 µs.
+/// High/SuperSpeed descriptors already give that exponent (plus one); for
+/// Full/Low Speed interrupt endpoints bInterval is in 1 ms frames.
+fn endpoint_interval(speed: u8, ep: &EndpointDescriptor) -> u32 {
+    if ep.transfer_type() != USB_ENDPOINT_INTERRUPT {
+        return 0;
     }
+    match speed {
+        USB_SPEED_HIGH | USB_SPEED_SUPER => ep.interval.clamp(1, 16) as u32 - 1,
+        _ => {
+            let microframes = ep.interval.max(1) as u32 * 8;
+            (31 - microframes.leading_zeros()).clamp(3, 10)
+        }
+    }
+}
 
-    // 3. Prepare Input Context for Configure Endpoint
-    let ctx = match unsafe { &mut *core::ptr::addr_of_mut!(XHCI_CTX) } {
-        Some(c) => c,
-        None => return,
-    };
-
-    let device_ctx_ptr = unsafe {
-        let buffers_ptr = core::ptr::addr_of_mut!(DEVICE_CONTEXT_BUFFERS);
-        &mut (*buffers_ptr).0[slot_id as usize - 1] as *mut DeviceContext
-    };
+/// Add bulk/interrupt endpoints to a slot with one Configure Endpoint
+/// command, giving each its own freshly allocated transfer ring.
+pub unsafe fn configure_endpoints(slot_id: u8, endpoints: &[EndpointDescriptor]) -> bool {
+    if endpoints.len() > MAX_INTERFACE_ENDPOINTS {
+        return false;
+    }
+    let speed = unsafe { (*core::ptr::addr_of!(SLOT_SPEEDS))[slot_id as usize - 1] };
+    let device_ctx_ptr = device_context(slot_id);
+    let input_ctx_ptr = core::ptr::addr_of_mut!(INPUT_CONTEXT_BUFFER) as *mut InputContext;
 
-    let input_ctx_ptr = unsafe {
-        let ptr = core::ptr::addr_of_mut!(INPUT_CONTEXT_BUFFER) as *mut InputContext;
-        core::ptr::write_bytes(ptr as *mut u8, 0, 4096);
-        // Add Flags: bit 0 (Slot), bit ep_index (Endpoint)
-        (*ptr).add_flags = 1 | (1 << ep_index);
+    let mut rings: [Option<TransferRing>; MAX_INTERFACE_ENDPOINTS] = [const { None }; MAX_INTERFACE_ENDPOINTS];
+    unsafe {
+        core::ptr::write_bytes(input_ctx_ptr as *mut u8, 0, 4096);
+        (*input_ctx_ptr).add_flags = 1; // Slot Context
 
         // Copy Slot Context
         core::ptr::copy_nonoverlapping(
             &(*device_ctx_ptr).slot as *const _ as *const u8,
-            &mut (*ptr).device.slot as *mut _ as *mut u8,
+            &mut (*input_ctx_ptr).device.slot as *mut _ as *mut u8,
             core::mem::size_of::<SlotContext>(),
         );
+    }
+    let mut entries = unsafe { ((*input_ctx_ptr).device.slot.field1 >> 27) & 0x1F };
+
+    for (i, desc) in endpoints.iter().enumerate() {
+        let ep_type = match (desc.transfer_type(), desc.is_in()) {
+            (USB_ENDPOINT_BULK, false) => EP_TYPE_BULK_OUT,
+            (USB_ENDPOINT_BULK, true) => EP_TYPE_BULK_IN,
+            (USB_ENDPOINT_INTERRUPT, false) => EP_TYPE_INTERRUPT_OUT,
+            (USB_ENDPOINT_INTERRUPT, true) => EP_TYPE_INTERRUPT_IN,
+            _ => return false,
+        };
+        let ring = match TransferRing::allocate() {
+            Some(ring) => ring,
+            None => return false,
+        };
+        let dci = desc.dci();
+        let mps = (desc.max_packet_size & 0x7FF) as u32;
 
-        // Update Slot Context in Input Context (Context Entries)
-        let entries = ep_index; // index of the last valid endpoint context
-        (*ptr).device.slot.field1 =
-            ((*ptr).device.slot.field1 & !(0x1F << 27)) | ((entries as u32) << 27);
-
-        // Setup Endpoint Context in Input Context
-        let ep_ctx = &mut (*ptr).device.endpoints[ep_index as usize - 1];
-        ep_ctx.field2 = (7 << 3) | ((mps as u32) << 16) | (3 << 1); // EP Type = Interrupt In (7), MPS, CErr = 3
-        ep_ctx.tr_dequeue_pointer = (tr_buffer as u64) | 1; // DCS = 1
-        ep_ctx.field4 = (interval as u32 - 1) << 16; // Interval (logged scale) - for HS: 2^(val) * 125us
-        // Note: For FS/LS it's 1ms units. Keyboard HS usually has interval 7-9 (1ms-4ms).
-        ptr
-    };
+        unsafe {
+            let ep_ctx = &mut (*input_ctx_ptr).device.endpoints[dci as usize - 1];
+            ep_ctx.field1 = endpoint_interval(speed, desc) << 16;
+            ep_ctx.field2 = (ep_type << 3) | (mps << 16) | (3 << 1); // EP Type, MPS, CErr = 3
+            ep_ctx.tr_dequeue_pointer = ring.dequeue_pointer();
+            // Average TRB Length, plus Max ESIT Payload for periodic endpoints
+            ep_ctx.field4 = if desc.transfer_type() == USB_ENDPOINT_INTERRUPT {
+                mps | (mps << 16)
+            } else {
+                3072
+            };
+            (*input_ctx_ptr).add_flags |= 1 << dci;
+        }
+        entries = entries.max(dci as u32);
+        rings[i] = Some(ring);
+    }
+
+    // Context Entries: index of the last valid endpoint context
+    unsafe {
+        (*input_ctx_ptr).device.slot.field1 =
+            ((*input_ctx_ptr).device.slot.field1 & !(0x1F << 27)) | (entries << 27);
+    }
 
-    // 4. Send Configure Endpoint Command
     let mut trb = Trb::default();
     trb.param = input_ctx_ptr as u64;
     trb.control = (TRB_CONFIGURE_ENDPOINT_COMMAND as u32) << 10 | (slot_id as u32) << 24;
-
-    unsafe {
-        write_volatile(core::ptr::addr_of_mut!(LAST_COMPLETION_CODE), 0);
-        ctx.cmd_ring.enqueue(trb, ctx.db);
+    let code = unsafe { execute_command(trb) };
+    if code != COMPLETION_SUCCESS {
+        println!("xHCI: CONFIGURE_ENDPOINT failed with code {}", code);
+        return false;
     }
 
-    // Wait for completion
-    while unsafe { read_volatile(core::ptr::addr_of!(LAST_COMPLETION_CODE)) } == 0 {
-        unsafe { process_events() };
-        core::hint::spin_loop();
+    for (desc, ring) in endpoints.iter().zip(rings.iter_mut()) {
+        if let Some(ring) = ring.take() {
+            unsafe { set_endpoint(slot_id, desc.dci(), Endpoint::new(ring, desc.max_packet_size & 0x7FF)) };
+        }
     }
+    true
+}
 
-    if unsafe { read_volatile(core::ptr::addr_of!(LAST_COMPLETION_CODE)) } == 1 {
+pub unsafe fn setup_keyboard_endpoint(slot_id: u8, interface: &UsbInterface) {
+    let ep = match interface.find_endpoint(USB_ENDPOINT_INTERRUPT, true) {
+        Some(ep) => ep,
+        None => {
+            println!("xHCI: Keyboard interface has no Interrupt In endpoint");
+            return;
+        }
+    };
+    let ep_index = ep.dci();
+    println!(
+        "xHCI: Setting up keyboard endpoint (Slot={}, Index={}, MPS={}, Interval={})...",
+        slot_id, ep_index, ep.max_packet_size, ep.interval
+    );
+
+    // 1. Set Idle (0 = infinity)
+    let setup_idle: [u8; 8] = [
+        0x21, // bmRequestType: Host-to-Device, Class, Interface
+        0x0A, // SET_IDLE
+        0x00, 0x00, // wValue: Duration=0, ReportID=0
+        interface.number, 0x00, // wIndex: Interface
+        0x00, 0x00, // wLength
+    ];
+    unsafe { control_transfer(slot_id, setup_idle, core::ptr::null_mut(), 0, false) };
+    println!("xHCI: SET_IDLE completed");
+
+    // 2. Set Protocol (0 = Boot Protocol)
+    let setup_protocol: [u8; 8] = [
+        0x21, // bmRequestType
+        0x0B, // SET_PROTOCOL
+        0x00, 0x00, // wValue: 0 (Boot Protocol)
+        interface.number, 0x00, // wIndex
+        0x00, 0x00, // wLength
+    ];
+    unsafe { control_transfer(slot_id, setup_protocol, core::ptr::null_mut(), 0, false) };
+    println!("xHCI: SET_PROTOCOL completed");
+
+    // 3. Configure the Interrupt In endpoint and start polling for reports
+    if unsafe { configure_endpoints(slot_id, &[ep]) } {
         println!("xHCI: Interrupt In endpoint configured");
-        // Start polling for reports
-        unsafe { queue_keyboard_report_request(slot_id, ep_index) };
-    } else {
-        println!("xHCI: CONFIGURE_ENDPOINT failed with code {}", unsafe {
-            read_volatile(core::ptr::addr_of!(LAST_COMPLETION_CODE))
-        });
+        unsafe {
+            (*core::ptr::addr_of_mut!(KEYBOARD_EP_INDICES))[slot_id as usize - 1] = ep_index;
+            queue_keyboard_report_request(slot_id, ep_index);
+        }
     }
 }
 
@@ -1262,9 +2115,9 @@ pub unsafe fn queue_keyboard_report_request(slot_id: u8, ep_index: u8) {
         None => return,
     };
     let db = unsafe { ctx.db.add(slot_id as usize) };
-    let tr = unsafe {
-        let rings_ptr = core::ptr::addr_of_mut!(KEYBOARD_TRANSFER_RINGS);
-        (*rings_ptr)[slot_id as usize - 1].as_mut().unwrap()
+    let tr = match unsafe { endpoint(slot_id, ep_index) } {
+        Some(ep) => &mut ep.ring,
+        None => return,
     };
     let buffer = unsafe {
         let buffers_ptr = core::ptr::addr_of_mut!(KEYBOARD_REPORT_BUFFERS);
@@ -1274,7 +2127,7 @@ pub unsafe fn queue_keyboard_report_request(slot_id: u8, ep_index: u8) {
     let mut trb = Trb::default();
     trb.param = buffer as u64;
     trb.status = 8; // Request 8 bytes
-    trb.control = (TRB_NORMAL as u32) << 10 | (1 << 5); // IOC = 1
+    trb.control = (TRB_NORMAL as u32) << 10 | TRB_FLAG_IOC;
     // println!("xHCI: Queueing report request for slot {}, ep {}", slot_id, ep_index);
     unsafe { tr.enqueue(trb, db, ep_index) };
 }
@@ -0,0 +1,122 @@
+#!/usr/bin/env bash
+# Boot the kernel in benchmark mode under QEMU, collect the results from the
+# serial port and compare them against a baseline.
+#
+# Usage: tools/bench.sh [options] [benchmark...]
+#   --scale <n>           multiply iteration counts by n (default 1)
+#   --out <file>          where to write the results (default bench/results.txt)
+#   --baseline <file>     compare against this results file
+#   --threshold <pct>     slowdown that counts as a regression (default 10)
+#   --save-baseline <file> copy the results there after the run
+#   --lockstat            build with lock statistics and print their table
+#
+# Benchmarks: ctxswitch syscall nvme-qd1 nvme-qd32 alloc locks fs net-echo
+# (all of them if none are named). Exits 1 if any result regressed by more
+# than the threshold, 2 if the run itself failed.
+set -e
+
+# Change directory to the workspace root
+cd "$(dirname "$0")/.."
+
+SCALE=1
+OUT=bench/results.txt
+BASELINE=""
+THRESHOLD=10
+SAVE_BASELINE=""
+FEATURES=""
+BENCHMARKS=()
+
+while [ $# -gt 0 ]; do
+    case "$1" in
+        --scale) SCALE="$2"; shift 2 ;;
+        --out) OUT="$2"; shift 2 ;;
+        --baseline) BASELINE="$2"; shift 2 ;;
+        --threshold) THRESHOLD="$2"; shift 2 ;;
+        --save-baseline) SAVE_BASELINE="$2"; shift 2 ;;
+        --lockstat) FEATURES="--features lockstat"; shift ;;
+        -h|--help) sed -n '2,15p' "$0" | sed 's/^# \{0,1\}//'; exit 0 ;;
+        -*) echo "Unknown option $1" >&2; exit 2 ;;
+        *) BENCHMARKS+=("$1"); shift ;;
+    esac
+done
+
+mkdir -p bench esp/EFI/BOOT "$(dirname "$OUT")"
+
+echo "🔨 Building kernel..."
+cargo build --release --target x86_64-unknown-uefi $FEATURES
+cp target/x86_64-unknown-uefi/release/os.efi esp/EFI/BOOT/BOOTX64.EFI
+
+# A fresh volume every run, so the filesystem benchmarks start from the same
+# state. bench.cfg on it is what switches the kernel into benchmark mode.
+echo "🔨 Preparing bench/nvme.img..."
+{
+    echo "# generated by tools/bench.sh"
+    echo "scale $SCALE"
+    for name in "${BENCHMARKS[@]}"; do
+        echo "$name"
+    done
+} > bench/bench.cfg
+rm -f bench/nvme.img
+truncate -s 1G bench/nvme.img
+KEF_TOOL="cargo run --quiet --release --manifest-path tools/kef-tool/Cargo.toml --"
+$KEF_TOOL format bench/nvme.img
+$KEF_TOOL insert bench/nvme.img bench/bench.cfg bench.cfg
+
+echo "🚀 Booting QEMU..."
+# The kernel powers the VM off when it is done; the timeout only catches a
+# hang.
+timeout 600 qemu-system-x86_64 \
+    -smp 2 \
+    -bios "${OVMF_BIOS}" \
+    -drive format=raw,file=fat:rw:esp \
+    -drive file=bench/nvme.img,if=none,id=nvm,format=raw \
+    -device nvme,serial=deadbeef,drive=nvm \
+    -device qemu-xhci,id=xhci,msix=off \
+    -device e1000,netdev=net0 \
+    -netdev user,id=net0 \
+    -display none \
+    -serial file:bench/serial.log \
+    -no-reboot || true
+
+if ! grep -q '^BENCH-END' bench/serial.log; then
+    echo "❌ Benchmark run did not finish; see bench/serial.log" >&2
+    exit 2
+fi
+
+# "BENCH <name> <value> <unit>" -> "<name> <value> <unit>"
+tr -d '\r' < bench/serial.log | sed -n 's/^BENCH \([^ ]*\) \([0-9]*\) \(.*\)$/\1 \2 \3/p' > "$OUT"
+tr -d '\r' < bench/serial.log | grep '^BENCH-SKIP' || true
+echo "✅ Results written to $OUT"
+cat "$OUT"
+
+if [ -n "$FEATURES" ]; then
+    # The kernel prints the lockstat table after BENCH-END.
+    echo
+    echo "Lock statistics:"
+    tr -d '\r' < bench/serial.log | sed -n '/^BENCH-END/,$p' | tail -n +2
+fi
+
+STATUS=0
+if [ -n "$BASELINE" ]; then
+    echo
+    echo "Comparison against $BASELINE (threshold ${THRESHOLD}%):"
+    # Every value is lower-is-better.
+    awk -v threshold="$THRESHOLD" '
+        NR == FNR { base[$1] = $2; next }
+        {
+            if (!($1 in base)) { printf "  %-24s %12s -> %12s  new\n", $1, "-", $2; next }
+            change = base[$1] == 0 ? 0 : 100 * ($2 - base[$1]) / base[$1]
+            flag = change > threshold ? "REGRESSED" : (change < -threshold ? "improved" : "")
+            printf "  %-24s %12s -> %12s  %+6.1f%%  %s\n", $1, base[$1], $2, change, flag
+            if (change > threshold) regressed = 1
+        }
+        END { exit regressed }
+    ' "$BASELINE" "$OUT" || STATUS=1
+fi
+
+if [ -n "$SAVE_BASELINE" ]; then
+    cp "$OUT" "$SAVE_BASELINE"
+    echo "Baseline saved to $SAVE_BASELINE"
+fi
+
+exit $STATUS
@@ -0,0 +1,5 @@
+// `cargo bench` entry point: every suite, with the flag cargo adds dropped.
+
+fn main() {
+    kbench::run(std::env::args().skip(1).filter(|arg| arg != "--bench").collect());
+}
@@ -0,0 +1,147 @@
+// ============================================================================
+// Host block devices
+// ============================================================================
+//
+// Both devices count the requests the filesystem makes, so a benchmark can
+// report I/O per operation next to wall time. On the real disk the request
+// count, not the bytes moved, is what dominates small-file cost.
+
+use kagfat::{BLOCK_SIZE, BlockDevice, DATA_START_LBA, FAT_ENTRIES, FsError, FsResult, SECTORS_PER_CLUSTER};
+use std::fs::{File, OpenOptions};
+use std::os::unix::fs::FileExt;
+
+/// Sectors a volume can actually use: the FAT addresses FAT_ENTRIES clusters
+/// whatever the boot sector says, so nothing past them is ever touched.
+pub const VOLUME_SECTORS: u64 = DATA_START_LBA + (FAT_ENTRIES as u64 - 2) * SECTORS_PER_CLUSTER as u64;
+
+#[derive(Debug, Clone, Copy, Default)]
+pub struct IoCounters {
+    pub reads: u64,
+    pub writes: u64,
+    pub sectors_read: u64,
+    pub sectors_written: u64,
+}
+
+impl IoCounters {
+    pub fn requests(&self) -> u64 {
+        self.reads + self.writes
+    }
+
+    pub fn since(&self, earlier: &IoCounters) -> IoCounters {
+        IoCounters {
+            reads: self.reads - earlier.reads,
+            writes: self.writes - earlier.writes,
+            sectors_read: self.sectors_read - earlier.sectors_read,
+            sectors_written: self.sectors_written - earlier.sectors_written,
+        }
+    }
+}
+
+/// A block device the benchmarks can read the counters of.
+pub trait CountingDevice: BlockDevice {
+    fn counters(&self) -> IoCounters;
+}
+
+fn check_range(lba: u64, len: usize) -> FsResult<u64> {
+    if len == 0 || len % BLOCK_SIZE != 0 {
+        return Err(FsError::InvalidArgument);
+    }
+    let count = (len / BLOCK_SIZE) as u64;
+    if lba.checked_add(count).map_or(true, |end| end > VOLUME_SECTORS) {
+        return Err(FsError::DeviceError);
+    }
+    Ok(count)
+}
+
+// ============================================================================
+// In-memory device
+// ============================================================================
+
+pub struct MemDisk {
+    data: Vec<u8>,
+    counters: IoCounters,
+}
+
+impl MemDisk {
+    pub fn new() -> Self {
+        Self {
+            data: vec![0; VOLUME_SECTORS as usize * BLOCK_SIZE],
+            counters: IoCounters::default(),
+        }
+    }
+}
+
+impl BlockDevice for MemDisk {
+    fn read_blocks(&mut self, lba: u64, buffer: &mut [u8]) -> FsResult<()> {
+        let count = check_range(lba, buffer.len())?;
+        let start = lba as usize * BLOCK_SIZE;
+        buffer.copy_from_slice(&self.data[start..start + buffer.len()]);
+        self.counters.reads += 1;
+        self.counters.sectors_read += count;
+        Ok(())
+    }
+
+    fn write_blocks(&mut self, lba: u64, buffer: &[u8]) -> FsResult<()> {
+        let count = check_range(lba, buffer.len())?;
+        let start = lba as usize * BLOCK_SIZE;
+        self.data[start..start + buffer.len()].copy_from_slice(buffer);
+        self.counters.writes += 1;
+        self.counters.sectors_written += count;
+        Ok(())
+    }
+}
+
+impl CountingDevice for MemDisk {
+    fn counters(&self) -> IoCounters {
+        self.counters
+    }
+}
+
+// ============================================================================
+// File-backed device
+// ============================================================================
+//
+// Positioned reads and writes against an image file, so the page cache and
+// the syscall cost per request show up the way a real disk's latency would.
+
+pub struct FileDisk {
+    file: File,
+    counters: IoCounters,
+}
+
+impl FileDisk {
+    /// Open (or create) the image at `path` and size it to VOLUME_SECTORS.
+    pub fn open(path: &str) -> std::io::Result<Self> {
+        let file = OpenOptions::new().read(true).write(true).create(true).truncate(false).open(path)?;
+        file.set_len(VOLUME_SECTORS * BLOCK_SIZE as u64)?;
+        Ok(Self { file, counters: IoCounters::default() })
+    }
+}
+
+impl BlockDevice for FileDisk {
+    fn read_blocks(&mut self, lba: u64, buffer: &mut [u8]) -> FsResult<()> {
+        let count = check_range(lba, buffer.len())?;
+        self.file
+            .read_exact_at(buffer, lba * BLOCK_SIZE as u64)
+            .map_err(|_| FsError::DeviceError)?;
+        self.counters.reads += 1;
+        self.counters.sectors_read += count;
+        Ok(())
+    }
+
+    fn write_blocks(&mut self, lba: u64, buffer: &[u8]) -> FsResult<()> {
+        let count = check_range(lba, buffer.len())?;
+        self.file
+            .write_all_at(buffer, lba * BLOCK_SIZE as u64)
+            .map_err(|_| FsError::DeviceError)?;
+        self.counters.writes += 1;
+        self.counters.sectors_written += count;
+        Ok(())
+    }
+}
+
+impl CountingDevice for FileDisk {
+    fn counters(&self) -> IoCounters {
+        self.counters
+    }
+}
@@ -0,0 +1,185 @@
+// ============================================================================
+// Filesystem benchmarks
+// ============================================================================
+//
+// The kernel's `kagfat::Volume` over a host device. Every figure comes with
+// the device requests it took, since that is what costs on real hardware;
+// the in-memory device makes the wall time mostly CPU.
+
+use crate::disk::{CountingDevice, IoCounters};
+use crate::{Report, Rng};
+use kagfat::{CLUSTER_SIZE, FAT_ENTRIES, FsError, ROOT_DIR_ENTRIES, Volume};
+use std::time::Instant;
+
+/// File sizes for the create/read/delete runs.
+const FILE_SIZES: [usize; 3] = [512, 16 * 1024, 256 * 1024];
+
+/// Files per run: the root directory holds ROOT_DIR_ENTRIES, and the biggest
+/// run must also fit in the clusters the FAT can address.
+fn file_count(size: usize) -> usize {
+    let clusters = FAT_ENTRIES - 2;
+    (ROOT_DIR_ENTRIES * 3 / 4).min(clusters / size.div_ceil(CLUSTER_SIZE) * 3 / 4)
+}
+
+fn name(i: usize) -> String {
+    format!("bench{:05}.dat", i)
+}
+
+/// Time `op` once per item and record rate and requests per item.
+fn measure<D: CountingDevice>(
+    report: &mut Report,
+    label: &str,
+    volume: &mut Volume<D>,
+    items: usize,
+    mut op: impl FnMut(&mut Volume<D>, usize) -> Result<(), FsError>,
+) -> Result<(), FsError> {
+    let before = volume.device().counters();
+    let start = Instant::now();
+    for i in 0..items {
+        op(volume, i)?;
+    }
+    let ns = start.elapsed().as_nanos();
+    let io = volume.device().counters().since(&before);
+    report.rate(label, items as u64, ns);
+    report.io(label, items as u64, &io);
+    Ok(())
+}
+
+/// Create, read, list and delete runs per file size. `scale` multiplies the
+/// random reads and listings; the file counts are bounded by the volume.
+pub fn files<D: CountingDevice>(
+    mut new_device: impl FnMut() -> D,
+    scale: usize,
+    report: &mut Report,
+) -> Result<(), FsError> {
+    let mut rng = Rng::new(0x6b61_6766_6174);
+    for size in FILE_SIZES {
+        let mut volume = Volume::new(new_device());
+        volume.format()?;
+        let count = file_count(size);
+        let data: Vec<u8> = (0..size).map(|i| (i * 31 + size) as u8).collect();
+        let kib = if size >= 1024 { format!("{}K", size / 1024) } else { format!("{}B", size) };
+
+        measure(report, &format!("fs create {}", kib), &mut volume, count, |v, i| {
+            v.create_file(&name(i), &data)
+        })?;
+        measure(report, &format!("fs read {}", kib), &mut volume, count, |v, i| {
+            let back = v.read_file(&name(i))?;
+            if back != data {
+                return Err(FsError::DeviceError);
+            }
+            Ok(())
+        })?;
+
+        // Small reads at random offsets, the way the KEF loader pages images in.
+        let handles = (0..count)
+            .map(|i| volume.open_file(&name(i)))
+            .collect::<Result<Vec<_>, _>>()?;
+        let mut buf = vec![0u8; 512.min(size)];
+        measure(report, &format!("fs read_at {}", kib), &mut volume, count * 4 * scale, |v, _| {
+            let handle = &handles[rng.below(count as u64) as usize];
+            let offset = rng.below((size - buf.len()) as u64 + 1) as u32;
+            v.read_file_at(handle, offset, &mut buf).map(|_| ())
+        })?;
+
+        measure(report, &format!("fs list ({} files)", count), &mut volume, 100 * scale, |v, _| {
+            v.list_files().map(|_| ())
+        })?;
+        measure(report, &format!("fs delete {}", kib), &mut volume, count, |v, i| v.delete_file(&name(i)))?;
+    }
+    Ok(())
+}
+
+/// Cost of one cluster allocation as the FAT fills up. The allocator scans
+/// sector by sector from the start, so a full prefix is the worst case.
+/// `scale` multiplies the allocation rounds.
+pub fn fat_alloc<D: CountingDevice>(
+    mut new_device: impl FnMut() -> D,
+    scale: usize,
+    report: &mut Report,
+) -> Result<(), FsError> {
+    let clusters = FAT_ENTRIES - 2;
+    for percent in [0usize, 50, 90, 99] {
+        let mut volume = Volume::new(new_device());
+        volume.format()?;
+        for _ in 0..clusters * percent / 100 {
+            volume.alloc_cluster()?;
+        }
+
+        let rounds = 2_000 * scale;
+        let before = volume.device().counters();
+        let start = Instant::now();
+        for _ in 0..rounds {
+            let cluster = volume.alloc_cluster()?;
+            volume.free_cluster_chain(cluster)?;
+        }
+        let ns = start.elapsed().as_nanos();
+        let io: IoCounters = volume.device().counters().since(&before);
+        let label = format!("fat alloc+free at {}% full", percent);
+        report.rate(&label, rounds as u64, ns);
+        report.io(&label, rounds as u64, &io);
+    }
+    Ok(())
+}
+
+// The request counts are deterministic, so they are checked exactly as the
+// ceilings they are today; a change that makes an operation cost more
+// device requests fails here before it shows up as latency on hardware.
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::disk::MemDisk;
+
+    /// Device requests `op` made on `volume`.
+    fn requests(volume: &mut Volume<MemDisk>, op: impl FnOnce(&mut Volume<MemDisk>)) -> u64 {
+        let before = volume.device().counters();
+        op(volume);
+        volume.device().counters().since(&before).requests()
+    }
+
+    fn formatted() -> Volume<MemDisk> {
+        let mut volume = Volume::new(MemDisk::new());
+        volume.format().unwrap();
+        volume
+    }
+
+    #[test]
+    fn small_file_operations_stay_cheap() {
+        let mut volume = formatted();
+        let data = vec![7u8; 512];
+        assert!(requests(&mut volume, |v| v.create_file("small", &data).unwrap()) <= 8);
+        assert!(requests(&mut volume, |v| assert_eq!(v.read_file("small").unwrap(), data)) <= 3);
+        let file = volume.open_file("small").unwrap();
+        let mut buf = [0u8; 100];
+        assert!(requests(&mut volume, |v| assert_eq!(v.read_file_at(&file, 40, &mut buf).unwrap(), 100)) <= 1);
+        assert!(requests(&mut volume, |v| assert_eq!(v.list_files().unwrap().len(), 1)) <= 2);
+        assert!(requests(&mut volume, |v| v.delete_file("small").unwrap()) <= 5);
+    }
+
+    #[test]
+    fn reads_cost_one_request_per_cluster() {
+        let mut volume = formatted();
+        let clusters = 16;
+        let data: Vec<u8> = (0..clusters * CLUSTER_SIZE).map(|i| i as u8).collect();
+        volume.create_file("big", &data).unwrap();
+        // Directory, then data and FAT entry for each cluster.
+        assert!(requests(&mut volume, |v| assert_eq!(v.read_file("big").unwrap(), data)) <= 1 + 2 * clusters as u64);
+        // A read within one cluster walks the chain to it and reads once.
+        let file = volume.open_file("big").unwrap();
+        let mut buf = vec![0u8; CLUSTER_SIZE];
+        let at = 5 * CLUSTER_SIZE;
+        assert!(requests(&mut volume, |v| assert_eq!(v.read_file_at(&file, at as u32, &mut buf).unwrap(), buf.len())) <= 6);
+        assert_eq!(buf, &data[at..at + CLUSTER_SIZE]);
+    }
+
+    #[test]
+    fn cluster_allocation_on_an_empty_fat_stays_cheap() {
+        let mut volume = formatted();
+        assert!(
+            requests(&mut volume, |v| {
+                let cluster = v.alloc_cluster().unwrap();
+                v.free_cluster_chain(cluster).unwrap();
+            }) <= 4
+        );
+    }
+}
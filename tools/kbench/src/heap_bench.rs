@@ -0,0 +1,143 @@
+// ============================================================================
+// Heap allocator benchmarks
+// ============================================================================
+//
+// The kernel's SegregatedAllocator runs over a page-aligned host buffer the
+// size of the kernel heap, so size classes, the arena split and the
+// large-block list behave exactly as they do on the target.
+
+use crate::heap::{BUCKET_SIZES, SegregatedAllocator};
+use crate::{Report, Rng};
+use std::alloc::Layout;
+use std::hint::black_box;
+use std::time::Instant;
+
+/// Stand-in for the pages the kernel maps for its heap.
+pub struct FakeArena {
+    base: *mut u8,
+    layout: Layout,
+}
+
+impl FakeArena {
+    pub fn new(size: usize) -> Self {
+        let layout = Layout::from_size_align(size, 4096).expect("arena size");
+        let base = unsafe { std::alloc::alloc_zeroed(layout) };
+        assert!(!base.is_null(), "could not allocate a {} byte arena", size);
+        Self { base, layout }
+    }
+
+    /// A fresh allocator over the whole arena.
+    pub fn allocator(&mut self) -> SegregatedAllocator {
+        let mut heap = SegregatedAllocator::new();
+        unsafe { heap.init(self.base as usize, self.layout.size()) };
+        heap
+    }
+}
+
+impl Drop for FakeArena {
+    fn drop(&mut self) {
+        unsafe { std::alloc::dealloc(self.base, self.layout) };
+    }
+}
+
+/// Allocation sizes for the throughput runs: one per size class, plus two
+/// that take the large-block path.
+const THROUGHPUT_SIZES: [usize; 7] = [16, 64, 256, 1024, 4096, 8192, 32768];
+
+/// Allocate a batch of `size`-byte blocks, free them in reverse, repeat.
+/// Batches are small enough that several fit in the heap at once.
+pub fn throughput(arena_size: usize, scale: usize, report: &mut Report) {
+    for size in THROUGHPUT_SIZES {
+        let mut arena = FakeArena::new(arena_size);
+        let mut heap = arena.allocator();
+        let batch = (arena_size / 8 / (size + 64)).clamp(1, 64);
+        let rounds = (20_000 * scale / batch).max(1);
+        let mut ptrs = Vec::with_capacity(batch);
+        let mut alloc_ns = 0u128;
+        let mut free_ns = 0u128;
+        let mut failed = 0u64;
+
+        for _ in 0..rounds {
+            let start = Instant::now();
+            for _ in 0..batch {
+                let ptr = unsafe { heap.alloc_aligned(size, 8) };
+                if ptr.is_null() {
+                    failed += 1;
+                } else {
+                    unsafe { ptr.write(0xA5) };
+                    ptrs.push(black_box(ptr));
+                }
+            }
+            alloc_ns += start.elapsed().as_nanos();
+
+            let start = Instant::now();
+            while let Some(ptr) = ptrs.pop() {
+                unsafe { heap.dealloc_aligned(ptr) };
+            }
+            free_ns += start.elapsed().as_nanos();
+        }
+
+        let ops = (rounds * batch) as u64;
+        report.rate(&format!("heap alloc {}B", size), ops, alloc_ns);
+        report.rate(&format!("heap free {}B", size), ops, free_ns);
+        if failed > 0 {
+            report.note(&format!("heap alloc {}B", size), &format!("{} allocations failed", failed));
+        }
+    }
+}
+
+/// Random mix of allocations (8 B to 32 KiB, skewed small) and frees of
+/// random live blocks, then a look at how the free memory is split up.
+pub fn churn(arena_size: usize, scale: usize, report: &mut Report) {
+    let mut arena = FakeArena::new(arena_size);
+    let mut heap = arena.allocator();
+    let mut rng = Rng::new(0x6b61_6775_7961);
+    let steps = 200_000 * scale;
+    let mut live: Vec<(*mut u8, usize)> = Vec::new();
+    let mut live_bytes = 0usize;
+    let mut failed = 0u64;
+
+    let start = Instant::now();
+    for _ in 0..steps {
+        // Grow while the heap is mostly empty, then hover around a steady
+        // state where allocations and frees balance.
+        let grow = live.is_empty() || rng.below(100) < if live_bytes < arena_size / 2 { 60 } else { 45 };
+        if grow {
+            let class = 8usize << rng.below(13);
+            let size = class / 2 + rng.below(class as u64 / 2 + 1) as usize;
+            let ptr = unsafe { heap.alloc_aligned(size, 8) };
+            if ptr.is_null() {
+                failed += 1;
+            } else {
+                live.push((ptr, size));
+                live_bytes += size;
+            }
+        } else {
+            let victim = rng.below(live.len() as u64) as usize;
+            let (ptr, size) = live.swap_remove(victim);
+            unsafe { heap.dealloc_aligned(ptr) };
+            live_bytes -= size;
+        }
+    }
+    report.rate("heap churn op", steps as u64, start.elapsed().as_nanos());
+
+    let stats = heap.stats();
+    let small_free: usize = stats.small_free.iter().zip(BUCKET_SIZES).map(|(&n, size)| n * size).sum();
+    let fragmentation = if stats.large_free == 0 {
+        0.0
+    } else {
+        100.0 * (1.0 - stats.large_largest as f64 / stats.large_free as f64)
+    };
+    report.value("heap churn live", live_bytes as u64, "bytes");
+    report.value("heap churn failed allocs", failed, "allocs");
+    report.value("heap churn arena left", stats.arena_free as u64, "bytes");
+    report.value("heap churn small lists", small_free as u64, "bytes");
+    report.value("heap churn large free", stats.large_free as u64, "bytes");
+    report.value("heap churn largest free", stats.large_largest as u64, "bytes");
+    report.value("heap churn large blocks", stats.large_blocks as u64, "blocks");
+    report.ratio("heap churn large frag", fragmentation, "%");
+
+    for (ptr, _) in live {
+        unsafe { heap.dealloc_aligned(ptr) };
+    }
+}
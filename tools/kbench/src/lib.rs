@@ -0,0 +1,180 @@
+// Host-side benchmarks for the kernel's heap allocator and filesystem.
+//
+// The code under test is the kernel's own: src/heap.rs is compiled in by
+// path and the filesystem is the `kagfat` crate. Run with
+// `cargo run --release -- [heap|fs|all] [--image <path>] [--scale <n>]`
+// or `cargo bench`, and compare the output against a previous run.
+// `cargo test` checks that the filesystem's device requests per operation
+// have not grown.
+
+#[path = "../../../src/heap.rs"]
+mod heap;
+
+pub mod disk;
+pub mod fs_bench;
+pub mod heap_bench;
+
+use disk::{FileDisk, IoCounters, MemDisk};
+
+/// Bytes in the kernel heap (main.rs maps 128 pages for it).
+const KERNEL_HEAP_SIZE: usize = 128 * 4096;
+
+// ============================================================================
+// Shared helpers
+// ============================================================================
+
+/// xorshift64*, so every run makes the same choices.
+pub struct Rng(u64);
+
+impl Rng {
+    pub fn new(seed: u64) -> Self {
+        Self(seed | 1)
+    }
+
+    pub fn next(&mut self) -> u64 {
+        self.0 ^= self.0 >> 12;
+        self.0 ^= self.0 << 25;
+        self.0 ^= self.0 >> 27;
+        self.0.wrapping_mul(0x2545_F491_4F6C_DD1D)
+    }
+
+    /// Uniform in `0..bound`; `bound` must be non-zero.
+    pub fn below(&mut self, bound: u64) -> u64 {
+        self.next() % bound
+    }
+}
+
+/// Rows of `name  value  unit  detail`, printed as one table at the end.
+pub struct Report {
+    rows: Vec<[String; 4]>,
+}
+
+impl Report {
+    fn new() -> Self {
+        Self { rows: Vec::new() }
+    }
+
+    fn push(&mut self, name: &str, value: String, unit: &str, detail: String) {
+        self.rows.push([name.to_string(), value, unit.to_string(), detail]);
+    }
+
+    /// `ops` operations that took `ns` nanoseconds in total.
+    pub fn rate(&mut self, name: &str, ops: u64, ns: u128) {
+        let per_op = ns as f64 / ops.max(1) as f64;
+        let per_sec = if ns == 0 { 0.0 } else { ops as f64 * 1e9 / ns as f64 };
+        self.push(name, format!("{:.1}", per_op), "ns/op", format!("{:.0} ops/s", per_sec));
+    }
+
+    /// Device requests and sectors moved per operation.
+    pub fn io(&mut self, name: &str, ops: u64, io: &IoCounters) {
+        let ops = ops.max(1) as f64;
+        self.push(
+            name,
+            format!("{:.2}", io.requests() as f64 / ops),
+            "req/op",
+            format!(
+                "{:.1} sectors read, {:.1} written",
+                io.sectors_read as f64 / ops,
+                io.sectors_written as f64 / ops
+            ),
+        );
+    }
+
+    pub fn value(&mut self, name: &str, value: u64, unit: &str) {
+        self.push(name, value.to_string(), unit, String::new());
+    }
+
+    pub fn ratio(&mut self, name: &str, value: f64, unit: &str) {
+        self.push(name, format!("{:.1}", value), unit, String::new());
+    }
+
+    pub fn note(&mut self, name: &str, text: &str) {
+        self.push(name, String::from("-"), "", text.to_string());
+    }
+
+    fn print(&self) {
+        let width = self.rows.iter().map(|row| row[0].len()).max().unwrap_or(0);
+        for [name, value, unit, detail] in &self.rows {
+            println!("{:<width$}  {:>12} {:<7} {}", name, value, unit, detail, width = width);
+        }
+    }
+}
+
+// ============================================================================
+// Main Execution
+// ============================================================================
+
+fn print_usage() {
+    println!("kbench - host benchmarks for the kernel heap and filesystem");
+    println!("Usage: kbench [heap|fs|all] [--image <path>] [--scale <n>]");
+    println!("  heap           allocator throughput and fragmentation under churn");
+    println!("  fs             file create/read/delete rates and FAT allocation cost");
+    println!("  --image <path> run the fs benchmarks on an image file instead of memory");
+    println!("  --scale <n>    multiply iteration counts by n (default 1); fs file counts");
+    println!("                 stay bounded by the volume");
+}
+
+/// Run the suites `args` (the command line after the program name) ask for
+/// and print the report.
+pub fn run(args: Vec<String>) {
+    let mut suite = "all";
+    let mut image: Option<String> = None;
+    let mut scale = 1usize;
+
+    let mut i = 0;
+    while i < args.len() {
+        match args[i].as_str() {
+            cmd @ ("heap" | "fs" | "all") => suite = cmd,
+            "--image" if i + 1 < args.len() => {
+                i += 1;
+                image = Some(args[i].clone());
+            }
+            "--scale" if i + 1 < args.len() => {
+                i += 1;
+                scale = match args[i].parse() {
+                    Ok(n) if n > 0 => n,
+                    _ => {
+                        eprintln!("Invalid scale '{}'", args[i]);
+                        std::process::exit(1);
+                    }
+                };
+            }
+            _ => {
+                print_usage();
+                std::process::exit(1);
+            }
+        }
+        i += 1;
+    }
+
+    let mut report = Report::new();
+
+    if suite != "fs" {
+        heap_bench::throughput(KERNEL_HEAP_SIZE, scale, &mut report);
+        heap_bench::churn(KERNEL_HEAP_SIZE, scale, &mut report);
+    }
+
+    if suite != "heap" {
+        let result = match &image {
+            Some(path) => {
+                let open = || {
+                    FileDisk::open(path).unwrap_or_else(|e| {
+                        eprintln!("Error opening image '{}': {}", path, e);
+                        std::process::exit(1);
+                    })
+                };
+                fs_bench::files(open, scale, &mut report)
+                    .and_then(|_| fs_bench::fat_alloc(open, scale, &mut report))
+            }
+            None => fs_bench::files(MemDisk::new, scale, &mut report)
+                .and_then(|_| fs_bench::fat_alloc(MemDisk::new, scale, &mut report)),
+        };
+        if let Err(e) = result {
+            report.print();
+            eprintln!("Filesystem benchmark failed: {:?}", e);
+            std::process::exit(1);
+        }
+    }
+
+    report.print();
+}
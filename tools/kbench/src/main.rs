@@ -0,0 +1,5 @@
+// Command-line entry point; the benchmarks live in the library.
+
+fn main() {
+    kbench::run(std::env::args().skip(1).collect());
+}
@@ -0,0 +1,325 @@
+// ============================================================================
+// ELF -> KEF v2 conversion (format from src/kef.rs)
+// ============================================================================
+//
+// Input is a position-independent x86_64 ELF (static-pie, as rustc links for
+// x86_64-unknown-none). Every PT_LOAD becomes a KEF segment with the same
+// permissions, with its zero-filled tail split off as a BSS segment, and
+// every R_X86_64_RELATIVE relocation becomes an entry in the KEF relocation
+// table with its addend stored in the image bytes.
+
+const KEF_V2_MAGIC: [u8; 4] = *b"KEF2";
+const KEF_HEADER_SIZE: usize = 32;
+const KEF_SEGMENT_SIZE: usize = 32;
+
+const KEF_SEG_TEXT: u32 = 1;
+const KEF_SEG_RODATA: u32 = 2;
+const KEF_SEG_DATA: u32 = 3;
+const KEF_SEG_BSS: u32 = 4;
+
+const KEF_SEG_READ: u32 = 1 << 0;
+const KEF_SEG_WRITE: u32 = 1 << 1;
+const KEF_SEG_EXEC: u32 = 1 << 2;
+
+const PAGE_SIZE: u64 = 4096;
+
+const ET_EXEC: u16 = 2;
+const ET_DYN: u16 = 3;
+const EM_X86_64: u16 = 62;
+
+const PT_LOAD: u32 = 1;
+const PT_DYNAMIC: u32 = 2;
+
+const PF_X: u32 = 1;
+const PF_W: u32 = 2;
+
+const DT_NULL: u64 = 0;
+const DT_RELA: u64 = 7;
+const DT_RELASZ: u64 = 8;
+const DT_RELAENT: u64 = 9;
+const DT_REL: u64 = 17;
+const DT_RELR: u64 = 36;
+
+const R_X86_64_NONE: u32 = 0;
+const R_X86_64_RELATIVE: u32 = 8;
+
+struct ProgramHeader {
+    p_type: u32,
+    flags: u32,
+    offset: u64,
+    vaddr: u64,
+    file_size: u64,
+    mem_size: u64,
+}
+
+struct Segment {
+    kind: u32,
+    flags: u32,
+    vaddr: u64,
+    mem_size: u64,
+    data: Vec<u8>,
+}
+
+fn u16_at(data: &[u8], offset: usize) -> Result<u16, String> {
+    data.get(offset..offset + 2)
+        .map(|b| u16::from_le_bytes(b.try_into().unwrap()))
+        .ok_or_else(|| format!("ELF truncated at {:#x}", offset))
+}
+
+fn u32_at(data: &[u8], offset: usize) -> Result<u32, String> {
+    data.get(offset..offset + 4)
+        .map(|b| u32::from_le_bytes(b.try_into().unwrap()))
+        .ok_or_else(|| format!("ELF truncated at {:#x}", offset))
+}
+
+fn u64_at(data: &[u8], offset: usize) -> Result<u64, String> {
+    data.get(offset..offset + 8)
+        .map(|b| u64::from_le_bytes(b.try_into().unwrap()))
+        .ok_or_else(|| format!("ELF truncated at {:#x}", offset))
+}
+
+fn program_headers(elf: &[u8]) -> Result<(u64, Vec<ProgramHeader>), String> {
+    if elf.len() < 64 || &elf[0..4] != b"\x7fELF" {
+        return Err("not an ELF file".into());
+    }
+    if elf[4] != 2 || elf[5] != 1 {
+        return Err("not a little-endian ELF64 file".into());
+    }
+    let e_type = u16_at(elf, 16)?;
+    if u16_at(elf, 18)? != EM_X86_64 {
+        return Err("not an x86_64 ELF file".into());
+    }
+    if e_type == ET_EXEC {
+        return Err("ELF is not position-independent; link it as a static PIE".into());
+    }
+    if e_type != ET_DYN {
+        return Err(format!("unsupported ELF type {}", e_type));
+    }
+
+    let entry = u64_at(elf, 24)?;
+    let phoff = u64_at(elf, 32)? as usize;
+    let phentsize = u16_at(elf, 54)? as usize;
+    let phnum = u16_at(elf, 56)? as usize;
+
+    let mut headers = Vec::with_capacity(phnum);
+    for i in 0..phnum {
+        let at = phoff + i * phentsize;
+        headers.push(ProgramHeader {
+            p_type: u32_at(elf, at)?,
+            flags: u32_at(elf, at + 4)?,
+            offset: u64_at(elf, at + 8)?,
+            vaddr: u64_at(elf, at + 16)?,
+            file_size: u64_at(elf, at + 32)?,
+            mem_size: u64_at(elf, at + 40)?,
+        });
+    }
+    Ok((entry, headers))
+}
+
+/// File offset of the bytes loaded at `vaddr`, if some PT_LOAD stores them.
+fn vaddr_to_offset(headers: &[ProgramHeader], vaddr: u64) -> Option<usize> {
+    headers
+        .iter()
+        .filter(|ph| ph.p_type == PT_LOAD)
+        .find(|ph| vaddr >= ph.vaddr && vaddr < ph.vaddr + ph.file_size)
+        .map(|ph| (ph.offset + (vaddr - ph.vaddr)) as usize)
+}
+
+/// (offset, addend) of every R_X86_64_RELATIVE relocation in the dynamic
+/// section; any other relocation type means the image cannot be loaded.
+fn relative_relocations(elf: &[u8], headers: &[ProgramHeader]) -> Result<Vec<(u64, u64)>, String> {
+    let dynamic = match headers.iter().find(|ph| ph.p_type == PT_DYNAMIC) {
+        Some(ph) => ph,
+        None => return Ok(Vec::new()),
+    };
+
+    let (mut rela, mut relasz, mut relaent) = (None, 0, 24);
+    let mut at = dynamic.offset as usize;
+    let end = at + dynamic.file_size as usize;
+    while at + 16 <= end {
+        let tag = u64_at(elf, at)?;
+        let value = u64_at(elf, at + 8)?;
+        match tag {
+            DT_NULL => break,
+            DT_RELA => rela = Some(value),
+            DT_RELASZ => relasz = value,
+            DT_RELAENT => relaent = value,
+            DT_REL | DT_RELR => {
+                return Err("only RELA relocations are supported (link without -z pack-relative-relocs)".into());
+            }
+            _ => {}
+        }
+        at += 16;
+    }
+
+    let rela = match rela {
+        Some(vaddr) => vaddr,
+        None => return Ok(Vec::new()),
+    };
+    let table = vaddr_to_offset(headers, rela).ok_or("relocation table is not in a loaded segment")?;
+    let mut relocations = Vec::new();
+    for i in 0..(relasz / relaent) as usize {
+        let entry = table + i * relaent as usize;
+        let offset = u64_at(elf, entry)?;
+        let info = u64_at(elf, entry + 8)?;
+        let addend = u64_at(elf, entry + 16)?;
+        match info as u32 {
+            R_X86_64_NONE => {}
+            R_X86_64_RELATIVE => relocations.push((offset, addend)),
+            other => return Err(format!("unsupported relocation type {} at {:#x}", other, offset)),
+        }
+    }
+    Ok(relocations)
+}
+
+fn segment_kind(flags: u32, has_file_bytes: bool) -> u32 {
+    if flags & KEF_SEG_EXEC != 0 {
+        KEF_SEG_TEXT
+    } else if flags & KEF_SEG_WRITE == 0 {
+        KEF_SEG_RODATA
+    } else if has_file_bytes {
+        KEF_SEG_DATA
+    } else {
+        KEF_SEG_BSS
+    }
+}
+
+fn kind_name(kind: u32) -> &'static str {
+    match kind {
+        KEF_SEG_TEXT => "text",
+        KEF_SEG_RODATA => "rodata",
+        KEF_SEG_DATA => "data",
+        _ => "bss",
+    }
+}
+
+/// Convert a static-PIE ELF image into a KEF v2 file whose stack may grow
+/// to `stack_pages` pages (0: the kernel's default).
+pub fn elf_to_kef(elf: &[u8], stack_pages: u16) -> Result<Vec<u8>, String> {
+    let (entry, headers) = program_headers(elf)?;
+    let loads: Vec<&ProgramHeader> = headers.iter().filter(|ph| ph.p_type == PT_LOAD && ph.mem_size > 0).collect();
+    if loads.is_empty() {
+        return Err("ELF has no loadable segments".into());
+    }
+
+    // The image starts at the page holding the lowest segment.
+    let link_base = loads.iter().map(|ph| ph.vaddr).min().unwrap() & !(PAGE_SIZE - 1);
+    let link_end = loads.iter().map(|ph| ph.vaddr + ph.mem_size).max().unwrap();
+    let image_size = (link_end - link_base).div_ceil(PAGE_SIZE) * PAGE_SIZE;
+
+    let mut segments = Vec::new();
+    for ph in &loads {
+        let mut flags = KEF_SEG_READ;
+        if ph.flags & PF_W != 0 {
+            flags |= KEF_SEG_WRITE;
+        }
+        if ph.flags & PF_X != 0 {
+            flags |= KEF_SEG_EXEC;
+        }
+        if flags & KEF_SEG_WRITE != 0 && flags & KEF_SEG_EXEC != 0 {
+            return Err(format!("segment at {:#x} is both writable and executable", ph.vaddr));
+        }
+        let start = ph.offset as usize;
+        let data = elf
+            .get(start..start + ph.file_size as usize)
+            .ok_or_else(|| format!("segment at {:#x} extends past end of file", ph.vaddr))?
+            .to_vec();
+        let vaddr = ph.vaddr - link_base;
+
+        if ph.file_size > 0 {
+            segments.push(Segment {
+                kind: segment_kind(flags, true),
+                flags,
+                vaddr,
+                mem_size: ph.file_size,
+                data,
+            });
+        }
+        if ph.mem_size > ph.file_size {
+            // Zero-filled at load time; nothing goes in the file.
+            segments.push(Segment {
+                kind: segment_kind(flags, false),
+                flags,
+                vaddr: vaddr + ph.file_size,
+                mem_size: ph.mem_size - ph.file_size,
+                data: Vec::new(),
+            });
+        }
+    }
+
+    // Two segments may share a page only with identical permissions.
+    for (i, a) in segments.iter().enumerate() {
+        for b in &segments[i + 1..] {
+            let a_pages = a.vaddr / PAGE_SIZE..=(a.vaddr + a.mem_size - 1) / PAGE_SIZE;
+            let b_pages = b.vaddr / PAGE_SIZE..=(b.vaddr + b.mem_size - 1) / PAGE_SIZE;
+            let overlap = a_pages.start() <= b_pages.end() && b_pages.start() <= a_pages.end();
+            if overlap && a.flags != b.flags {
+                return Err(format!(
+                    "{} at {:#x} and {} at {:#x} share a page with different permissions",
+                    kind_name(a.kind), a.vaddr, kind_name(b.kind), b.vaddr
+                ));
+            }
+        }
+    }
+
+    // Store each addend in the image; the loader adds the load base.
+    let mut relocations = Vec::new();
+    for (offset, addend) in relative_relocations(elf, &headers)? {
+        let image_offset = offset - link_base;
+        let segment = segments
+            .iter_mut()
+            .find(|s| image_offset >= s.vaddr && image_offset + 8 <= s.vaddr + s.data.len() as u64)
+            .ok_or_else(|| format!("relocation at {:#x} is outside the file-backed image", offset))?;
+        let at = (image_offset - segment.vaddr) as usize;
+        segment.data[at..at + 8].copy_from_slice(&(addend - link_base).to_le_bytes());
+        relocations.push(image_offset);
+    }
+    relocations.sort_unstable();
+
+    // Header, segment table, contents, relocation table.
+    let mut out = vec![0u8; KEF_HEADER_SIZE + segments.len() * KEF_SEGMENT_SIZE];
+    let mut file_offsets = Vec::with_capacity(segments.len());
+    for segment in &segments {
+        file_offsets.push(if segment.data.is_empty() { 0 } else { out.len() as u32 });
+        out.extend_from_slice(&segment.data);
+    }
+    while out.len() % 8 != 0 {
+        out.push(0);
+    }
+    let reloc_offset = out.len() as u32;
+    for offset in &relocations {
+        out.extend_from_slice(&offset.to_le_bytes());
+    }
+
+    out[0..4].copy_from_slice(&KEF_V2_MAGIC);
+    out[4..6].copy_from_slice(&(segments.len() as u16).to_le_bytes());
+    out[6..8].copy_from_slice(&stack_pages.to_le_bytes());
+    out[8..16].copy_from_slice(&(entry - link_base).to_le_bytes());
+    out[16..24].copy_from_slice(&image_size.to_le_bytes());
+    out[24..28].copy_from_slice(&reloc_offset.to_le_bytes());
+    out[28..32].copy_from_slice(&(relocations.len() as u32).to_le_bytes());
+    for (i, (segment, file_offset)) in segments.iter().zip(&file_offsets).enumerate() {
+        let at = KEF_HEADER_SIZE + i * KEF_SEGMENT_SIZE;
+        out[at..at + 4].copy_from_slice(&segment.kind.to_le_bytes());
+        out[at + 4..at + 8].copy_from_slice(&segment.flags.to_le_bytes());
+        out[at + 8..at + 16].copy_from_slice(&segment.vaddr.to_le_bytes());
+        out[at + 16..at + 24].copy_from_slice(&segment.mem_size.to_le_bytes());
+        out[at + 24..at + 28].copy_from_slice(&file_offset.to_le_bytes());
+        out[at + 28..at + 32].copy_from_slice(&(segment.data.len() as u32).to_le_bytes());
+    }
+
+    for segment in &segments {
+        println!(
+            "  {:<6} {:#08x}  {:>7} bytes in memory, {:>7} in file  {}{}{}",
+            kind_name(segment.kind),
+            segment.vaddr,
+            segment.mem_size,
+            segment.data.len(),
+            if segment.flags & KEF_SEG_READ != 0 { "r" } else { "-" },
+            if segment.flags & KEF_SEG_WRITE != 0 { "w" } else { "-" },
+            if segment.flags & KEF_SEG_EXEC != 0 { "x" } else { "-" },
+        );
+    }
+    println!("  {} relocations, image size {:#x}", relocations.len(), image_size);
+    Ok(out)
+}
@@ -0,0 +1,452 @@
+use crate::mmap::MappedFile;
+use std::io;
+
+use kagfat::{
+    BLOCK_SIZE, BootSector, CLUSTER_SIZE, DATA_START_LBA, Dir, FAT_ENTRY_EOC, FAT_ENTRY_FREE,
+    FAT_ENTRY_MEDIA, FAT_ENTRY_RESERVED, FAT_SECTORS, FAT_START_LBA, FatDirEntry, Fat, ROOT_DIR_SECTORS,
+    ROOT_DIR_START_LBA, SECTORS_PER_CLUSTER,
+};
+
+// The layout and on-disk structures come from the `kagfat` crate, which the
+// kernel's src/fs.rs uses too.
+
+const FAT_BYTES: usize = FAT_SECTORS as usize * BLOCK_SIZE;
+const ROOT_DIR_BYTES: usize = ROOT_DIR_SECTORS as usize * BLOCK_SIZE;
+
+fn invalid_data(msg: &'static str) -> io::Error {
+    io::Error::new(io::ErrorKind::InvalidData, msg)
+}
+
+fn check_name(name: &str) -> io::Result<()> {
+    if !kagfat::valid_name(name.as_bytes()) {
+        return Err(io::Error::new(io::ErrorKind::InvalidInput, "Filename must be 1 to 21 bytes"));
+    }
+    Ok(())
+}
+
+fn cluster_offset(cluster: u16) -> usize {
+    (DATA_START_LBA as usize + (cluster as usize - 2) * SECTORS_PER_CLUSTER as usize) * BLOCK_SIZE
+}
+
+// ============================================================================
+// In-memory image
+// ============================================================================
+//
+// The image file is mapped once, and the FAT and root directory are parsed
+// into memory when it is opened. Every edit works on those copies: cluster
+// allocation is a scan of an array instead of a sector read per entry, and
+// file data is copied straight into the mapping. `commit` writes the FAT
+// and directory back in one pass and flushes the mapping.
+//
+// Nothing on disk points at new data until `commit`, and clusters released
+// by replaced files are not reused before it, so an image whose batch failed
+// part-way still holds its previous contents.
+
+/// One inconsistency `fsck` found, and what it did to the in-memory copy.
+/// The repair only reaches the image once it is committed.
+pub struct Problem {
+    pub finding: String,
+    pub repair: String,
+}
+
+impl Problem {
+    fn new(finding: String, repair: String) -> Self {
+        Self { finding, repair }
+    }
+}
+
+pub struct FatImage {
+    map: MappedFile,
+    fat: Vec<u16>,
+    dir: Vec<FatDirEntry>,
+    /// One past the highest cluster number the volume can use.
+    cluster_limit: u16,
+    /// Lowest cluster that may be free; everything below it is in use.
+    free_hint: u16,
+    /// Clusters of replaced files, freed by the next `commit`.
+    released: Vec<u16>,
+}
+
+impl FatImage {
+    /// Map the image at `path` and load its FAT and root directory.
+    pub fn open(path: &str) -> io::Result<Self> {
+        let map = MappedFile::open(path)?;
+        if map.len() < DATA_START_LBA as usize * BLOCK_SIZE {
+            return Err(invalid_data("Disk is not formatted with KAGFAT16"));
+        }
+        let bytes = map.bytes();
+        let bs = BootSector::parse(bytes[..BLOCK_SIZE].try_into().unwrap());
+        if !bs.is_formatted() {
+            return Err(invalid_data("Disk is not formatted with KAGFAT16"));
+        }
+
+        let fat_start = FAT_START_LBA as usize * BLOCK_SIZE;
+        let fat = Fat::new(&bytes[fat_start..fat_start + FAT_BYTES]).iter().collect();
+        let dir_start = ROOT_DIR_START_LBA as usize * BLOCK_SIZE;
+        let dir = Dir::new(&bytes[dir_start..dir_start + ROOT_DIR_BYTES]).iter().collect();
+
+        Ok(Self {
+            map,
+            fat,
+            dir,
+            cluster_limit: bs.cluster_limit(),
+            free_hint: 2,
+            released: Vec::new(),
+        })
+    }
+
+    /// Write a fresh KAGFAT16 layout to the image at `path`, which must
+    /// exist, and open it.
+    pub fn format(path: &str) -> io::Result<Self> {
+        let mut map = MappedFile::open(path)?;
+        map.ensure_len(DATA_START_LBA as usize * BLOCK_SIZE)?;
+        let bytes = map.bytes_mut();
+        bytes[..BLOCK_SIZE].copy_from_slice(&BootSector::new().to_bytes());
+        // Zero the FAT and the root directory.
+        bytes[FAT_START_LBA as usize * BLOCK_SIZE..DATA_START_LBA as usize * BLOCK_SIZE].fill(0);
+        drop(map);
+
+        let mut image = Self::open(path)?;
+        // Reserved entries 0 and 1
+        image.fat[0] = FAT_ENTRY_MEDIA;
+        image.fat[1] = FAT_ENTRY_EOC;
+        image.commit()?;
+        Ok(image)
+    }
+
+    /// Directory entries of every file, in directory order.
+    pub fn files(&self) -> impl Iterator<Item = &FatDirEntry> {
+        self.dir.iter().filter(|entry| entry.is_in_use())
+    }
+
+    fn find(&self, name: &str) -> Option<usize> {
+        self.dir
+            .iter()
+            .position(|entry| entry.is_in_use() && entry.name() == name.as_bytes())
+    }
+
+    /// The clusters of the chain starting at `first`, in order. Stops at the
+    /// end of chain, at a link out of the volume, or after as many clusters
+    /// as the volume has, so a looping chain still ends.
+    fn chain(&self, first: u16) -> Vec<u16> {
+        let mut clusters = Vec::new();
+        let mut current = first;
+        while current >= 2 && current < self.cluster_limit && clusters.len() < self.cluster_limit as usize {
+            clusters.push(current);
+            current = self.fat[current as usize];
+        }
+        clusters
+    }
+
+    /// Queue `first` and every cluster after it in its chain to be freed
+    /// by the next `commit`.
+    fn release_chain(&mut self, first: u16) {
+        let clusters = self.chain(first);
+        self.released.extend(clusters);
+    }
+
+    /// First cluster of the lowest run of `count` free clusters.
+    fn find_run(&self, count: usize) -> Option<u16> {
+        let mut run_start = 0;
+        let mut run_len = 0;
+        for cluster in self.free_hint..self.cluster_limit {
+            if self.fat[cluster as usize] != FAT_ENTRY_FREE {
+                run_len = 0;
+                continue;
+            }
+            if run_len == 0 {
+                run_start = cluster;
+            }
+            run_len += 1;
+            if run_len == count {
+                return Some(run_start);
+            }
+        }
+        None
+    }
+
+    /// Pick `count` free clusters, as one contiguous run if there is one,
+    /// otherwise the lowest free clusters in order.
+    fn pick_clusters(&self, count: usize) -> io::Result<Vec<u16>> {
+        if count == 0 {
+            return Ok(Vec::new());
+        }
+        if let Some(start) = self.find_run(count) {
+            return Ok((start..start + count as u16).collect());
+        }
+
+        let scattered: Vec<u16> = (self.free_hint..self.cluster_limit)
+            .filter(|&c| self.fat[c as usize] == FAT_ENTRY_FREE)
+            .take(count)
+            .collect();
+        if scattered.len() < count {
+            return Err(io::Error::new(io::ErrorKind::WriteZero, "No free clusters available (Disk Full)"));
+        }
+        Ok(scattered)
+    }
+
+    /// Copy `data` into `clusters`, zero the tail of the last one, and link
+    /// them into a chain.
+    fn store(&mut self, data: &[u8], clusters: &[u16]) -> io::Result<()> {
+        if let Some(&last) = clusters.iter().max() {
+            self.map.ensure_len(cluster_offset(last) + CLUSTER_SIZE)?;
+        }
+        let bytes = self.map.bytes_mut();
+        for (chunk, &cluster) in data.chunks(CLUSTER_SIZE).zip(clusters) {
+            let at = cluster_offset(cluster);
+            bytes[at..at + chunk.len()].copy_from_slice(chunk);
+            bytes[at + chunk.len()..at + CLUSTER_SIZE].fill(0);
+        }
+        for pair in clusters.windows(2) {
+            self.fat[pair[0] as usize] = pair[1];
+        }
+        if let Some(&last) = clusters.last() {
+            self.fat[last as usize] = FAT_ENTRY_EOC;
+        }
+        if clusters.first() == Some(&self.free_hint) {
+            self.free_hint += 1;
+        }
+        Ok(())
+    }
+
+    /// Add `name` with contents `data`, replacing any file of that name.
+    /// Returns the number of clusters used.
+    pub fn insert(&mut self, name: &str, data: &[u8]) -> io::Result<usize> {
+        check_name(name)?;
+        let size = u32::try_from(data.len())
+            .map_err(|_| io::Error::new(io::ErrorKind::InvalidInput, "File is larger than 4 GiB"))?;
+        let old = self.find(name);
+        let slot = match old {
+            Some(slot) => slot,
+            None => self
+                .dir
+                .iter()
+                .position(|entry| !entry.is_in_use())
+                .ok_or_else(|| io::Error::new(io::ErrorKind::WriteZero, "No free directory slots left"))?,
+        };
+
+        let clusters = self.pick_clusters(data.len().div_ceil(CLUSTER_SIZE))?;
+        self.store(data, &clusters)?;
+
+        if let Some(slot) = old {
+            let first = self.dir[slot].first_cluster;
+            self.release_chain(first);
+        }
+        self.dir[slot] = FatDirEntry::new(name.as_bytes(), clusters.first().copied().unwrap_or(0), size)
+            .ok_or_else(|| io::Error::new(io::ErrorKind::InvalidInput, "Filename must be 1 to 21 bytes"))?;
+        Ok(clusters.len())
+    }
+
+    /// Contents of `name`, or None if there is no such file.
+    pub fn read(&self, name: &str) -> io::Result<Option<Vec<u8>>> {
+        check_name(name)?;
+        let Some(slot) = self.find(name) else {
+            return Ok(None);
+        };
+        let entry = &self.dir[slot];
+        let clusters = self.chain(entry.first_cluster);
+        if clusters.len() * CLUSTER_SIZE < entry.size as usize {
+            return Err(invalid_data("Cluster chain is shorter than the file size (run fsck)"));
+        }
+        let mut data = Vec::with_capacity(entry.size as usize);
+        let bytes = self.map.bytes();
+        for &cluster in &clusters {
+            let at = cluster_offset(cluster);
+            let len = (entry.size as usize - data.len()).min(CLUSTER_SIZE);
+            if len == 0 {
+                break;
+            }
+            let chunk = bytes
+                .get(at..at + len)
+                .ok_or_else(|| invalid_data("Cluster lies past the end of the image"))?;
+            data.extend_from_slice(chunk);
+        }
+        Ok(Some(data))
+    }
+
+    /// Check the FAT against the directory and repair what is found in
+    /// memory; `commit` writes the repairs. Returns one entry per problem.
+    ///
+    /// Each file keeps the clusters its chain reaches before the chain
+    /// leaves the volume, runs into a free cluster or into a cluster an
+    /// earlier file already owns (a cross-link or a loop), or passes the
+    /// file size; the chain is cut there. A file whose chain is too short
+    /// for its size is shrunk to it. Every allocated cluster no file owns
+    /// afterwards is part of an orphaned chain and is freed.
+    pub fn fsck(&mut self) -> Vec<Problem> {
+        let mut problems = Vec::new();
+        let mut owned = vec![false; self.fat.len()];
+
+        for slot in 0..self.dir.len() {
+            if !self.dir[slot].is_in_use() {
+                continue;
+            }
+            let name = String::from_utf8_lossy(self.dir[slot].name()).into_owned();
+            let size = self.dir[slot].size as usize;
+            let needed = size.div_ceil(CLUSTER_SIZE);
+
+            let mut kept = 0;
+            let mut last: Option<u16> = None;
+            let mut current = self.dir[slot].first_cluster;
+            while kept < needed {
+                let reason = if current < 2 || current >= self.cluster_limit {
+                    Some(format!("links to cluster {:#x} outside the volume", current))
+                } else if owned[current as usize] {
+                    Some(format!("is cross-linked at cluster {}", current))
+                } else if self.fat[current as usize] == FAT_ENTRY_FREE {
+                    Some(format!("runs into free cluster {}", current))
+                } else {
+                    None
+                };
+                if let Some(reason) = reason {
+                    problems.push(Problem::new(
+                        format!("{}: chain {} after {} of {} clusters", name, reason, kept, needed),
+                        format!("truncated to {} clusters", kept),
+                    ));
+                    break;
+                }
+                owned[current as usize] = true;
+                kept += 1;
+                last = Some(current);
+                current = self.fat[current as usize];
+            }
+            if kept == needed && needed > 0 && current < FAT_ENTRY_RESERVED {
+                problems.push(Problem::new(
+                    format!("{}: chain continues past the file size of {} clusters", name, kept),
+                    String::from("cut at the file size"),
+                ));
+            }
+
+            match last {
+                Some(last) => self.fat[last as usize] = FAT_ENTRY_EOC,
+                None => {
+                    if self.dir[slot].first_cluster != 0 && needed == 0 {
+                        problems.push(Problem::new(
+                            format!("{}: empty file owns clusters", name),
+                            String::from("released"),
+                        ));
+                    }
+                    self.dir[slot].first_cluster = 0;
+                }
+            }
+            if kept < needed {
+                self.dir[slot].size = (kept * CLUSTER_SIZE) as u32;
+            }
+        }
+
+        // Whatever is allocated but owned by no file is orphaned. Count the
+        // chains by their heads: orphans no other orphan links to.
+        let orphans: Vec<u16> = (2..self.cluster_limit)
+            .filter(|&c| self.fat[c as usize] != FAT_ENTRY_FREE && !owned[c as usize])
+            .collect();
+        if !orphans.is_empty() {
+            let mut linked = vec![false; self.fat.len()];
+            for &c in &orphans {
+                let next = self.fat[c as usize];
+                if (next as usize) < linked.len() {
+                    linked[next as usize] = true;
+                }
+            }
+            let chains = orphans.iter().filter(|&&c| !linked[c as usize]).count().max(1);
+            problems.push(Problem::new(
+                format!("{} orphaned chains ({} clusters)", chains, orphans.len()),
+                String::from("freed"),
+            ));
+            for &c in &orphans {
+                self.fat[c as usize] = FAT_ENTRY_FREE;
+            }
+        }
+
+        let beyond = (self.cluster_limit as usize..self.fat.len())
+            .filter(|&c| self.fat[c] != FAT_ENTRY_FREE)
+            .count();
+        if beyond > 0 {
+            problems.push(Problem::new(
+                format!("{} FAT entries past the end of the volume", beyond),
+                String::from("cleared"),
+            ));
+            self.fat[self.cluster_limit as usize..].fill(FAT_ENTRY_FREE);
+        }
+        if self.fat[0] != FAT_ENTRY_MEDIA || self.fat[1] != FAT_ENTRY_EOC {
+            problems.push(Problem::new(
+                String::from("reserved FAT entries 0 and 1 are wrong"),
+                String::from("restored"),
+            ));
+            self.fat[0] = FAT_ENTRY_MEDIA;
+            self.fat[1] = FAT_ENTRY_EOC;
+        }
+
+        self.free_hint = 2;
+        problems
+    }
+
+    /// Number of files whose clusters are not one contiguous run.
+    pub fn fragmented_files(&self) -> usize {
+        self.files()
+            .filter(|entry| self.chain(entry.first_cluster).windows(2).any(|w| w[1] != w[0] + 1))
+            .count()
+    }
+
+    /// Rewrite files into contiguous runs, packed towards the start of the
+    /// volume. Files are visited in on-disk order and each one that is
+    /// fragmented, or could sit lower, is copied to the lowest free run that
+    /// holds it. Every move is committed before the next one, so the image is
+    /// consistent at every step and the old clusters are free for the files
+    /// after it. A fragmented file that no free run can hold stays where it
+    /// is. Returns the names of the files moved.
+    pub fn defrag(&mut self) -> io::Result<Vec<String>> {
+        let mut slots: Vec<usize> = (0..self.dir.len())
+            .filter(|&slot| self.dir[slot].is_in_use() && self.dir[slot].first_cluster >= 2)
+            .collect();
+        slots.sort_by_key(|&slot| self.dir[slot].first_cluster);
+
+        let mut moved = Vec::new();
+        for slot in slots {
+            let old = self.chain(self.dir[slot].first_cluster);
+            let contiguous = old.windows(2).all(|w| w[1] == w[0] + 1);
+            let Some(start) = self.find_run(old.len()) else {
+                continue;
+            };
+            if contiguous && start >= old[0] {
+                continue;
+            }
+
+            let bytes = self.map.bytes();
+            let mut data = Vec::with_capacity(old.len() * CLUSTER_SIZE);
+            for &cluster in &old {
+                let at = cluster_offset(cluster);
+                let chunk = bytes
+                    .get(at..at + CLUSTER_SIZE)
+                    .ok_or_else(|| invalid_data("Cluster lies past the end of the image"))?;
+                data.extend_from_slice(chunk);
+            }
+            let new: Vec<u16> = (start..start + old.len() as u16).collect();
+            self.store(&data, &new)?;
+            self.released.extend(&old);
+            self.dir[slot].first_cluster = start;
+            self.commit()?;
+            moved.push(String::from_utf8_lossy(self.dir[slot].name()).into_owned());
+        }
+        Ok(moved)
+    }
+
+    /// Write the FAT and root directory into the image and flush it.
+    pub fn commit(&mut self) -> io::Result<()> {
+        for cluster in self.released.drain(..) {
+            self.fat[cluster as usize] = FAT_ENTRY_FREE;
+            self.free_hint = self.free_hint.min(cluster);
+        }
+        let bytes = self.map.bytes_mut();
+        let fat_start = FAT_START_LBA as usize * BLOCK_SIZE;
+        let mut fat = Fat::new(&mut bytes[fat_start..fat_start + FAT_BYTES]);
+        for (i, &entry) in self.fat.iter().enumerate() {
+            fat.set(i, entry);
+        }
+        let dir_start = ROOT_DIR_START_LBA as usize * BLOCK_SIZE;
+        let mut dir = Dir::new(&mut bytes[dir_start..dir_start + ROOT_DIR_BYTES]);
+        for (i, entry) in self.dir.iter().enumerate() {
+            dir.set(i, entry);
+        }
+        self.map.flush()
+    }
+}
@@ -0,0 +1,183 @@
+// ============================================================================
+// Memory-mapped image file
+// ============================================================================
+//
+// The disk image is mapped shared and read/write, so edits go straight to the
+// page cache and `flush` writes them back with a single msync. The tool has
+// no dependencies, so the three libc calls it needs are declared here. Other
+// platforms read the whole file and write it back on flush.
+
+use std::fs::{File, OpenOptions};
+use std::io;
+
+#[cfg(unix)]
+mod sys {
+    use std::ffi::c_void;
+
+    pub const PROT_READ: i32 = 1;
+    pub const PROT_WRITE: i32 = 2;
+    pub const MAP_SHARED: i32 = 1;
+    #[cfg(target_os = "linux")]
+    pub const MS_SYNC: i32 = 4;
+    #[cfg(not(target_os = "linux"))]
+    pub const MS_SYNC: i32 = 0x10;
+
+    unsafe extern "C" {
+        pub fn mmap(addr: *mut c_void, len: usize, prot: i32, flags: i32, fd: i32, offset: i64) -> *mut c_void;
+        pub fn msync(addr: *mut c_void, len: usize, flags: i32) -> i32;
+        pub fn munmap(addr: *mut c_void, len: usize) -> i32;
+    }
+}
+
+pub struct MappedFile {
+    file: File,
+    #[cfg(unix)]
+    ptr: *mut u8,
+    #[cfg(not(unix))]
+    data: Vec<u8>,
+    len: usize,
+}
+
+impl MappedFile {
+    /// Open `path` for reading and writing and map all of it.
+    pub fn open(path: &str) -> io::Result<Self> {
+        let file = OpenOptions::new().read(true).write(true).open(path)?;
+        let len = usize::try_from(file.metadata()?.len())
+            .map_err(|_| io::Error::new(io::ErrorKind::InvalidInput, "Image too large to map"))?;
+        let mut mapped = Self {
+            file,
+            #[cfg(unix)]
+            ptr: std::ptr::null_mut(),
+            #[cfg(not(unix))]
+            data: Vec::new(),
+            len: 0,
+        };
+        mapped.map(len)?;
+        Ok(mapped)
+    }
+
+    pub fn len(&self) -> usize {
+        self.len
+    }
+
+    /// Grow the file with zeros (sparse where the filesystem allows) so it is
+    /// at least `len` bytes long, and remap it.
+    pub fn ensure_len(&mut self, len: usize) -> io::Result<()> {
+        if len <= self.len {
+            return Ok(());
+        }
+        self.unmap()?;
+        self.file.set_len(len as u64)?;
+        self.map(len)
+    }
+
+    #[cfg(unix)]
+    pub fn bytes(&self) -> &[u8] {
+        if self.len == 0 {
+            return &[];
+        }
+        unsafe { std::slice::from_raw_parts(self.ptr, self.len) }
+    }
+
+    #[cfg(unix)]
+    pub fn bytes_mut(&mut self) -> &mut [u8] {
+        if self.len == 0 {
+            return &mut [];
+        }
+        unsafe { std::slice::from_raw_parts_mut(self.ptr, self.len) }
+    }
+
+    /// Write every change back to the file.
+    #[cfg(unix)]
+    pub fn flush(&mut self) -> io::Result<()> {
+        if self.len != 0 && unsafe { sys::msync(self.ptr.cast(), self.len, sys::MS_SYNC) } != 0 {
+            return Err(io::Error::last_os_error());
+        }
+        Ok(())
+    }
+
+    #[cfg(unix)]
+    fn map(&mut self, len: usize) -> io::Result<()> {
+        use std::os::fd::AsRawFd;
+
+        if len != 0 {
+            let ptr = unsafe {
+                sys::mmap(
+                    std::ptr::null_mut(),
+                    len,
+                    sys::PROT_READ | sys::PROT_WRITE,
+                    sys::MAP_SHARED,
+                    self.file.as_raw_fd(),
+                    0,
+                )
+            };
+            // MAP_FAILED is (void *)-1.
+            if ptr as isize == -1 {
+                return Err(io::Error::last_os_error());
+            }
+            self.ptr = ptr.cast();
+        }
+        self.len = len;
+        Ok(())
+    }
+
+    #[cfg(unix)]
+    fn unmap(&mut self) -> io::Result<()> {
+        self.flush()?;
+        if self.len != 0 {
+            unsafe { sys::munmap(self.ptr.cast(), self.len) };
+        }
+        self.ptr = std::ptr::null_mut();
+        self.len = 0;
+        Ok(())
+    }
+
+    #[cfg(not(unix))]
+    pub fn bytes(&self) -> &[u8] {
+        &self.data
+    }
+
+    #[cfg(not(unix))]
+    pub fn bytes_mut(&mut self) -> &mut [u8] {
+        &mut self.data
+    }
+
+    #[cfg(not(unix))]
+    pub fn flush(&mut self) -> io::Result<()> {
+        use std::io::{Seek, SeekFrom, Write};
+
+        self.file.seek(SeekFrom::Start(0))?;
+        self.file.write_all(&self.data)?;
+        self.file.sync_data()
+    }
+
+    #[cfg(not(unix))]
+    fn map(&mut self, len: usize) -> io::Result<()> {
+        use std::io::{Read, Seek, SeekFrom};
+
+        self.data = vec![0; len];
+        self.file.seek(SeekFrom::Start(0))?;
+        self.file.read_exact(&mut self.data)?;
+        self.len = len;
+        Ok(())
+    }
+
+    #[cfg(not(unix))]
+    fn unmap(&mut self) -> io::Result<()> {
+        self.flush()?;
+        self.data = Vec::new();
+        self.len = 0;
+        Ok(())
+    }
+}
+
+impl Drop for MappedFile {
+    fn drop(&mut self) {
+        // Unmapping does not lose writes to a shared mapping; `flush` only
+        // makes them durable. The non-unix copy is dropped unwritten.
+        #[cfg(unix)]
+        if self.len != 0 {
+            unsafe { sys::munmap(self.ptr.cast(), self.len) };
+        }
+    }
+}
@@ -7,16 +7,19 @@ cd "$(dirname "$0")/.."
 echo "🔨 Installing target x86_64-unknown-none..."
 rustup target add x86_64-unknown-none || true
 
-echo "🔨 Compiling user/init.rs to user/init.kef..."
+echo "🔨 Compiling user/init.rs to user/init.elf..."
+# x86_64-unknown-none links a static PIE by default; its R_X86_64_RELATIVE
+# relocations become the KEF v2 relocation table.
 rustc --target x86_64-unknown-none \
       -C relocation-model=pic \
       -C linker-flavor=ld.lld \
       -C linker=rust-lld \
-      -C link-arg=-Tuser/linker.ld \
-      -C link-arg=--oformat=binary \
       -O \
-      -o user/init.kef \
+      -o user/init.elf \
       user/src/init.rs
 
+echo "🔨 Converting user/init.elf to user/init.kef (KEF v2)..."
+cargo run --manifest-path tools/kef-tool/Cargo.toml -- convert user/init.elf user/init.kef
+
 echo "✅ Successfully built user/init.kef!"
 ls -lh user/init.kef
@@ -21,11 +21,16 @@ pub extern "C" fn _start() -> ! {
     // Let's poll for keypress to shut down
     std::print("Press any key to trigger shutdown...\n");
 
-    loop {
-        std::poll_xhci();
-        let key = std::read_key();
-        if key != 0 {
-            break;
+    // Sleep in the kernel until a key goes down; key-ups and bare modifier
+    // presses are skipped.
+    let mut input = std::InputReader::new();
+    let mut events = [std::InputEvent::default(); 16];
+    'wait: loop {
+        let n = input.read(&mut events);
+        for event in &events[..n] {
+            if event.pressed() && event.ascii != 0 {
+                break 'wait;
+            }
         }
     }
 
@@ -63,6 +63,26 @@ unsafe fn syscall2(id: usize, arg1: usize, arg2: usize) -> usize {
     ret
 }
 
+#[inline(always)]
+unsafe fn syscall3(id: usize, arg1: usize, arg2: usize, arg3: usize) -> usize {
+    let ret: usize;
+    core::arch::asm!(
+        "syscall",
+        in("rax") id,
+        in("rdi") arg1,
+        in("rsi") arg2,
+        in("rdx") arg3,
+        lateout("rax") ret,
+        out("rcx") _,
+        out("r11") _,
+        out("r10") _,
+        out("r8") _,
+        out("r9") _,
+        options(nostack, preserves_flags)
+    );
+    ret
+}
+
 #[inline(always)]
 unsafe fn syscall4(id: usize, arg1: usize, arg2: usize, arg3: usize, arg4: usize) -> usize {
     let ret: usize;
@@ -83,6 +103,34 @@ unsafe fn syscall4(id: usize, arg1: usize, arg2: usize, arg3: usize, arg4: usize
     ret
 }
 
+#[inline(always)]
+unsafe fn syscall6(
+    id: usize,
+    arg1: usize,
+    arg2: usize,
+    arg3: usize,
+    arg4: usize,
+    arg5: usize,
+    arg6: usize,
+) -> usize {
+    let ret: usize;
+    core::arch::asm!(
+        "syscall",
+        in("rax") id,
+        in("rdi") arg1,
+        in("rsi") arg2,
+        in("rdx") arg3,
+        in("r10") arg4,
+        in("r8") arg5,
+        in("r9") arg6,
+        lateout("rax") ret,
+        out("rcx") _,
+        out("r11") _,
+        options(nostack, preserves_flags)
+    );
+    ret
+}
+
 // ── Basic I/O ────────────────────────────────────────────────────────────────
 
 pub fn print(s: &str) {
@@ -112,9 +160,136 @@ pub fn clear() {
     unsafe { syscall0(9); }
 }
 
+// ── Input events ─────────────────────────────────────────────────────────────
+
+/// Matches the kernel's `input::InputEvent` repr.
+#[repr(C)]
+#[derive(Clone, Copy, Default)]
+pub struct InputEvent {
+    /// TSC value when the key transition was seen.
+    pub timestamp: u64,
+    /// HID keyboard usage ID (0xE0..=0xE7 are the modifier keys).
+    pub usage: u8,
+    pub modifiers: u8,
+    pub flags: u8,
+    /// ASCII for presses of printable keys, otherwise 0.
+    pub ascii: u8,
+    _reserved: u32,
+}
+
+pub const INPUT_FLAG_PRESSED: u8 = 1 << 0;
+const INPUT_READ_NONBLOCK: usize = 1 << 0;
+
+impl InputEvent {
+    pub fn pressed(&self) -> bool {
+        self.flags & INPUT_FLAG_PRESSED != 0
+    }
+}
+
+/// Address of the kernel's read-only event ring page. Its first u64 is the
+/// number of events published so far.
+fn input_ring() -> *const u64 {
+    unsafe { syscall0(22) as *const u64 }
+}
+
+/// An independent reader of the keyboard event stream. Every reader sees
+/// every event published after it was created; readers do not steal events
+/// from each other.
+pub struct InputReader {
+    ring: *const u64,
+    cursor: u64,
+}
+
+impl InputReader {
+    pub fn new() -> Self {
+        let ring = input_ring();
+        Self { ring, cursor: unsafe { core::ptr::read_volatile(ring) } }
+    }
+
+    /// True if events are waiting; checks the shared page, no syscall.
+    pub fn pending(&self) -> bool {
+        unsafe { core::ptr::read_volatile(self.ring) > self.cursor }
+    }
+
+    /// Fill `events` with the next batch, sleeping until at least one
+    /// arrives. Returns the number of events written.
+    pub fn read(&mut self, events: &mut [InputEvent]) -> usize {
+        self.read_with_flags(events, 0)
+    }
+
+    /// Like `read`, but returns 0 instead of waiting.
+    pub fn try_read(&mut self, events: &mut [InputEvent]) -> usize {
+        self.read_with_flags(events, INPUT_READ_NONBLOCK)
+    }
+
+    fn read_with_flags(&mut self, events: &mut [InputEvent], flags: usize) -> usize {
+        if events.is_empty() {
+            return 0;
+        }
+        let n = unsafe {
+            syscall4(
+                21,
+                events.as_mut_ptr() as usize,
+                events.len(),
+                &mut self.cursor as *mut u64 as usize,
+                flags,
+            )
+        };
+        if (n as isize) < 0 { 0 } else { n }
+    }
+}
+
 // ── Memory ───────────────────────────────────────────────────────────────────
 
-/// Allocate `size` bytes with `align` alignment. Returns null on failure.
+/// The `#[global_allocator]`: Box, Vec and friends allocate from arenas
+/// mapped with `map_anon`, not from the kernel's shared user heap.
+mod heap;
+
+/// Map `size` bytes of zeroed memory at an address the kernel picks.
+/// Returns null on failure.
+pub fn map_anon(size: usize) -> *mut u8 {
+    unsafe { syscall1(26, size) as *mut u8 }
+}
+
+pub const PROT_NONE: usize = 0;
+pub const PROT_READ: usize = 1 << 0;
+pub const PROT_WRITE: usize = 1 << 1;
+pub const PROT_EXEC: usize = 1 << 2;
+/// `mmap` flag: map exactly at the given address, which must be
+/// page-aligned and in 0x6800_0000_0000..0x7000_0000_0000, replacing what
+/// was mapped there. Without it the address is only a hint (0: none).
+pub const MAP_FIXED: usize = 1 << 4;
+
+/// Map `len` bytes of zeroed memory with `prot` (PROT_*) and `flags`. Pages
+/// are filled on first touch. Returns null on failure.
+pub fn mmap(addr: usize, len: usize, prot: usize, flags: usize) -> *mut u8 {
+    unsafe { syscall6(27, addr, len, prot | flags, 0, 0, 0) as *mut u8 }
+}
+
+/// Map `len` bytes of `filename` from `offset` (page-aligned) on. Pages are
+/// read through the kernel's page cache on first touch; with PROT_WRITE,
+/// writes go to private copies and never reach the file. Touching a page
+/// wholly past the end of the file faults. Returns null on failure.
+pub fn mmap_file(addr: usize, len: usize, prot: usize, flags: usize, filename: &str, offset: usize) -> *mut u8 {
+    unsafe {
+        syscall6(27, addr, len, prot | flags, filename.as_ptr() as usize, filename.len(), offset) as *mut u8
+    }
+}
+
+/// Unmap the pages of [addr, addr + len) that `mmap` or `map_anon` mapped.
+/// Returns 0, or usize::MAX if the range is not page-aligned user memory.
+pub fn munmap(addr: *mut u8, len: usize) -> usize {
+    unsafe { syscall2(28, addr as usize, len) }
+}
+
+/// Change the protection of [addr, addr + len), which must be mapped
+/// completely. Returns 0, or usize::MAX on failure.
+pub fn mprotect(addr: *mut u8, len: usize, prot: usize) -> usize {
+    unsafe { syscall3(29, addr as usize, len, prot) }
+}
+
+/// Allocate `size` bytes with `align` alignment from the kernel's user heap,
+/// which every task shares. Returns null on failure.
 pub fn alloc(size: usize, align: usize) -> *mut u8 {
     unsafe { syscall2(1, size, align) as *mut u8 }
 }
@@ -154,6 +329,31 @@ pub fn add_task(entry: usize, user_rsp: usize) -> usize {
     unsafe { syscall2(3, entry, user_rsp) }
 }
 
+/// Start a thread at `entry` in this address space on a new stack that
+/// grows on demand up to `stack_size` bytes, with a guard page below it.
+/// Returns the task ID, or usize::MAX on failure.
+pub fn add_thread(entry: usize, stack_size: usize) -> usize {
+    unsafe { syscall2(25, entry, stack_size) }
+}
+
+/// Load the KEF file `filename` into a new address space and start it with
+/// the stack size its header asks for. Returns the task ID, or usize::MAX
+/// on failure.
+pub fn spawn(filename: &str) -> usize {
+    spawn_with_stack(filename, 0)
+}
+
+/// Like `spawn`, but the new task's stack may grow to `stack_size` bytes.
+pub fn spawn_with_stack(filename: &str, stack_size: usize) -> usize {
+    unsafe { syscall4(23, filename.as_ptr() as usize, filename.len(), stack_size, 0) }
+}
+
+/// Duplicate the current task copy-on-write. Returns the child's task ID in
+/// the parent and 0 in the child, or usize::MAX on failure.
+pub fn fork() -> usize {
+    unsafe { syscall0(24) }
+}
+
 /// Terminate the current task with `exit_code`.
 pub fn terminate_task(exit_code: usize) {
     unsafe { syscall1(5, exit_code); }
@@ -170,6 +370,115 @@ pub fn get_task_exit_code(task_id: usize) -> usize {
     unsafe { syscall1(17, task_id) }
 }
 
+// ── Threads and synchronization ──────────────────────────────────────────────
+
+/// `spawn_thread`, `Thread::join`, `Mutex` and `Condvar`, built on the
+/// syscalls below.
+pub mod sync;
+
+/// Start a thread in this address space at `entry` with `arg` in r12, on a
+/// fresh stack of up to `stack_size` bytes and with its FS base at `tls`.
+/// If `exit_word` is not null the kernel stores 0 there and wakes its
+/// futex waiters when the thread terminates. Returns the task ID, or
+/// usize::MAX on failure.
+pub fn clone_thread(entry: usize, stack_size: usize, tls: usize, arg: usize, exit_word: *const u32) -> usize {
+    unsafe { syscall6(30, entry, stack_size, tls, arg, exit_word as usize, 0) }
+}
+
+/// Set the calling thread's FS base. Returns 0, or usize::MAX on failure.
+pub fn set_fs_base(base: usize) -> usize {
+    unsafe { syscall2(31, 0, base) }
+}
+
+/// Set the calling thread's GS base. Returns 0, or usize::MAX on failure.
+pub fn set_gs_base(base: usize) -> usize {
+    unsafe { syscall2(31, 1, base) }
+}
+
+/// Sleep while the u32 at `word` equals `expected`, until `futex_wake` on
+/// it. Returns 0 when woken (possibly spuriously), 1 if the value had
+/// already changed.
+pub fn futex_wait(word: *const u32, expected: u32) -> usize {
+    unsafe { syscall2(32, word as usize, expected as usize) }
+}
+
+/// Wake up to `count` threads sleeping on `word`. Returns how many woke.
+pub fn futex_wake(word: *const u32, count: usize) -> usize {
+    unsafe { syscall2(33, word as usize, count) }
+}
+
+// ── CPU affinity ─────────────────────────────────────────────────────────────
+
+/// Let task `task_id` (0: the calling task) run only on the CPUs whose bits
+/// are set in `mask` (bit n: CPU index n). New tasks and threads inherit
+/// their creator's mask. Returns 0, or usize::MAX if there is no such task
+/// or no online CPU in `mask`.
+pub fn set_affinity(task_id: usize, mask: u64) -> usize {
+    unsafe { syscall2(34, task_id, mask as usize) }
+}
+
+/// The affinity mask of task `task_id` (0: the calling task), or 0 if there
+/// is no such task.
+pub fn get_affinity(task_id: usize) -> u64 {
+    unsafe { syscall1(35, task_id) as u64 }
+}
+
+/// Index of the CPU the caller is running on.
+pub fn current_cpu() -> usize {
+    unsafe { syscall0(36) }
+}
+
+/// Mask of the CPUs that run tasks.
+pub fn online_cpus() -> u64 {
+    unsafe { syscall0(37) as u64 }
+}
+
+// ── Scheduling ───────────────────────────────────────────────────────────────
+
+/// Weighted fair share; the parameter is the nice value, -20 (most CPU) to
+/// 19 (least), 0 by default.
+pub const SCHED_FAIR: usize = 0;
+/// Real-time, priority 1..=99: runs ahead of every fair task and keeps the
+/// CPU across yields until it blocks or a higher priority is ready.
+pub const SCHED_FIFO: usize = 1;
+/// Like SCHED_FIFO, but lets tasks of equal priority go first whenever it
+/// yields.
+pub const SCHED_RR: usize = 2;
+
+/// Set the scheduling policy of task `task_id` (0: the calling task). New
+/// tasks and threads inherit their creator's. Returns 0, or usize::MAX on
+/// failure.
+pub fn set_scheduler(task_id: usize, policy: usize, param: isize) -> usize {
+    unsafe { syscall3(38, task_id, policy, param as usize) }
+}
+
+/// Set the nice value of a task (0: the calling task) and make it a fair
+/// task if it was not. Returns 0, or usize::MAX on failure.
+pub fn set_nice(task_id: usize, nice: isize) -> usize {
+    set_scheduler(task_id, SCHED_FAIR, nice)
+}
+
+/// The (policy, parameter) of task `task_id` (0: the calling task), or
+/// None if there is no such task.
+pub fn get_scheduler(task_id: usize) -> Option<(usize, isize)> {
+    let ret = unsafe { syscall1(39, task_id) };
+    if ret == usize::MAX {
+        return None;
+    }
+    Some((ret >> 32, ret as u32 as i32 as isize))
+}
+
+// ── Diagnostics ──────────────────────────────────────────────────────────────
+
+/// Have the kernel print its lock statistics table on the console, the lock
+/// with the most total wait first, and zero the counters if `reset`.
+/// Returns the number of locks listed, or None if the kernel was built
+/// without the `lockstat` feature.
+pub fn lock_stats(reset: bool) -> Option<usize> {
+    let ret = unsafe { syscall1(40, reset as usize) };
+    if ret == usize::MAX { None } else { Some(ret) }
+}
+
 // ── Filesystem ───────────────────────────────────────────────────────────────
 
 /// Matches the kernel's `SyscallFileEntry` repr.
@@ -181,7 +490,8 @@ pub struct FileEntry {
     pub first_cluster: u16,
 }
 
-/// Format the filesystem. Returns 0 on success, negative error code otherwise.
+/// Format the filesystem. Returns 0 on success, negative error code otherwise
+/// (-7 while a file is open, e.g. a running or mapped one).
 pub fn fs_format() -> i32 {
     unsafe { syscall0(11) as i32 }
 }
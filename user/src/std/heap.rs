@@ -0,0 +1,385 @@
+// ── Heap allocator ───────────────────────────────────────────────────────────
+//
+// The global allocator for KEF programs. Memory comes from the kernel in
+// arenas (`sys_map_anon`), so a Box or Vec costs a syscall only when an
+// arena runs out.
+//
+// Requests up to 2 KiB are rounded to a power-of-two size class and served
+// from per-thread caches. Each cache is a singly linked free list per class.
+// A cache that runs dry takes a batch of objects from the central lists. A
+// cache that holds too many gives a batch back. Larger requests take whole
+// pages from a first-fit list of free page runs, and neighbouring runs merge
+// when they are freed. Requests of `DIRECT_MIN` bytes or more get a mapping
+// of their own, which goes back to the kernel when they are freed.
+//
+// There is no thread-local storage yet. A thread finds its cache from its
+// stack address instead: the kernel gives every user stack its own 1 MiB
+// span. Threads whose spans hash to the same slot share the cache, and the
+// cache lock keeps that correct.
+
+use super::{map_anon, munmap, yield_task};
+use core::alloc::{GlobalAlloc, Layout};
+use core::cell::UnsafeCell;
+use core::ops::{Deref, DerefMut};
+use core::ptr::null_mut;
+use core::sync::atomic::{AtomicBool, Ordering};
+
+const PAGE_SIZE: usize = 4096;
+
+/// Bytes asked of the kernel at a time (more if one request needs more).
+const ARENA_SIZE: usize = 1024 * 1024;
+
+/// Object sizes of the small size classes.
+const CLASS_SIZES: [usize; 8] = [16, 32, 64, 128, 256, 512, 1024, 2048];
+const NUM_CLASSES: usize = CLASS_SIZES.len();
+const MAX_SMALL: usize = CLASS_SIZES[NUM_CLASSES - 1];
+
+/// Smallest request mapped on its own instead of cut from an arena.
+const DIRECT_MIN: usize = 256 * 1024;
+
+/// Bytes carved into objects at once when a class runs out.
+const SLAB_SIZE: usize = 16 * 1024;
+
+/// Bytes moved between a thread cache and the central lists at once.
+const BATCH_BYTES: usize = 8 * 1024;
+
+const CACHE_SLOTS: usize = 16;
+
+/// log2 of the span the kernel reserves per user stack.
+const STACK_SPAN_SHIFT: u32 = 20;
+
+/// Spins on a contended lock before yielding the CPU to the holder.
+const SPINS_BEFORE_YIELD: usize = 1000;
+
+fn class_index(size: usize) -> usize {
+    CLASS_SIZES.iter().position(|&class| class >= size).unwrap_or(NUM_CLASSES)
+}
+
+/// Objects per batch for a class: at least 4, at most 64.
+fn batch_len(class: usize) -> usize {
+    (BATCH_BYTES / CLASS_SIZES[class]).clamp(4, 64)
+}
+
+fn pages_for(size: usize) -> usize {
+    size.div_ceil(PAGE_SIZE)
+}
+
+// ── Locking ──────────────────────────────────────────────────────────────────
+
+struct Locked<T> {
+    locked: AtomicBool,
+    data: UnsafeCell<T>,
+}
+
+unsafe impl<T> Sync for Locked<T> {}
+
+struct Guard<'a, T> {
+    lock: &'a Locked<T>,
+}
+
+impl<T> Locked<T> {
+    const fn new(data: T) -> Self {
+        Self { locked: AtomicBool::new(false), data: UnsafeCell::new(data) }
+    }
+
+    fn try_lock(&self) -> Option<Guard<'_, T>> {
+        self.locked
+            .compare_exchange(false, true, Ordering::Acquire, Ordering::Relaxed)
+            .ok()
+            .map(|_| Guard { lock: self })
+    }
+
+    fn lock(&self) -> Guard<'_, T> {
+        let mut spins = 0;
+        loop {
+            if let Some(guard) = self.try_lock() {
+                return guard;
+            }
+            spins += 1;
+            if spins % SPINS_BEFORE_YIELD == 0 {
+                yield_task();
+            } else {
+                core::hint::spin_loop();
+            }
+        }
+    }
+}
+
+impl<T> Deref for Guard<'_, T> {
+    type Target = T;
+    fn deref(&self) -> &T {
+        unsafe { &*self.lock.data.get() }
+    }
+}
+
+impl<T> DerefMut for Guard<'_, T> {
+    fn deref_mut(&mut self) -> &mut T {
+        unsafe { &mut *self.lock.data.get() }
+    }
+}
+
+impl<T> Drop for Guard<'_, T> {
+    fn drop(&mut self) {
+        self.lock.locked.store(false, Ordering::Release);
+    }
+}
+
+// ── Free lists ───────────────────────────────────────────────────────────────
+
+struct FreeObject {
+    next: *mut FreeObject,
+}
+
+/// A chain of free objects of one class, with its length.
+#[derive(Clone, Copy)]
+struct FreeList {
+    head: *mut FreeObject,
+    len: usize,
+}
+
+impl FreeList {
+    const EMPTY: FreeList = FreeList { head: null_mut(), len: 0 };
+
+    fn pop(&mut self) -> *mut u8 {
+        let object = self.head;
+        if !object.is_null() {
+            self.head = unsafe { (*object).next };
+            self.len -= 1;
+        }
+        object as *mut u8
+    }
+
+    fn push(&mut self, ptr: *mut u8) {
+        let object = ptr as *mut FreeObject;
+        unsafe { (*object).next = self.head };
+        self.head = object;
+        self.len += 1;
+    }
+
+    /// Move up to `n` objects from the front of `self` into `to`.
+    fn move_to(&mut self, to: &mut FreeList, n: usize) {
+        for _ in 0..n {
+            let object = self.pop();
+            if object.is_null() {
+                break;
+            }
+            to.push(object);
+        }
+    }
+}
+
+/// A run of free pages. The header lives in the run's first page.
+struct FreeRun {
+    pages: usize,
+    next: *mut FreeRun,
+}
+
+// ── Central lists ────────────────────────────────────────────────────────────
+
+struct Central {
+    lists: [FreeList; NUM_CLASSES],
+    /// Free page runs, sorted by address; adjacent runs are merged.
+    runs: *mut FreeRun,
+}
+
+impl Central {
+    const EMPTY: Central = Central { lists: [FreeList::EMPTY; NUM_CLASSES], runs: null_mut() };
+
+    /// First fit from the run list, taken from the end of the run so the
+    /// list itself does not change unless the run is used up.
+    fn alloc_pages(&mut self, pages: usize) -> *mut u8 {
+        unsafe {
+            let mut link: *mut *mut FreeRun = &mut self.runs;
+            while !(*link).is_null() {
+                let run = *link;
+                if (*run).pages > pages {
+                    (*run).pages -= pages;
+                    return (run as *mut u8).add((*run).pages * PAGE_SIZE);
+                }
+                if (*run).pages == pages {
+                    *link = (*run).next;
+                    return run as *mut u8;
+                }
+                link = &mut (*run).next;
+            }
+        }
+
+        let size = (pages * PAGE_SIZE).max(ARENA_SIZE);
+        let arena = map_anon(size);
+        if arena.is_null() {
+            return null_mut();
+        }
+        self.free_pages(arena, pages_for(size));
+        self.alloc_pages(pages)
+    }
+
+    fn free_pages(&mut self, ptr: *mut u8, pages: usize) {
+        unsafe {
+            let new = ptr as *mut FreeRun;
+            let mut prev: *mut FreeRun = null_mut();
+            let mut next = self.runs;
+            while !next.is_null() && (next as usize) < (new as usize) {
+                prev = next;
+                next = (*next).next;
+            }
+
+            (*new).pages = pages;
+            (*new).next = next;
+            if !next.is_null() && new as usize + pages * PAGE_SIZE == next as usize {
+                (*new).pages += (*next).pages;
+                (*new).next = (*next).next;
+            }
+
+            if prev.is_null() {
+                self.runs = new;
+            } else if prev as usize + (*prev).pages * PAGE_SIZE == new as usize {
+                (*prev).pages += (*new).pages;
+                (*prev).next = (*new).next;
+            } else {
+                (*prev).next = new;
+            }
+        }
+    }
+
+    /// Cut a fresh slab into `class` objects on the central list.
+    fn carve(&mut self, class: usize) {
+        let slab = self.alloc_pages(SLAB_SIZE / PAGE_SIZE);
+        if slab.is_null() {
+            return;
+        }
+        let size = CLASS_SIZES[class];
+        for i in (0..SLAB_SIZE / size).rev() {
+            self.lists[class].push(unsafe { slab.add(i * size) });
+        }
+    }
+
+    /// Move a batch of `class` objects into `to`. Leaves `to` empty only
+    /// when out of memory.
+    fn refill(&mut self, class: usize, to: &mut FreeList) {
+        let want = batch_len(class);
+        if self.lists[class].len < want {
+            self.carve(class);
+        }
+        self.lists[class].move_to(to, want);
+    }
+
+    fn pop(&mut self, class: usize) -> *mut u8 {
+        if self.lists[class].head.is_null() {
+            self.carve(class);
+        }
+        self.lists[class].pop()
+    }
+}
+
+// ── Thread caches ────────────────────────────────────────────────────────────
+
+struct ThreadCache {
+    lists: [FreeList; NUM_CLASSES],
+}
+
+impl ThreadCache {
+    const EMPTY: ThreadCache = ThreadCache { lists: [FreeList::EMPTY; NUM_CLASSES] };
+}
+
+/// The cache slot of the calling thread, from the span its stack lives in.
+fn cache_slot() -> usize {
+    let rsp: usize;
+    unsafe { core::arch::asm!("mov {}, rsp", out(reg) rsp, options(nomem, nostack, preserves_flags)) };
+    (rsp >> STACK_SPAN_SHIFT) % CACHE_SLOTS
+}
+
+// ── Global allocator ─────────────────────────────────────────────────────────
+
+pub struct Heap {
+    central: Locked<Central>,
+    caches: [Locked<ThreadCache>; CACHE_SLOTS],
+}
+
+impl Heap {
+    const fn new() -> Self {
+        Self {
+            central: Locked::new(Central::EMPTY),
+            caches: [const { Locked::new(ThreadCache::EMPTY) }; CACHE_SLOTS],
+        }
+    }
+
+    fn alloc_small(&self, class: usize) -> *mut u8 {
+        // A contended slot means another thread shares it right now; going
+        // to the central lists beats waiting for it.
+        let Some(mut cache) = self.caches[cache_slot()].try_lock() else {
+            return self.central.lock().pop(class);
+        };
+        if cache.lists[class].head.is_null() {
+            self.central.lock().refill(class, &mut cache.lists[class]);
+        }
+        cache.lists[class].pop()
+    }
+
+    fn free_small(&self, ptr: *mut u8, class: usize) {
+        let Some(mut cache) = self.caches[cache_slot()].try_lock() else {
+            self.central.lock().lists[class].push(ptr);
+            return;
+        };
+        let list = &mut cache.lists[class];
+        list.push(ptr);
+        let batch = batch_len(class);
+        if list.len > 2 * batch {
+            list.move_to(&mut self.central.lock().lists[class], batch);
+        }
+    }
+}
+
+unsafe impl GlobalAlloc for Heap {
+    unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+        let size = layout.size().max(layout.align());
+        if size <= MAX_SMALL {
+            // Objects sit at multiples of their power-of-two size in a
+            // page-aligned slab, so they are aligned to their size.
+            return self.alloc_small(class_index(size));
+        }
+        if layout.align() > PAGE_SIZE {
+            return null_mut();
+        }
+        if size >= DIRECT_MIN {
+            return map_anon(size);
+        }
+        self.central.lock().alloc_pages(pages_for(size))
+    }
+
+    unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+        let size = layout.size().max(layout.align());
+        if size <= MAX_SMALL {
+            self.free_small(ptr, class_index(size));
+        } else if size >= DIRECT_MIN {
+            munmap(ptr, size);
+        } else {
+            self.central.lock().free_pages(ptr, pages_for(size));
+        }
+    }
+
+    unsafe fn realloc(&self, ptr: *mut u8, layout: Layout, new_size: usize) -> *mut u8 {
+        // Same class or same page count: the block already fits.
+        let old = layout.size().max(layout.align());
+        let new = new_size.max(layout.align());
+        let fits = if old <= MAX_SMALL || new <= MAX_SMALL {
+            old <= MAX_SMALL && new <= MAX_SMALL && class_index(old) == class_index(new)
+        } else {
+            pages_for(old) == pages_for(new) && (old >= DIRECT_MIN) == (new >= DIRECT_MIN)
+        };
+        if fits {
+            return ptr;
+        }
+
+        let new_ptr = unsafe { self.alloc(Layout::from_size_align_unchecked(new_size, layout.align())) };
+        if !new_ptr.is_null() {
+            unsafe {
+                core::ptr::copy_nonoverlapping(ptr, new_ptr, layout.size().min(new_size));
+                self.dealloc(ptr, layout);
+            }
+        }
+        new_ptr
+    }
+}
+
+#[global_allocator]
+static HEAP: Heap = Heap::new();
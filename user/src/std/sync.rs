@@ -0,0 +1,221 @@
+// ── Threads and synchronization ──────────────────────────────────────────────
+//
+// Threads are kernel tasks sharing this address space. Each gets a page
+// that holds its entry point, argument and result; the thread's FS base
+// points at it, and its first word holds its own address as the x86-64 TLS
+// ABI expects. The kernel clears the page's `running` word and wakes it
+// when the thread exits, which is what `join` sleeps on.
+//
+// `Mutex` and `Condvar` stay in user space while uncontended and only ask
+// the kernel to sleep or wake (futex) when a thread has to wait.
+
+use super::{clone_thread, futex_wait, futex_wake, map_anon, munmap, terminate_task};
+use core::cell::UnsafeCell;
+use core::ops::{Deref, DerefMut};
+use core::sync::atomic::{AtomicU32, Ordering};
+
+const PAGE_SIZE: usize = 4096;
+
+/// Spins on a contended mutex before sleeping in the kernel.
+const SPINS_BEFORE_SLEEP: usize = 100;
+
+// ── Threads ──────────────────────────────────────────────────────────────────
+
+#[repr(C)]
+struct ThreadBlock {
+    /// Address of this block, read through `fs:0`.
+    self_ptr: usize,
+    /// 1 until the thread terminates; the kernel sets it to 0.
+    running: AtomicU32,
+    entry: fn(usize) -> usize,
+    arg: usize,
+    result: usize,
+}
+
+/// A thread started by `spawn_thread`. Dropping it without `join` detaches
+/// the thread, and its block is never freed.
+pub struct Thread {
+    id: usize,
+    block: *mut ThreadBlock,
+}
+
+/// Run `entry(arg)` on a new thread whose stack may grow to `stack_size`
+/// bytes. Returns None if the kernel could not start it.
+pub fn spawn_thread(entry: fn(usize) -> usize, arg: usize, stack_size: usize) -> Option<Thread> {
+    let block = map_anon(PAGE_SIZE) as *mut ThreadBlock;
+    if block.is_null() {
+        return None;
+    }
+    unsafe {
+        block.write(ThreadBlock {
+            self_ptr: block as usize,
+            running: AtomicU32::new(1),
+            entry,
+            arg,
+            result: 0,
+        });
+    }
+    let running = unsafe { &(*block).running } as *const AtomicU32 as *const u32;
+    let id = clone_thread(thread_start as *const () as usize, stack_size, block as usize, block as usize, running);
+    if id == usize::MAX {
+        munmap(block as *mut u8, PAGE_SIZE);
+        return None;
+    }
+    Some(Thread { id, block })
+}
+
+impl Thread {
+    /// The thread's task ID.
+    pub fn id(&self) -> usize {
+        self.id
+    }
+
+    /// Wait for the thread to finish and return what its entry returned
+    /// (0 if it was killed).
+    pub fn join(self) -> usize {
+        let running = unsafe { &(*self.block).running };
+        while running.load(Ordering::Acquire) != 0 {
+            futex_wait(running.as_ptr(), 1);
+        }
+        let result = unsafe { (*self.block).result };
+        munmap(self.block as *mut u8, PAGE_SIZE);
+        result
+    }
+}
+
+/// The FS base of the calling thread, read through `fs:0`: its block for a
+/// thread from `spawn_thread`. Any other thread must first point its FS base
+/// (`set_fs_base`) at memory that starts with its own address.
+pub fn thread_pointer() -> usize {
+    let ptr: usize;
+    unsafe { core::arch::asm!("mov {}, fs:[0]", out(reg) ptr, options(nostack, preserves_flags, readonly)) };
+    ptr
+}
+
+/// First instruction of every thread: the kernel leaves the block in r12.
+#[unsafe(naked)]
+extern "C" fn thread_start() -> ! {
+    core::arch::naked_asm!(
+        "mov rdi, r12",
+        "and rsp, -16",
+        "call {main}",
+        "ud2",
+        main = sym thread_main,
+    );
+}
+
+extern "C" fn thread_main(block: *mut ThreadBlock) -> ! {
+    unsafe {
+        (*block).result = ((*block).entry)((*block).arg);
+    }
+    terminate_task(0);
+    loop {}
+}
+
+// ── Mutex ────────────────────────────────────────────────────────────────────
+
+const UNLOCKED: u32 = 0;
+const LOCKED: u32 = 1;
+/// Locked, and a thread may be asleep waiting for it.
+const CONTENDED: u32 = 2;
+
+pub struct Mutex<T> {
+    state: AtomicU32,
+    data: UnsafeCell<T>,
+}
+
+unsafe impl<T: Send> Sync for Mutex<T> {}
+unsafe impl<T: Send> Send for Mutex<T> {}
+
+pub struct MutexGuard<'a, T> {
+    mutex: &'a Mutex<T>,
+}
+
+impl<T> Mutex<T> {
+    pub const fn new(data: T) -> Self {
+        Self { state: AtomicU32::new(UNLOCKED), data: UnsafeCell::new(data) }
+    }
+
+    pub fn try_lock(&self) -> Option<MutexGuard<'_, T>> {
+        self.state
+            .compare_exchange(UNLOCKED, LOCKED, Ordering::Acquire, Ordering::Relaxed)
+            .ok()
+            .map(|_| MutexGuard { mutex: self })
+    }
+
+    pub fn lock(&self) -> MutexGuard<'_, T> {
+        if let Some(guard) = self.try_lock() {
+            return guard;
+        }
+        // A short spin catches holders that are about to let go.
+        for _ in 0..SPINS_BEFORE_SLEEP {
+            core::hint::spin_loop();
+            if self.state.load(Ordering::Relaxed) == UNLOCKED {
+                if let Some(guard) = self.try_lock() {
+                    return guard;
+                }
+            }
+        }
+        // Taking it as CONTENDED makes the next unlock wake someone, which
+        // covers any other sleepers.
+        while self.state.swap(CONTENDED, Ordering::Acquire) != UNLOCKED {
+            futex_wait(self.state.as_ptr(), CONTENDED);
+        }
+        MutexGuard { mutex: self }
+    }
+}
+
+impl<T> Deref for MutexGuard<'_, T> {
+    type Target = T;
+    fn deref(&self) -> &T {
+        unsafe { &*self.mutex.data.get() }
+    }
+}
+
+impl<T> DerefMut for MutexGuard<'_, T> {
+    fn deref_mut(&mut self) -> &mut T {
+        unsafe { &mut *self.mutex.data.get() }
+    }
+}
+
+impl<T> Drop for MutexGuard<'_, T> {
+    fn drop(&mut self) {
+        if self.mutex.state.swap(UNLOCKED, Ordering::Release) == CONTENDED {
+            futex_wake(self.mutex.state.as_ptr(), 1);
+        }
+    }
+}
+
+// ── Condition variable ───────────────────────────────────────────────────────
+
+/// Waiters sleep on a sequence number that every notify bumps, so a notify
+/// between unlocking the mutex and going to sleep is not lost.
+pub struct Condvar {
+    seq: AtomicU32,
+}
+
+impl Condvar {
+    pub const fn new() -> Self {
+        Self { seq: AtomicU32::new(0) }
+    }
+
+    /// Unlock `guard`'s mutex, sleep until notified, and lock it again.
+    /// Wake-ups may be spurious: wait in a loop on the actual condition.
+    pub fn wait<'a, T>(&self, guard: MutexGuard<'a, T>) -> MutexGuard<'a, T> {
+        let seq = self.seq.load(Ordering::Relaxed);
+        let mutex = guard.mutex;
+        drop(guard);
+        futex_wait(self.seq.as_ptr(), seq);
+        mutex.lock()
+    }
+
+    pub fn notify_one(&self) {
+        self.seq.fetch_add(1, Ordering::Release);
+        futex_wake(self.seq.as_ptr(), 1);
+    }
+
+    pub fn notify_all(&self) {
+        self.seq.fetch_add(1, Ordering::Release);
+        futex_wake(self.seq.as_ptr(), usize::MAX);
+    }
+}